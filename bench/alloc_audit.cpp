@@ -0,0 +1,250 @@
+/*
+ * satip: heap allocation audit of streaming and zapping
+ *
+ * Counts the heap allocations of a session (RTSP, RTP, RTCP, output) with
+ * a malloc interposer, against the SAT>IP server stand-in on loopback. After a
+ * warm-up, streaming and zapping (frequency and PID changes) must not
+ * allocate: one JSON line per phase, exit status 1 if one did.
+ *
+ * usage: alloc_audit [seconds of streaming] [zaps]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <execinfo.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include "config.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "log.h"
+#include "tools/standin.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+/* malloc interposer, glibc */
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+#define STACK_DEPTH 16
+
+static std::atomic<bool> counting(false);
+static std::atomic<unsigned long> allocations(0);
+static void* first_stack[STACK_DEPTH]; // of the first allocation counted
+static int first_depth;
+static thread_local bool exempt = false; // threads of the stand-in, backtrace()
+
+static inline void count()
+{
+	if (!counting.load(std::memory_order_relaxed) || exempt)
+		return;
+	if (allocations.fetch_add(1) == 0) {
+		exempt = true;
+		first_depth = backtrace(first_stack, STACK_DEPTH);
+		exempt = false;
+	}
+}
+
+extern "C" void* malloc(size_t size)
+{
+	count();
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count_, size_t size)
+{
+	count();
+	return __libc_calloc(count_, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+	count();
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	count();
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+	count();
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+
+#define STREAM_MBPS 10
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the session loop of satipSession, without vtuner */
+
+static void runSession(satipRTSP& rtsp, double seconds)
+{
+	const double end = now() + seconds;
+	while (now() < end) {
+		rtsp.handleRTSPStatus();
+		struct pollfd pfd = {rtsp.getRtspSocketFd(), rtsp.getPollEvent(), 0};
+		const int timeout = std::min(rtsp.getPollTimeout(), 10);
+		poll(&pfd, pfd.events ? 1 : 0, timeout);
+		rtsp.handleNextTimer();
+		if (pfd.events && pfd.revents)
+			rtsp.handlePollEvents(pfd.revents);
+	}
+}
+
+// like the vtuner does it: tuning properties, DTV_TUNE, then the PIDs
+static void zap(satipConfig& config, int n)
+{
+	static const unsigned int freqs[] = {118360, 120120, 117270, 122070};
+	config.setPosition(1);
+	config.setFrequency(freqs[n % 4]);
+	config.setModsys(n % 2 ? SYS_DVBS2 : SYS_DVBS);
+	config.setModtype(n % 2 ? PSK_8 : QPSK);
+	config.setSymrate(27500);
+	config.setFec(FEC_3_4);
+	config.setRolloff(ROLLOFF_35);
+	config.setChannelChanged();
+
+	u16 pids[16];
+	for (int i = 0; i < 16; ++i)
+		pids[i] = i < 4 ? i : 0x100 + n * 16 + i;
+	config.updatePidList(pids, 16);
+}
+
+static bool zapAndWait(satipStandIn& server, satipRTSP& rtsp, satipConfig& config, int n)
+{
+	const unsigned long plays = server.getCounters().plays;
+	const double start = now();
+	zap(config, n);
+	bool played = false;
+	while (!played && now() - start < 2) {
+		runSession(rtsp, 0.001);
+		played = server.getCounters().plays != plays;
+	}
+	return played;
+}
+
+// PID churn on the tuned transponder, sent as addpids/delpids
+static void changePids(satipRTSP& rtsp, satipConfig& config, int n)
+{
+	u16 pids[24];
+	for (int i = 0; i < 24; ++i)
+		pids[i] = i < 4 ? i : 0x200 + (n + i) % 40;
+	config.updatePidList(pids, 24);
+	runSession(rtsp, 0.02);
+}
+
+static void report(unsigned long count)
+{
+	printf(",\"allocations\":%lu}\n", count);
+	fflush(stdout);
+	if (count) {
+		fprintf(stderr, "alloc_audit: first allocation from\n");
+		backtrace_symbols_fd(first_stack, first_depth, STDERR_FILENO);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const double seconds = argc > 1 ? atof(argv[1]) : 2;
+	const int zaps = argc > 2 ? atoi(argv[2]) : 20;
+
+	// the threads of the stand-in are not audited
+	satipStandIn server(STREAM_MBPS, 1);
+	server.setThreadHook([] { exempt = true; });
+	if (server.start() < 0)
+		return 1;
+	const std::string port = std::to_string(server.getPort());
+
+	vtunerOpt settings;
+	settings.m_vtuner_type = "satip_client";
+	settings.m_fe_type = FE_TYPE_SAT;
+	settings.m_ipaddr = "127.0.0.1";
+	settings.m_servers.push_back(settings.m_ipaddr);
+	settings.m_port = port;
+	settings.m_output = "file:/dev/null";
+
+	bool ok = true;
+	{
+		satipConfig config(FE_TYPE_SAT, &settings);
+		satipRTP rtp(-1, &settings, config.getPidFilter());
+		satipRTSP rtsp(&config, "127.0.0.1", port.c_str(), &rtp);
+		rtp.run();
+
+		// warm-up: first tuning, zaps and PID changes of every kind, backtrace()
+		void* stack[STACK_DEPTH];
+		backtrace(stack, STACK_DEPTH);
+		zap(config, 0);
+		runSession(rtsp, 0.5);
+		for (int i = 1; i < 4; ++i) {
+			ok &= zapAndWait(server, rtsp, config, i);
+			changePids(rtsp, config, i);
+		}
+		runSession(rtsp, 0.5);
+
+		const unsigned long sent = server.getCounters().datagrams;
+		allocations = 0;
+		counting = true;
+		runSession(rtsp, seconds);
+		counting = false;
+		const unsigned long streamed = server.getCounters().datagrams - sent;
+		const frontendTelemetry stats = rtp.getTelemetry();
+		ok &= streamed > 0 && stats.has_lock && allocations == 0;
+		printf("{\"bench\":\"alloc_audit\",\"phase\":\"streaming\",\"seconds\":%.1f,\"datagrams\":%lu,\"lock\":%u",
+			seconds, streamed, stats.has_lock);
+		report(allocations);
+
+		int done = 0;
+		allocations = 0;
+		counting = true;
+		for (int i = 0; i < zaps; ++i) {
+			done += zapAndWait(server, rtsp, config, i);
+			changePids(rtsp, config, i);
+		}
+		counting = false;
+		ok &= done == zaps && allocations == 0;
+		printf("{\"bench\":\"alloc_audit\",\"phase\":\"zap\",\"zaps\":%d,\"completed\":%d", zaps, done);
+		report(allocations);
+
+		rtp.stop();
+	}
+
+	server.stop();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+/*
+ * satip: control plane benchmark
+ *
+ * N sessions with the vtuner emulator (see vtuneremulator.h) instead of the
+ * kernel module, against the SAT>IP server stand-in on loopback, the TS goes
+ * to /dev/null. Per scenario (zap, storm and pidchurn) it reports the
+ * messages sent and the ones without response, how long the session thread
+ * took to answer, the time from DTV_TUNE to FE_HAS_LOCK and the RTSP requests
+ * that caused. The lock is seen by the status poll of the emulator, so its
+ * times are multiples of the poll interval (lock_poll_ms) and tell zap
+ * paths apart only by whole polls. One JSON line per scenario.
+ *
+ * usage: bench_control [sessions] [seconds] [scenario]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "log.h"
+#include "option.h"
+#include "session.h"
+#include "vtuneremulator.h"
+#include "tools/standin.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+static bool run(const char* scenario, int sessions, double seconds)
+{
+	satipStandIn server(8, sessions);
+	if (server.start())
+		return false;
+	char port[8];
+	snprintf(port, sizeof(port), "%d", server.getPort());
+
+	vtunerEmulator::resetTotals();
+	std::vector<std::unique_ptr<vtunerOpt>> settings;
+	std::vector<std::unique_ptr<satipSession>> clients;
+	for (int i = 0; i < sessions; ++i) {
+		settings.push_back(std::make_unique<vtunerOpt>());
+		vtunerOpt& opt = *settings.back();
+		opt.m_index = i;
+		opt.m_vtuner_type = "satip_client";
+		opt.m_fe_type = FE_TYPE_SAT;
+		opt.m_ipaddr = "127.0.0.1";
+		opt.m_servers.push_back(opt.m_ipaddr);
+		opt.m_port = port;
+		opt.m_control = std::string("emulator:") + scenario;
+
+		int initok = 0;
+		clients.push_back(std::make_unique<satipSession>("127.0.0.1", port, FE_TYPE_SAT, &opt, initok));
+		if (!initok) {
+			fprintf(stderr, "bench_control: session %d did not start\n", i);
+			return false;
+		}
+		clients.back()->start();
+	}
+
+	usleep(seconds * 1e6);
+
+	const vtunerEmulator::counters c = vtunerEmulator::getTotals();
+	const satipStandIn::counters end = server.getCounters();
+	printf("{\"bench\":\"control\",\"scenario\":\"%s\",\"sessions\":%d,\"seconds\":%.1f,\"messages\":%lu,"
+		"\"responses\":%lu,\"timeouts\":%lu,\"zaps\":%lu,\"locks\":%lu,\"pid_lists\":%lu,"
+		"\"response_us_p50\":%.1f,\"response_us_p99\":%.1f,\"response_us_max\":%.1f,"
+		"\"lock_ms_p50\":%.2f,\"lock_ms_p99\":%.2f,\"lock_ms_max\":%.2f,\"lock_poll_ms\":%d,\"rtsp_requests\":%lu}\n",
+		scenario, sessions, seconds, c.messages, c.responses, c.timeouts, c.zaps, c.locks, c.pid_lists,
+		c.response_us_p50, c.response_us_p99, c.response_us_max, c.lock_ms_p50, c.lock_ms_p99, c.lock_ms_max,
+		vtunerEmulator::STATUS_INTERVAL_MS, end.requests);
+	fflush(stdout);
+
+	for (auto& client : clients) {
+		client->stop();
+		client->join();
+	}
+	clients.clear();
+	server.stop();
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	const int sessions = argc > 1 ? atoi(argv[1]) : 4;
+	const double seconds = argc > 2 ? atof(argv[2]) : 5;
+	static const char* scenarios[] = {"zap", "storm", "pidchurn"};
+
+	bool ok = true;
+	for (const char* scenario : scenarios)
+		if (argc <= 3 || strncmp(argv[3], scenario, strlen(argv[3])) == 0)
+			ok &= run(scenario, sessions, seconds);
+	return ok ? 0 : 1;
+}
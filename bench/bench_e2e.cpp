@@ -0,0 +1,372 @@
+/*
+ * satip: end-to-end benchmark
+ *
+ * N sessions stream from the SAT>IP server stand-in on loopback into UDP
+ * outputs read by this program, over UDP and over TCP interleaved. Reports
+ * the throughput at the outputs, the CPU time of the client threads per
+ * Mbit/s, the TS packets lost on the way (continuity counters) and the zap
+ * latency: from satipSession::tune() to the first TS packet of the new PIDs
+ * at the output. One JSON line per transport.
+ *
+ * With an impairment (see tools/impair.h) the sessions go through the
+ * impairment proxy, glitches (receives with TS packets lost) and the
+ * longest gap in the output show how the client recovers.
+ *
+ * Then one session at transponder rate (PIDS_ALL_MBPS) with pids=all: the
+ * stand-in sends all PIDs of the transponder, the client filters them down
+ * to the tuned ones. The run is repeated with the PIDs requested from the
+ * server, the difference in CPU per Mbit/s from the server is the cost of
+ * the filter.
+ *
+ * usage: bench_e2e [sessions] [Mbit/s per session] [seconds] [zaps] [impairment]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "log.h"
+#include "option.h"
+#include "session.h"
+#include "tools/impair.h"
+#include "tools/standin.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define PIDS_PER_ZAP 4
+#define ZAP_TIMEOUT 2.0
+#define PIDS_ALL_MBPS 100
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The UDP output of a session */
+struct sink
+{
+	int fd = -1;
+	int port = 0;
+	std::thread thread;
+	std::atomic<bool> running{true};
+	std::atomic<unsigned long> packets{0};
+	std::atomic<unsigned long> lost{0};
+	std::atomic<unsigned long> glitches{0};
+	std::atomic<double> gap_max{0}; // s between receives
+	// zap in progress: its first PID, -1 when seen
+	std::atomic<double> zap_start{0};
+	std::atomic<int> zap_pid{-1};
+	std::atomic<double> zap_latency{0};
+};
+
+static void receive(sink* s)
+{
+	unsigned char buf[65536];
+	uint8_t last_cc[pidSet::PID_COUNT];
+	pidSet seen;
+	double last = 0;
+	while (s->running) {
+		const ssize_t res = recv(s->fd, buf, sizeof(buf), 0);
+		if (res <= 0)
+			continue;
+		const double t = now();
+		if (last > 0 && t - last > s->gap_max)
+			s->gap_max = t - last;
+		last = t;
+
+		unsigned long packets = 0;
+		unsigned long lost = 0;
+		for (ssize_t pos = 0; pos + satipStandIn::TS_PACKET_SIZE <= res; pos += satipStandIn::TS_PACKET_SIZE) {
+			const unsigned char* p = buf + pos;
+			if (p[0] != 0x47)
+				continue;
+			const int pid = ((p[1] & 0x1f) << 8) | p[2];
+			const uint8_t cc = p[3] & 0x0f;
+			++packets;
+
+			const int zap_pid = s->zap_pid.load(std::memory_order_acquire);
+			if (zap_pid >= 0 && pid >= zap_pid && pid < zap_pid + PIDS_PER_ZAP) {
+				s->zap_latency = now() - s->zap_start;
+				s->zap_pid = -1;
+				// the PIDs of the last zap may come back later
+				seen.clear();
+			}
+
+			if (seen.test(pid))
+				lost += (cc - last_cc[pid] - 1) & 0x0f;
+			seen.set(pid);
+			last_cc[pid] = cc;
+		}
+		s->packets += packets;
+		s->lost += lost;
+		if (lost)
+			++s->glitches;
+	}
+}
+
+static bool openSink(sink& s)
+{
+	s.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	const int size = 4 * 1024 * 1024;
+	setsockopt(s.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	struct timeval tv = {0, 100000};
+	setsockopt(s.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(s.fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+		getsockname(s.fd, reinterpret_cast<struct sockaddr*>(&addr), &len))
+		return false;
+	s.port = ntohs(addr.sin_port);
+	s.thread = std::thread(receive, &s);
+	return true;
+}
+
+// CPU time of the client threads ("satip-*") in clock ticks
+static unsigned long clientTicks()
+{
+	unsigned long ticks = 0;
+	DIR* dir = opendir("/proc/self/task");
+	if (!dir)
+		return 0;
+	while (struct dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] == '.')
+			continue;
+		char path[300];
+		snprintf(path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name);
+		FILE* f = fopen(path, "r");
+		if (!f)
+			continue;
+		char stat[512];
+		const size_t len = fread(stat, 1, sizeof(stat) - 1, f);
+		fclose(f);
+		stat[len] = 0;
+
+		const char* name = strchr(stat, '(');
+		const char* end = strrchr(stat, ')');
+		if (!name || !end || strncmp(name + 1, "satip-", 6))
+			continue;
+		unsigned long utime = 0, stime = 0;
+		// after the name: state and 10 fields, then utime and stime
+		if (sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2)
+			ticks += utime + stime;
+	}
+	closedir(dir);
+	return ticks;
+}
+
+static tuningRequest tuning(int zap)
+{
+	tuningRequest t;
+	t.src = 1;
+	t.freq = zap % 2 ? 120120 : 118360;
+	t.pol = CONFIG_POL_HORIZONTAL;
+	t.msys = SYS_DVBS;
+	t.mtype = QPSK;
+	t.symrate = 27500;
+	t.fec = FEC_3_4;
+	t.rolloff = ROLLOFF_35;
+	for (int i = 0; i < PIDS_PER_ZAP; ++i)
+		t.pids.set(0x100 + (zap % 256) * 16 + i);
+	return t;
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+// CPU of the client threads per Mbit/s from the server in cpu_per_input
+static bool run(bool tcp, int sessions, double mbps, double seconds, int zaps, const char* impair, bool pids_all,
+	double& cpu_per_input)
+{
+	satipStandIn server(mbps, sessions);
+	if (server.start())
+		return false;
+	impairment network;
+	impairment::parse(impair, network);
+	satipImpairProxy proxy(network);
+	if (*impair && proxy.start("127.0.0.1", 0, "127.0.0.1", server.getPort()))
+		return false;
+	char port[8];
+	snprintf(port, sizeof(port), "%d", *impair ? proxy.getPort() : server.getPort());
+
+	std::vector<std::unique_ptr<sink>> sinks;
+	std::vector<std::unique_ptr<vtunerOpt>> settings;
+	std::vector<std::unique_ptr<satipSession>> clients;
+	for (int i = 0; i < sessions; ++i) {
+		sinks.push_back(std::make_unique<sink>());
+		if (!openSink(*sinks.back()))
+			return false;
+
+		settings.push_back(std::make_unique<vtunerOpt>());
+		vtunerOpt& opt = *settings.back();
+		opt.m_index = i;
+		opt.m_vtuner_type = "satip_client";
+		opt.m_fe_type = FE_TYPE_SAT;
+		opt.m_ipaddr = "127.0.0.1";
+		opt.m_servers.push_back(opt.m_ipaddr);
+		opt.m_port = port;
+		opt.m_tcpdata = tcp;
+		opt.m_output = "udp:127.0.0.1:" + std::to_string(sinks.back()->port);
+		// Enigma2 polling the frontend, the tuning comes from tune()
+		opt.m_control = "emulator:idle";
+		opt.m_pids_all = pids_all;
+
+		int initok = 0;
+		clients.push_back(std::make_unique<satipSession>("127.0.0.1", port, FE_TYPE_SAT, &opt, initok));
+		if (!initok) {
+			fprintf(stderr, "bench_e2e: session %d did not start\n", i);
+			return false;
+		}
+		clients.back()->start();
+		clients.back()->tune(tuning(0));
+	}
+
+	// all streams up, then settle
+	const double deadline = now() + 5;
+	while (now() < deadline && std::any_of(sinks.begin(), sinks.end(), [](auto& s) { return s->packets == 0; }))
+		usleep(10000);
+	usleep(500000);
+
+	// streaming
+	unsigned long received = 0, lost = 0, glitches = 0;
+	for (auto& s : sinks) {
+		received -= s->packets;
+		lost -= s->lost;
+		glitches -= s->glitches;
+		s->gap_max = 0;
+	}
+	const satipStandIn::counters before = server.getCounters();
+	const unsigned long ticks = clientTicks();
+	const double start = now();
+	usleep(seconds * 1e6);
+	const double elapsed = now() - start;
+	const unsigned long cpu_ticks = clientTicks() - ticks;
+	const satipStandIn::counters after = server.getCounters();
+	double gap_max = 0;
+	for (auto& s : sinks) {
+		received += s->packets;
+		lost += s->lost;
+		glitches += s->glitches;
+		gap_max = std::max<double>(gap_max, s->gap_max);
+	}
+
+	const unsigned long server_ts = after.ts_packets - before.ts_packets;
+	const double throughput = received * satipStandIn::TS_PACKET_SIZE * 8 / elapsed / 1e6;
+	const double input = server_ts * satipStandIn::TS_PACKET_SIZE * 8 / elapsed / 1e6;
+	const double cpu = 100.0 * cpu_ticks / sysconf(_SC_CLK_TCK) / elapsed;
+	cpu_per_input = input > 0 ? cpu / input : 0;
+	// PIDs not tuned, dropped by the client
+	const double filtered = server_ts > received + lost ? 100.0 * (server_ts - received - lost) / server_ts : 0;
+
+	// zaps, all sessions at once
+	std::vector<double> latencies;
+	int timeouts = 0;
+	for (int n = 1; n <= zaps; ++n) {
+		const tuningRequest t = tuning(n);
+		for (int i = 0; i < sessions; ++i) {
+			sinks[i]->zap_start = now();
+			sinks[i]->zap_pid.store(0x100 + (n % 256) * 16, std::memory_order_release);
+			clients[i]->tune(t);
+		}
+		const double zap_deadline = now() + ZAP_TIMEOUT;
+		while (now() < zap_deadline && std::any_of(sinks.begin(), sinks.end(), [](auto& s) { return s->zap_pid >= 0; }))
+			usleep(1000);
+		for (auto& s : sinks) {
+			if (s->zap_pid.exchange(-1) >= 0)
+				++timeouts;
+			else
+				latencies.push_back(s->zap_latency * 1000);
+		}
+		usleep(100000);
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	const satipStandIn::counters end = server.getCounters();
+	printf("{\"bench\":\"e2e\",\"transport\":\"%s\",\"pids_all\":%s,\"sessions\":%d,\"mbps_per_session\":%.1f,"
+		"\"seconds\":%.1f,\"input_mbps\":%.2f,\"throughput_mbps\":%.2f,\"server_ts\":%lu,\"received_ts\":%lu,"
+		"\"lost_ts\":%lu,\"loss_pct\":%.4f,\"filtered_pct\":%.2f,\"server_dropped\":%lu,\"cpu_pct\":%.2f,"
+		"\"cpu_pct_per_mbps\":%.4f,\"cpu_pct_per_input_mbps\":%.4f,\"zaps\":%zu,\"zap_timeouts\":%d,"
+		"\"zap_ms_p50\":%.2f,\"zap_ms_p90\":%.2f,\"zap_ms_p99\":%.2f,\"zap_ms_max\":%.2f,\"rtsp_requests\":%lu,"
+		"\"impairment\":\"%s\",\"glitches\":%lu,\"gap_ms_max\":%.2f}\n",
+		tcp ? "tcp" : "udp", pids_all ? "true" : "false", sessions, mbps, elapsed, input, throughput, server_ts, received,
+		lost, received + lost ? 100.0 * lost / (received + lost) : 0, filtered, after.dropped - before.dropped, cpu,
+		throughput > 0 ? cpu / throughput : 0, cpu_per_input, latencies.size(), timeouts, percentile(latencies, 0.5),
+		percentile(latencies, 0.9), percentile(latencies, 0.99), latencies.empty() ? 0 : latencies.back(),
+		end.requests, impair, glitches, gap_max * 1000);
+	fflush(stdout);
+
+	for (auto& c : clients) {
+		c->stop();
+		c->join();
+	}
+	clients.clear();
+	proxy.stop();
+	server.stop();
+	for (auto& s : sinks) {
+		s->running = false;
+		s->thread.join();
+		close(s->fd);
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	const int sessions = argc > 1 ? atoi(argv[1]) : 4;
+	const double mbps = argc > 2 ? atof(argv[2]) : 20;
+	const double seconds = argc > 3 ? atof(argv[3]) : 5;
+	const int zaps = argc > 4 ? atoi(argv[4]) : 20;
+	const char* impair = argc > 5 ? argv[5] : "";
+	impairment network;
+	if (!impairment::parse(impair, network)) {
+		fprintf(stderr, "bench_e2e: bad impairment %s, see tools/impair.h\n", impair);
+		return 1;
+	}
+
+	double cpu_per_input = 0;
+	bool ok = run(false, sessions, mbps, seconds, zaps, impair, false, cpu_per_input);
+	ok &= run(true, sessions, mbps, seconds, zaps, impair, false, cpu_per_input);
+
+	// filter cost: the transponder filtered by the client against the tuned
+	// PIDs from the server, no zaps as the stand-in sends one transponder
+	double requested = 0, filtered = 0;
+	ok &= run(false, 1, PIDS_ALL_MBPS, seconds, 0, impair, false, requested);
+	ok &= run(false, 1, PIDS_ALL_MBPS, seconds, 0, impair, true, filtered);
+	printf("{\"bench\":\"e2e_pids_all\",\"mbps\":%d,\"cpu_pct_per_input_mbps\":%.4f,"
+		"\"cpu_pct_per_input_mbps_requested\":%.4f,\"filter_cost_pct_per_mbps\":%.4f}\n",
+		PIDS_ALL_MBPS, filtered, requested, filtered - requested);
+	return ok ? 0 : 1;
+}
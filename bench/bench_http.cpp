@@ -0,0 +1,145 @@
+/*
+ * satip: HTTP re-streaming benchmark
+ *
+ * One stream served to 1 - 64 local clients, at a transponder rate and
+ * as fast as possible. Reports the stream rate, what the clients received
+ * together and the skipped/dropped clients, one JSON line per run.
+ *
+ * usage: bench_http [seconds per run]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "httpstream.h"
+#include "log.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define CHUNK (7 * 188)
+#define BATCH 32
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void client(int port, std::atomic<bool>* running, std::atomic<uint64_t>* received)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) {
+		close(fd);
+		return;
+	}
+	static const char request[] = "GET /tuner/0 HTTP/1.0\r\n\r\n";
+	if (send(fd, request, sizeof(request) - 1, 0) < 0) {
+		close(fd);
+		return;
+	}
+
+	struct timeval tv = {0, 100000};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	std::vector<char> buf(256 * 1024);
+	uint64_t bytes = 0;
+	while (*running) {
+		const ssize_t res = recv(fd, buf.data(), buf.size(), 0);
+		if (res == 0)
+			break;
+		if (res > 0)
+			bytes += res;
+	}
+	*received += bytes;
+	close(fd);
+}
+
+// rate_mb 0: as fast as possible
+static void run(int clients, double rate_mb, double seconds)
+{
+	httpServer server(1000000); // measure, don't drop
+	const int port = server.start(0);
+	if (port < 0)
+		exit(1);
+	streamRing* ring = new streamRing(&server, 0);
+
+	std::atomic<bool> running(true);
+	std::atomic<uint64_t> received(0);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < clients; ++i)
+		threads.emplace_back(client, port, &running, &received);
+	usleep(200000);
+
+	std::vector<unsigned char> data(BATCH * CHUNK);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = (i % 188) ? static_cast<unsigned char>(i) : 0x47;
+	struct iovec iov[BATCH];
+
+	const uint64_t sent_before = server.getSentBytes();
+	const double start = now();
+	uint64_t produced = 0;
+	while (now() - start < seconds) {
+		for (int i = 0; i < BATCH; ++i) {
+			iov[i].iov_base = &data[i * CHUNK];
+			iov[i].iov_len = CHUNK;
+		}
+		ring->write(iov, BATCH);
+		produced += BATCH * CHUNK;
+		if (rate_mb > 0) {
+			const double due = start + produced / (rate_mb * 1e6);
+			const double wait = due - now();
+			if (wait > 0)
+				usleep(wait * 1e6);
+		}
+	}
+	const double elapsed = now() - start;
+	const uint64_t sent = server.getSentBytes() - sent_before;
+
+	running = false;
+	for (auto& t : threads)
+		t.join();
+	delete ring;
+
+	printf("{\"bench\":\"http_fanout\",\"clients\":%d,\"stream_mb_per_s\":%.1f,\"delivered_mb_per_s\":%.1f,"
+		"\"per_client_pct\":%.1f,\"skips\":%llu,\"drops\":%llu}\n",
+		clients, produced / elapsed / 1e6, sent / elapsed / 1e6,
+		100.0 * sent / (static_cast<double>(produced) * clients),
+		static_cast<unsigned long long>(server.getSkipped()), static_cast<unsigned long long>(server.getDropped()));
+	server.stop();
+}
+
+int main(int argc, char** argv)
+{
+	const double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+	for (int clients = 1; clients <= 64; clients *= 2)
+		run(clients, 8.0, seconds); // ~64Mbit/s transponder
+	for (int clients = 1; clients <= 64; clients *= 2)
+		run(clients, 0, seconds);
+	return 0;
+}
@@ -0,0 +1,388 @@
+/*
+ * satip: microbenchmarks of the hot paths
+ *
+ * RTSP response parsing, PID list updates and the PLAY requests built from
+ * them, the next timer with many timers, RTCP parsing, the TCP interleaved
+ * deframing and logging, off and on. Each runs long enough to time, five
+ * times, and reports the fastest and the median time per operation, one JSON
+ * line each.
+ *
+ * usage: bench_micro [part of a name]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "log.h"
+#include "option.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "timer.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define RUNS 5
+#define MIN_RUN_SEC 0.05
+#define TS_DATAGRAM (7 * 188)
+#define FRAMES 48
+
+static const char* filter = nullptr;
+static volatile size_t result_sink;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool selected(const char* name)
+{
+	return !filter || strstr(name, filter);
+}
+
+// 'runs' in ns per operation
+static void report(const char* name, unsigned long ops, int items, std::vector<double>& runs)
+{
+	std::sort(runs.begin(), runs.end());
+	printf("{\"bench\":\"micro\",\"name\":\"%s\",\"ops\":%lu,\"items_per_op\":%d,\"ns_per_op_min\":%.2f,"
+		"\"ns_per_op_median\":%.2f}\n", name, ops, items, runs.front(), runs[runs.size() / 2]);
+	fflush(stdout);
+}
+
+// 'op' returns something that depends on its work, so it is not left out
+template <typename F>
+static void bench(const char* name, int items, F op)
+{
+	if (!selected(name))
+		return;
+
+	size_t sink = 0;
+	unsigned long ops = 1;
+	for (;;) {
+		const double start = now();
+		for (unsigned long i = 0; i < ops; ++i)
+			sink += op();
+		if (now() - start >= MIN_RUN_SEC)
+			break;
+		ops *= 2;
+	}
+
+	std::vector<double> runs;
+	for (int r = 0; r < RUNS; ++r) {
+		const double start = now();
+		for (unsigned long i = 0; i < ops; ++i)
+			sink += op();
+		runs.push_back((now() - start) / ops * 1e9);
+	}
+	result_sink = sink;
+	report(name, ops, items, runs);
+}
+
+/* The private parts of satipRTSP and satipRTP under test */
+class satipMicroBench
+{
+public:
+	static std::string_view findRTSPResponse(std::string_view msg)
+	{
+		std::string_view::size_type begin;
+		return satipRTSP::findRTSPResponse(msg, begin);
+	}
+
+	static std::string_view findParameter(std::string_view msg, std::string_view param, char sep)
+	{
+		return satipRTSP::findParameter(msg, param, sep);
+	}
+
+	static int parseNumber(std::string_view value)
+	{
+		return satipRTSP::parseNumber(value);
+	}
+
+	// 'data' as received, deframed as handleResponse() does it
+	static int deframe(satipRTSP& rtsp, const unsigned char* data, size_t size)
+	{
+		memcpy(rtsp.m_rx_data.get(), data, size);
+		rtsp.m_rx_data_wpos = size;
+		rtsp.handleInterleavedData();
+		return rtsp.m_rx_data_wpos;
+	}
+
+	static void rtcpData(satipRTP& rtp, const unsigned char* data, int size)
+	{
+		rtp.rtcpData(data, size);
+	}
+
+	static void parseRtcpAppPayload(satipRTP& rtp, const char* data, int size)
+	{
+		rtp.parseRtcpAppPayload(data, size);
+	}
+};
+
+static void put16(unsigned char* p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(unsigned char* p, uint32_t v)
+{
+	put16(p, v >> 16);
+	put16(p + 2, v);
+}
+
+static const char setup_response[] =
+	"RTSP/1.0 200 OK\r\n"
+	"CSeq: 1\r\n"
+	"Session: 0521595368;timeout=60\r\n"
+	"Transport: RTP/AVP;unicast;client_port=46938-46939;server_port=8000-8001\r\n"
+	"com.ses.streamID: 1\r\n"
+	"\r\n";
+
+static const char app_payload[] =
+	"ver=1.0;src=1;tuner=1,224,1,15,11836.00,h,dvbs2,8psk,on,0.35,27500,34;pids=0,16,17,18,256,257,258,259";
+
+// 'count' interleaved RTP frames of 7 TS packets, sequence numbers from 'seq'
+static std::vector<unsigned char> interleavedFrames(int count, uint16_t seq)
+{
+	const int frame = 4 + 12 + TS_DATAGRAM;
+	std::vector<unsigned char> data(count * frame, 0xff);
+	for (int i = 0; i < count; ++i) {
+		unsigned char* p = data.data() + i * frame;
+		p[0] = '$';
+		p[1] = 0;
+		put16(p + 2, frame - 4);
+		p[4] = 0x80;
+		p[5] = 33;
+		put16(p + 6, seq + i);
+		put32(p + 8, 0);
+		put32(p + 12, 0x12345678);
+		for (int t = 0; t < 7; ++t) {
+			unsigned char* ts = p + 16 + t * 188;
+			ts[0] = 0x47;
+			ts[1] = 0x01;
+			ts[2] = 0x00;
+			ts[3] = 0x10 | ((i * 7 + t) & 0x0f);
+		}
+	}
+	return data;
+}
+
+static void benchRtsp()
+{
+	const std::string_view setup(setup_response, sizeof(setup_response) - 1);
+	bench("find_rtsp_response", 1, [&] {
+		return satipMicroBench::findRTSPResponse(setup).size();
+	});
+
+	// TCP data mode: the response behind the stream data received with it
+	const std::vector<unsigned char> frames = interleavedFrames(FRAMES, 0);
+	std::string buffered(reinterpret_cast<const char*>(frames.data()), frames.size());
+	buffered += setup;
+	bench("find_rtsp_response_after_64k_data", 1, [&] {
+		return satipMicroBench::findRTSPResponse(buffered).size();
+	});
+
+	bench("find_parameter_setup", 3, [&] {
+		return satipMicroBench::findParameter(setup, "Session", ':').size() +
+			satipMicroBench::parseNumber(satipMicroBench::findParameter(setup, "timeout", '=')) +
+			satipMicroBench::parseNumber(satipMicroBench::findParameter(setup, "com.ses.streamID", ':'));
+	});
+}
+
+static void benchConfig()
+{
+	vtunerOpt settings;
+	settings.m_vtuner_type = "satip_client";
+	settings.m_fe_type = FE_TYPE_SAT;
+	settings.m_ipaddr = "127.0.0.1";
+	settings.m_servers.push_back(settings.m_ipaddr);
+	satipConfig config(FE_TYPE_SAT, &settings);
+	config.setPosition(1);
+	config.setFrequency(118360);
+	config.setModsys(SYS_DVBS2);
+	config.setModtype(PSK_8);
+	config.setSymrate(27500);
+	config.setFec(FEC_3_4);
+	config.setRolloff(ROLLOFF_35);
+
+	// a channel with its audio, subtitle and EPG PIDs, the next one shares a few
+	u16 pids[2][24];
+	for (int i = 0; i < 24; ++i) {
+		pids[0][i] = i < 4 ? i : 0x100 + i;
+		pids[1][i] = i < 12 ? pids[0][i] : 0x200 + i;
+	}
+
+	int n = 0;
+	bench("update_pid_list", 1, [&] {
+		config.updatePidList(pids[++n & 1], 24);
+		return static_cast<size_t>(config.getPidStatus());
+	});
+	bench("play_data_pid_change", 1, [&] {
+		config.updatePidList(pids[++n & 1], 24);
+		return config.getPlayData().first.size();
+	});
+	bench("play_data_zap", 1, [&] {
+		config.setFrequency(++n & 1 ? 118360 : 120120);
+		config.setChannelChanged();
+		config.updatePidList(pids[n & 1], 24);
+		return config.getPlayData().first.size();
+	});
+
+	static const int all[] = {8, 64, 512};
+	for (int count : all) {
+		satipTimer timers(count);
+		for (int i = 0; i < count; ++i)
+			timers.create([](void*) {}, nullptr, "bench")->start(1000 + (i * 7919) % 60000);
+		char name[32];
+		snprintf(name, sizeof(name), "next_timer_%d", count);
+		bench(name, 1, [&] { return static_cast<size_t>(timers.getNextTimerBegin()); });
+	}
+}
+
+static void benchRtpRtcp()
+{
+	vtunerOpt settings;
+	settings.m_vtuner_type = "satip_client";
+	settings.m_fe_type = FE_TYPE_SAT;
+	settings.m_ipaddr = "127.0.0.1";
+	settings.m_servers.push_back(settings.m_ipaddr);
+	settings.m_output = "file:/dev/null";
+	settings.m_tcpdata = true;
+	satipConfig config(FE_TYPE_SAT, &settings);
+	satipRTP rtp(-1, &settings, config.getPidFilter());
+	satipRTSP rtsp(&config, "127.0.0.1", "554", &rtp);
+
+	// sender report and APP report, as a server sends them
+	unsigned char rtcp[256];
+	memset(rtcp, 0, sizeof(rtcp));
+	rtcp[0] = 0x80;
+	rtcp[1] = 200;
+	put16(rtcp + 2, 6);
+	put32(rtcp + 4, 0x12345678);
+	const int app_len = sizeof(app_payload) - 1;
+	const int app_size = (16 + app_len + 3) / 4 * 4;
+	unsigned char* app = rtcp + 28;
+	app[0] = 0x80;
+	app[1] = 204;
+	put16(app + 2, app_size / 4 - 1);
+	put32(app + 4, 0x12345678);
+	memcpy(app + 8, "SES1", 4);
+	put16(app + 14, app_len);
+	memcpy(app + 16, app_payload, app_len);
+
+	uint32_t packets = 0;
+	bench("rtcp_sr_app", 1, [&] {
+		put32(rtcp + 20, ++packets);
+		satipMicroBench::rtcpData(rtp, rtcp, 28 + app_size);
+		return static_cast<size_t>(rtcp[20]);
+	});
+	bench("rtcp_app_payload", 1, [&] {
+		satipMicroBench::parseRtcpAppPayload(rtp, app_payload, app_len);
+		return static_cast<size_t>(rtp.getTelemetry().has_lock);
+	});
+
+	// the delivery of a frame alone, then deframing with it
+	uint16_t seq = 0;
+	std::vector<unsigned char> frame = interleavedFrames(1, 0);
+	bench("rtp_tcp_data", 1, [&] {
+		put16(frame.data() + 6, seq++);
+		rtp.rtpTcpData(frame.data(), frame.size());
+		return static_cast<size_t>(frame[7]);
+	});
+
+	std::vector<unsigned char> frames = interleavedFrames(FRAMES, 0);
+	const size_t frame_size = frames.size() / FRAMES;
+	bench("deframe_64k", FRAMES, [&] {
+		for (int i = 0; i < FRAMES; ++i)
+			put16(frames.data() + i * frame_size + 6, seq++);
+		return static_cast<size_t>(satipMicroBench::deframe(rtsp, frames.data(), frames.size()));
+	});
+	// a read that ends within a frame, the rest is moved to the front
+	bench("deframe_64k_partial", FRAMES - 1, [&] {
+		for (int i = 0; i < FRAMES; ++i)
+			put16(frames.data() + i * frame_size + 6, seq++);
+		return static_cast<size_t>(satipMicroBench::deframe(rtsp, frames.data(), frames.size() - frame_size / 2));
+	});
+}
+
+static void benchLogging()
+{
+	const int value = 42;
+	dbg_level = MSG_ERROR;
+	bench("log_debug_off", 1, [&] {
+		DEBUG(MSG_NET, "RTP/AVP Data Continuity error. expected: %d - packet: %d\n", value, value + 1);
+		return static_cast<size_t>(value);
+	});
+
+	// the messages go to /dev/null, not to the results
+	fflush(stderr);
+	const int saved = dup(STDERR_FILENO);
+	const int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDERR_FILENO);
+	close(null_fd);
+
+	dbg_level = MSG_DEBUG;
+	bench("log_debug_on_sync", 1, [&] {
+		DEBUG(MSG_NET, "RTP/AVP Data Continuity error. expected: %d - packet: %d\n", value, value + 1);
+		return static_cast<size_t>(value);
+	});
+
+	// with the log thread: bursts of half a ring, timed without the pauses
+	// in which the log thread writes them, so nothing is dropped
+	if (selected("log_debug_on_async")) {
+		log_start();
+		const int burst = 32;
+		const int bursts = 200;
+		std::vector<double> runs;
+		for (int r = 0; r < RUNS; ++r) {
+			double elapsed = 0;
+			for (int b = 0; b < bursts; ++b) {
+				const double start = now();
+				for (int i = 0; i < burst; ++i)
+					DEBUG(MSG_NET, "RTP/AVP Data Continuity error. expected: %d - packet: %d\n", value, i);
+				elapsed += now() - start;
+				usleep(1000);
+			}
+			runs.push_back(elapsed / (burst * bursts) * 1e9);
+		}
+		log_stop();
+		report("log_debug_on_async", burst * bursts, 1, runs);
+	}
+	dbg_level = MSG_ERROR;
+
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+}
+
+int main(int argc, char** argv)
+{
+	filter = argc > 1 ? argv[1] : nullptr;
+
+	benchRtsp();
+	benchConfig();
+	benchRtpRtcp();
+	benchLogging();
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * satip: recorder benchmark
+ *
+ * Writes a TS-like stream through the plain file output and the recorder
+ * (writeback and O_DIRECT) as fast as possible and reports the rate the
+ * writes were taken at, how long closing took, how much the recorder
+ * dropped (what its pool can't hold, it never blocks the writer) and how
+ * much of the file stayed in the page cache, one JSON line per mode. With
+ * drops the input rate is not a disk rate.
+ *
+ * usage: bench_recorder [directory] [MB]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "output.h"
+#include "recorder.h"
+#include "log.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define CHUNK (7 * 188)
+#define BATCH 32
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// bytes of the file in the page cache
+static size_t residentBytes(const std::string& path, size_t* size)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	*size = 0;
+	if (fd < 0 || fstat(fd, &st) || st.st_size == 0) {
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	*size = st.st_size;
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	const long page = sysconf(_SC_PAGESIZE);
+	std::vector<unsigned char> vec((st.st_size + page - 1) / page);
+	size_t resident = 0;
+	if (!mincore(map, st.st_size, vec.data()))
+		for (unsigned char v : vec)
+			resident += (v & 1) ? page : 0;
+	munmap(map, st.st_size);
+	return resident;
+}
+
+// page cache residency of the files starting with 'prefix', removes them
+static double cachedPercent(const std::string& dir, const std::string& prefix)
+{
+	size_t total = 0, resident = 0;
+	DIR* d = opendir(dir.c_str());
+	if (!d)
+		return 0;
+	while (struct dirent* e = readdir(d)) {
+		if (strncmp(e->d_name, prefix.c_str(), prefix.size()))
+			continue;
+		const std::string path = dir + "/" + e->d_name;
+		size_t size;
+		resident += residentBytes(path, &size);
+		total += size;
+		unlink(path.c_str());
+	}
+	closedir(d);
+	return total ? 100.0 * resident / total : 0;
+}
+
+// Writes 'mb' MB into 'sink', returns the time it took
+static double run(const char* mode, outputSink* sink, size_t mb, const std::vector<unsigned char>& data)
+{
+	const size_t total = mb * 1024 * 1024;
+	struct iovec iov[BATCH];
+	size_t written = 0;
+	const double start = now();
+	while (written < total) {
+		for (int i = 0; i < BATCH; ++i) {
+			iov[i].iov_base = const_cast<unsigned char*>(&data[i * CHUNK]);
+			iov[i].iov_len = CHUNK;
+		}
+		sink->write(iov, BATCH);
+		written += BATCH * CHUNK;
+	}
+	const double secs = now() - start;
+	printf("{\"bench\":\"recorder\",\"mode\":\"%s\",\"mb\":%zu,\"input_mb_per_s\":%.1f", mode, mb, written / secs / 1e6);
+	return secs;
+}
+
+int main(int argc, char** argv)
+{
+	const std::string dir = argc > 1 ? argv[1] : ".";
+	const size_t mb = argc > 2 ? atoi(argv[2]) : 512;
+
+	std::vector<unsigned char> data(BATCH * CHUNK);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = (i % 188) ? static_cast<unsigned char>(random()) : 0x47;
+
+	{
+		const std::string path = dir + "/bench-plain.ts";
+		auto sink = outputSink::create("file:" + path, -1);
+		if (!sink)
+			return 1;
+		run("page_cache", sink.get(), mb, data);
+		const double start = now();
+		sink.reset();
+		printf(",\"close_sec\":%.2f,\"dropped\":0,\"dropped_pct\":0.0,\"cached_pct\":%.1f}\n",
+			now() - start, cachedPercent(dir, "bench-plain"));
+	}
+
+	for (int direct = 0; direct <= 1; ++direct) {
+		recorderSink::settings s;
+		s.prefix = dir + (direct ? "/bench-direct" : "/bench-writeback");
+		s.segment_bytes = 256 * 1024 * 1024;
+		s.segment_sec = 0;
+		s.direct = direct;
+		s.blocks = 64;
+
+		recorderSink* rec = new recorderSink(s);
+		if (!rec->isOpened())
+			return 1;
+		run(direct ? "direct" : "writeback", rec, mb, data);
+		// the I/O thread writes the queued blocks before it stops
+		const double start = now();
+		const uint64_t dropped = rec->getDropped();
+		delete rec;
+		printf(",\"close_sec\":%.2f,\"dropped\":%llu,\"dropped_pct\":%.1f,\"cached_pct\":%.1f}\n",
+			now() - start, static_cast<unsigned long long>(dropped), 100.0 * dropped / (mb * 1048576.0),
+			cachedPercent(dir, direct ? "bench-direct" : "bench-writeback"));
+	}
+	return 0;
+}
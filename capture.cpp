@@ -0,0 +1,283 @@
+/*
+ * satip: capture of the received packets and RTSP exchanges
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "capture.h"
+#include "log.h"
+#include "threadpolicy.h"
+
+static void put16(unsigned char* p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char* p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(unsigned char* p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint32_t get32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t get64(const unsigned char* p)
+{
+	return get32(p) | (static_cast<uint64_t>(get32(p + 4)) << 32);
+}
+
+static uint64_t clockNs(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+packetCapture::packetCapture(const std::string& path) :
+	m_path(path),
+	m_fd(-1),
+	m_start(clockNs(CLOCK_MONOTONIC)),
+	m_current(nullptr),
+	m_stopping(false),
+	m_thread(0),
+	m_records(0),
+	m_dropped(0)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&m_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (m_fd < 0) {
+		ERROR(MSG_MAIN, "capture: open %s failed: %s\n", path.c_str(), strerror(errno));
+		return;
+	}
+	unsigned char header[FILE_HEADER_SIZE];
+	memcpy(header, MAGIC, 8);
+	put32(header + 8, FORMAT_VERSION);
+	put32(header + 12, 0);
+	put64(header + 16, clockNs(CLOCK_REALTIME));
+	if (write(m_fd, header, sizeof(header)) != sizeof(header)) {
+		ERROR(MSG_MAIN, "capture: write %s failed: %s\n", path.c_str(), strerror(errno));
+		return;
+	}
+
+	m_blocks.resize(BLOCKS);
+	for (auto& blk : m_blocks) {
+		blk.data.resize(BLOCK_SIZE);
+		blk.len = 0;
+		m_free.push_back(&blk);
+	}
+	INFO(MSG_MAIN, "capturing to %s\n", path.c_str());
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+}
+
+packetCapture::~packetCapture()
+{
+	pthread_mutex_lock(&m_lock);
+	if (m_current && m_current->len > 0) {
+		m_full.push_back(m_current);
+		m_current = nullptr;
+	}
+	m_stopping = true;
+	pthread_cond_signal(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+
+	if (m_thread)
+		pthread_join(m_thread, nullptr);
+	if (m_fd >= 0)
+		close(m_fd);
+
+	if (m_dropped)
+		WARN(MSG_MAIN, "capture %s: %llu of %llu records dropped, disk too slow\n", m_path.c_str(),
+			static_cast<unsigned long long>(m_dropped), static_cast<unsigned long long>(m_records));
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+}
+
+uint64_t packetCapture::now() const
+{
+	return clockNs(CLOCK_MONOTONIC) - m_start;
+}
+
+void packetCapture::add(captureType type, int channel, uint64_t time, const void* data, size_t len)
+{
+	const size_t size = RECORD_HEADER_SIZE + len;
+	pthread_mutex_lock(&m_lock);
+	++m_records;
+	if (m_current && m_current->len + size > BLOCK_SIZE) {
+		m_full.push_back(m_current);
+		m_current = nullptr;
+		pthread_cond_signal(&m_cond);
+	}
+	if (!m_current && !m_free.empty()) {
+		m_current = m_free.back();
+		m_free.pop_back();
+	}
+	if (!m_current || size > BLOCK_SIZE) {
+		++m_dropped;
+		pthread_mutex_unlock(&m_lock);
+		return;
+	}
+
+	unsigned char* p = m_current->data.data() + m_current->len;
+	p[0] = type;
+	p[1] = channel;
+	put16(p + 2, 0);
+	put32(p + 4, len);
+	put64(p + 8, time);
+	memcpy(p + RECORD_HEADER_SIZE, data, len);
+	m_current->len += size;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void packetCapture::addStream(captureType type, uint64_t time, const void* data, size_t len)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t done = 0; done < len; ) {
+		const size_t part = std::min(len - done, BLOCK_SIZE - RECORD_HEADER_SIZE);
+		add(type, 0, time, p + done, part);
+		done += part;
+	}
+}
+
+void* packetCapture::thread_wrapper(void* ptr)
+{
+	return static_cast<packetCapture*>(ptr)->ioLoop();
+}
+
+void* packetCapture::ioLoop()
+{
+	threadRoleScope role(THREAD_ROLE_WRITER, "satip-capture");
+	pthread_mutex_lock(&m_lock);
+	for (;;)
+	{
+		if (m_full.empty() && !m_stopping) {
+			struct timespec until;
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_sec += 1;
+			// what came in the last second goes out, even if the block is not full
+			if (pthread_cond_timedwait(&m_cond, &m_lock, &until) == ETIMEDOUT &&
+				m_full.empty() && m_current && m_current->len > 0) {
+				m_full.push_back(m_current);
+				m_current = nullptr;
+			}
+		}
+		if (m_full.empty()) {
+			if (m_stopping)
+				break;
+			continue;
+		}
+
+		block* blk = m_full.front();
+		m_full.pop_front();
+		pthread_mutex_unlock(&m_lock);
+
+		size_t done = 0;
+		while (done < blk->len) {
+			const ssize_t res = write(m_fd, blk->data.data() + done, blk->len - done);
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0) {
+				ERROR_RL(MSG_MAIN, errno, "capture: write failed: %s\n", strerror(errno));
+				break;
+			}
+			done += res;
+		}
+
+		pthread_mutex_lock(&m_lock);
+		blk->len = 0;
+		m_free.push_back(blk);
+	}
+	pthread_mutex_unlock(&m_lock);
+	return 0;
+}
+
+captureReader::captureReader(const char* path) :
+	m_data(nullptr),
+	m_size(0),
+	m_pos(packetCapture::FILE_HEADER_SIZE),
+	m_start(0),
+	m_version(0)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || st.st_size < static_cast<off_t>(packetCapture::FILE_HEADER_SIZE)) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return;
+
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	const uint32_t version = get32(p + 8);
+	if (memcmp(p, packetCapture::MAGIC, 8) || version < 1 || version > packetCapture::FORMAT_VERSION) {
+		munmap(data, st.st_size);
+		return;
+	}
+	m_data = p;
+	m_size = st.st_size;
+	m_start = get64(p + 16);
+	m_version = version;
+}
+
+captureReader::~captureReader()
+{
+	if (m_data)
+		munmap(const_cast<unsigned char*>(m_data), m_size);
+}
+
+bool captureReader::next(record& rec)
+{
+	if (!m_data || m_size - m_pos < packetCapture::RECORD_HEADER_SIZE)
+		return false;
+	const unsigned char* p = m_data + m_pos;
+	const size_t len = get32(p + 4);
+	if (m_size - m_pos - packetCapture::RECORD_HEADER_SIZE < len)
+		return false;
+
+	rec.type = static_cast<captureType>(p[0]);
+	rec.channel = p[1];
+	rec.time = get64(p + 8);
+	rec.data = p + packetCapture::RECORD_HEADER_SIZE;
+	rec.len = len;
+	m_pos += packetCapture::RECORD_HEADER_SIZE + len;
+	return true;
+}
@@ -0,0 +1,136 @@
+/*
+ * satip: capture of the received packets and RTSP exchanges
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_CAPTURE_H
+#define _SATIP_CAPTURE_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+/*
+ * Capture file, all numbers little endian:
+ *   header  "SATIPCAP", version (u32), 0 (u32), start (u64, unix time in ns)
+ *   records type (u8), channel (u8), 0 (u16), length (u32), time (u64, ns since the start), data
+ *
+ * RTP and RTCP records are UDP datagrams, the RTP datagrams of one receive
+ * share their time. TCP records are the bytes of one read of the RTSP
+ * connection as they came off the socket, responses and "$" frames alike,
+ * long reads take several records. Interleaved records are whole "$" frames
+ * of a shared connection (tcpdata_shared), channel is their channel. RTSP
+ * records are the requests sent and the responses received. Version 1 has
+ * no TCP records, all "$" frames are interleaved records.
+ */
+enum captureType
+{
+	CAPTURE_RTP = 1,
+	CAPTURE_RTCP,
+	CAPTURE_INTERLEAVED,
+	CAPTURE_RTSP_TX,
+	CAPTURE_RTSP_RX,
+	CAPTURE_TCP_RX
+};
+
+/*
+ * Writes a capture. Records are copied into blocks from a fixed pool
+ * under a lock, so any thread may add them, an I/O thread writes the full
+ * blocks and the partly filled one every second. If the pool runs dry
+ * whole records are dropped and counted.
+ */
+class packetCapture
+{
+public:
+	static constexpr char MAGIC[] = "SATIPCAP";
+	static constexpr uint32_t FORMAT_VERSION = 2;
+	static constexpr size_t FILE_HEADER_SIZE = 24;
+	static constexpr size_t RECORD_HEADER_SIZE = 16;
+	static constexpr size_t BLOCK_SIZE = 256 * 1024;
+	static constexpr int BLOCKS = 16;
+
+private:
+	struct block
+	{
+		std::vector<unsigned char> data;
+		size_t len;
+	};
+
+	std::string m_path;
+	int m_fd;
+	uint64_t m_start; // CLOCK_MONOTONIC ns
+
+	std::vector<block> m_blocks;
+	std::vector<block*> m_free;
+	std::deque<block*> m_full;
+	block* m_current;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	bool m_stopping;
+	pthread_t m_thread;
+	uint64_t m_records;
+	uint64_t m_dropped;
+
+	static void* thread_wrapper(void* ptr);
+	void* ioLoop();
+
+public:
+	explicit packetCapture(const std::string& path);
+	~packetCapture();
+
+	bool isOpened() const { return m_thread != 0; }
+
+	// ns since the start, take it once for the datagrams of one receive
+	uint64_t now() const;
+	void add(captureType type, int channel, uint64_t time, const void* data, size_t len); // any thread
+	// stream data, in as many records as it takes
+	void addStream(captureType type, uint64_t time, const void* data, size_t len);
+};
+
+/* Reads a capture, the record data points into the mapped file */
+class captureReader
+{
+	const unsigned char* m_data;
+	size_t m_size;
+	size_t m_pos;
+	uint64_t m_start;
+	uint32_t m_version;
+
+public:
+	struct record
+	{
+		captureType type;
+		int channel;
+		uint64_t time;
+		const unsigned char* data;
+		size_t len;
+	};
+
+	explicit captureReader(const char* path);
+	~captureReader();
+
+	bool isOpened() const { return m_data != nullptr; }
+	uint64_t getStart() const { return m_start; }
+	uint32_t getVersion() const { return m_version; }
+	void rewind() { m_pos = packetCapture::FILE_HEADER_SIZE; }
+
+	// false at the end, or at a record cut short
+	bool next(record& rec);
+};
+
+#endif
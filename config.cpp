@@ -23,7 +23,9 @@
 #ifndef __uint32_t_defined
 #include <stdint.h>
 #endif
-#include <sstream> // std::ostringstream
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "config.h"
 #include "log.h"
@@ -43,25 +45,43 @@ static uint32_t pls_root2gold(uint32_t root)
 
 satipConfig::satipConfig(int fe_type, vtunerOpt* settings):
 	m_fe_type(fe_type),
+	m_pids_all(false),
+	m_server_pids_all(false),
+	m_churn_start(0),
+	m_churn_count(0),
+	m_churn_prev(0),
+	m_has_guests_pending(false),
+	m_guest_changed(false),
+	m_has_guests(false),
+	m_shared(false),
+	m_share_lost(false),
+	m_event_fd(-1),
+	m_reload_changed(false),
+	m_tuning_changed(false),
 	m_signal_source(1),
 	m_pol(CONFIG_POL_HORIZONTAL),
 	m_status(CONFIG_STATUS_CHANNEL_INVALID),
 	m_pid_status(CONFIG_STATUS_PID_STATIONARY),
 	m_lnb_voltage_onoff(CONFIG_LNB_OFF),
-	m_settings(settings)
+	m_settings(settings),
+	m_tuning_data(TUNING_DATA_SIZE),
+	m_request_data(REQUEST_DATA_SIZE)
 {
-	for (int i = 0; i < MAX_PIDS; i++)
-	{
-		m_pid_list[i].status = PID_INVALID;
-		m_pid_list[i].pid = -1;
-	}
-
+	pthread_mutex_init(&m_guest_lock, NULL);
+	pthread_mutex_init(&m_reload_lock, NULL);
+	pthread_mutex_init(&m_tuning_lock, NULL);
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	clearProperty();
 }
 
 satipConfig::~satipConfig()
 {
 	DEBUG(MSG_MAIN,"Destruct satipConfig.\n");
+	if (m_event_fd >= 0)
+		close(m_event_fd);
+	pthread_mutex_destroy(&m_guest_lock);
+	pthread_mutex_destroy(&m_reload_lock);
+	pthread_mutex_destroy(&m_tuning_lock);
 }
 
 void satipConfig::clearProperty()
@@ -87,164 +107,176 @@ void satipConfig::clearProperty()
 
 void satipConfig::clearPidList()
 {
-	for (int i = 0; i < MAX_PIDS; i++)
+	m_pid_desired.clear();
+	m_pid_current.clear();
+	m_pids_all = m_settings->m_pids_all;
+	m_server_pids_all = false;
+	updatePidFilter();
+}
+
+void satipConfig::updatePidsAllMode(int changes)
+{
+	/* PID changes of the current and the previous minute */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	if (ts.tv_sec - m_churn_start >= 60)
+	{
+		m_churn_prev = (ts.tv_sec - m_churn_start >= 120) ? 0 : m_churn_count;
+		m_churn_count = 0;
+		m_churn_start = ts.tv_sec;
+	}
+	m_churn_count += changes;
+	const int churn = m_churn_count + m_churn_prev * (60 - (ts.tv_sec - m_churn_start)) / 60;
+	const int count = m_pid_desired.count();
+
+	const int count_limit = m_settings->m_pids_all_count;
+	const int churn_limit = m_settings->m_pids_all_churn;
+	bool pids_all;
+	if (m_settings->m_pids_all)
+		pids_all = true;
+	else if (!m_pids_all) /* switch on above the limits */
+		pids_all = (count_limit > 0 && count >= count_limit) || (churn_limit > 0 && churn > churn_limit);
+	else /* and back off well below them */
+		pids_all = (count_limit > 0 && count >= count_limit * 3 / 4) || (churn_limit > 0 && churn > churn_limit / 2);
+
+	if (pids_all != m_pids_all)
 	{
-		m_pid_list[i].status = PID_INVALID;
+		INFO(MSG_MAIN, "pids=all mode %s (PIDs : %d, PID changes/min : %d)\n", pids_all ? "on" : "off", count, churn);
+		m_pids_all = pids_all;
 	}
 }
 
-void satipConfig::updatePidList(const u16* new_pid_list)
+void satipConfig::updatePidList(const u16* new_pid_list, int count)
 {
-	DEBUG(MSG_HW, "====================== updatePidList ======================\n");
-	int new_pid = -1;
-	int cur_pid = -1;
-	int found = 0;
-
-	for (int new_index = 0; new_index < MAX_PIDS; new_index++)
+	pidSet pids;
+	for (int i = 0; i < count; i++)
 	{
-		if (new_pid_list[new_index] >= 0x2000)
-			continue;
+		if (new_pid_list[i] < pidSet::PID_COUNT)
+			pids.set(new_pid_list[i]);
+	}
+	updatePidList(pids);
+}
 
-		new_pid = static_cast<int>(new_pid_list[new_index]);
+void satipConfig::updatePidList(const pidSet& pids)
+{
+	DEBUG(MSG_HW, "====================== updatePidList ======================\n");
 
-		DEBUG(MSG_HW, "receive PID : %d\n", new_pid);
-	}
+	const pidSet old_desired = m_pid_desired;
+	m_pid_desired = pids;
 
-	/* add pid */
-	for (int new_index = 0; new_index < MAX_PIDS; new_index++)
-	{
-		new_pid = static_cast<int>(new_pid_list[new_index]);
+	updatePidsAllMode((m_pid_desired - old_desired).count() + (old_desired - m_pid_desired).count());
+	updatePidFilter();
 
-		if (new_pid >= 0x2000)
-			continue;
+	if (LOG_ENABLED(MSG_HW, MSG_DEBUG))
+	{
+		m_pid_desired.forEach([](int pid) { DEBUG(MSG_HW, "receive PID : %d\n", pid); });
+		(m_pid_desired - m_pid_current).forEach([](int pid) { DEBUG(MSG_HW, "ADD PID : %d\n", pid); });
+		(m_pid_current - m_pid_desired).forEach([](int pid) { DEBUG(MSG_HW, "DELETE PID : %d\n", pid); });
+	}
 
-		found = 0;
-		for (int cur_index = 0; cur_index < MAX_PIDS; cur_index++)
-		{
-			if (m_pid_list[cur_index].pid == new_pid)
-			{
-				found = 1;
-				switch(m_pid_list[cur_index].status)
-				{
-					case PID_ADD:
-						DEBUG(MSG_HW, "ADD PID(already added) : %d\n", new_pid);
-						break;
-
-					case PID_DELETE:
-						DEBUG(MSG_HW, "REMOVE PID : %d\n", new_pid);
-						m_pid_list[cur_index].status = PID_VALID;
-						break;
-
-					case PID_VALID:
-						DEBUG(MSG_HW, "ADD PID(already added) : %d\n", new_pid);
-						break;
-
-					case PID_INVALID:
-						DEBUG(MSG_HW, "ADD PID : %d\n", new_pid);
-						m_pid_list[cur_index].status = PID_ADD;
-						break;
-
-					default:
-						break;
-				}
-				
-			}
-		}
+	updatePidStatus();
 
-		if (!found)
-		{
-			int cur_index = 0;
-			for (; cur_index < MAX_PIDS; cur_index++)
-			{
-				if (m_pid_list[cur_index].status == PID_INVALID)
-				{
-					DEBUG(MSG_HW, "ADD PID : %d\n", new_pid);
-					m_pid_list[cur_index].pid = new_pid;
-					m_pid_list[cur_index].status = PID_ADD;
-					break;
-				}
-			}
+	DEBUG(MSG_HW, "====================== updatePidList END======================\n");
+}
 
-			if (cur_index == MAX_PIDS)
-			{
-				ERROR(MSG_MAIN, "NEW PID ADD FAILED, m_pid_list list is full..");
-			}
-		}
-	}
+void satipConfig::updatePidStatus()
+{
+	if (m_pids_all != m_server_pids_all || (!m_pids_all && requestedPids() != m_pid_current))
+		m_pid_status = CONFIG_STATUS_PID_CHANGED;
+	else
+		m_pid_status = CONFIG_STATUS_PID_STATIONARY;
+}
 
-	/* del pid */
-	for (int cur_index = 0; cur_index < MAX_PIDS; cur_index++)
-	{
-		cur_pid = m_pid_list[cur_index].pid;
+// Guest: our PIDs are now part of the owner's request
+const pidSet& satipConfig::commitSharedPids()
+{
+	m_pid_current = m_pid_desired;
+	m_server_pids_all = m_pids_all;
+	updatePidStatus();
+	return m_pid_desired;
+}
 
-		if (cur_pid >= 0x2000)
-			continue;
-	
-		found = 0;
-		for (int new_index = 0; new_index < MAX_PIDS; new_index++)
-		{
-			new_pid = static_cast<int>(new_pid_list[new_index]);
+// Guest: the owner's TS carries more than our PIDs, filter it
+void satipConfig::setShared(bool shared)
+{
+	m_shared = shared;
+	updatePidFilter();
+}
 
-			if (new_pid >= 0x2000)
-				continue;
+void satipConfig::setGuestPids(const pidSet& pids, bool has_guests)
+{
+	pthread_mutex_lock(&m_guest_lock);
+	m_guest_pending = pids;
+	m_has_guests_pending = has_guests;
+	m_guest_changed.store(true, std::memory_order_release);
+	pthread_mutex_unlock(&m_guest_lock);
+	eventfd_write(m_event_fd, 1);
+}
 
-			if (cur_pid == new_pid)
-			{
-				found = 1;
-				break;
-			}
-		}
+// Owner: request the union of our and the guests' PIDs
+void satipConfig::applyGuestPids()
+{
+	if (!m_guest_changed.exchange(false, std::memory_order_acquire))
+		return;
 
-		if (!found)
-		{
-			switch(m_pid_list[cur_index].status)
-			{
-				case PID_ADD:
-					DEBUG(MSG_HW, "DELETE PID : %d\n", cur_pid);
-					m_pid_list[cur_index].status = PID_INVALID;
-					break;
-
-				case PID_DELETE:
-					break;
-
-				case PID_VALID:
-					DEBUG(MSG_HW, "DELETE PID : %d\n", cur_pid);
-					m_pid_list[cur_index].status = PID_DELETE;
-					break;
-
-				case PID_INVALID:
-					break;
-
-				default:
-					break;
-			}
-		}
-	}
+	pthread_mutex_lock(&m_guest_lock);
+	m_pid_guest = m_guest_pending;
+	m_has_guests = m_has_guests_pending;
+	pthread_mutex_unlock(&m_guest_lock);
 
+	updatePidFilter();
 	updatePidStatus();
+}
 
-	DEBUG(MSG_HW, "====================== updatePidList END======================\n");
+void satipConfig::setShareLost()
+{
+	m_share_lost.store(true);
+	eventfd_write(m_event_fd, 1);
+}
 
-	return;
+void satipConfig::wakeUp()
+{
+	eventfd_write(m_event_fd, 1);
 }
 
-void satipConfig::updatePidStatus()
+void satipConfig::setReloadSettings(const vtunerOpt& settings)
+{
+	pthread_mutex_lock(&m_reload_lock);
+	m_reload_pending = settings;
+	m_reload_changed.store(true, std::memory_order_release);
+	pthread_mutex_unlock(&m_reload_lock);
+	eventfd_write(m_event_fd, 1);
+}
+
+bool satipConfig::applyReloadSettings()
 {
-	/* update PID status */
-	int pid_changed = 0;
-	for (int cur_index = 0; cur_index < MAX_PIDS; cur_index++)
+	if (!m_reload_changed.exchange(false, std::memory_order_acquire))
+		return false;
+
+	const vtunerOpt old = *m_settings;
+	pthread_mutex_lock(&m_reload_lock);
+	m_settings->applyLive(m_reload_pending);
+	pthread_mutex_unlock(&m_reload_lock);
+
+	if (m_settings->m_pids_all != old.m_pids_all || m_settings->m_pids_all_count != old.m_pids_all_count ||
+		m_settings->m_pids_all_churn != old.m_pids_all_churn)
 	{
-		if ((m_pid_list[cur_index].status == PID_ADD) || (m_pid_list[cur_index].status == PID_DELETE))
-		{
-			pid_changed = 1;
-			break;
-		}
+		INFO(MSG_MAIN, "tuner %d: pids_all %d, pids_all_count %d, pids_all_churn %d\n", m_settings->m_index,
+			m_settings->m_pids_all, m_settings->m_pids_all_count, m_settings->m_pids_all_churn);
+		updatePidsAllMode(0);
+		updatePidFilter();
+		updatePidStatus();
 	}
+	if (m_settings->m_fe_number != old.m_fe_number || m_settings->m_force_plts != old.m_force_plts)
+		INFO(MSG_MAIN, "tuner %d: fe %d, force_plts %d from the next tuning\n", m_settings->m_index,
+			m_settings->m_fe_number, m_settings->m_force_plts);
+	return m_settings->m_rtp_net_buffer_size_mb != old.m_rtp_net_buffer_size_mb;
+}
 
-	if (pid_changed)
-		m_pid_status = CONFIG_STATUS_PID_CHANGED;
-	else
-		m_pid_status = CONFIG_STATUS_PID_STATIONARY;
+void satipConfig::clearEvent()
+{
+	eventfd_t value;
+	eventfd_read(m_event_fd, &value);
 }
 
 void satipConfig::setVoltage(int voltage)
@@ -282,10 +314,51 @@ t_pid_status satipConfig::getPidStatus()
 	return m_pid_status;
 }
 
-std::string satipConfig::getTuningData()
+transponderId satipConfig::getTransponder()
+{
+	transponderId id;
+	id.fe_type = m_fe_type;
+	id.freq = m_frequency;
+	id.src = m_fe_type == FE_TYPE_SAT ? m_signal_source : 0;
+	id.pol = m_fe_type != FE_TYPE_SAT ? 0 : m_pol == CONFIG_POL_VERTICAL ? 'v' : 'h';
+	return id;
+}
+
+void satipConfig::setPendingTuning(const tuningRequest& tuning)
+{
+	pthread_mutex_lock(&m_tuning_lock);
+	m_tuning_pending = tuning;
+	m_tuning_changed.store(true, std::memory_order_release);
+	pthread_mutex_unlock(&m_tuning_lock);
+	eventfd_write(m_event_fd, 1);
+}
+
+// As the vtuner does it: the properties, DTV_TUNE, then the PID list
+void satipConfig::applyPendingTuning()
 {
-	std::string data;
-	std::ostringstream oss_data;
+	if (!m_tuning_changed.exchange(false, std::memory_order_acquire))
+		return;
+
+	pthread_mutex_lock(&m_tuning_lock);
+	const tuningRequest& t = m_tuning_pending;
+	m_signal_source = t.src;
+	m_frequency = t.freq;
+	m_pol = t.pol;
+	m_msys = t.msys;
+	m_mtype = t.mtype;
+	m_symrate = t.symrate;
+	m_fec = t.fec;
+	m_rolloff = t.rolloff;
+	m_lnb_voltage_onoff = CONFIG_LNB_ON;
+	setChannelChanged();
+	updatePidList(t.pids);
+	pthread_mutex_unlock(&m_tuning_lock);
+}
+
+std::string_view satipConfig::getTuningData()
+{
+	textBuffer& oss_data = m_tuning_data;
+	oss_data.clear();
 
 	if (m_settings->m_fe_number > 0)
 		oss_data << "&fe=" << m_settings->m_fe_number;
@@ -505,15 +578,17 @@ std::string satipConfig::getTuningData()
 	src=1&freq=11538&pol=v&ro=0.35&msys=dvbs&mtype=qpsk&plts=off&sr=22000&fec=56&pids=0,611,621,631
 	*/
 
-	DEBUG(MSG_MAIN, "TUNE DATA : \n%s\n", oss_data.str().c_str());
+	DEBUG(MSG_MAIN, "TUNE DATA : \n%s\n", oss_data.c_str());
 
-	return oss_data.str();
+	return oss_data.view();
 }
 
-std::pair<std::string, bool> satipConfig::getSetupData()
+std::pair<std::string_view, bool> satipConfig::getSetupData()
 {
 	bool channelChanged = false;
-	std::ostringstream oss_data;
+	textBuffer& oss_data = m_request_data;
+	oss_data.clear();
+	oss_data << '?';
 
 	if (m_status == CONFIG_STATUS_CHANNEL_CHANGED)
 	{
@@ -522,51 +597,38 @@ std::pair<std::string, bool> satipConfig::getSetupData()
 		channelChanged = true;
 	}
 
-	std::ostringstream oss_addpid;
-	for (int cur_index = 0; cur_index < MAX_PIDS; cur_index++)
+	const pidSet requested = requestedPids();
+	if (m_pids_all)
 	{
-		if ((m_pid_list[cur_index].status == PID_ADD) || (m_pid_list[cur_index].status == PID_VALID))
-		{
-			if (!oss_addpid.str().empty())
-				oss_addpid << ',';
-
-			oss_addpid << m_pid_list[cur_index].pid;
-
-			m_pid_list[cur_index].status = PID_VALID;
-		}
+		oss_data << "&pids=all";
 	}
-
-	if (!oss_addpid.str().empty()) 
+	else if (!requested.empty())
 	{
-		oss_data << "&pids=" << oss_addpid.str();
+		oss_data << "&pids=";
+		requested.appendTo(oss_data);
 	}
 	else
 	{
 		oss_data << "&pids=none";
 	}
 
+	m_pid_current = requested;
+	m_server_pids_all = m_pids_all;
 	updatePidStatus();
 
-	std::string data = oss_data.str();
-	if (!data.empty())
-	{
-		if (data[0] == '&')
-			data.erase(data.begin());
-
-		data.insert(data.begin(), '?');
-	}
-
 	/* 
 	src=1&freq=10202&pol=v&msys=dvbs&sr=27500&fec=34&pids=0,16,25,104
 	*/
 
-	return { std::move(data), channelChanged };
+	return requestData(channelChanged);
 }
 
-std::pair<std::string, bool> satipConfig::getPlayData()
+std::pair<std::string_view, bool> satipConfig::getPlayData()
 {
 	bool channelChanged = false;
-	std::ostringstream oss_data;
+	textBuffer& oss_data = m_request_data;
+	oss_data.clear();
+	oss_data << '?';
 
 	if (m_status == CONFIG_STATUS_CHANNEL_CHANGED)
 	{
@@ -575,59 +637,63 @@ std::pair<std::string, bool> satipConfig::getPlayData()
 		channelChanged = true;
 	}
 
-	if (m_pid_status == CONFIG_STATUS_PID_CHANGED)
+	const pidSet requested = requestedPids();
+	if (m_pid_status == CONFIG_STATUS_PID_CHANGED && m_pids_all)
 	{
-		std::string addpid, delpid;
-		std::ostringstream oss_addpid, oss_delpid;
-		for (int cur_index = 0; cur_index < MAX_PIDS; cur_index++)
-		{
-			if (m_pid_list[cur_index].status == PID_ADD)
-			{
-				if (!oss_addpid.str().empty())
-					oss_addpid << ',';
-
-				oss_addpid << m_pid_list[cur_index].pid;
-
-				m_pid_list[cur_index].status = PID_VALID;
-			}
-			else if (m_pid_list[cur_index].status == PID_DELETE)
-			{
-				if (!oss_delpid.str().empty())
-					oss_delpid << ',';
-
-				oss_delpid << m_pid_list[cur_index].pid;
-
-				m_pid_list[cur_index].status = PID_INVALID;
-			}
-		}
+		oss_data << "&pids=all";
+		m_pid_current = requested;
+		m_server_pids_all = true;
+		updatePidStatus();
+	}
+	else if (m_pid_status == CONFIG_STATUS_PID_CHANGED && m_server_pids_all)
+	{
+		oss_data << "&pids=";
+		if (requested.empty())
+			oss_data << "none";
+		else
+			requested.appendTo(oss_data);
+		m_pid_current = requested;
+		m_server_pids_all = false;
+		updatePidStatus();
+	}
+	else if (m_pid_status == CONFIG_STATUS_PID_CHANGED)
+	{
+		const pidSet addpid = requested - m_pid_current;
+		const pidSet delpid = m_pid_current - requested;
 
-		if (!oss_addpid.str().empty())
+		if (!addpid.empty())
 		{
-			oss_data << "&addpids=" << oss_addpid.str();
+			oss_data << "&addpids=";
+			addpid.appendTo(oss_data);
 		}
 
-		if (!oss_delpid.str().empty())
+		if (!delpid.empty())
 		{
-			oss_data << "&delpids=" << oss_delpid.str();
+			oss_data << "&delpids=";
+			delpid.appendTo(oss_data);
 		}
 
+		m_pid_current = requested;
 		updatePidStatus();
 	}
 
-	std::string data = oss_data.str();
-	if (!data.empty())
-	{
-		if (data[0] == '&')
-			data.erase(data.begin());
-
-		data.insert(data.begin(), '?');
-	}
-
 	/*
 	?src=1&freq=11538&pol=v&ro=0.35&msys=dvbs&mtype=qpsk&plts=off&sr=22000&fec=56&pids=0,611,621,631
 	*/
 
-	return { std::move(data), channelChanged };
+	return requestData(channelChanged);
 }
 
+// "?&src=1&..." to "?src=1&...", nothing for just "?"
+std::pair<std::string_view, bool> satipConfig::requestData(bool channelChanged)
+{
+	if (m_request_data.size() == 1)
+		m_request_data.clear();
+	else if (m_request_data[1] == '&')
+		m_request_data.erase(1, 1);
+
+	if (m_request_data.overflow())
+		ERROR(MSG_MAIN, "RTSP request data cut at %zu bytes\n", m_request_data.size());
 
+	return { m_request_data.view(), channelChanged };
+}
@@ -21,13 +21,15 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
 
+#include <atomic>
 #include <string>
 #include <utility>
+#include <pthread.h>
 #include <linux/dvb/frontend.h>
 
 #include "option.h"
-
-#define MAX_PIDS 30 // from usbtunerhelper
+#include "pidset.h"
+#include "textbuffer.h"
 
 typedef unsigned short u16;
 
@@ -69,15 +71,55 @@ typedef enum
 	CONFIG_STATUS_PID_CHANGED
 }t_pid_status;
 
+/* What a server tuner is tuned to, to compare with the streams of a server */
+struct transponderId
+{
+	int fe_type;
+	int src;            // DVB-S only
+	unsigned int freq;  // 100kHz
+	char pol;           // DVB-S only, 'h' or 'v'
+
+	bool operator==(const transponderId& other) const
+	{
+		return fe_type == other.fe_type && src == other.src && freq == other.freq && pol == other.pol;
+	}
+};
+
+/* A tuning from outside the vtuner, for sessions without a vtuner device */
+struct tuningRequest
+{
+	int src;
+	unsigned int freq; // 100kHz
+	int pol;           // CONFIG_POL_*
+	int msys;          // SYS_*
+	int mtype;
+	int symrate;
+	int fec;
+	int rolloff;
+	pidSet pids;
+};
+
 class satipConfig
 {
 public:
+	/* the longest tuning and a request with all PIDs, "&pids=0,1,...,8191" */
+	static constexpr size_t TUNING_DATA_SIZE = 256;
+	static constexpr size_t REQUEST_DATA_SIZE = TUNING_DATA_SIZE + 16 + pidSet::PID_COUNT * 5;
+
 	satipConfig(int fe_type, vtunerOpt* settings);
 	virtual ~satipConfig();
 
 	bool isTcpData() {return m_settings->m_tcpdata;}
+	bool isTcpZeroCopy() {return m_settings->m_tcpdata && m_settings->m_tcpdata_zerocopy && !m_settings->m_tcpdata_shared;}
+	bool isTcpShared() {return m_settings->m_tcpdata && m_settings->m_tcpdata_shared;}
 	int getTcpDataTimeout() {return m_settings->m_tcpdata_timeout;}
 	int getRtpNetBufferSizeMB() {return m_settings->m_rtp_net_buffer_size_mb;}
+	bool isShareTransponder() {return m_settings->m_share_transponder;}
+	const std::vector<std::string>& getServers() {return m_settings->m_servers;}
+	bool isServerPool() {return m_settings->m_servers.size() > 1;}
+	transponderId getTransponder();
+	int getTunerIndex() {return m_settings->m_index;}
+	const std::string& getControl() {return m_settings->m_control;}
 	int getFeType() {return m_fe_type;}
 
 	/* vtuner property */
@@ -143,33 +185,84 @@ public:
 	/* channel, pid status */
 	t_channel_status getChannelStatus();
 	void setChannelChanged();
+	void setChannelStable() {m_status = CONFIG_STATUS_CHANNEL_STABLE;}
 	t_pid_status getPidStatus();
-	void updatePidList(const u16* new_pid_list);
+	void updatePidList(const u16* new_pid_list, int count);
+	void updatePidList(const pidSet& pids);
 	void updatePidStatus();
+	bool isPidsAll() {return m_pids_all;}
+	const pidFilter* getPidFilter() {return &m_pid_filter;}
+
+	/* transponder sharing, see sharing.h */
+	std::string getTuningKey() {return std::string(getTuningData());}
+	const pidSet& commitSharedPids();
+	void setShared(bool shared);
+	void setGuestPids(const pidSet& pids, bool has_guests); // any thread
+	void applyGuestPids();
+	void setShareLost(); // any thread
+	bool takeShareLost() {return m_share_lost.exchange(false);}
+	int getEventFd() {return m_event_fd;}
+	void clearEvent();
+	void wakeUp(); // any thread, e.g. to see the session stopping
+
+	/* options changed by a config reload, see sessionManager::reload() */
+	void setReloadSettings(const vtunerOpt& settings); // any thread
+	bool applyReloadSettings(); // true if the net buffer size changed
 
-	/* write RTSP message */
-	std::pair<std::string, bool> getSetupData();
-	std::pair<std::string, bool> getPlayData();
+	/* tuning without vtuner, see satipSession::tune() */
+	void setPendingTuning(const tuningRequest& tuning); // any thread
+	void applyPendingTuning();
+
+	/* write RTSP message, the text is valid until the next call */
+	std::pair<std::string_view, bool> getSetupData();
+	std::pair<std::string_view, bool> getPlayData();
 
 private:
 	static constexpr int M_NO_STREAM_ID_FILTER = NO_STREAM_ID_FILTER;
 	int m_fe_type;
 
-	typedef enum
-	{
-		PID_ADD = 0,
-		PID_DELETE,
-		PID_VALID,
-		PID_INVALID
-	}t_pid_elem_status;
-	
-	struct pid_elem
-	{
-		int pid;
-		t_pid_elem_status status;
-	};
+	/* PIDs requested by the vtuner and PIDs the server is streaming */
+	pidSet m_pid_desired;
+	pidSet m_pid_current;
+
+	/* pids=all mode, PIDs are then selected by m_pid_filter in the data path */
+	bool m_pids_all;
+	bool m_server_pids_all;
+	pidFilter m_pid_filter;
+	time_t m_churn_start;
+	int m_churn_count;
+	int m_churn_prev;
+
+	void updatePidsAllMode(int changes);
 
-	struct pid_elem m_pid_list[MAX_PIDS];
+	/* PIDs of the sessions sharing our stream, set by their threads */
+	pthread_mutex_t m_guest_lock;
+	pidSet m_guest_pending;
+	bool m_has_guests_pending;
+	std::atomic<bool> m_guest_changed;
+	pidSet m_pid_guest;
+	bool m_has_guests;
+	bool m_shared; // we get the stream of another session
+	std::atomic<bool> m_share_lost;
+	int m_event_fd;
+
+	/* set by the thread reloading the config */
+	pthread_mutex_t m_reload_lock;
+	vtunerOpt m_reload_pending;
+	std::atomic<bool> m_reload_changed;
+
+	/* set by satipSession::tune() */
+	pthread_mutex_t m_tuning_lock;
+	tuningRequest m_tuning_pending;
+	std::atomic<bool> m_tuning_changed;
+
+	pidSet requestedPids() const
+	{
+		pidSet pids = m_pid_desired;
+		pids |= m_pid_guest;
+		return pids;
+	}
+	void updatePidFilter() {m_pid_filter.update(m_pid_desired, m_pids_all || m_has_guests || m_shared);}
 
 	void clearPidList();
 
@@ -197,7 +290,12 @@ private:
 	
 	vtunerOpt* m_settings;
 
-	std::string getTuningData();
+	/* allocated with the session, requests are built without allocating */
+	textBuffer m_tuning_data;
+	textBuffer m_request_data;
+
+	std::string_view getTuningData();
+	std::pair<std::string_view, bool> requestData(bool channelChanged);
 };
 
 #endif /* _CONFIG_H_ */
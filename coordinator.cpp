@@ -0,0 +1,464 @@
+/*
+ * satip: tuner coordination between satipclient instances
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+
+#include <algorithm>
+#include <set>
+
+#include "coordinator.h"
+#include "serverpool.h"
+#include "log.h"
+#include "threadpolicy.h"
+
+#define COORD_MAGIC "SATIPCOORD/1 "
+#define COORD_MAX_MESSAGE 8192
+
+static int64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct transponderLess
+{
+	bool operator()(const transponderId& a, const transponderId& b) const
+	{
+		if (a.fe_type != b.fe_type)
+			return a.fe_type < b.fe_type;
+		if (a.src != b.src)
+			return a.src < b.src;
+		if (a.freq != b.freq)
+			return a.freq < b.freq;
+		return a.pol < b.pol;
+	}
+};
+
+static std::string serverKey(const std::string& host, const std::string& port)
+{
+	return host + ":" + port;
+}
+
+satipCoordinator::satipCoordinator() :
+	m_fd(-1),
+	m_thread(0),
+	m_running(false)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	memset(&m_group, 0, sizeof(m_group));
+
+	uint64_t id = 0;
+	if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+		id = (static_cast<uint64_t>(getpid()) << 32) ^ static_cast<uint64_t>(now_ms());
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(id));
+	m_id = buf;
+}
+
+satipCoordinator::~satipCoordinator()
+{
+	stop();
+	close(m_event_fd);
+	pthread_mutex_destroy(&m_lock);
+}
+
+int satipCoordinator::start(const std::string& address)
+{
+	if (m_running)
+		return 0;
+
+	// group:port[@interface]
+	const size_t at = address.find('@');
+	const std::string group_port = address.substr(0, at);
+	const std::string iface = at == std::string::npos ? std::string() : address.substr(at + 1);
+	const size_t colon = group_port.rfind(':');
+	struct in_addr ifaddr;
+	ifaddr.s_addr = htonl(INADDR_ANY);
+
+	m_group.sin_family = AF_INET;
+	if (colon == std::string::npos ||
+		inet_pton(AF_INET, group_port.substr(0, colon).c_str(), &m_group.sin_addr) != 1 ||
+		(m_group.sin_port = htons(atoi(group_port.c_str() + colon + 1))) == 0 ||
+		(!iface.empty() && inet_pton(AF_INET, iface.c_str(), &ifaddr) != 1))
+	{
+		ERROR(MSG_MAIN, "coordination: bad address '%s', want group:port[@interface]\n", address.c_str());
+		return -1;
+	}
+
+	m_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_fd < 0)
+	{
+		ERROR(MSG_MAIN, "coordination: socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// every instance on the host binds the group port
+	const int on = 1;
+	setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_port = m_group.sin_port;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	int res = bind(m_fd, reinterpret_cast<struct sockaddr*>(&local), sizeof(local));
+
+	if (!res && IN_MULTICAST(ntohl(m_group.sin_addr.s_addr)))
+	{
+		struct ip_mreq mreq;
+		mreq.imr_multiaddr = m_group.sin_addr;
+		mreq.imr_interface = ifaddr;
+		const unsigned char ttl = 1;
+		const unsigned char loop = 1;  // other instances on this host
+		res = setsockopt(m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+		if (!res && ifaddr.s_addr != htonl(INADDR_ANY))
+			res = setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+		setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+		setsockopt(m_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+	}
+	else if (!res)
+	{
+		// a broadcast address
+		res = setsockopt(m_fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+	}
+
+	if (res)
+	{
+		ERROR(MSG_MAIN, "coordination: %s: %s\n", address.c_str(), strerror(errno));
+		close(m_fd);
+		m_fd = -1;
+		return -1;
+	}
+
+	INFO(MSG_MAIN, "coordination on %s as %s\n", address.c_str(), m_id.c_str());
+	m_running = true;
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+	return 0;
+}
+
+void satipCoordinator::stop()
+{
+	if (!m_running.exchange(false))
+		return;
+	eventfd_write(m_event_fd, 1);
+	pthread_join(m_thread, nullptr);
+	m_thread = 0;
+
+	// let the others count our frontends free now
+	announce("BYE");
+	close(m_fd);
+	m_fd = -1;
+}
+
+void* satipCoordinator::thread_wrapper(void* ptr)
+{
+	return static_cast<satipCoordinator*>(ptr)->coordLoop();
+}
+
+void* satipCoordinator::coordLoop()
+{
+	threadRoleScope role(THREAD_ROLE_SESSION, "satip-coord");
+	DEBUG(MSG_MAIN, "COORDINATION LOOP START\n");
+	int64_t next_announce = 0;
+	while (m_running)
+	{
+		const int64_t now = now_ms();
+		if (now >= next_announce)
+		{
+			expirePeers();
+			announce();
+			next_announce = now + ANNOUNCE_INTERVAL_MS;
+		}
+
+		struct pollfd pfd[2] = {{m_event_fd, POLLIN, 0}, {m_fd, POLLIN, 0}};
+		if (poll(pfd, 2, static_cast<int>(next_announce - now)) <= 0)
+			continue;
+		if (pfd[0].revents)
+		{
+			eventfd_t value;
+			eventfd_read(m_event_fd, &value);
+		}
+		if (pfd[1].revents & POLLIN)
+			receive();
+	}
+	DEBUG(MSG_MAIN, "COORDINATION LOOP END.\n");
+	return 0;
+}
+
+void satipCoordinator::announce(const char* type)
+{
+	std::string msg = COORD_MAGIC;
+	msg += type;
+	msg += "\nid: " + m_id + "\n";
+
+	pthread_mutex_lock(&m_lock);
+	if (strcmp(type, "BYE"))
+	{
+		for (const auto& [owner, c] : m_local)
+		{
+			char line[128];
+			snprintf(line, sizeof(line), "%s: %s %d %d %u %c ", c.reserving ? "reserve" : "hold",
+				c.server.c_str(), c.tp.fe_type, c.tp.src, c.tp.freq, c.tp.pol ? c.tp.pol : '-');
+			if (msg.size() + strlen(line) + c.tuning.size() + 1 > COORD_MAX_MESSAGE)
+			{
+				WARN(MSG_MAIN, "coordination: too many tuners for one message\n");
+				break;
+			}
+			msg += line + c.tuning + "\n";
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	if (m_fd >= 0 && sendto(m_fd, msg.data(), msg.size(), 0,
+		reinterpret_cast<const struct sockaddr*>(&m_group), sizeof(m_group)) < 0)
+		DEBUG_RL(MSG_NET, errno, "coordination: sendto: %s\n", strerror(errno));
+}
+
+void satipCoordinator::receive()
+{
+	char buf[COORD_MAX_MESSAGE];
+	ssize_t len;
+	while ((len = recv(m_fd, buf, sizeof(buf), 0)) > 0)
+		handleMessage(std::string_view(buf, len));
+}
+
+void satipCoordinator::handleMessage(std::string_view msg)
+{
+	if (msg.substr(0, strlen(COORD_MAGIC)) != COORD_MAGIC)
+		return;
+
+	std::string type;
+	std::string id;
+	std::vector<claim> claims;
+	size_t pos = 0;
+	while (pos < msg.size())
+	{
+		size_t end = msg.find('\n', pos);
+		if (end == std::string_view::npos)
+			end = msg.size();
+		const std::string line(msg.substr(pos, end - pos));
+		pos = end + 1;
+
+		if (type.empty())
+		{
+			type = line.substr(strlen(COORD_MAGIC));
+		}
+		else if (line.compare(0, 4, "id: ") == 0)
+		{
+			id = line.substr(4);
+		}
+		else if (line.compare(0, 6, "hold: ") == 0 || line.compare(0, 9, "reserve: ") == 0)
+		{
+			claim c;
+			char server[64];
+			char pol;
+			int tuning_pos = -1;
+			c.reserving = line[0] == 'r';
+			if (sscanf(line.c_str() + line.find(' ') + 1, "%63s %d %d %u %c %n", server,
+				&c.tp.fe_type, &c.tp.src, &c.tp.freq, &pol, &tuning_pos) < 5 || tuning_pos < 0)
+				continue;
+			c.server = server;
+			c.tp.pol = pol == '-' ? 0 : pol;
+			c.tuning = line.substr(line.find(' ') + 1 + tuning_pos);
+			claims.push_back(c);
+		}
+	}
+
+	if (id.empty() || id == m_id) // our own, looped back
+		return;
+
+	pthread_mutex_lock(&m_lock);
+	if (type == "BYE")
+	{
+		if (m_peers.erase(id))
+			INFO(MSG_MAIN, "coordination: %s left\n", id.c_str());
+	}
+	else if (type == "ANNOUNCE")
+	{
+		const bool is_new = m_peers.find(id) == m_peers.end();
+		peer& p = m_peers[id];
+		p.claims = claims;
+		p.seen = now_ms();
+		if (is_new)
+			INFO(MSG_MAIN, "coordination: %s joined, %zu tuners in use\n", id.c_str(), claims.size());
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void satipCoordinator::expirePeers()
+{
+	const int64_t now = now_ms();
+	pthread_mutex_lock(&m_lock);
+	for (auto it = m_peers.begin(); it != m_peers.end();)
+	{
+		if (now - it->second.seen > PEER_TIMEOUT_MS)
+		{
+			WARN(MSG_MAIN, "coordination: %s went silent, its tuners count free\n", it->first.c_str());
+			it = m_peers.erase(it);
+		}
+		else
+			++it;
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+bool satipCoordinator::isBusy(const std::string& server, const transponderId& tp, const void* owner,
+	const std::vector<transponderId>& streams)
+{
+	if (std::find(streams.begin(), streams.end(), tp) != streams.end())
+		return true;
+	for (const auto& [o, c] : m_local)
+		if (o != owner && !c.reserving && c.server == server && c.tp == tp)
+			return true;
+	for (const auto& [id, p] : m_peers)
+		for (const claim& c : p.claims)
+			if (!c.reserving && c.server == server && c.tp == tp)
+				return true;
+	return false;
+}
+
+bool satipCoordinator::reserve(const void* owner, const std::string& host, const std::string& port,
+	const transponderId& tp, const std::string& tuning)
+{
+	if (!m_running)
+		return true;
+
+	const std::string server = serverKey(host, port);
+	serverPool::serverState state;
+	const bool known = serverPool::getInstance()->getState(host, port, state) &&
+		tp.fe_type >= 0 && tp.fe_type < 3 && state.frontends[tp.fe_type] >= 0;
+
+	pthread_mutex_lock(&m_lock);
+	// without the capacity of the server there is nothing to decide
+	const bool granted = !known || isBusy(server, tp, owner, state.streams);
+	m_local[owner] = claim{server, tp, tuning, !granted};
+	pthread_mutex_unlock(&m_lock);
+
+	if (!granted)
+		DEBUG(MSG_MAIN, "coordination: reserving transponder %u on %s\n", tp.freq / 10, server.c_str());
+	announce();
+	return granted;
+}
+
+bool satipCoordinator::confirm(const void* owner)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_local.find(owner);
+	if (it == m_local.end() || !it->second.reserving)
+	{
+		const bool held = it != m_local.end();
+		pthread_mutex_unlock(&m_lock);
+		return held;
+	}
+	const claim mine = it->second;
+	pthread_mutex_unlock(&m_lock);
+
+	const size_t colon = mine.server.rfind(':');
+	serverPool::serverState state;
+	serverPool::getInstance()->getState(mine.server.substr(0, colon), mine.server.substr(colon + 1), state);
+	const int fe_type = mine.tp.fe_type;
+
+	pthread_mutex_lock(&m_lock);
+	// frontends of the type in use on the server: streams seen by DESCRIBE and holds
+	std::set<transponderId, transponderLess> busy;
+	for (const transponderId& tp : state.streams)
+		if (tp.fe_type == fe_type)
+			busy.insert(tp);
+	for (const auto& [o, c] : m_local)
+		if (o != owner && !c.reserving && c.server == mine.server && c.tp.fe_type == fe_type)
+			busy.insert(c.tp);
+	for (const auto& [id, p] : m_peers)
+		for (const claim& c : p.claims)
+			if (!c.reserving && c.server == mine.server && c.tp.fe_type == fe_type)
+				busy.insert(c.tp);
+	const int used = std::max(static_cast<int>(busy.size()), static_cast<int>(state.used[fe_type].size()));
+
+	// reservations going first: from lower ids, on transponders not yet in use
+	std::set<transponderId, transponderLess> ahead;
+	for (const auto& [id, p] : m_peers)
+		if (id < m_id)
+			for (const claim& c : p.claims)
+				if (c.reserving && c.server == mine.server && c.tp.fe_type == fe_type && !busy.count(c.tp))
+					ahead.insert(c.tp);
+
+	const bool shared = busy.count(mine.tp) || ahead.count(mine.tp);
+	const int needed = used + static_cast<int>(ahead.size()) + (shared ? 0 : 1);
+	const bool granted = state.frontends[fe_type] < 0 || needed <= state.frontends[fe_type];
+	if (granted)
+		m_local[owner].reserving = false;
+	else
+		m_local.erase(owner);
+	pthread_mutex_unlock(&m_lock);
+
+	if (granted)
+		DEBUG(MSG_MAIN, "coordination: transponder %u on %s reserved\n", mine.tp.freq / 10, mine.server.c_str());
+	else
+		INFO(MSG_MAIN, "coordination: %s has no frontend left for transponder %u (%d in use, %zu reserved by others)\n",
+			mine.server.c_str(), mine.tp.freq / 10, used, ahead.size());
+	announce();
+	return granted;
+}
+
+void satipCoordinator::retune(const void* owner, const transponderId& tp, const std::string& tuning)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_local.find(owner);
+	const bool found = it != m_local.end();
+	if (found)
+	{
+		it->second.tp = tp;
+		it->second.tuning = tuning;
+	}
+	pthread_mutex_unlock(&m_lock);
+	if (found)
+		announce();
+}
+
+void satipCoordinator::release(const void* owner)
+{
+	pthread_mutex_lock(&m_lock);
+	const bool found = m_local.erase(owner) > 0;
+	pthread_mutex_unlock(&m_lock);
+	if (found && m_running)
+		announce();
+}
+
+std::vector<transponderId> satipCoordinator::remoteTransponders(const std::string& server)
+{
+	std::vector<transponderId> res;
+	if (!m_running)
+		return res;
+	pthread_mutex_lock(&m_lock);
+	for (const auto& [id, p] : m_peers)
+		for (const claim& c : p.claims)
+			if (c.server == server && std::find(res.begin(), res.end(), c.tp) == res.end())
+				res.push_back(c.tp);
+	pthread_mutex_unlock(&m_lock);
+	return res;
+}
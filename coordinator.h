@@ -0,0 +1,129 @@
+/*
+ * satip: tuner coordination between satipclient instances
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_COORDINATOR_H
+#define _SATIP_COORDINATOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "config.h"
+
+/*
+ * Instances sharing the SAT>IP servers of a LAN tell each other which
+ * frontends they use. Each one sends its whole state as one UDP datagram to
+ * a multicast group, every ANNOUNCE_INTERVAL_MS and on each change:
+ *
+ *	SATIPCOORD/1 ANNOUNCE
+ *	id: 5c0e9a1b7d3f2468
+ *	hold: 192.168.1.10:554 0 1 118360 h src=1&freq=11836&pol=h&...
+ *	reserve: 192.168.1.10:554 0 1 120120 v src=1&freq=12012&pol=v&...
+ *
+ * with server, fe_type, src, freq (100kHz), pol ('-' if none) and tuning.
+ *
+ * A session wanting a transponder no one streams on its server first
+ * announces a reservation and waits RESERVE_WAIT_MS. If the frontends of the
+ * server (from the DESCRIBE of the server pool) are then all held or
+ * reserved by instances with a lower id, it backs off, else it sends SETUP.
+ * A transponder already held on the server, by anyone, costs no frontend,
+ * the server shares it, so these sessions go ahead at once and placement in
+ * the server pool prefers such servers.
+ */
+class satipCoordinator
+{
+public:
+	static constexpr int ANNOUNCE_INTERVAL_MS = 2000;
+	static constexpr int PEER_TIMEOUT_MS = 3 * ANNOUNCE_INTERVAL_MS + 1000;
+	static constexpr int RESERVE_WAIT_MS = 100;
+	static constexpr int RESERVE_RETRY_MS = 1000;
+
+private:
+	struct claim
+	{
+		std::string server; // host:port
+		transponderId tp;
+		std::string tuning;
+		bool reserving;
+	};
+
+	struct peer
+	{
+		std::vector<claim> claims;
+		int64_t seen; // CLOCK_MONOTONIC ms
+	};
+
+	std::string m_id;
+	int m_fd;
+	struct sockaddr_in m_group;
+	int m_event_fd;
+	pthread_t m_thread;
+	std::atomic<bool> m_running;
+
+	pthread_mutex_t m_lock;
+	std::map<const void*, claim> m_local;  // by owner
+	std::map<std::string, peer> m_peers;   // by id
+
+	static void* thread_wrapper(void* ptr);
+	void* coordLoop();
+
+	void announce(const char* type = "ANNOUNCE");
+	void receive();
+	void handleMessage(std::string_view msg);
+	void expirePeers();
+
+	// 'tp' in 'streams' of 'server' or held there by anyone but 'owner'
+	bool isBusy(const std::string& server, const transponderId& tp, const void* owner,
+		const std::vector<transponderId>& streams);
+
+public:
+	satipCoordinator();
+	virtual ~satipCoordinator();
+
+	// "group:port[@interface]", e.g. 239.255.42.42:5500@127.0.0.1 for
+	// instances on one host
+	int start(const std::string& address);
+	void stop();
+	bool isEnabled() {return m_running;}
+
+	// true: go ahead with SETUP, the frontend is held for 'owner'.
+	// false: call confirm() after RESERVE_WAIT_MS
+	bool reserve(const void* owner, const std::string& host, const std::string& port,
+		const transponderId& tp, const std::string& tuning);
+	// true: no other instance objected, the reservation is held now
+	bool confirm(const void* owner);
+	// the session tuned its frontend to another transponder
+	void retune(const void* owner, const transponderId& tp, const std::string& tuning);
+	void release(const void* owner);
+
+	// transponders other instances hold or reserve on host:port
+	std::vector<transponderId> remoteTransponders(const std::string& server);
+
+	static satipCoordinator* getInstance()
+	{
+		static satipCoordinator instance;
+		return &instance;
+	}
+};
+
+#endif
@@ -0,0 +1,413 @@
+/*
+ * satip: HTTP TS re-streaming
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "httpstream.h"
+#include "log.h"
+#include "threadpolicy.h"
+
+#define TS_PACKET_SIZE 188
+#define HTTP_MAX_CLIENTS 64
+#define HTTP_SEND_MAX (256 * 1024) // per client and pass, keeps it fair
+#define HTTP_SAFETY (1024 * 1024) // writer headroom while a send copies from the ring
+#define HTTP_POLL_MS 100
+
+static const char http_ok[] =
+	"HTTP/1.0 200 OK\r\n"
+	"Content-Type: video/mp2t\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Connection: close\r\n\r\n";
+static const char http_not_found[] = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n";
+static const char http_bad_request[] = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
+static const char http_unavailable[] = "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+
+streamRing::streamRing(httpServer* server, int index) :
+	m_data(std::make_unique<unsigned char[]>(STREAM_RING_SIZE)),
+	m_head(0),
+	m_limit(0),
+	m_server(server),
+	m_index(index)
+{
+	m_server->registerStream(m_index, this);
+}
+
+streamRing::~streamRing()
+{
+	m_server->unregisterStream(m_index);
+}
+
+int streamRing::write(struct iovec* iov, int iovcnt)
+{
+	uint64_t head = m_head.load(std::memory_order_relaxed);
+	int count = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		count += iov[i].iov_len;
+	// a sender copying from the ring sees what this write overwrites
+	m_limit.store(head + count, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (int i = 0; i < iovcnt; ++i) {
+		const unsigned char* data = static_cast<const unsigned char*>(iov[i].iov_base);
+		size_t len = iov[i].iov_len;
+		while (len > 0) {
+			const size_t offset = head % STREAM_RING_SIZE;
+			const size_t n = std::min(len, STREAM_RING_SIZE - offset);
+			memcpy(&m_data[offset], data, n);
+			data += n;
+			len -= n;
+			head += n;
+		}
+	}
+	m_head.store(head, std::memory_order_release);
+	m_server->notify();
+	return count;
+}
+
+int streamRing::getIov(uint64_t pos, size_t len, struct iovec* iov) const
+{
+	const size_t offset = pos % STREAM_RING_SIZE;
+	iov[0].iov_base = &m_data[offset];
+	iov[0].iov_len = std::min(len, STREAM_RING_SIZE - offset);
+	if (iov[0].iov_len == len)
+		return 1;
+	iov[1].iov_base = &m_data[0];
+	iov[1].iov_len = len - iov[0].iov_len;
+	return 2;
+}
+
+httpServer::httpServer(int max_skips) :
+	m_listen_fd(-1),
+	m_event_fd(-1),
+	m_max_skips(max_skips),
+	m_thread(0),
+	m_running(false),
+	m_sleeping(false),
+	m_sent_bytes(0),
+	m_skipped(0),
+	m_dropped(0)
+{
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+httpServer::~httpServer()
+{
+	stop();
+	pthread_mutex_destroy(&m_lock);
+}
+
+int httpServer::start(int port)
+{
+	m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0)
+		return -1;
+
+	const int one = 1;
+	setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	socklen_t addr_len = sizeof(addr);
+	if (bind(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+		listen(m_listen_fd, HTTP_MAX_CLIENTS) ||
+		getsockname(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &addr_len)) {
+		ERROR(MSG_SRV, "http: port %d: %s\n", port, strerror(errno));
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return -1;
+	}
+
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_running = true;
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+
+	INFO(MSG_SRV, "http streaming on port %d\n", ntohs(addr.sin_port));
+	return ntohs(addr.sin_port);
+}
+
+void httpServer::stop()
+{
+	if (!m_running)
+		return;
+	m_running = false;
+	wakeup();
+	pthread_join(m_thread, nullptr);
+	m_thread = 0;
+
+	for (auto& c : m_clients)
+		close(c.fd);
+	m_clients.clear();
+	close(m_listen_fd);
+	close(m_event_fd);
+	m_listen_fd = m_event_fd = -1;
+}
+
+void httpServer::wakeup()
+{
+	const uint64_t one = 1;
+	if (::write(m_event_fd, &one, sizeof(one)) < 0)
+		DEBUG(MSG_SRV, "http: wakeup: %s\n", strerror(errno));
+}
+
+void httpServer::registerStream(int index, streamRing* ring)
+{
+	pthread_mutex_lock(&m_lock);
+	m_streams[index] = ring;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void httpServer::unregisterStream(int index)
+{
+	pthread_mutex_lock(&m_lock);
+	auto it = m_streams.find(index);
+	if (it != m_streams.end()) {
+		// the ring is going away, the loop must not look at it again
+		for (auto& c : m_clients) {
+			if (c.ring == it->second) {
+				closeClient(c, "stream ended");
+				c.ring = nullptr;
+			}
+		}
+		m_streams.erase(it);
+	}
+	pthread_mutex_unlock(&m_lock);
+	// poll() holds the closed sockets, their clients see the close once it returns
+	if (m_running)
+		wakeup();
+}
+
+void* httpServer::thread_wrapper(void* ptr)
+{
+	return static_cast<httpServer*>(ptr)->serverLoop();
+}
+
+void httpServer::closeClient(client& c, const char* reason)
+{
+	if (c.fd < 0)
+		return;
+	DEBUG(MSG_SRV, "http: client %d closed (%s)\n", c.fd, reason);
+	close(c.fd);
+	c.fd = -1;
+}
+
+void httpServer::acceptClients()
+{
+	for (;;) {
+		const int fd = accept4(m_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (m_clients.size() >= HTTP_MAX_CLIENTS) {
+			send(fd, http_unavailable, sizeof(http_unavailable) - 1, MSG_NOSIGNAL);
+			close(fd);
+			continue;
+		}
+		const int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		m_clients.emplace_back();
+		client& c = m_clients.back();
+		c.fd = fd;
+		c.ring = nullptr;
+		c.cursor = 0;
+		c.blocked = false;
+		c.skips = 0;
+		c.request_len = 0;
+	}
+}
+
+// Read the request line, false if the client has to be closed
+bool httpServer::readRequest(client& c)
+{
+	const ssize_t res = recv(c.fd, c.request + c.request_len, sizeof(c.request) - 1 - c.request_len, 0);
+	if (res <= 0)
+		return res < 0 && errno == EAGAIN;
+	c.request_len += res;
+	c.request[c.request_len] = 0;
+	if (!strstr(c.request, "\r\n\r\n") && !strstr(c.request, "\n\n"))
+		return c.request_len < static_cast<int>(sizeof(c.request)) - 1;
+
+	int index = -1;
+	const char* reply = http_bad_request;
+	if (sscanf(c.request, "GET /tuner/%d", &index) == 1) {
+		auto it = m_streams.find(index);
+		if (it != m_streams.end()) {
+			c.ring = it->second;
+			// start at the live position, on a TS packet
+			const uint64_t head = c.ring->head();
+			c.cursor = head - head % TS_PACKET_SIZE;
+			reply = http_ok;
+		} else {
+			reply = http_not_found;
+		}
+	}
+
+	INFO(MSG_SRV, "http: client %d: GET /tuner/%d: %s\n", c.fd, index, reply == http_ok ? "ok" : "refused");
+	// the socket buffer is empty, the short reply fits
+	if (send(c.fd, reply, strlen(reply), MSG_NOSIGNAL) < 0 || reply != http_ok)
+		return false;
+	return true;
+}
+
+// Send what is queued for the client, false if it has to be closed
+bool httpServer::sendData(client& c)
+{
+	uint64_t head = c.ring->head();
+	if (c.ring->limit() - c.cursor > streamRing::STREAM_RING_SIZE - HTTP_SAFETY) {
+		// too slow: skip to the live position. A client in the middle of
+		// a TS packet gets the end of another one, the rest stays aligned.
+		if (++c.skips > m_max_skips) {
+			++m_dropped;
+			return false;
+		}
+		++m_skipped;
+		const uint64_t phase = c.cursor % TS_PACKET_SIZE;
+		c.cursor = head - head % TS_PACKET_SIZE;
+		if (phase)
+			c.cursor -= TS_PACKET_SIZE - phase;
+		DEBUG(MSG_SRV, "http: client %d too slow, skipped\n", c.fd);
+	}
+
+	const size_t len = std::min<uint64_t>(head - c.cursor, HTTP_SEND_MAX);
+	if (len == 0)
+		return true;
+
+	struct iovec iov[2];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = c.ring->getIov(c.cursor, len, iov);
+
+	const ssize_t res = sendmsg(c.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR) {
+			c.blocked = true;
+			return true;
+		}
+		return false;
+	}
+
+	// the writer must not have reached the data while it was copied, a
+	// write still copying counts: the client got overwritten bytes and
+	// can't be resynced on what it already has, drop it
+	if (c.ring->limit() - c.cursor > streamRing::STREAM_RING_SIZE) {
+		++m_dropped;
+		DEBUG(MSG_SRV, "http: client %d lapped while sending\n", c.fd);
+		return false;
+	}
+
+	head = c.ring->head();
+	c.cursor += res;
+	m_sent_bytes += res;
+	c.blocked = static_cast<size_t>(res) < len && head - c.cursor > 0;
+	return true;
+}
+
+void* httpServer::serverLoop()
+{
+	threadRoleScope role(THREAD_ROLE_WRITER, "satip-http");
+	std::vector<struct pollfd> fds;
+	DEBUG(MSG_SRV, "HTTP LOOP START\n");
+
+	while (m_running)
+	{
+		fds.clear();
+		fds.push_back({m_listen_fd, POLLIN, 0});
+		fds.push_back({m_event_fd, POLLIN, 0});
+
+		// set before looking for data, a writer after this wakes us up
+		m_sleeping = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		pthread_mutex_lock(&m_lock);
+		bool pending = false;
+		for (auto& c : m_clients) {
+			if (c.fd < 0) {
+				fds.push_back({-1, 0, 0}); // closed, removed after this pass
+				continue;
+			}
+			short events = POLLIN; // request or hang up
+			if (c.ring && c.blocked)
+				events |= POLLOUT;
+			else if (c.ring && c.ring->head() != c.cursor)
+				pending = true;
+			fds.push_back({c.fd, events, 0});
+		}
+		pthread_mutex_unlock(&m_lock);
+
+		if (pending)
+			m_sleeping = false;
+		poll(fds.data(), fds.size(), pending ? 0 : HTTP_POLL_MS);
+		m_sleeping = false;
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t count;
+			if (read(m_event_fd, &count, sizeof(count)) < 0)
+				DEBUG(MSG_SRV, "http: eventfd: %s\n", strerror(errno));
+		}
+
+		pthread_mutex_lock(&m_lock);
+		if (fds[0].revents & POLLIN)
+			acceptClients();
+
+		size_t i = 2;
+		for (auto& c : m_clients) {
+			const short revents = i < fds.size() && fds[i].fd == c.fd ? fds[i].revents : 0;
+			++i;
+			if (c.fd < 0)
+				continue;
+
+			if (!c.ring) {
+				if ((revents & (POLLIN | POLLHUP | POLLERR)) && !readRequest(c))
+					closeClient(c, "request");
+				continue;
+			}
+			// nothing more is expected from the client but the close
+			char discard[256];
+			if ((revents & POLLIN) && recv(c.fd, discard, sizeof(discard), MSG_DONTWAIT) == 0) {
+				closeClient(c, "closed");
+				continue;
+			}
+			if (revents & (POLLHUP | POLLERR)) {
+				closeClient(c, "hang up");
+				continue;
+			}
+			if (revents & POLLOUT)
+				c.blocked = false;
+			if (!c.blocked && !sendData(c))
+				closeClient(c, "send");
+		}
+		m_clients.remove_if([](const client& c) { return c.fd < 0; });
+		pthread_mutex_unlock(&m_lock);
+	}
+
+	DEBUG(MSG_SRV, "HTTP LOOP END.\n");
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * satip: HTTP TS re-streaming
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_HTTPSTREAM_H
+#define _SATIP_HTTPSTREAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+
+#include <pthread.h>
+
+#include "output.h"
+
+class httpServer;
+
+/*
+ * Last STREAM_RING_SIZE bytes of the TS of one tuner. The receiving thread
+ * writes and never waits, each HTTP client is a read cursor into it.
+ */
+class streamRing : public outputSink
+{
+public:
+	static constexpr size_t STREAM_RING_SIZE = 4 * 1024 * 1024;
+
+private:
+	std::unique_ptr<unsigned char[]> m_data;
+	std::atomic<uint64_t> m_head; // bytes written since start
+	std::atomic<uint64_t> m_limit; // end of the write in progress, set before it copies
+	httpServer* m_server;
+	int m_index;
+
+public:
+	streamRing(httpServer* server, int index);
+	virtual ~streamRing();
+
+	int write(struct iovec* iov, int iovcnt) override;
+	const char* describe() const override { return "http"; }
+
+	uint64_t head() const { return m_head.load(std::memory_order_acquire); }
+	// data before limit() - STREAM_RING_SIZE may have been overwritten, also
+	// by a write not in head() yet; call after reading the data
+	uint64_t limit() const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return m_limit.load(std::memory_order_relaxed);
+	}
+	// data of [pos, pos + len) as up to two pieces
+	int getIov(uint64_t pos, size_t len, struct iovec* iov) const;
+};
+
+/*
+ * Serves GET /tuner/N with the live TS of tuner N from one thread.
+ * Clients that fall behind by more than the ring (minus a safety margin)
+ * are skipped ahead to the live position, after 'max_skips' skips they
+ * are dropped. Data is sent with sendmsg from the ring; MSG_ZEROCOPY is
+ * not used as the ring is overwritten while the kernel could still
+ * reference the pages.
+ */
+class httpServer
+{
+	struct client
+	{
+		int fd;
+		streamRing* ring; // nullptr while reading the request
+		uint64_t cursor;
+		bool blocked;     // wait for POLLOUT
+		int skips;
+		char request[1024];
+		int request_len;
+	};
+
+	int m_listen_fd;
+	int m_event_fd;
+	int m_max_skips;
+	pthread_t m_thread;
+	std::atomic<bool> m_running;
+	std::atomic<bool> m_sleeping;
+
+	/* guarded by m_lock, held by the server thread while it sends */
+	pthread_mutex_t m_lock;
+	std::map<int, streamRing*> m_streams;
+	std::list<client> m_clients;
+
+	/* statistics */
+	std::atomic<uint64_t> m_sent_bytes;
+	std::atomic<uint64_t> m_skipped;
+	std::atomic<uint64_t> m_dropped;
+
+	static void* thread_wrapper(void* ptr);
+	void* serverLoop();
+
+	void acceptClients();
+	bool readRequest(client& c);
+	bool sendData(client& c);
+	void closeClient(client& c, const char* reason);
+
+public:
+	httpServer(int max_skips = 3);
+	virtual ~httpServer();
+
+	// port 0 picks a free port, returns the port or -1
+	int start(int port);
+	void stop();
+	bool isRunning() const { return m_running; }
+
+	void registerStream(int index, streamRing* ring);
+	void unregisterStream(int index);
+
+	// new data in a ring, wakes the server thread if it waits
+	void notify()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_sleeping.load(std::memory_order_relaxed) && m_sleeping.exchange(false))
+			wakeup();
+	}
+	void wakeup();
+
+	uint64_t getSentBytes() const { return m_sent_bytes; }
+	uint64_t getSkipped() const { return m_skipped; }
+	uint64_t getDropped() const { return m_dropped; }
+
+	static httpServer* getInstance()
+	{
+		static httpServer instance;
+		return &instance;
+	}
+};
+
+#endif
@@ -15,52 +15,615 @@
  * GNU General Public License for more details.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iomanip>
+#include <mutex>
+#include <vector>
 
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
 #include <stdarg.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #define MAX_MSGSIZE 1024
 #include "log.h"
+#include "threadpolicy.h"
 
-__thread char msg[MAX_MSGSIZE];
+#define LOG_RING_SIZE  64 // records per thread, power of 2
+#define LOG_MAX_ARGS   12
+#define LOG_WAIT_MSEC 100
+
+pid_t log_pid = getpid();
+
+/*
+ * Log records are captured in the calling thread as the format pointer plus
+ * the raw arguments (strings are copied), and are pushed into a per-thread
+ * single producer/single consumer ring. The log thread formats and writes
+ * them. A full ring drops the record and counts it, it never blocks.
+ */
+namespace {
+
+enum log_arg_type
+{
+	ARG_INT = 0,
+	ARG_UINT,
+	ARG_LONG,
+	ARG_ULONG,
+	ARG_LLONG,
+	ARG_ULLONG,
+	ARG_SIZE,
+	ARG_INTMAX,
+	ARG_PTRDIFF,
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_STR
+};
+
+struct log_arg
+{
+	unsigned char type;
+	union
+	{
+		int i;
+		unsigned int u;
+		long l;
+		unsigned long ul;
+		long long ll;
+		unsigned long long ull;
+		size_t z;
+		intmax_t j;
+		ptrdiff_t t;
+		double d;
+		const void* p;
+		unsigned int str; // offset in log_record::str
+	};
+};
+
+struct log_record
+{
+	const char* fmt; // NULL: 'str' holds the formatted message
+	struct timespec ts;
+	int level;
+	int nargs;
+	log_arg args[LOG_MAX_ARGS];
+	char str[MAX_MSGSIZE];
+};
+
+struct log_ring
+{
+	std::atomic<unsigned int> head{0}; // written by the producer thread
+	std::atomic<unsigned int> tail{0}; // written by the log thread
+	std::atomic<unsigned int> dropped{0};
+	std::atomic<bool> in_use{true};
+	log_record records[LOG_RING_SIZE];
+};
+
+struct log_ratelimit_cfg
+{
+	double rate;  // messages per second, 0: unlimited
+	double burst;
+};
+
+// Indexed by MSG_ type bit: MSG_MAIN, MSG_NET, MSG_HW, MSG_SRV, MSG_DATA
+log_ratelimit_cfg log_rl_cfg[5] = {
+	{ 5.0, 10.0 }, { 5.0, 10.0 }, { 5.0, 10.0 }, { 5.0, 10.0 }, { 5.0, 10.0 }
+};
+int log_rl_interval = 10;
+
+std::mutex log_rl_sites_lock;
+std::vector<log_ratelimit*> log_rl_sites;
+
+const log_ratelimit_cfg& getRateLimitCfg(unsigned int mtype)
+{
+	for (unsigned int i = 0; i < 5; ++i) {
+		if (mtype & (1u << i))
+			return log_rl_cfg[i];
+	}
+	return log_rl_cfg[0];
+}
+
+double elapsedSec(const struct timespec& now, const struct timespec& then)
+{
+	return static_cast<double>(now.tv_sec - then.tv_sec) + (now.tv_nsec - then.tv_nsec) / 1e9;
+}
+
+std::mutex log_rings_lock;
+std::vector<log_ring*> log_rings;
+std::atomic<bool> log_running{false};
+std::atomic<bool> log_sleeping{false};
+int log_event_fd = -1;
+pthread_t log_thread;
+
+struct log_ring_owner
+{
+	log_ring* ring = nullptr;
+	~log_ring_owner()
+	{
+		if (ring)
+			ring->in_use.store(false, std::memory_order_release);
+	}
+};
+
+thread_local log_ring_owner log_owner;
+
+// Registration happens once per thread, rings of exited threads are reused
+log_ring* getThreadRing()
+{
+	if (log_owner.ring)
+		return log_owner.ring;
+
+	std::lock_guard<std::mutex> lock(log_rings_lock);
+	for (log_ring* ring : log_rings) {
+		if (!ring->in_use.load(std::memory_order_acquire)) {
+			ring->in_use.store(true, std::memory_order_relaxed);
+			log_owner.ring = ring;
+			return ring;
+		}
+	}
+	log_owner.ring = new log_ring;
+	log_rings.push_back(log_owner.ring);
+	return log_owner.ring;
+}
+
+// Parse one conversion spec at 'p' (just after '%'), returns its end
+const char* parseSpec(const char* p, int& type)
+{
+	type = -1;
+	while (*p && strchr("-+ #0", *p))
+		++p;
+	while (*p >= '0' && *p <= '9')
+		++p;
+	if (*p == '.') {
+		++p;
+		while (*p >= '0' && *p <= '9')
+			++p;
+	}
+	int length = 0; // 1:l 2:ll 3:z 4:j 5:t
+	if (p[0] == 'h') {
+		p += (p[1] == 'h') ? 2 : 1;
+	} else if (p[0] == 'l') {
+		length = (p[1] == 'l') ? 2 : 1;
+		p += length;
+	} else if (p[0] == 'z') {
+		length = 3; ++p;
+	} else if (p[0] == 'j') {
+		length = 4; ++p;
+	} else if (p[0] == 't') {
+		length = 5; ++p;
+	}
+	switch (*p) {
+		case 'd': case 'i':
+			{
+				static const int types[] = { ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF };
+				type = types[length];
+			}
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			{
+				static const int types[] = { ARG_UINT, ARG_ULONG, ARG_ULLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF };
+				type = types[length];
+			}
+			break;
+		case 'c':
+			type = ARG_INT;
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			type = ARG_DOUBLE;
+			break;
+		case 'p':
+			type = ARG_PTR;
+			break;
+		case 's':
+			type = length == 0 ? ARG_STR : -1;
+			break;
+		default:
+			return p; // '*', %n, %ls, ... are not captured
+	}
+	return p + 1;
+}
+
+// Capture arguments in the record, false if the format is not supported
+bool captureArgs(log_record& rec, const char* fmt, va_list ap)
+{
+	unsigned int str_used = 0;
+	rec.nargs = 0;
+	for (const char* p = fmt; *p; ) {
+		if (*p++ != '%')
+			continue;
+		if (*p == '%') {
+			++p;
+			continue;
+		}
+		int type;
+		p = parseSpec(p, type);
+		if (type < 0 || rec.nargs == LOG_MAX_ARGS)
+			return false;
+
+		log_arg& arg = rec.args[rec.nargs++];
+		arg.type = static_cast<unsigned char>(type);
+		switch (type) {
+			case ARG_INT:     arg.i = va_arg(ap, int); break;
+			case ARG_UINT:    arg.u = va_arg(ap, unsigned int); break;
+			case ARG_LONG:    arg.l = va_arg(ap, long); break;
+			case ARG_ULONG:   arg.ul = va_arg(ap, unsigned long); break;
+			case ARG_LLONG:   arg.ll = va_arg(ap, long long); break;
+			case ARG_ULLONG:  arg.ull = va_arg(ap, unsigned long long); break;
+			case ARG_SIZE:    arg.z = va_arg(ap, size_t); break;
+			case ARG_INTMAX:  arg.j = va_arg(ap, intmax_t); break;
+			case ARG_PTRDIFF: arg.t = va_arg(ap, ptrdiff_t); break;
+			case ARG_DOUBLE:  arg.d = va_arg(ap, double); break;
+			case ARG_PTR:     arg.p = va_arg(ap, void*); break;
+			case ARG_STR:
+				{
+					const char* str = va_arg(ap, const char*);
+					if (str == NULL)
+						str = "(null)";
+					if (str_used >= sizeof(rec.str) - 1) {
+						// No room left, the remaining strings are logged empty
+						rec.str[sizeof(rec.str) - 1] = '\0';
+						arg.str = sizeof(rec.str) - 1;
+						break;
+					}
+					const size_t len = strnlen(str, sizeof(rec.str) - 1 - str_used);
+					memcpy(rec.str + str_used, str, len);
+					rec.str[str_used + len] = '\0';
+					arg.str = str_used;
+					str_used += len + 1;
+				}
+				break;
+			default:
+				return false;
+		}
+	}
+	return true;
+}
+
+// Format a captured record, one conversion spec at a time
+void formatRecord(const log_record& rec, char* out, size_t size)
+{
+	if (rec.fmt == NULL) {
+		snprintf(out, size, "%s", rec.str);
+		return;
+	}
+
+	size_t pos = 0;
+	int argn = 0;
+	for (const char* p = rec.fmt; *p && pos < size - 1; ) {
+		if (*p != '%') {
+			out[pos++] = *p++;
+			continue;
+		}
+		if (p[1] == '%') {
+			out[pos++] = '%';
+			p += 2;
+			continue;
+		}
+		int type;
+		const char* end = parseSpec(p + 1, type);
+		char spec[32];
+		const size_t spec_len = end - p;
+		if (spec_len >= sizeof(spec) || argn == rec.nargs)
+			break;
+		memcpy(spec, p, spec_len);
+		spec[spec_len] = '\0';
+		p = end;
+
+		const log_arg& arg = rec.args[argn++];
+		int n = 0;
+		switch (arg.type) {
+			case ARG_INT:     n = snprintf(out + pos, size - pos, spec, arg.i); break;
+			case ARG_UINT:    n = snprintf(out + pos, size - pos, spec, arg.u); break;
+			case ARG_LONG:    n = snprintf(out + pos, size - pos, spec, arg.l); break;
+			case ARG_ULONG:   n = snprintf(out + pos, size - pos, spec, arg.ul); break;
+			case ARG_LLONG:   n = snprintf(out + pos, size - pos, spec, arg.ll); break;
+			case ARG_ULLONG:  n = snprintf(out + pos, size - pos, spec, arg.ull); break;
+			case ARG_SIZE:    n = snprintf(out + pos, size - pos, spec, arg.z); break;
+			case ARG_INTMAX:  n = snprintf(out + pos, size - pos, spec, arg.j); break;
+			case ARG_PTRDIFF: n = snprintf(out + pos, size - pos, spec, arg.t); break;
+			case ARG_DOUBLE:  n = snprintf(out + pos, size - pos, spec, arg.d); break;
+			case ARG_PTR:     n = snprintf(out + pos, size - pos, spec, arg.p); break;
+			case ARG_STR:     n = snprintf(out + pos, size - pos, spec, rec.str + arg.str); break;
+			default: break;
+		}
+		if (n > 0)
+			pos = std::min(pos + n, size - 1);
+	}
+	out[pos] = '\0';
+}
+
+void outputMessage(const int level, const struct timespec& tp, const char* msg)
+{
+	if (use_syslog) {
+		int priority;
+		switch(level) {
+			case 1: priority=LOG_ERR; break;
+			case 2: priority=LOG_WARNING; break;
+			case 3: priority=LOG_INFO; break;
+			default: priority=LOG_DEBUG; break;
+		}
+		syslog(priority, "%s", msg);
+	} else {
+		fprintf(stderr, "[%ld.%03ld]%s", static_cast<long>(tp.tv_sec), static_cast<long>(tp.tv_nsec) / 1000000L, msg);
+	}
+}
+
+// Drain all rings, returns the number of records written. Only the ring
+// list is read under log_rings_lock, rings are never freed so the snapshot
+// stays valid while the records are written without it.
+int drainRings()
+{
+	static std::vector<log_ring*> rings; // log thread, or log_stop() after it
+	char msg[MAX_MSGSIZE];
+	int count = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(log_rings_lock);
+		rings = log_rings;
+	}
+	for (log_ring* ring : rings) {
+		unsigned int tail = ring->tail.load(std::memory_order_relaxed);
+		const unsigned int head = ring->head.load(std::memory_order_acquire);
+		for (; tail != head; ++tail, ++count) {
+			const log_record& rec = ring->records[tail % LOG_RING_SIZE];
+			formatRecord(rec, msg, sizeof(msg));
+			outputMessage(rec.level, rec.ts, msg);
+		}
+		ring->tail.store(tail, std::memory_order_release);
+
+		const unsigned int dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped > 0) {
+			struct timespec tp;
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
+			snprintf(msg, sizeof(msg), "[%d %-15s:%4u][%-27s]\t  warn: %u log records dropped\n",
+				log_pid, __FILE__, __LINE__, __FUNCTION__, dropped);
+			outputMessage(MSG_WARN, tp, msg);
+		}
+	}
+	return count;
+}
+
+// seq_cst after log_sleeping is set, pairs with the fence in write_message()
+bool ringsEmpty()
+{
+	std::lock_guard<std::mutex> lock(log_rings_lock);
+	for (log_ring* ring : log_rings) {
+		if (ring->head.load(std::memory_order_seq_cst) != ring->tail.load(std::memory_order_relaxed))
+			return false;
+	}
+	return true;
+}
+
+// The message of the call site is not repeated: its arguments are gone, only the values are kept
+void emitSummary(unsigned int mtype, int level, const char* tag, const char* file, unsigned int line,
+		const char* function, unsigned int count, double secs, long first, long last)
+{
+	write_message(mtype, level, "[%d %-15s:%4u][%-27s]\t%s: %u occurrences in last %.0fs, first/last value %ld/%ld\n",
+		log_pid, file, line, function, tag, count, secs, first, last);
+}
+
+void* logThread(void*)
+{
+	threadRoleScope role(THREAD_ROLE_LOGGER, "satip-log");
+	struct pollfd pfd;
+	pfd.fd = log_event_fd;
+	pfd.events = POLLIN;
+
+	while (log_running.load(std::memory_order_acquire)) {
+		log_flush_ratelimits(false);
+		drainRings();
+
+		log_sleeping.store(true);
+		if (!ringsEmpty()) {
+			log_sleeping.store(false);
+			continue;
+		}
+		pfd.revents = 0;
+		if (poll(&pfd, 1, LOG_WAIT_MSEC) > 0) {
+			eventfd_t value;
+			eventfd_read(log_event_fd, &value);
+		}
+		log_sleeping.store(false);
+	}
+	drainRings();
+	return NULL;
+}
+
+} // namespace
 
 void write_message(const unsigned int mtype, const int level, const char* fmt, ... ) {
 	if (!(mtype & dbg_mask)) {
 		return;
 	}
 
-	if (level <= dbg_level) {
-		char tn[MAX_MSGSIZE];
+	if (level > dbg_level) {
+		return;
+	}
+
+	if (!log_running.load(std::memory_order_acquire)) {
+		char msg[MAX_MSGSIZE];
 		va_list ap;
 		va_start(ap, fmt);
-		vsnprintf(tn, sizeof(tn)-1, fmt, ap);
+		vsnprintf(msg, sizeof(msg), fmt, ap);
 		va_end(ap);
-		strncat(msg, tn, sizeof(msg)-1);
-		msg[sizeof(tn)-1] = '\0';
-
-		if (use_syslog) {
-			int priority;
-			switch(level) {
-				case 1: priority=LOG_ERR; break;
-				case 2: priority=LOG_WARNING; break;
-				case 3: priority=LOG_INFO; break;
-				default: priority=LOG_DEBUG; break;
-			}
-			syslog(priority, "%s", msg);
-		} else {
-			struct timespec tp;
-			clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
-			fprintf(stderr, "[%ld.%03ld]%s", static_cast<long>(tp.tv_sec), static_cast<long>(tp.tv_nsec) / 1000000L, msg);
+
+		struct timespec tp;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
+		outputMessage(level, tp, msg);
+		return;
+	}
+
+	log_ring* ring = getThreadRing();
+	const unsigned int head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	log_record& rec = ring->records[head % LOG_RING_SIZE];
+	rec.level = level;
+	rec.fmt = fmt;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &rec.ts);
+
+	va_list ap;
+	va_start(ap, fmt);
+	const bool captured = captureArgs(rec, fmt, ap);
+	va_end(ap);
+	if (!captured) {
+		// Unsupported conversion, format it here instead
+		va_start(ap, fmt);
+		vsnprintf(rec.str, sizeof(rec.str), fmt, ap);
+		va_end(ap);
+		rec.fmt = NULL;
+	}
+
+	ring->head.store(head + 1, std::memory_order_release);
+
+	// the head before log_sleeping, or the log thread may miss both
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (log_sleeping.load(std::memory_order_relaxed) && log_sleeping.exchange(false)) {
+		eventfd_write(log_event_fd, 1);
+	}
+}
+
+void log_start()
+{
+	log_pid = getpid();
+	if (log_running.load())
+		return;
+
+	log_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (log_event_fd == -1)
+		return;
+
+	log_running.store(true);
+	if (pthread_create(&log_thread, NULL, logThread, NULL)) {
+		log_running.store(false);
+		close(log_event_fd);
+		log_event_fd = -1;
+	}
+}
+
+void log_stop()
+{
+	log_flush_ratelimits(true);
+	if (!log_running.exchange(false))
+		return;
+
+	eventfd_write(log_event_fd, 1);
+	pthread_join(log_thread, NULL);
+	drainRings(); // records pushed while the thread was exiting
+	close(log_event_fd);
+	log_event_fd = -1;
+}
+
+log_ratelimit::log_ratelimit(unsigned int mtype, int level, const char* tag,
+		const char* file, unsigned int line, const char* function) :
+	m_mtype(mtype),
+	m_level(level),
+	m_tag(tag),
+	m_file(file),
+	m_line(line),
+	m_function(function),
+	m_tokens(getRateLimitCfg(mtype).burst),
+	m_suppressed(0),
+	m_contended(0),
+	m_first_value(0),
+	m_last_value(0)
+{
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &m_refill_ts);
+	m_first_ts = m_refill_ts;
+
+	std::lock_guard<std::mutex> lock(log_rl_sites_lock);
+	log_rl_sites.push_back(this);
+}
+
+bool log_ratelimit::allow(long value)
+{
+	if (m_lock.test_and_set(std::memory_order_acquire)) {
+		m_contended.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	const log_ratelimit_cfg& cfg = getRateLimitCfg(m_mtype);
+	if (cfg.rate <= 0.0) {
+		m_lock.clear(std::memory_order_release);
+		return true;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	m_tokens = std::min(cfg.burst, m_tokens + elapsedSec(now, m_refill_ts) * cfg.rate);
+	m_refill_ts = now;
+
+	bool allowed = false;
+	if (m_tokens >= 1.0) {
+		m_tokens -= 1.0;
+		allowed = true;
+	} else {
+		if (m_suppressed == 0) {
+			m_first_ts = now;
+			m_first_value = value;
 		}
+		m_last_value = value;
+		++m_suppressed;
 	}
+	m_lock.clear(std::memory_order_release);
+
+	flush(now, false);
+	return allowed;
+}
 
-	strncpy(msg, "", sizeof(msg));
-} 
+void log_ratelimit::flush(const struct timespec& now, bool force)
+{
+	if (m_lock.test_and_set(std::memory_order_acquire)) {
+		return;
+	}
+	const double secs = elapsedSec(now, m_first_ts);
+	if ((m_suppressed == 0 && m_contended.load(std::memory_order_relaxed) == 0) ||
+	    (!force && secs < log_rl_interval)) {
+		m_lock.clear(std::memory_order_release);
+		return;
+	}
+	const unsigned int count = m_suppressed + m_contended.exchange(0, std::memory_order_relaxed);
+	const long first = m_first_value;
+	const long last = m_last_value;
+	m_suppressed = 0;
+	m_lock.clear(std::memory_order_release);
+
+	emitSummary(m_mtype, m_level, m_tag, m_file, m_line, m_function, count, secs, first, last);
+}
+
+void log_set_ratelimit(unsigned int mtype, double rate, double burst)
+{
+	for (unsigned int i = 0; i < 5; ++i) {
+		if (mtype & (1u << i)) {
+			log_rl_cfg[i].rate = rate;
+			log_rl_cfg[i].burst = std::max(burst, 1.0);
+		}
+	}
+}
+
+void log_set_ratelimit_interval(int interval)
+{
+	log_rl_interval = interval;
+}
+
+void log_flush_ratelimits(bool force)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	std::lock_guard<std::mutex> lock(log_rl_sites_lock);
+	for (log_ratelimit* site : log_rl_sites) {
+		site->flush(now, force);
+	}
+}
 
 std::string convertToHexASCIITable(
 		const unsigned char* p,
@@ -18,14 +18,19 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+#include <atomic>
 #include <string>
 
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
+
+#include "_config.h"
 
 extern int dbg_level;
 extern unsigned int dbg_mask; // MSG_DATA | MSG_MAIN | MSG_NET | MSG_HW | MSG_SRV
 extern int use_syslog;
+extern pid_t log_pid; // cached getpid(), set by log_start()
 
 
 #define MSG_MAIN   1
@@ -40,13 +45,78 @@ extern int use_syslog;
 #define MSG_INFO   3
 #define MSG_DEBUG  4
 
-#define ERROR(mtype, msg, ...) write_message(mtype, MSG_ERROR, "[%d %-15s:%4u][%-27s]\t error: " msg, getpid(), __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__)
-#define  WARN(mtype, msg, ...) write_message(mtype, MSG_WARN,  "[%d %-15s:%4u][%-27s]\t  warn: " msg, getpid(), __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__)
-#define  INFO(mtype, msg, ...) write_message(mtype, MSG_INFO,  "[%d %-15s:%4u][%-27s]\t  info: " msg, getpid(), __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__)
-#define DEBUG(mtype, msg, ...) write_message(mtype, MSG_DEBUG, "[%d %-15s:%4u][%-27s]\t debug: " msg, getpid(), __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__)
+// Message types compiled in, --disable-data-logging removes MSG_DATA
+#ifdef DISABLE_DATA_LOGGING
+#define LOG_COMPILED_MASK (MSG_ALL & ~MSG_DATA)
+#else
+#define LOG_COMPILED_MASK MSG_ALL
+#endif
+
+// Checked inline so disabled messages cost no call or argument evaluation
+#define LOG_ENABLED(mtype, level) (((mtype) & LOG_COMPILED_MASK) && ((mtype) & dbg_mask) && (level) <= dbg_level)
+
+#define ERROR(mtype, msg, ...) do { if (LOG_ENABLED(mtype, MSG_ERROR)) write_message(mtype, MSG_ERROR, "[%d %-15s:%4u][%-27s]\t error: " msg, log_pid, __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__); } while (0)
+#define  WARN(mtype, msg, ...) do { if (LOG_ENABLED(mtype, MSG_WARN))  write_message(mtype, MSG_WARN,  "[%d %-15s:%4u][%-27s]\t  warn: " msg, log_pid, __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__); } while (0)
+#define  INFO(mtype, msg, ...) do { if (LOG_ENABLED(mtype, MSG_INFO))  write_message(mtype, MSG_INFO,  "[%d %-15s:%4u][%-27s]\t  info: " msg, log_pid, __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__); } while (0)
+#define DEBUG(mtype, msg, ...) do { if (LOG_ENABLED(mtype, MSG_DEBUG)) write_message(mtype, MSG_DEBUG, "[%d %-15s:%4u][%-27s]\t debug: " msg, log_pid, __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__); } while (0)
+
+/*
+ * Rate limited variants for messages that can repeat per packet. Each call
+ * site has a token bucket (rate/burst per MSG_ type, see log_set_ratelimit),
+ * suppressed messages are collapsed into a periodic summary of the call site
+ * with the count and the first/last 'value' passed by it.
+ */
+#define LOG_RATELIMITED(mtype, level, tag, value, msg, ...) do { if (LOG_ENABLED(mtype, level)) { \
+		static log_ratelimit rl_site(mtype, level, tag, __FILE__, __LINE__, __FUNCTION__); \
+		if (rl_site.allow(value)) \
+			write_message(mtype, level, "[%d %-15s:%4u][%-27s]\t" tag ": " msg, log_pid, __FILE__, __LINE__, __FUNCTION__, ## __VA_ARGS__); \
+	} } while (0)
+
+#define ERROR_RL(mtype, value, msg, ...) LOG_RATELIMITED(mtype, MSG_ERROR, " error", value, msg, ## __VA_ARGS__)
+#define  WARN_RL(mtype, value, msg, ...) LOG_RATELIMITED(mtype, MSG_WARN,  "  warn", value, msg, ## __VA_ARGS__)
+#define  INFO_RL(mtype, value, msg, ...) LOG_RATELIMITED(mtype, MSG_INFO,  "  info", value, msg, ## __VA_ARGS__)
+#define DEBUG_RL(mtype, value, msg, ...) LOG_RATELIMITED(mtype, MSG_DEBUG, " debug", value, msg, ## __VA_ARGS__)
+
+class log_ratelimit
+{
+public:
+	log_ratelimit(unsigned int mtype, int level, const char* tag,
+		const char* file, unsigned int line, const char* function);
+
+	bool allow(long value);
+	void flush(const struct timespec& now, bool force);
+
+private:
+	const unsigned int m_mtype;
+	const int m_level;
+	const char* m_tag;
+	const char* m_file;
+	const unsigned int m_line;
+	const char* m_function;
+
+	std::atomic_flag m_lock = ATOMIC_FLAG_INIT;
+	double m_tokens;
+	struct timespec m_refill_ts;
+	unsigned int m_suppressed;
+	std::atomic<unsigned int> m_contended; // suppressed while locked
+	struct timespec m_first_ts;
+	long m_first_value;
+	long m_last_value;
+};
+
+// Token bucket for the rate limited messages of 'mtype' (one or more MSG_
+// bits), rate 0 disables limiting. Summaries are written every 'interval' sec.
+void log_set_ratelimit(unsigned int mtype, double rate, double burst);
+void log_set_ratelimit_interval(int interval);
+void log_flush_ratelimits(bool force);
 
 void write_message(const unsigned int, const int, const char*, ...);
 
+// Start/stop the background log writer. Without it (before start or after
+// stop) messages are formatted and written synchronously by the caller.
+void log_start();
+void log_stop();
+
 std::string convertToHexASCIITable(
 		const unsigned char* p,
 		const std::size_t length,
@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <sched.h>
 #include <sys/mman.h>
@@ -30,13 +32,18 @@
 #include "session.h"
 #include "log.h"
 #include "manager.h"
+#include "httpstream.h"
+#include "rtspmux.h"
+#include "serverpool.h"
+#include "coordinator.h"
 
 int dbg_level = MSG_ERROR;
 
 unsigned int dbg_mask = MSG_MAIN | MSG_NET | MSG_HW | MSG_SRV;
 int use_syslog = 0;
 
-bool main_running = true;
+volatile sig_atomic_t main_running = 1;
+static volatile sig_atomic_t reload_requested = 0;
 
 void sigint_handler(int signo)
 {
@@ -45,6 +52,13 @@ void sigint_handler(int signo)
 	sessionManager* vtmng = sessionManager::getInstance();
 	vtmng->sessionStop();
 	vtmng->sessionJoin();
+	main_running = 0;
+}
+
+// the reload runs on the main thread, see below
+static void sighup_handler(int)
+{
+	reload_requested = 1;
 }
 
 void print_usage(void)
@@ -58,35 +72,34 @@ void print_usage(void)
            "                               3: Info\n"
            "                               4: Debug\n"
            "       -y                   Use syslog instead of STDERR for logging\n"
+           "       -r <mask>,<rate>,<burst>  Rate limit repeated messages of <mask> types\n"
+           "                            (default: 5,10 per sec for all, rate 0: unlimited)\n"
+           "       -i <sec>             Summary interval of rate limited messages (default: 10)\n"
+           "       -s <port>            Serve the TS of tuner N at http://<box>:<port>/tuner/N\n"
+           "       -c <group>:<port>[@<if>]  Coordinate tuners with other instances over this\n"
+           "                            multicast group, e.g. 239.255.42.42:5500\n"
            "       -h                   Print help\n"
                                              );
 }
 
 #ifdef RT_SCHEDULING
-static void enable_rt_scheduling()
+// The threads set their scheduling by role, see threadpolicy.h
+static void lock_memory()
 {
-  struct sched_param schedp;
-
   if ( mlockall(MCL_CURRENT|MCL_FUTURE) )
     DEBUG(MSG_MAIN, "Pages not locked\n");
   else
     DEBUG(MSG_MAIN, "Pages locked\n");
-
-  schedp.sched_priority = sched_get_priority_min(SCHED_FIFO);
-
-  if ( sched_setscheduler(0, SCHED_FIFO, &schedp) )
-    DEBUG(MSG_MAIN, "No realtime scheduling\n");
-  else
-    DEBUG(MSG_MAIN, "Realtime scheduling enabled at prio %d\n",schedp.sched_priority);
-
 }
 #endif // RT_SCHEDULING
 
 int main(int argc, char** argv)
 {
 	int opt;
+	int http_port = 0;
+	const char* coordination = nullptr;
 
-	while( (opt = getopt(argc, argv, "m:l:yh") ) != -1 )
+	while( (opt = getopt(argc, argv, "m:l:yr:i:s:c:h") ) != -1 )
 	{
 		switch(opt)
 		{
@@ -102,6 +115,32 @@ int main(int argc, char** argv)
 				use_syslog = 1;
 				break;
 
+			case 'r':
+			{
+				unsigned int mask = 0;
+				double rate = 0.0;
+				double burst = 1.0;
+				if (sscanf(optarg, "%u,%lf,%lf", &mask, &rate, &burst) < 2)
+				{
+					print_usage();
+					exit(1);
+				}
+				log_set_ratelimit(mask, rate, burst);
+				break;
+			}
+
+			case 'i':
+				log_set_ratelimit_interval(atoi(optarg));
+				break;
+
+			case 's':
+				http_port = atoi(optarg);
+				break;
+
+			case 'c':
+				coordination = optarg;
+				break;
+
 			case 'h':
 			default:
 				print_usage();
@@ -109,21 +148,64 @@ int main(int argc, char** argv)
 		}
 	}
 
+	// SIGHUP reloads the config. It and the stop signals are blocked before
+	// any thread starts, so in all of them, and only interrupt the
+	// sigsuspend() of the main thread below.
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighup_handler;
+	sigaction(SIGHUP, &sa, NULL);
+	sigset_t signal_mask;
+	sigset_t wait_mask;
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGHUP);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signal_mask, &wait_mask);
+
+	log_start();
+
+	// before the sessions, they register their streams with it
+	if (http_port > 0 && httpServer::getInstance()->start(http_port) < 0)
+		ERROR(MSG_MAIN, "http streaming not available\n");
+
 #ifdef RT_SCHEDULING
-	enable_rt_scheduling();
+	lock_memory();
 #endif
 
 	signal(SIGINT, sigint_handler);
 	signal(SIGTERM, sigint_handler);
 	signal(SIGKILL, sigint_handler);
 
+	// shared server connections and the server pool outlive the sessions using them
+	rtspMuxPool::getInstance();
+	serverPool::getInstance();
+	satipCoordinator::getInstance();
+
+	if (coordination && satipCoordinator::getInstance()->start(coordination) < 0)
+		ERROR(MSG_MAIN, "tuner coordination not available\n");
+
 	sessionManager* vtmng = sessionManager::getInstance();
 	int res = vtmng->satipStart();
-	if (!res)
-		pause();
+	while (!res && main_running)
+	{
+		sigsuspend(&wait_mask);
+		if (reload_requested)
+		{
+			reload_requested = 0;
+			INFO(MSG_MAIN, "SIGHUP, reloading the config\n");
+			vtmng->reload();
+		}
+	}
 
 	DEBUG(MSG_MAIN,"End MAIN\n");
 
+	httpServer::getInstance()->stop();
+	serverPool::getInstance()->stop();
+	satipCoordinator::getInstance()->stop();
+
+	log_stop();
+
 	return 0;
 }
 
@@ -23,6 +23,8 @@
 #include "manager.h"
 #include "session.h"
 #include "option.h"
+#include "serverpool.h"
+#include "coordinator.h"
 #include "log.h"
 
 const char* default_port = "554";
@@ -37,9 +39,9 @@ sessionManager::~sessionManager()
 	DEBUG(MSG_MAIN,"Destruct resource manager.\n");
 	if (m_sessions.size())
 	{
-		for (std::list<Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+		for (std::map<int, Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
 		{
-			Session* session = *it;
+			Session* session = it->second;
 			delete session;
 		}
 	}
@@ -54,13 +56,82 @@ int sessionManager::satipStart()
 	for (std::map<int, vtunerOpt>::iterator it(data->begin()); it!=data->end(); it++)
 	{
 		if (it->second.isAvailable())
+			startTuner(it->second);
+	}
+
+	return 0;
+}
+
+int sessionManager::startTuner(vtunerOpt& settings)
+{
+	// with coordination the capacity of every server matters
+	if (settings.m_servers.size() > 1 || satipCoordinator::getInstance()->isEnabled())
+	{
+		serverPool::getInstance()->addServers(settings.m_servers, settings.m_port.empty() ? default_port : settings.m_port);
+		serverPool::getInstance()->start();
+	}
+
+	DEBUG(MSG_MAIN, "try connect : [%d] type : %s, ip : %s, fe_type : %d\n", settings.m_index, settings.m_vtuner_type.c_str(), settings.m_ipaddr.c_str(), settings.m_fe_type);
+	return satipSessionCreate(settings.m_ipaddr.c_str(), settings.m_fe_type, settings.m_port.c_str(), &settings);
+}
+
+/*
+ * Read the config again. Tuners whose transport, server or output changed
+ * get a new session, removed ones stop, the others keep streaming and take
+ * over the rest of their options on their own thread.
+ */
+void sessionManager::reload()
+{
+	std::map<int, vtunerOpt> fresh;
+	if (!m_satip_opt.load(fresh))
+	{
+		ERROR(MSG_MAIN, "config reload: can't read the config, keeping the running one\n");
+		return;
+	}
+
+	std::map<int, vtunerOpt>* current = m_satip_opt.getData();
+	int kept = 0;
+	for (std::map<int, Session*>::iterator it = m_sessions.begin(); it != m_sessions.end();)
+	{
+		const int index = it->first;
+		const std::map<int, vtunerOpt>::iterator f = fresh.find(index);
+		if (f != fresh.end() && f->second.isAvailable() && !(*current)[index].needsRestart(f->second))
 		{
-			DEBUG(MSG_MAIN, "try connect : [%d] type : %s, ip : %s, fe_type : %d\n", it->first, it->second.m_vtuner_type.c_str(), it->second.m_ipaddr.c_str(), it->second.m_fe_type);
-			satipSessionCreate(it->second.m_ipaddr.c_str(), it->second.m_fe_type, it->second.m_port.c_str(), &(it->second));
+			it->second->reload(f->second);
+			++kept;
+			++it;
+			continue;
 		}
+
+		INFO(MSG_MAIN, "config reload: tuner %d %s\n", index, f == fresh.end() || !f->second.isAvailable() ? "removed" : "changed, restarting it");
+		Session* session = it->second;
+		session->stop();
+		session->join();
+		delete session;
+		it = m_sessions.erase(it);
 	}
 
-	return 0;
+	// the settings of running sessions are theirs, the rest is replaced
+	for (std::map<int, vtunerOpt>::iterator it = current->begin(); it != current->end();)
+	{
+		if (m_sessions.count(it->first) || fresh.count(it->first))
+			++it;
+		else
+			it = current->erase(it);
+	}
+	for (std::map<int, vtunerOpt>::iterator it = fresh.begin(); it != fresh.end(); ++it)
+	{
+		if (!m_sessions.count(it->first))
+			(*current)[it->first] = it->second;
+	}
+
+	int started = 0;
+	for (std::map<int, vtunerOpt>::iterator it = current->begin(); it != current->end(); ++it)
+	{
+		if (!m_sessions.count(it->first) && it->second.isAvailable() && startTuner(it->second) == 0)
+			++started;
+	}
+	INFO(MSG_MAIN, "config reload: %d tuners kept, %d started\n", kept, started);
 }
 
 int sessionManager::satipSessionCreate(const char* ipaddr, int fe_type, const char *port, vtunerOpt* settings)
@@ -76,7 +147,7 @@ int sessionManager::satipSessionCreate(const char* ipaddr, int fe_type, const ch
 		return -1;
 	}
 
-	addSession(session);
+	addSession(settings->m_index, session);
 
 	DEBUG(MSG_MAIN, "Create satip session ok (%s , %d)\n", ipaddr, fe_type);
 
@@ -93,9 +164,9 @@ void sessionManager::sessionStart()
 
 	if (m_sessions.size())
 	{
-		for (std::list<Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+		for (std::map<int, Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
 		{
-			Session* session = *it;
+			Session* session = it->second;
 			session->start();
 		}
 	}
@@ -105,9 +176,9 @@ void sessionManager::sessionJoin()
 {
 	if (m_sessions.size())
 	{
-		for (std::list<Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+		for (std::map<int, Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
 		{
-			Session* session = *it;
+			Session* session = it->second;
 			session->join();
 		}
 	}
@@ -117,9 +188,9 @@ void sessionManager::sessionStop()
 {
 	if (m_sessions.size())
 	{
-		for (std::list<Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+		for (std::map<int, Session*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
 		{
-			Session* session = *it;
+			Session* session = it->second;
 			session->stop();
 		}
 	}
@@ -33,17 +33,19 @@ const int max_adapters = 8;
 
 class sessionManager
 {
-	std::list<Session*> m_sessions;
+	std::map<int, Session*> m_sessions; // by tuner index
 	optParser m_satip_opt;
 
 	int satipSessionCreate(const char* ipaddr, int fe_type, const char *port, vtunerOpt* settings);
-	void addSession(Session* session) { m_sessions.push_back(session); }
+	void addSession(int index, Session* session) { m_sessions[index] = session; }
+	int startTuner(vtunerOpt& settings);
 
 public:
 	sessionManager();
 	virtual ~sessionManager();
 
 	int satipStart();
+	void reload();
 	void sessionStart();
 	void sessionJoin();
 	void sessionStop();
@@ -21,12 +21,39 @@
 
 #include "option.h"
 #include "log.h"
+#include "threadpolicy.h"
 
 const char* conf_name = "/etc/vtuner.conf";
 
+bool vtunerOpt::needsRestart(const vtunerOpt& other) const
+{
+	return m_vtuner_type != other.m_vtuner_type || m_servers != other.m_servers || m_port != other.m_port ||
+		m_fe_type != other.m_fe_type ||
+		m_tcpdata != other.m_tcpdata || m_tcpdata_zerocopy != other.m_tcpdata_zerocopy ||
+		m_tcpdata_shared != other.m_tcpdata_shared ||
+		m_pcr_pacing != other.m_pcr_pacing || m_pcr_pid != other.m_pcr_pid ||
+		m_pacing_latency_ms != other.m_pacing_latency_ms ||
+		m_output != other.m_output || m_record != other.m_record || m_capture != other.m_capture ||
+		m_control != other.m_control ||
+		m_record_segment_mb != other.m_record_segment_mb || m_record_segment_sec != other.m_record_segment_sec ||
+		m_record_direct != other.m_record_direct || m_record_buffer_mb != other.m_record_buffer_mb ||
+		m_share_transponder != other.m_share_transponder;
+}
+
+void vtunerOpt::applyLive(const vtunerOpt& other)
+{
+	m_tcpdata_timeout = other.m_tcpdata_timeout;
+	m_rtp_net_buffer_size_mb = other.m_rtp_net_buffer_size_mb;
+	m_fe_number = other.m_fe_number;
+	m_force_plts = other.m_force_plts;
+	m_pids_all = other.m_pids_all;
+	m_pids_all_count = other.m_pids_all_count;
+	m_pids_all_churn = other.m_pids_all_churn;
+}
+
 optParser::optParser()
 {
-	load();
+	load(m_settings);
 	dump();
 	DEBUG(MSG_MAIN, "%d Satip configuration loaded..\n", m_settings.size());
 }
@@ -57,12 +84,12 @@ std::vector<std::string> optParser::split(const std::string &line, char delim)
 	return elems;
 }
 
-void optParser::load()
+bool optParser::load(std::map<int, vtunerOpt>& settings)
 {
 	std::ifstream in_file(conf_name);
 	if (!in_file.is_open())
 	{
-		return;
+		return false;
 	}
 
 	std::string line;
@@ -74,6 +101,9 @@ void optParser::load()
 	tuner_type_table["DVB-C"] = 1;
 	tuner_type_table["DVB-T"] = 2;
 
+	// thread.<role>=..., see threadpolicy.h
+	std::map<std::string, std::string> thread_lines;
+
 	while(std::getline(in_file, line))
 	{
 //		DEBUG(MSG_MAIN, "%s\n", line.c_str());
@@ -82,12 +112,19 @@ void optParser::load()
 		if (data.size() != 2)
 			continue;
 
+		if (data[0].compare(0, 7, "thread.") == 0)
+		{
+			thread_lines[data[0].substr(7)] = data[1];
+			continue;
+		}
+
 		index = atoi(data[0].c_str());
 
-		if (m_settings.find(index) == m_settings.end())
+		if (settings.find(index) == settings.end())
 		{
 			vtunerOpt vt_set;
-			m_settings[index] = vt_set;
+			vt_set.m_index = index;
+			settings[index] = vt_set;
 		}
 
 //		DEBUG(MSG_MAIN, "index : %d\n", index);
@@ -98,33 +135,90 @@ void optParser::load()
 		{
 			std::vector<std::string> attr = split(data[i], ':');
 			if (attr[0] == "vtuner_type")
-				m_settings[index].m_vtuner_type = attr[1];
+				settings[index].m_vtuner_type = attr[1];
 
 			else if (attr[0] == "ipaddr")
-				m_settings[index].m_ipaddr = attr[1];
+			{
+				settings[index].m_servers = split(attr[1], '|');
+				settings[index].m_ipaddr = settings[index].m_servers.empty() ? "" : settings[index].m_servers[0];
+			}
 
 			else if (attr[0] == "tcpdata" && attr[1] == "1")
-				m_settings[index].m_tcpdata = true;
+				settings[index].m_tcpdata = true;
+
+			else if (attr[0] == "tcpdata_zerocopy" && attr[1] == "1")
+				settings[index].m_tcpdata_zerocopy = true;
+
+			else if (attr[0] == "tcpdata_shared" && attr[1] == "1")
+				settings[index].m_tcpdata_shared = true;
 
 			else if (attr[0] == "tcpdata_timeout")
-				m_settings[index].m_tcpdata_timeout = atoi(attr[1].c_str());
+				settings[index].m_tcpdata_timeout = atoi(attr[1].c_str());
 
 			else if (attr[0] == "rtp_net_buffer_mb")
-				m_settings[index].m_rtp_net_buffer_size_mb = atoi(attr[1].c_str());
+				settings[index].m_rtp_net_buffer_size_mb = atoi(attr[1].c_str());
 
 			else if (attr[0] == "tuner_type")
-				m_settings[index].m_fe_type = tuner_type_table[attr[1]];
+				settings[index].m_fe_type = tuner_type_table[attr[1]];
 
 			else if (attr[0] == "force_plts" && attr[1] == "1")
-				m_settings[index].m_force_plts = true;
+				settings[index].m_force_plts = true;
+
+			else if (attr[0] == "pids_all" && attr[1] == "1")
+				settings[index].m_pids_all = true;
+
+			else if (attr[0] == "pids_all_count")
+				settings[index].m_pids_all_count = atoi(attr[1].c_str());
+
+			else if (attr[0] == "pids_all_churn")
+				settings[index].m_pids_all_churn = atoi(attr[1].c_str());
+
+			else if (attr[0] == "pcr_pacing" && attr[1] == "1")
+				settings[index].m_pcr_pacing = true;
+
+			else if (attr[0] == "pcr_pid")
+				settings[index].m_pcr_pid = atoi(attr[1].c_str());
+
+			else if (attr[0] == "pacing_latency_ms")
+				settings[index].m_pacing_latency_ms = atoi(attr[1].c_str());
+
+			else if (attr[0] == "output" && attr.size() > 1)
+				settings[index].m_output = data[i].substr(data[i].find(':') + 1);
+
+			else if (attr[0] == "record" && attr.size() > 1)
+				settings[index].m_record = data[i].substr(data[i].find(':') + 1);
+
+			else if (attr[0] == "capture" && attr.size() > 1)
+				settings[index].m_capture = data[i].substr(data[i].find(':') + 1);
+
+			else if (attr[0] == "control" && attr.size() > 1)
+				settings[index].m_control = data[i].substr(data[i].find(':') + 1);
+
+			else if (attr[0] == "record_segment_mb")
+				settings[index].m_record_segment_mb = atoi(attr[1].c_str());
+
+			else if (attr[0] == "record_segment_sec")
+				settings[index].m_record_segment_sec = atoi(attr[1].c_str());
+
+			else if (attr[0] == "record_direct")
+				settings[index].m_record_direct = attr[1] == "1";
+
+			else if (attr[0] == "record_buffer_mb")
+				settings[index].m_record_buffer_mb = atoi(attr[1].c_str());
+
+			else if (attr[0] == "share_transponder" && attr[1] == "1")
+				settings[index].m_share_transponder = true;
 
 			else if (attr[0] == "fe")
-				m_settings[index].m_fe_number = atoi(attr[1].c_str());
+				settings[index].m_fe_number = atoi(attr[1].c_str());
 
 			else if (attr[0] == "port")
-				m_settings[index].m_port = attr[1];
+				settings[index].m_port = attr[1];
 		}
 	}
+
+	threadPolicies::getInstance()->configure(thread_lines);
+	return true;
 }
 
 bool optParser::isEmpty()
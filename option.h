@@ -29,21 +29,48 @@ bool modelCheck();
 class vtunerOpt
 {
 public:
+	int m_index; // N= in vtuner.conf
 	std::string m_vtuner_type;
 	std::string m_ipaddr;
+	std::vector<std::string> m_servers; // ipaddr:a|b|c, m_ipaddr is the first one
 	bool m_tcpdata;
+	bool m_tcpdata_zerocopy;
+	bool m_tcpdata_shared;
 	int m_tcpdata_timeout;
 	int m_rtp_net_buffer_size_mb;
 	int m_fe_type;
 	int m_fe_number;
 	bool m_force_plts;
+	bool m_pids_all;
+	int m_pids_all_count;
+	int m_pids_all_churn;
+	bool m_pcr_pacing;
+	int m_pcr_pid;
+	int m_pacing_latency_ms;
+	std::string m_output;
+	std::string m_record;
+	std::string m_capture;
+	std::string m_control; // vtuner control, "" the device
+	int m_record_segment_mb;
+	int m_record_segment_sec;
+	bool m_record_direct;
+	int m_record_buffer_mb;
+	bool m_share_transponder;
 	std::string m_port;
 
-	vtunerOpt():m_tcpdata(false),m_tcpdata_timeout(6000),m_rtp_net_buffer_size_mb(6),m_fe_type(-1),m_fe_number(0),m_force_plts(false)
+	vtunerOpt():m_index(0),m_tcpdata(false),m_tcpdata_zerocopy(false),m_tcpdata_shared(false),m_tcpdata_timeout(6000),m_rtp_net_buffer_size_mb(6),m_fe_type(-1),m_fe_number(0),m_force_plts(false),
+		m_pids_all(false),m_pids_all_count(0),m_pids_all_churn(0),m_pcr_pacing(false),m_pcr_pid(-1),m_pacing_latency_ms(100),
+		m_record_segment_mb(1024),m_record_segment_sec(0),m_record_direct(true),m_record_buffer_mb(8),
+		m_share_transponder(false)
 	{
 	}
 
-	bool isAvailable()
+	// options a running session can't take over, it is recreated for them
+	bool needsRestart(const vtunerOpt& other) const;
+	// take over the options a running session can, from a reload
+	void applyLive(const vtunerOpt& other);
+
+	bool isAvailable() const
 	{
 		if (m_vtuner_type != "satip_client" || m_fe_type == -1 || m_ipaddr.empty())
 			return false;
@@ -57,13 +84,15 @@ class optParser
 	std::map<int, vtunerOpt> m_settings;
 	void dump();
 	std::vector<std::string> split(const std::string &line, char delim);
-	void load();
 
 public:
 	optParser();
 	virtual ~optParser();
 	bool isEmpty();
 	std::map<int, vtunerOpt>* getData() { return &m_settings; }
+
+	// read the config file into 'settings', false if it can't be opened
+	bool load(std::map<int, vtunerOpt>& settings);
 	
 };
 
@@ -0,0 +1,256 @@
+/*
+ * satip: TS output sinks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+
+#include "output.h"
+#include "log.h"
+
+#define TS_PACKET_SIZE 188
+#define TS_PER_DATAGRAM 7
+#define DATAGRAM_BATCH 32 // datagrams per sendmmsg()
+#define RTP_HEADER_SIZE 12
+#define RTP_PT_MP2T 33
+
+std::unique_ptr<outputSink> outputSink::create(const std::string& spec, int vtuner_fd)
+{
+	const size_t colon = spec.find(':');
+	const std::string type = spec.substr(0, colon);
+	const std::string arg = colon == std::string::npos ? "" : spec.substr(colon + 1);
+
+	if (isVtuner(spec)) {
+		if (vtuner_fd < 0)
+			return nullptr;
+		return std::make_unique<fdSink>(vtuner_fd, false, "vtuner");
+	}
+
+	if (type == "stdout")
+		return std::make_unique<fdSink>(STDOUT_FILENO, false, "stdout");
+
+	if ((type == "file" || type == "pipe") && !arg.empty()) {
+		if (type == "pipe" && mkfifo(arg.c_str(), 0644) && errno != EEXIST) {
+			ERROR(MSG_MAIN, "output: mkfifo %s failed: %s\n", arg.c_str(), strerror(errno));
+			return nullptr;
+		}
+		// O_RDWR keeps the open of a pipe without reader from blocking
+		const int fd = type == "pipe" ? open(arg.c_str(), O_RDWR) :
+			open(arg.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			ERROR(MSG_MAIN, "output: open %s failed: %s\n", arg.c_str(), strerror(errno));
+			return nullptr;
+		}
+		return std::make_unique<fdSink>(fd, true, spec);
+	}
+
+	if (type == "udp" || type == "rtp") {
+		const size_t port = arg.rfind(':');
+		if (port != std::string::npos) {
+			const int sock = udpSink::connectTo(arg.substr(0, port), arg.substr(port + 1));
+			if (sock < 0)
+				return nullptr;
+			return std::make_unique<udpSink>(sock, type == "rtp", spec);
+		}
+	}
+
+	ERROR(MSG_MAIN, "output: invalid output '%s'\n", spec.c_str());
+	return nullptr;
+}
+
+fdSink::fdSink(int fd, bool own_fd, const std::string& name) :
+	m_fd(fd),
+	m_own_fd(own_fd),
+	m_name(name)
+{
+	DEBUG(MSG_MAIN, "Create output %s.\n", m_name.c_str());
+}
+
+fdSink::~fdSink()
+{
+	if (m_own_fd)
+		close(m_fd);
+}
+
+int fdSink::write(struct iovec* iov, int iovcnt)
+{
+	int count = 0;
+	while (iovcnt > 0) {
+		auto write_res = ::writev(m_fd, iov, iovcnt);
+		if (write_res == 0) {
+			return -1;
+		}
+
+		if (write_res == -1) {
+			if (errno == EINTR)	{
+				DEBUG(MSG_MAIN, "WRITE : raise EINTR..continue.\n");
+				continue;
+			}
+
+			perror("RTP Write.");
+			return write_res;
+		}
+
+		count += write_res;
+		// skip what is written, continue with the rest
+		while (iovcnt > 0 && static_cast<size_t>(write_res) >= iov->iov_len) {
+			write_res -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = static_cast<unsigned char *>(iov->iov_base) + write_res;
+			iov->iov_len -= write_res;
+		}
+	}
+	return count;
+}
+
+udpSink::udpSink(int socket, bool rtp, const std::string& name) :
+	m_socket(socket),
+	m_rtp(rtp),
+	m_seq(0),
+	m_ssrc(static_cast<uint32_t>(random())),
+	m_name(name),
+	m_pending_len(0)
+{
+	DEBUG(MSG_MAIN, "Create output %s.\n", m_name.c_str());
+}
+
+udpSink::~udpSink()
+{
+	close(m_socket);
+}
+
+int udpSink::connectTo(const std::string& host, const std::string& port)
+{
+	struct addrinfo hints;
+	struct addrinfo* res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	const int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if (err) {
+		ERROR(MSG_MAIN, "output: %s:%s: %s\n", host.c_str(), port.c_str(), gai_strerror(err));
+		return -1;
+	}
+
+	const int sock = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen)) {
+		ERROR(MSG_MAIN, "output: connect %s:%s failed: %s\n", host.c_str(), port.c_str(), strerror(errno));
+		if (sock >= 0)
+			close(sock);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+// Send full datagrams from 'data', returns the bytes consumed
+int udpSink::sendDatagrams(const unsigned char* data, int len)
+{
+	unsigned char headers[DATAGRAM_BATCH][RTP_HEADER_SIZE];
+	struct iovec iov[DATAGRAM_BATCH][2];
+	struct mmsghdr msgs[DATAGRAM_BATCH];
+	const int datagram = TS_PER_DATAGRAM * TS_PACKET_SIZE;
+	int done = 0;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	const uint32_t timestamp = static_cast<uint32_t>(ts.tv_sec * 90000ULL + ts.tv_nsec / 11111);
+
+	while (len - done >= datagram) {
+		int count = 0;
+		memset(msgs, 0, sizeof(msgs));
+		for (; count < DATAGRAM_BATCH && len - done - count * datagram >= datagram; ++count) {
+			int iovcnt = 0;
+			if (m_rtp) {
+				unsigned char* h = headers[count];
+				const uint16_t seq = m_seq++;
+				h[0] = 0x80;
+				h[1] = RTP_PT_MP2T;
+				h[2] = seq >> 8;
+				h[3] = seq & 0xff;
+				h[4] = timestamp >> 24;
+				h[5] = (timestamp >> 16) & 0xff;
+				h[6] = (timestamp >> 8) & 0xff;
+				h[7] = timestamp & 0xff;
+				h[8] = m_ssrc >> 24;
+				h[9] = (m_ssrc >> 16) & 0xff;
+				h[10] = (m_ssrc >> 8) & 0xff;
+				h[11] = m_ssrc & 0xff;
+				iov[count][iovcnt].iov_base = h;
+				iov[count][iovcnt++].iov_len = RTP_HEADER_SIZE;
+			}
+			iov[count][iovcnt].iov_base = const_cast<unsigned char*>(data + done + count * datagram);
+			iov[count][iovcnt++].iov_len = datagram;
+			msgs[count].msg_hdr.msg_iov = iov[count];
+			msgs[count].msg_hdr.msg_iovlen = iovcnt;
+		}
+
+		const int sent = sendmmsg(m_socket, msgs, count, 0);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0) {
+			// the receiver may not be there (yet), the data is dropped
+			DEBUG_RL(MSG_NET, errno, "output %s: send failed: %s\n", m_name.c_str(), strerror(errno));
+			return len - len % datagram;
+		}
+		done += sent * datagram;
+	}
+	return done;
+}
+
+int udpSink::write(struct iovec* iov, int iovcnt)
+{
+	int count = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		const unsigned char* data = static_cast<const unsigned char*>(iov[i].iov_base);
+		int len = iov[i].iov_len;
+		count += len;
+
+		// complete a datagram started by the previous write
+		if (m_pending_len > 0) {
+			const int n = std::min<int>(len, sizeof(m_pending) - m_pending_len);
+			memcpy(m_pending + m_pending_len, data, n);
+			m_pending_len += n;
+			data += n;
+			len -= n;
+			if (m_pending_len < static_cast<int>(sizeof(m_pending)))
+				continue;
+			sendDatagrams(m_pending, m_pending_len);
+			m_pending_len = 0;
+		}
+
+		const int sent = sendDatagrams(data, len);
+		memcpy(m_pending, data + sent, len - sent);
+		m_pending_len = len - sent;
+	}
+	return count;
+}
@@ -0,0 +1,91 @@
+/*
+ * satip: TS output sinks
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_OUTPUT_H
+#define _SATIP_OUTPUT_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <sys/uio.h>
+
+/*
+ * Destination of the received TS. Selected per tuner with output:<spec>
+ *   vtuner              the vtuner device (default)
+ *   file:<path>         plain file, truncated on start
+ *   pipe:<path>         named pipe, created if missing
+ *   stdout
+ *   udp:<host>:<port>   TS over UDP, 7 packets per datagram
+ *   rtp:<host>:<port>   TS over RTP/UDP
+ */
+class outputSink
+{
+public:
+	virtual ~outputSink() {}
+
+	// Write the whole TS data, the iovec array may be modified.
+	// Returns the bytes written or -1.
+	virtual int write(struct iovec* iov, int iovcnt) = 0;
+	virtual const char* describe() const = 0;
+
+	static bool isVtuner(const std::string& spec) { return spec.empty() || spec == "vtuner"; }
+	// nullptr if the spec is invalid or the output can't be opened
+	static std::unique_ptr<outputSink> create(const std::string& spec, int vtuner_fd);
+};
+
+/* vtuner device, file, pipe or stdout */
+class fdSink : public outputSink
+{
+	int m_fd;
+	bool m_own_fd;
+	std::string m_name;
+
+public:
+	fdSink(int fd, bool own_fd, const std::string& name);
+	virtual ~fdSink();
+
+	int write(struct iovec* iov, int iovcnt) override;
+	const char* describe() const override { return m_name.c_str(); }
+};
+
+/* UDP re-emitter, with or without an RTP header */
+class udpSink : public outputSink
+{
+	int m_socket;
+	bool m_rtp;
+	uint16_t m_seq;
+	uint32_t m_ssrc;
+	std::string m_name;
+
+	/* TS packets waiting for a full datagram */
+	unsigned char m_pending[7 * 188];
+	int m_pending_len;
+
+	int sendDatagrams(const unsigned char* data, int len);
+
+public:
+	udpSink(int socket, bool rtp, const std::string& name);
+	virtual ~udpSink();
+
+	int write(struct iovec* iov, int iovcnt) override;
+	const char* describe() const override { return m_name.c_str(); }
+
+	static int connectTo(const std::string& host, const std::string& port);
+};
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * satip: PCR paced output
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+
+#include "pacer.h"
+#include "log.h"
+#include "threadpolicy.h"
+
+#define TS_PACKET_SIZE 188
+#define PACER_RING_PACKETS 16384 // 3MB, > 500ms at 40Mbit/s
+#define PACER_MARKS 1024
+#define PACER_HIGH_WATER (PACER_RING_PACKETS * 3 / 4)
+#define PACER_IDLE_NS 2000000ULL // wait for data
+#define PACER_MAX_SLEEP_NS 10000000ULL
+#define PACER_MIN_CHUNK 7 // packets per write while pacing
+#define PACER_NO_PCR_NS 500000000ULL // pass through after latency + this without PCR
+#define PACER_REPORT_NS 10000000000ULL
+#define PCR_MAX_GAP (27000000ULL) // 1s, larger steps are discontinuities
+#define PCR_LOST_NS 1000000000ULL // detect the PCR PID again after 1s without
+#define PCR_WRAP (0x200000000ULL * 300)
+#define METER_SLOT_NS 10000000ULL
+
+static uint64_t monotonicNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+		;
+}
+
+void burstMeter::add(uint64_t now_ns, uint32_t bytes)
+{
+	const uint64_t slot = now_ns / METER_SLOT_NS;
+	if (slot != m_slot) {
+		if (m_slot_bytes > m_peak.load(std::memory_order_relaxed))
+			m_peak.store(m_slot_bytes, std::memory_order_relaxed);
+		m_slot = slot;
+		m_slot_bytes = 0;
+	}
+	m_slot_bytes += bytes;
+	m_total.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+double burstMeter::takeRatio(uint64_t period_ns)
+{
+	const uint32_t peak = m_peak.exchange(0, std::memory_order_relaxed);
+	const uint64_t total = m_total.exchange(0, std::memory_order_relaxed);
+	const double average = static_cast<double>(total) * METER_SLOT_NS / period_ns;
+	return average > 0 ? peak / average : 0;
+}
+
+satipPacer::satipPacer(outputSink* output, int pcr_pid, int latency_ms) :
+	m_output(output),
+	m_cfg_pcr_pid(pcr_pid),
+	m_pcr_pid(pcr_pid),
+	m_pcr_ns(0),
+	m_restart(false),
+	m_reset(false),
+	m_latency_ns(static_cast<uint64_t>(std::max(latency_ms, 0)) * 1000000),
+	m_ring(std::make_unique<unsigned char[]>(PACER_RING_PACKETS * TS_PACKET_SIZE)),
+	m_head(0),
+	m_tail(0),
+	m_marks(std::make_unique<pcrMark[]>(PACER_MARKS)),
+	m_mark_head(0),
+	m_mark_tail(0),
+	m_thread(0),
+	m_running(false),
+	m_overflow(0),
+	m_catchups(0),
+	m_passthrough(0),
+	m_report_ns(0),
+	m_anchored(false),
+	m_base_ns(0),
+	m_base_pcr(0),
+	m_prev{0, 0, false},
+	m_last_mark_ns(0)
+{
+	DEBUG(MSG_MAIN, "Create pacer (pcr pid %d, latency %d ms).\n", pcr_pid, latency_ms);
+}
+
+satipPacer::~satipPacer()
+{
+	stop();
+}
+
+void* satipPacer::thread_wrapper(void* ptr)
+{
+	return static_cast<satipPacer*>(ptr)->paceLoop();
+}
+
+void satipPacer::run()
+{
+	if (m_running)
+		return;
+	m_running = true;
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+}
+
+void satipPacer::stop()
+{
+	m_running = false;
+	if (m_thread) {
+		pthread_join(m_thread, nullptr);
+		m_thread = 0;
+	}
+}
+
+void satipPacer::scanPcr(const unsigned char* ts, uint64_t pos, uint64_t now)
+{
+	if (m_reset.load(std::memory_order_relaxed) && m_reset.exchange(false, std::memory_order_acquire)) {
+		m_pcr_pid = m_cfg_pcr_pid;
+		m_restart = true;
+	}
+
+	// adaptation field with the PCR flag, no transport error
+	if ((ts[1] & 0x80) || !(ts[3] & 0x20) || ts[4] < 7 || !(ts[5] & 0x10))
+		return;
+
+	const int pid = ((ts[1] & 0x1f) << 8) | ts[2];
+	if (m_cfg_pcr_pid < 0 && pid != m_pcr_pid && m_pcr_pid >= 0 && now - m_pcr_ns > PCR_LOST_NS) {
+		INFO(MSG_MAIN, "pacing: no PCR on PID %d, looking for another one\n", m_pcr_pid);
+		m_pcr_pid = -1;
+		m_restart = true;
+	}
+	if (m_pcr_pid < 0) {
+		m_pcr_pid = pid;
+		INFO(MSG_MAIN, "pacing on the PCR of PID %d\n", pid);
+	}
+	if (pid != m_pcr_pid)
+		return;
+	m_pcr_ns = now;
+
+	const uint64_t mark_head = m_mark_head.load(std::memory_order_relaxed);
+	if (mark_head - m_mark_tail.load(std::memory_order_acquire) >= PACER_MARKS)
+		return;
+
+	const uint64_t base = (static_cast<uint64_t>(ts[6]) << 25) | (ts[7] << 17) | (ts[8] << 9) | (ts[9] << 1) | (ts[10] >> 7);
+	const uint64_t ext = ((ts[10] & 0x01) << 8) | ts[11];
+	pcrMark& mark = m_marks[mark_head % PACER_MARKS];
+	mark.pos = pos + 1; // data up to and including this packet
+	mark.pcr = base * 300 + ext;
+	mark.restart = m_restart;
+	m_restart = false;
+	m_mark_head.store(mark_head + 1, std::memory_order_release);
+}
+
+int satipPacer::push(const struct iovec* iov, int iovcnt)
+{
+	uint64_t head = m_head.load(std::memory_order_relaxed);
+	const uint64_t tail = m_tail.load(std::memory_order_acquire);
+	const uint64_t now = monotonicNs();
+	int bytes = 0;
+
+	for (int i = 0; i < iovcnt; ++i) {
+		const unsigned char* ts = static_cast<const unsigned char*>(iov[i].iov_base);
+		for (size_t size = iov[i].iov_len; size >= TS_PACKET_SIZE; ts += TS_PACKET_SIZE, size -= TS_PACKET_SIZE) {
+			if (head - tail >= PACER_RING_PACKETS) {
+				m_overflow.fetch_add(size / TS_PACKET_SIZE, std::memory_order_relaxed);
+				break;
+			}
+			memcpy(&m_ring[(head % PACER_RING_PACKETS) * TS_PACKET_SIZE], ts, TS_PACKET_SIZE);
+			m_head.store(head + 1, std::memory_order_release);
+			scanPcr(ts, head, now);
+			++head;
+			bytes += TS_PACKET_SIZE;
+		}
+	}
+
+	m_in_meter.add(now, bytes);
+	return bytes;
+}
+
+// Write the queued packets before 'pos', false on a write error
+bool satipPacer::writeUntil(uint64_t pos)
+{
+	uint64_t tail = m_tail.load(std::memory_order_relaxed);
+	pos = std::min(pos, m_head.load(std::memory_order_acquire));
+	if (pos <= tail)
+		return true;
+
+	size_t offset = (tail % PACER_RING_PACKETS) * TS_PACKET_SIZE;
+	size_t left = (pos - tail) * TS_PACKET_SIZE;
+	bool ok = true;
+	m_out_meter.add(monotonicNs(), left);
+
+	struct iovec iov[2];
+	int iovcnt = 1;
+	iov[0].iov_base = &m_ring[offset];
+	iov[0].iov_len = std::min(left, PACER_RING_PACKETS * TS_PACKET_SIZE - offset);
+	if (iov[0].iov_len < left) {
+		iov[1].iov_base = &m_ring[0];
+		iov[1].iov_len = left - iov[0].iov_len;
+		iovcnt = 2;
+	}
+	if (m_output->write(iov, iovcnt) < 0) {
+		ERROR_RL(MSG_MAIN, errno, "pacer write failed: %s\n", strerror(errno));
+		ok = false;
+	}
+
+	// what could not be written is dropped
+	m_tail.store(pos, std::memory_order_release);
+	return ok;
+}
+
+uint64_t satipPacer::pcrTime(uint64_t pcr) const
+{
+	return m_base_ns + (pcr + PCR_WRAP - m_base_pcr) % PCR_WRAP * 1000 / 27;
+}
+
+// Write everything up to 'mark' now and time the following data from it
+void satipPacer::rebase(const pcrMark& mark, uint64_t now)
+{
+	writeUntil(mark.pos);
+	m_prev = mark;
+	m_mark_tail.fetch_add(1, std::memory_order_release);
+	m_base_pcr = mark.pcr;
+	m_base_ns = now + m_latency_ns / 2;
+	m_last_mark_ns = now;
+}
+
+void satipPacer::report(uint64_t now)
+{
+	if (m_report_ns == 0) {
+		m_report_ns = now;
+		return;
+	}
+	if (now - m_report_ns < PACER_REPORT_NS)
+		return;
+
+	const uint64_t period = now - m_report_ns;
+	m_report_ns = now;
+	const double in_ratio = m_in_meter.takeRatio(period);
+	const double out_ratio = m_out_meter.takeRatio(period);
+	if (in_ratio > 0 || out_ratio > 0)
+		INFO(MSG_MAIN, "pacing: burstiness (peak/average per 10ms) in %.1f out %.1f, catch-ups %u, passthrough %u, overflow %llu packets, queued %llu packets\n",
+			in_ratio, out_ratio, m_catchups, m_passthrough,
+			static_cast<unsigned long long>(m_overflow.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed)));
+}
+
+void* satipPacer::paceLoop()
+{
+	threadRoleScope role(THREAD_ROLE_WRITER, "satip-pacer");
+	DEBUG(MSG_MAIN, "PACER LOOP START\n");
+	m_last_mark_ns = monotonicNs();
+
+	while (m_running)
+	{
+		const uint64_t now = monotonicNs();
+		report(now);
+
+		const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+		const uint64_t head = m_head.load(std::memory_order_acquire);
+		const bool have_mark = m_mark_tail.load(std::memory_order_relaxed) != m_mark_head.load(std::memory_order_acquire);
+
+		if (!have_mark) {
+			if (tail != head && now - m_last_mark_ns > m_latency_ns + PACER_NO_PCR_NS) {
+				if (m_anchored) {
+					WARN(MSG_MAIN, "pacing: no PCR, passing the data through\n");
+					m_anchored = false;
+					++m_passthrough;
+				}
+				writeUntil(head);
+			}
+			sleepUntil(now + PACER_IDLE_NS);
+			continue;
+		}
+
+		const pcrMark mark = m_marks[m_mark_tail.load(std::memory_order_relaxed) % PACER_MARKS];
+
+		if (mark.restart && m_anchored) {
+			DEBUG(MSG_MAIN, "pacing: new channel or PCR PID\n");
+			rebase(mark, now + m_latency_ns / 2);
+			continue;
+		}
+
+		if (!m_anchored) {
+			// first PCR: everything before it leaves after the latency
+			m_anchored = true;
+			m_prev = mark;
+			m_prev.pos = tail;
+			m_base_pcr = mark.pcr;
+			m_base_ns = now + m_latency_ns;
+			m_last_mark_ns = now;
+		}
+
+		const uint64_t t0 = pcrTime(m_prev.pcr);
+		const uint64_t pcr_delta = (mark.pcr + PCR_WRAP - m_prev.pcr) % PCR_WRAP;
+		const uint64_t t1 = t0 + pcr_delta * 1000 / 27;
+
+		if (pcr_delta > PCR_MAX_GAP) {
+			DEBUG(MSG_MAIN, "pacing: PCR discontinuity\n");
+			rebase(mark, now + m_latency_ns / 2);
+			continue;
+		}
+		if (now > t1 + m_latency_ns || head - tail > PACER_HIGH_WATER) {
+			++m_catchups;
+			rebase(mark, now);
+			continue;
+		}
+		if (now < t0) {
+			sleepUntil(std::min<uint64_t>(t0, now + PACER_MAX_SLEEP_NS));
+			continue;
+		}
+
+		// position due now, interpolated between the two PCRs
+		const uint64_t span = mark.pos - m_prev.pos;
+		uint64_t due = mark.pos;
+		if (now < t1 && t1 > t0)
+			due = m_prev.pos + span * (now - t0) / (t1 - t0);
+
+		if (due > tail)
+			writeUntil(due);
+
+		if (due >= mark.pos) {
+			m_prev = mark;
+			m_mark_tail.fetch_add(1, std::memory_order_release);
+			m_last_mark_ns = now;
+			continue;
+		}
+
+		// sleep until the next chunk is due
+		const uint64_t next = std::min(due + PACER_MIN_CHUNK, mark.pos);
+		const uint64_t wake = span ? t0 + (t1 - t0) * (next - m_prev.pos) / span : t1;
+		sleepUntil(std::min<uint64_t>(std::max<uint64_t>(wake, now + 100000), now + PACER_MAX_SLEEP_NS));
+	}
+
+	DEBUG(MSG_MAIN, "PACER LOOP END.\n");
+	return 0;
+}
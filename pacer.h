@@ -0,0 +1,123 @@
+/*
+ * satip: PCR paced output
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_PACER_H
+#define _SATIP_PACER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "output.h"
+
+/* Bytes per 10ms slot, peak against average over a report period */
+class burstMeter
+{
+	uint64_t m_slot;
+	uint32_t m_slot_bytes;
+	std::atomic<uint32_t> m_peak;
+	std::atomic<uint64_t> m_total;
+
+public:
+	burstMeter() : m_slot(0), m_slot_bytes(0), m_peak(0), m_total(0) {}
+
+	void add(uint64_t now_ns, uint32_t bytes);
+	// peak slot / average slot over the last 'period_ns', 0 without data
+	double takeRatio(uint64_t period_ns);
+};
+
+/*
+ * TS packets from the receiving thread go through a ring and are written
+ * by the pacer thread at the rate given by the PCRs of one PID, delayed by
+ * 'latency_ms'. When the output falls behind by more than the latency, the
+ * ring fills up or the PCR jumps, the timing is re-anchored (catch-up).
+ * Without PCRs the data passes through unpaced. Without a configured
+ * 'pcr_pid' the first PID carrying PCRs is used, and detected again after
+ * reset() or when it carries no PCR for a second while another PID does.
+ */
+class satipPacer
+{
+	struct pcrMark
+	{
+		uint64_t pos; // packet index in the stream
+		uint64_t pcr; // 27MHz
+		bool restart; // first PCR after a reset or a new PCR PID
+	};
+
+	outputSink* m_output;
+	const int m_cfg_pcr_pid; // -1: detected
+
+	/* receiving thread state */
+	int m_pcr_pid;
+	uint64_t m_pcr_ns; // last PCR of m_pcr_pid
+	bool m_restart;
+	std::atomic<bool> m_reset;
+	uint64_t m_latency_ns;
+
+	std::unique_ptr<unsigned char[]> m_ring;
+	std::atomic<uint64_t> m_head; // packets pushed
+	std::atomic<uint64_t> m_tail; // packets written
+
+	std::unique_ptr<pcrMark[]> m_marks;
+	std::atomic<uint64_t> m_mark_head;
+	std::atomic<uint64_t> m_mark_tail;
+
+	pthread_t m_thread;
+	std::atomic<bool> m_running;
+
+	/* metrics */
+	burstMeter m_in_meter;
+	burstMeter m_out_meter;
+	std::atomic<uint64_t> m_overflow;
+	unsigned int m_catchups;
+	unsigned int m_passthrough;
+	uint64_t m_report_ns;
+
+	/* pacer thread state */
+	bool m_anchored;
+	uint64_t m_base_ns;
+	uint64_t m_base_pcr;
+	pcrMark m_prev;
+	uint64_t m_last_mark_ns;
+
+	static void* thread_wrapper(void* ptr);
+	void* paceLoop();
+
+	void scanPcr(const unsigned char* ts, uint64_t pos, uint64_t now);
+	bool writeUntil(uint64_t pos);
+	uint64_t pcrTime(uint64_t pcr) const;
+	void rebase(const pcrMark& mark, uint64_t now);
+	void report(uint64_t now);
+
+public:
+	satipPacer(outputSink* output, int pcr_pid, int latency_ms);
+	virtual ~satipPacer();
+
+	void run();
+	void stop();
+	// Channel or PID set changed: time the data from the next PCR on, and
+	// detect the PCR PID again unless it is configured
+	void reset() { m_reset.store(true, std::memory_order_release); }
+
+	// Queue whole TS packets, returns the bytes accepted
+	int push(const struct iovec* iov, int iovcnt);
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * satip: PID set
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PIDSET_H__
+#define __PIDSET_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include "textbuffer.h"
+
+/* One bit per TS PID (0 - 0x1FFF) */
+class pidSet
+{
+public:
+	static constexpr int PID_COUNT = 0x2000;
+	static constexpr int WORDS = PID_COUNT / 64;
+
+	pidSet() { clear(); }
+
+	void clear() { memset(m_words, 0, sizeof(m_words)); }
+
+	void set(int pid)
+	{
+		if (pid >= 0 && pid < PID_COUNT)
+			m_words[pid >> 6] |= UINT64_C(1) << (pid & 63);
+	}
+
+	void reset(int pid)
+	{
+		if (pid >= 0 && pid < PID_COUNT)
+			m_words[pid >> 6] &= ~(UINT64_C(1) << (pid & 63));
+	}
+
+	bool test(int pid) const
+	{
+		return pid >= 0 && pid < PID_COUNT && (m_words[pid >> 6] >> (pid & 63)) & 1;
+	}
+
+	int count() const
+	{
+		int n = 0;
+		for (int i = 0; i < WORDS; ++i)
+			n += __builtin_popcountll(m_words[i]);
+		return n;
+	}
+
+	bool empty() const
+	{
+		uint64_t any = 0;
+		for (int i = 0; i < WORDS; ++i)
+			any |= m_words[i];
+		return any == 0;
+	}
+
+	bool operator==(const pidSet& other) const
+	{
+		uint64_t diff = 0;
+		for (int i = 0; i < WORDS; ++i)
+			diff |= m_words[i] ^ other.m_words[i];
+		return diff == 0;
+	}
+
+	bool operator!=(const pidSet& other) const { return !(*this == other); }
+
+	/* PIDs in this set and not in 'other' */
+	pidSet operator-(const pidSet& other) const
+	{
+		pidSet res(NoInit);
+		for (int i = 0; i < WORDS; ++i)
+			res.m_words[i] = m_words[i] & ~other.m_words[i];
+		return res;
+	}
+
+	pidSet& operator|=(const pidSet& other)
+	{
+		for (int i = 0; i < WORDS; ++i)
+			m_words[i] |= other.m_words[i];
+		return *this;
+	}
+
+	/* Call f(pid) for each PID in ascending order */
+	template <typename F>
+	void forEach(F f) const
+	{
+		for (int i = 0; i < WORDS; ++i) {
+			uint64_t word = m_words[i];
+			while (word) {
+				f((i << 6) + __builtin_ctzll(word));
+				word &= word - 1;
+			}
+		}
+	}
+
+	/* Comma separated list, e.g. "0,16,611" */
+	void appendTo(textBuffer& text) const
+	{
+		bool first = true;
+		forEach([&](int pid) {
+			if (!first)
+				text << ',';
+			text << pid;
+			first = false;
+		});
+	}
+
+	const uint64_t* words() const { return m_words; }
+
+private:
+	enum NoInitTag { NoInit };
+	explicit pidSet(NoInitTag) {}
+
+	uint64_t m_words[WORDS];
+};
+
+/* PID set published by the session thread and read by the data path */
+class pidFilter
+{
+public:
+	pidFilter() : m_enabled(false), m_changes(0)
+	{
+		for (int i = 0; i < pidSet::WORDS; ++i)
+			m_words[i].store(0, std::memory_order_relaxed);
+	}
+
+	void update(const pidSet& pids, bool enabled)
+	{
+		const uint64_t* words = pids.words();
+		bool changed = false;
+		for (int i = 0; i < pidSet::WORDS; ++i)
+			changed |= m_words[i].exchange(words[i], std::memory_order_relaxed) != words[i];
+		m_enabled.store(enabled, std::memory_order_release);
+		if (changed)
+			m_changes.fetch_add(1, std::memory_order_release);
+	}
+
+	bool isEnabled() const { return m_enabled.load(std::memory_order_acquire); }
+	// updates with a different PID set, for the data path to notice a zap
+	unsigned int changes() const { return m_changes.load(std::memory_order_acquire); }
+
+	bool test(int pid) const
+	{
+		return (m_words[pid >> 6].load(std::memory_order_relaxed) >> (pid & 63)) & 1;
+	}
+
+private:
+	std::atomic<bool> m_enabled;
+	std::atomic<unsigned int> m_changes;
+	std::atomic<uint64_t> m_words[pidSet::WORDS];
+};
+
+#endif // __PIDSET_H__
@@ -0,0 +1,276 @@
+/*
+ * satip: TS recorder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <algorithm>
+
+#include "recorder.h"
+#include "log.h"
+#include "threadpolicy.h"
+
+#define DIRECT_ALIGN 4096
+
+static_assert(recorderSink::BLOCK_SIZE % 188 == 0 && recorderSink::BLOCK_SIZE % DIRECT_ALIGN == 0,
+	"segments start on a TS packet, O_DIRECT writes whole blocks");
+
+static uint64_t elapsedNs(const struct timespec& from, const struct timespec& to)
+{
+	return (to.tv_sec - from.tv_sec) * 1000000000ULL + to.tv_nsec - from.tv_nsec;
+}
+
+recorderSink::recorderSink(const settings& s) :
+	m_settings(s),
+	m_name("record:" + s.prefix),
+	m_current(nullptr),
+	m_stopping(false),
+	m_thread(0),
+	m_fd(-1),
+	m_fd_direct(false),
+	m_segment_index(0),
+	m_segment_written(0),
+	m_segment_start{0, 0},
+	m_total_written(0),
+	m_dropped(0),
+	m_write_ns(0)
+{
+	DEBUG(MSG_MAIN, "Create recorder %s.\n", m_settings.prefix.c_str());
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_cond_init(&m_cond, NULL);
+
+	m_blocks.resize(std::max(m_settings.blocks, 2));
+	for (auto& blk : m_blocks) {
+		void* data = nullptr;
+		if (posix_memalign(&data, DIRECT_ALIGN, BLOCK_SIZE)) {
+			ERROR(MSG_MAIN, "recorder: out of memory\n");
+			return;
+		}
+		blk.data = static_cast<unsigned char*>(data);
+		blk.len = 0;
+		m_free.push_back(&blk);
+	}
+
+	if (!openSegment())
+		return;
+
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+}
+
+recorderSink::~recorderSink()
+{
+	pthread_mutex_lock(&m_lock);
+	if (m_current && m_current->len > 0) {
+		m_full.push_back(m_current);
+		m_current = nullptr;
+	}
+	m_stopping = true;
+	pthread_cond_signal(&m_cond);
+	pthread_mutex_unlock(&m_lock);
+
+	if (m_thread)
+		pthread_join(m_thread, nullptr);
+	closeSegment();
+
+	if (m_dropped)
+		WARN(MSG_MAIN, "recorder %s: %llu bytes dropped, disk too slow\n", m_settings.prefix.c_str(),
+			static_cast<unsigned long long>(m_dropped));
+
+	for (auto& blk : m_blocks)
+		free(blk.data);
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void* recorderSink::thread_wrapper(void* ptr)
+{
+	return static_cast<recorderSink*>(ptr)->ioLoop();
+}
+
+bool recorderSink::openSegment()
+{
+	char date[32];
+	const time_t now = time(NULL);
+	struct tm tm;
+	strftime(date, sizeof(date), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+	const std::string path = m_settings.prefix + "-" + date + "-" + std::to_string(m_segment_index++) + ".ts";
+
+	const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	m_fd_direct = false;
+	if (m_settings.direct) {
+		m_fd = open(path.c_str(), flags | O_DIRECT, 0644);
+		if (m_fd >= 0)
+			m_fd_direct = true;
+		else if (errno == EINVAL)
+			WARN(MSG_MAIN, "recorder: no O_DIRECT on %s, using writeback\n", path.c_str());
+	}
+	if (m_fd < 0)
+		m_fd = open(path.c_str(), flags, 0644);
+	if (m_fd < 0) {
+		ERROR(MSG_MAIN, "recorder: open %s failed: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	// reserve the segment, keeps it contiguous on disk
+	if (m_settings.segment_bytes > 0 && fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, m_settings.segment_bytes))
+		DEBUG(MSG_MAIN, "recorder: fallocate: %s\n", strerror(errno));
+
+	m_segment_written = 0;
+	clock_gettime(CLOCK_MONOTONIC, &m_segment_start);
+	m_write_ns = 0;
+	INFO(MSG_MAIN, "recording to %s%s\n", path.c_str(), m_fd_direct ? " (O_DIRECT)" : "");
+	return true;
+}
+
+void recorderSink::closeSegment()
+{
+	if (m_fd < 0)
+		return;
+
+	// give back what fallocate reserved beyond the data
+	if (ftruncate(m_fd, m_segment_written))
+		WARN(MSG_MAIN, "recorder: ftruncate: %s\n", strerror(errno));
+	if (!m_fd_direct)
+		posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(m_fd);
+	m_fd = -1;
+
+	if (m_write_ns > 0)
+		INFO(MSG_MAIN, "recorder: segment closed, %lld bytes, %.1f MB/s write rate\n",
+			static_cast<long long>(m_segment_written), m_segment_written * 1e3 / m_write_ns);
+}
+
+void recorderSink::writeBlock(const block& blk)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t len = blk.len;
+	if (m_fd_direct && len % DIRECT_ALIGN) {
+		// the last, partial block: O_DIRECT needs aligned sizes
+		fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+		m_fd_direct = false;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		const ssize_t res = pwrite(m_fd, blk.data + done, len - done, m_segment_written + done);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			ERROR_RL(MSG_MAIN, errno, "recorder: write failed: %s\n", strerror(errno));
+			break;
+		}
+		done += res;
+	}
+
+	if (!m_fd_direct && done > 0) {
+		// start writeback of this block, wait for the previous one and drop it from the cache
+		sync_file_range(m_fd, m_segment_written, done, SYNC_FILE_RANGE_WRITE);
+		if (m_segment_written >= static_cast<int64_t>(BLOCK_SIZE)) {
+			const off64_t prev = m_segment_written - BLOCK_SIZE;
+			sync_file_range(m_fd, prev, BLOCK_SIZE,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(m_fd, prev, BLOCK_SIZE, POSIX_FADV_DONTNEED);
+		}
+	}
+
+	m_segment_written += done;
+	m_total_written += done;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	m_write_ns += elapsedNs(start, end);
+}
+
+void* recorderSink::ioLoop()
+{
+	threadRoleScope role(THREAD_ROLE_WRITER, "satip-recorder");
+	DEBUG(MSG_MAIN, "RECORDER LOOP START\n");
+	pthread_mutex_lock(&m_lock);
+	for (;;)
+	{
+		while (m_full.empty() && !m_stopping)
+			pthread_cond_wait(&m_cond, &m_lock);
+		if (m_full.empty())
+			break;
+
+		block* blk = m_full.front();
+		m_full.pop_front();
+		pthread_mutex_unlock(&m_lock);
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((m_settings.segment_bytes > 0 && m_segment_written >= m_settings.segment_bytes) ||
+			(m_settings.segment_sec > 0 && now.tv_sec - m_segment_start.tv_sec >= m_settings.segment_sec)) {
+			closeSegment();
+			openSegment();
+		}
+		if (m_fd >= 0)
+			writeBlock(*blk);
+
+		pthread_mutex_lock(&m_lock);
+		blk->len = 0;
+		m_free.push_back(blk);
+	}
+	pthread_mutex_unlock(&m_lock);
+	DEBUG(MSG_MAIN, "RECORDER LOOP END.\n");
+	return 0;
+}
+
+// hand the current block to the I/O thread and take a free one
+void recorderSink::queueCurrent()
+{
+	pthread_mutex_lock(&m_lock);
+	if (m_current) {
+		m_full.push_back(m_current);
+		pthread_cond_signal(&m_cond);
+	}
+	m_current = nullptr;
+	if (!m_free.empty()) {
+		m_current = m_free.back();
+		m_free.pop_back();
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+int recorderSink::write(struct iovec* iov, int iovcnt)
+{
+	int count = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		const unsigned char* data = static_cast<const unsigned char*>(iov[i].iov_base);
+		size_t len = iov[i].iov_len;
+		count += len;
+		while (len > 0) {
+			if (!m_current || m_current->len == BLOCK_SIZE)
+				queueCurrent();
+			if (!m_current) {
+				m_dropped += len;
+				break;
+			}
+			const size_t n = std::min(len, BLOCK_SIZE - m_current->len);
+			memcpy(m_current->data + m_current->len, data, n);
+			m_current->len += n;
+			data += n;
+			len -= n;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,123 @@
+/*
+ * satip: TS recorder
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_RECORDER_H
+#define _SATIP_RECORDER_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "output.h"
+
+/*
+ * Records the TS into <prefix>-<date>-<time>-<n>.ts segments, rotated by
+ * size and/or time. The caller only copies into ~1MB blocks from a fixed
+ * pool, an I/O thread writes the full blocks. With O_DIRECT the page cache
+ * is bypassed, otherwise each block is written back with sync_file_range
+ * and dropped from the cache. If the pool runs dry the data is dropped.
+ */
+class recorderSink : public outputSink
+{
+public:
+	struct settings
+	{
+		std::string prefix;
+		int64_t segment_bytes;  // 0: no size limit
+		int segment_sec;        // 0: no time limit
+		bool direct;            // O_DIRECT
+		int blocks;             // pool size
+	};
+
+	// segments rotate between blocks: whole TS packets (188 = 4 * 47) and
+	// O_DIRECT aligned (4096), 940KB
+	static constexpr size_t BLOCK_SIZE = 5 * 47 * 4096;
+
+private:
+	struct block
+	{
+		unsigned char* data;
+		size_t len;
+	};
+
+	settings m_settings;
+	std::string m_name;
+
+	/* block pool, m_free and m_full are guarded by m_lock */
+	std::vector<block> m_blocks;
+	std::vector<block*> m_free;
+	std::deque<block*> m_full;
+	block* m_current; // owned by the writer
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	bool m_stopping;
+	pthread_t m_thread;
+
+	/* I/O thread */
+	int m_fd;
+	bool m_fd_direct;
+	int m_segment_index;
+	int64_t m_segment_written;
+	struct timespec m_segment_start;
+	uint64_t m_total_written;
+	uint64_t m_dropped;
+	uint64_t m_write_ns;
+
+	static void* thread_wrapper(void* ptr);
+	void* ioLoop();
+
+	bool openSegment();
+	void closeSegment();
+	void writeBlock(const block& blk);
+	void queueCurrent();
+
+public:
+	recorderSink(const settings& s);
+	virtual ~recorderSink();
+
+	bool isOpened() const { return m_thread != 0; }
+	int write(struct iovec* iov, int iovcnt) override;
+	const char* describe() const override { return m_name.c_str(); }
+
+	uint64_t getWritten() const { return m_total_written; }
+	uint64_t getDropped() const { return m_dropped; }
+};
+
+/* Same data to the recorder and the primary output */
+class teeSink : public outputSink
+{
+	std::unique_ptr<outputSink> m_primary;
+	std::unique_ptr<outputSink> m_secondary;
+
+public:
+	teeSink(std::unique_ptr<outputSink> primary, std::unique_ptr<outputSink> secondary)
+		: m_primary(std::move(primary)), m_secondary(std::move(secondary)) {}
+
+	int write(struct iovec* iov, int iovcnt) override
+	{
+		m_secondary->write(iov, iovcnt); // copies, leaves iov alone
+		return m_primary->write(iov, iovcnt);
+	}
+	const char* describe() const override { return m_primary->describe(); }
+};
+
+#endif
@@ -28,35 +28,91 @@
 #include <poll.h>
 #include <errno.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
 #include "rtp.h"
 #include "log.h"
+#include "trace.h"
+#include "threadpolicy.h"
+
+#define RTCP_SR   200
+#define RTCP_RR   201
+#define RTCP_SDES 202
+#define RTCP_BYE  203
+#define RTCP_APP  204
+
+#define RTCP_SDES_END   0
+#define RTCP_SDES_CNAME 1
 
 //#define BUFFER_SIZE ((188 / 4) * 4096) /* multiple of ts packet and page size */
 #define BUFFER_SIZE 1328 // 12byte +188*7
+#define TS_PACKET_SIZE 188
+#define FILTER_BUFFER_SIZE (64 * 1024) // >= RTP_BATCH * BUFFER_SIZE and max interleaved frame
+#define TS_ERROR_WINDOW 1 // sec, window for the error rate (BER)
+#define SR_DRIFT_MIN_TIME 10 // sec between sender reports to estimate the drift
+#define NTP_UNIX_OFFSET 2208988800ULL // 1900 to 1970
 #define PORT_BASE 45000
 #define PORT_RANGE 2000
 
-satipRTP::satipRTP(int vtuner_fd, bool tcp_data, int rtp_net_buffer_size_mb) :
+satipRTP::satipRTP(int vtuner_fd, const vtunerOpt* settings, const pidFilter* pid_filter) :
 						m_rtp_port(-1),
 						m_rtp_socket(-1),
 						m_rtcp_port(-1),
 						m_rtcp_socket(-1),
 						m_thread(0),
 						m_running(false),
-						m_rtp_net_buffer_size_mb(rtp_net_buffer_size_mb),
+						m_rtp_net_buffer_size_mb(settings->m_rtp_net_buffer_size_mb),
 						m_rtp_pseq(0),
-						m_hasLock(false),
-						m_signalStrength(0),
-						m_signalQuality(0),
+						m_pid_filter(pid_filter),
+						m_filter_buf(std::make_unique<unsigned char[]>(FILTER_BUFFER_SIZE)),
+						m_pid_changes(0),
+						m_has_guests(false),
+						m_share_source(nullptr),
+						m_stats(),
+						m_stats_reset(false),
+						m_stats_pseq_valid(false),
+						m_window_start{0, 0},
+						m_server_ssrc(0),
+						m_server_ssrc_valid(false),
+						m_sr_first(),
+						m_sr_min_offset(0),
+						m_rtcp_app_count(0),
 						m_openok(false)
 {
+	memset(m_ts_cc, 0xff, sizeof(m_ts_cc));
+	pthread_mutex_init(&m_write_lock, NULL);
+	pthread_mutex_init(&m_guest_lock, NULL);
 	DEBUG(MSG_MAIN,"Create RTP.\n");
-	m_vtuner_fd = vtuner_fd;
-	m_tcp_data = tcp_data;
-	if (tcp_data) {
+	m_tcp_data = settings->m_tcpdata;
+	m_output = outputSink::create(settings->m_output, vtuner_fd);
+	if (!m_output) {
+		ERROR(MSG_MAIN, "Create RTP failed, no output.\n");
+		return;
+	}
+	if (!settings->m_record.empty()) {
+		recorderSink::settings rec;
+		rec.prefix = settings->m_record;
+		rec.segment_bytes = static_cast<int64_t>(settings->m_record_segment_mb) * 1024 * 1024;
+		rec.segment_sec = settings->m_record_segment_sec;
+		rec.direct = settings->m_record_direct;
+		rec.blocks = settings->m_record_buffer_mb * 1024 * 1024 / recorderSink::BLOCK_SIZE;
+		auto recorder = std::make_unique<recorderSink>(rec);
+		if (recorder->isOpened())
+			m_output = std::make_unique<teeSink>(std::move(m_output), std::move(recorder));
+	}
+	if (!settings->m_capture.empty()) {
+		m_capture = std::make_unique<packetCapture>(settings->m_capture);
+		if (!m_capture->isOpened())
+			m_capture.reset();
+	}
+	if (httpServer::getInstance()->isRunning())
+		m_output = std::make_unique<teeSink>(std::move(m_output),
+			std::make_unique<streamRing>(httpServer::getInstance(), settings->m_index));
+	if (settings->m_pcr_pacing)
+		m_pacer = std::make_unique<satipPacer>(m_output.get(), settings->m_pcr_pid, settings->m_pacing_latency_ms);
+	if (m_tcp_data) {
 		m_openok = 1;
 	} else {
 		m_openok = !openRTP();
@@ -75,13 +131,115 @@ satipRTP::~satipRTP()
 
 	if (m_rtp_socket)
 		close(m_rtp_socket);
+
+	pthread_mutex_destroy(&m_guest_lock);
+	pthread_mutex_destroy(&m_write_lock);
+}
+
+void satipRTP::addGuest(satipRTP* guest)
+{
+	pthread_mutex_lock(&m_guest_lock);
+	m_guests.push_back(guest);
+	m_has_guests.store(true, std::memory_order_release);
+	pthread_mutex_unlock(&m_guest_lock);
 }
 
+// after this the owner's data path no longer touches 'guest'
+void satipRTP::removeGuest(satipRTP* guest)
+{
+	pthread_mutex_lock(&m_guest_lock);
+	m_guests.erase(std::remove(m_guests.begin(), m_guests.end(), guest), m_guests.end());
+	m_has_guests.store(!m_guests.empty(), std::memory_order_release);
+	pthread_mutex_unlock(&m_guest_lock);
+}
+
+// Called on tuning: clear the published state now, the receiving thread
+// drops its counters before it handles the next packet
 void satipRTP::unset()
 {
-	m_signalStrength = 0;
-	m_hasLock = false;
-	m_signalQuality = 0;
+	m_telemetry.publish(frontendTelemetry());
+	m_stats_reset.store(true, std::memory_order_release);
+	if (m_pacer)
+		m_pacer->reset();
+}
+
+void satipRTP::checkStatsReset()
+{
+	if (m_stats_reset.load(std::memory_order_relaxed) && m_stats_reset.exchange(false, std::memory_order_acquire)) {
+		m_stats = frontendTelemetry();
+		m_stats_pseq_valid = false;
+		m_server_ssrc_valid = false;
+		m_sr_first.valid = false;
+		m_window_start.tv_sec = 0;
+		memset(m_ts_cc, 0xff, sizeof(m_ts_cc));
+	}
+}
+
+// Count TEI flagged packets and continuity errors, publish once per window
+void satipRTP::scanTsPackets(const struct iovec *iov, int iovcnt)
+{
+	uint32_t packets = 0;
+	uint32_t cc_errors = 0;
+	uint32_t tei = 0;
+
+	for (int i = 0; i < iovcnt; ++i) {
+		const unsigned char *ts = static_cast<const unsigned char *>(iov[i].iov_base);
+		for (size_t size = iov[i].iov_len; size >= TS_PACKET_SIZE; ts += TS_PACKET_SIZE, size -= TS_PACKET_SIZE) {
+			++packets;
+			if (ts[1] & 0x80) {
+				++tei;
+				continue;
+			}
+			const int pid = ((ts[1] & 0x1f) << 8) | ts[2];
+			const int afc = (ts[3] >> 4) & 3;
+			if (pid == 0x1fff || !(afc & 1))
+				continue;
+			const uint8_t cc = ts[3] & 0x0f;
+			const uint8_t last = m_ts_cc[pid];
+			const bool discontinuity = (afc & 2) && ts[4] > 0 && (ts[5] & 0x80);
+			if (last != 0xff && cc != last && cc != ((last + 1) & 0x0f) && !discontinuity)
+				++cc_errors;
+			m_ts_cc[pid] = cc;
+		}
+	}
+
+	m_stats.cc_errors += cc_errors;
+	m_stats.tei_packets += tei;
+	m_stats.window_ts_packets += packets;
+	m_stats.window_errors += cc_errors + tei;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if (m_window_start.tv_sec == 0) {
+		m_window_start = now;
+	} else if (now.tv_sec - m_window_start.tv_sec >= TS_ERROR_WINDOW) {
+		m_window_start = now;
+		m_telemetry.publish(m_stats);
+		m_stats.window_ts_packets = 0;
+		m_stats.window_errors = 0;
+	}
+}
+
+void satipRTP::setNetBuffer(int sock)
+{
+	int len = m_rtp_net_buffer_size_mb * 1024 * 1024;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &len, sizeof(len)))
+		WARN(MSG_MAIN, "unable to set UDP buffer (force) size to %d\n", len);
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len)))
+		WARN(MSG_MAIN, "unable to set UDP buffer size to %d\n", len);
+
+	socklen_t sl = sizeof(int);
+	if (!getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &len, &sl))
+		DEBUG(MSG_DATA, "UDP buffer size is %d bytes\n", len);
+}
+
+// Config reload, the socket keeps receiving
+void satipRTP::resizeNetBuffer(int size_mb)
+{
+	m_rtp_net_buffer_size_mb = size_mb;
+	if (!m_tcp_data && m_rtp_socket >= 0)
+		setNetBuffer(m_rtp_socket);
 }
 
 int satipRTP::openRTP()
@@ -119,16 +277,7 @@ int satipRTP::openRTP()
 			continue;
 		}
 
-		int len = m_rtp_net_buffer_size_mb * 1024 * 1024;
-		if (setsockopt(rtp_sock, SOL_SOCKET, SO_RCVBUFFORCE, &len, sizeof(len)))
-			WARN(MSG_MAIN, "unable to set UDP buffer (force) size to %d\n", len);
-
-		if (setsockopt(rtp_sock, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len)))
-			WARN(MSG_MAIN, "unable to set UDP buffer size to %d\n", len);
-
-		socklen_t sl = sizeof(int);
-		if (!getsockopt(rtp_sock, SOL_SOCKET, SO_RCVBUF, &len, &sl))
-			DEBUG(MSG_DATA, "UDP buffer size is %d bytes\n", len);
+		setNetBuffer(rtp_sock);
 
 		memset(&inaddr, 0, sizeof(inaddr));
 		inaddr.sin_family = AF_INET;
@@ -157,7 +306,48 @@ int satipRTP::openRTP()
 	return 0;
 }
 
-void satipRTP::parseRtcpAppPayload(const char* buffer)
+static inline uint16_t rd16(const unsigned char* p)
+{
+	return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t rd32(const unsigned char* p)
+{
+	return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+		(static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+// Parse a decimal number in [p, end), advances p. -1 if there is none.
+static int parseNumber(const char*& p, const char* end)
+{
+	int value = -1;
+	for (; p < end && *p >= '0' && *p <= '9'; ++p)
+		value = (value < 0 ? 0 : value * 10) + (*p - '0');
+	return value;
+}
+
+static uint64_t localNtpTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((static_cast<uint64_t>(ts.tv_sec) + NTP_UNIX_OFFSET) << 32) |
+		((static_cast<uint64_t>(ts.tv_nsec) << 32) / 1000000000);
+}
+
+static double elapsed(const struct timespec& from, const struct timespec& to)
+{
+	return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+static size_t iovBytes(const struct iovec* iov, int iovcnt)
+{
+	size_t bytes = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		bytes += iov[i].iov_len;
+	return bytes;
+}
+
+void satipRTP::parseRtcpAppPayload(const char* buffer, int size)
 {
 	/*
 		APP Packet String Payload Format:
@@ -170,67 +360,182 @@ void satipRTP::parseRtcpAppPayload(const char* buffer)
 			'1' : the frontend if locked
 		quality (Signal quality) : Numerical value between 0 and 15
 	*/
+	static const char tuner_tag[] = ";tuner=";
 
-	unset();
+	m_stats.has_lock = 0;
+	m_stats.signal_strength = 0;
+	m_stats.signal_quality = 0;
 
-	const char* strp = strstr(buffer, ";tuner=");
+	const char* end = buffer + size;
+	const char* strp = static_cast<const char*>(memmem(buffer, size, tuner_tag, sizeof(tuner_tag) - 1));
 	if (strp)
 	{
-		static int rateLimit = 0;
-		int level = 0;
-		int lock = 0;
-		int quality = 0;
-		strp = strstr(strp, ",");
-		sscanf(strp, ",%d,%d,%d,%*s", &level, &lock, &quality);
-
-		m_signalStrength = (level >= 0) ? (level * 65535 / 255) : 0;
-		m_hasLock = lock == 1;
-		m_signalQuality = (m_hasLock && (quality >= 0)) ? (quality * 65535 / 15) : 0;
-		++rateLimit;
-		if (rateLimit > 3) {
-			rateLimit = 0;
-			DEBUG(MSG_MAIN, "RTCP: signalStrength : %d, hasLock : %d, signalQuality : %d\n", m_signalStrength, m_hasLock, m_signalQuality);
+		strp = static_cast<const char*>(memchr(strp, ',', end - strp));
+		int level = -1;
+		int lock = -1;
+		int quality = -1;
+		if (strp && ++strp < end)
+			level = parseNumber(strp, end);
+		if (strp && strp < end && *strp++ == ',')
+			lock = parseNumber(strp, end);
+		if (strp && strp < end && *strp++ == ',')
+			quality = parseNumber(strp, end);
+
+		m_stats.signal_strength = (level >= 0) ? (level * 65535 / 255) : 0;
+		m_stats.has_lock = lock == 1;
+		m_stats.signal_quality = (m_stats.has_lock && (quality >= 0)) ? (quality * 65535 / 15) : 0;
+		if (++m_rtcp_app_count % 4 == 0)
+			DEBUG(MSG_MAIN, "RTCP: signalStrength : %u, hasLock : %u, signalQuality : %u\n", m_stats.signal_strength, m_stats.has_lock, m_stats.signal_quality);
+	}
+	m_telemetry.publish(m_stats);
+}
+
+// Clock mapping from the server's sender reports: drift of the server clock
+// against ours and the offset of our receive time to the server send time,
+// which is the one way delay when both clocks are NTP synchronised.
+void satipRTP::handleSenderReport(const unsigned char* body, int size)
+{
+	if (size < 24)
+		return;
+
+	checkServerSsrc(rd32(body), "SR SSRC");
+
+	rtcpClockMapping sr;
+	sr.ntp = (static_cast<uint64_t>(rd32(body + 4)) << 32) | rd32(body + 8);
+	sr.rtp_ts = rd32(body + 12);
+	clock_gettime(CLOCK_MONOTONIC, &sr.local);
+
+	const double offset = static_cast<int64_t>(localNtpTime() - sr.ntp) / 4294967296.0;
+	if (!m_sr_first.valid || offset < m_sr_min_offset)
+		m_sr_min_offset = offset;
+
+	if (!m_sr_first.valid) {
+		sr.valid = true;
+		m_sr_first = sr;
+	}
+
+	double drift_ppm = 0;
+	double rtp_clock = 0;
+	const double local_elapsed = elapsed(m_sr_first.local, sr.local);
+	if (local_elapsed >= SR_DRIFT_MIN_TIME) {
+		const double server_elapsed = static_cast<int64_t>(sr.ntp - m_sr_first.ntp) / 4294967296.0;
+		drift_ppm = (server_elapsed - local_elapsed) / local_elapsed * 1e6;
+		if (server_elapsed > 0)
+			rtp_clock = static_cast<uint32_t>(sr.rtp_ts - m_sr_first.rtp_ts) / server_elapsed;
+	}
+
+	m_stats.clock_drift_ppm = static_cast<int32_t>(drift_ppm);
+	m_stats.sr_offset_us = static_cast<int32_t>(std::max(-2000.0, std::min(2000.0, offset)) * 1e6);
+	m_stats.sr_delay_excess_us = static_cast<uint32_t>(std::min(2000.0, offset - m_sr_min_offset) * 1e6);
+	m_telemetry.publish(m_stats);
+
+	DEBUG(MSG_NET, "RTCP SR: ssrc %08x, packets %u, drift %.1f ppm, rtp clock %.0f Hz, offset %.3f ms (+%.3f ms)\n",
+		rd32(body), rd32(body + 16), drift_ppm, rtp_clock, offset * 1e3, (offset - m_sr_min_offset) * 1e3);
+}
+
+void satipRTP::handleReportBlocks(const unsigned char* blocks, int count, int size)
+{
+	for (; count > 0 && size >= 24; --count, blocks += 24, size -= 24)
+		DEBUG(MSG_NET, "RTCP RB: ssrc %08x, fraction lost %u/256, cumulative lost %u, jitter %u\n",
+			rd32(blocks), blocks[4], rd32(blocks + 4) & 0x00ffffff, rd32(blocks + 12));
+}
+
+void satipRTP::handleSdes(const unsigned char* body, int count, int size)
+{
+	const unsigned char* p = body;
+	const unsigned char* end = body + size;
+	for (; count > 0 && end - p >= 4; --count) {
+		const uint32_t ssrc = rd32(p);
+		p += 4;
+		while (p < end && *p != RTCP_SDES_END) {
+			if (end - p < 2 || end - p < 2 + p[1])
+				return;
+			if (*p == RTCP_SDES_CNAME)
+				DEBUG(MSG_NET, "RTCP SDES: ssrc %08x, cname %.*s\n", ssrc, p[1], reinterpret_cast<const char*>(p + 2));
+			p += 2 + p[1];
+		}
+		// the item list ends with a null octet and is padded to 32 bits
+		p = body + ((p - body) / 4 + 1) * 4;
+	}
+}
+
+void satipRTP::handleBye(const unsigned char* body, int count, int size)
+{
+	for (int i = 0; i < count && size >= (i + 1) * 4; ++i) {
+		if (!m_server_ssrc_valid || rd32(body + i * 4) == m_server_ssrc) {
+			serverRestart("BYE");
+			m_server_ssrc_valid = false;
+			return;
 		}
 	}
 }
 
-void satipRTP::rtcpData(unsigned char* a_buffer, int a_size)
+void satipRTP::handleApp(const unsigned char* body, int size)
 {
-	int done = 0;
-	uint32_t* buffer = reinterpret_cast<uint32_t*>(a_buffer);
-	uint32_t val;
+	if (size < 8)
+		return;
 
-	int pt;
-	int length;
+	DEBUG(MSG_DATA, "RTCP: app defined (204) name: %.4s\n", reinterpret_cast<const char*>(body + 4));
 
-	DEBUG(MSG_DATA,"RTCP DATA : %s\n", buffer);
+	// SAT>IP: identifier (16 bit), string length (16 bit), string
+	if (size >= 12 && memcmp(body + 4, "SES1", 4) == 0) {
+		const int length = std::min<int>(rd16(body + 10), size - 12);
+		if (length > 0) {
+			DEBUG(MSG_DATA, "RTCP APP string Payload : %.*s\n", length, reinterpret_cast<const char*>(body + 12));
+			parseRtcpAppPayload(reinterpret_cast<const char*>(body + 12), length);
+		}
+	}
+}
+
+// Walk a compound RTCP packet in place
+void satipRTP::rtcpData(const unsigned char* buffer, int size)
+{
+	checkStatsReset();
+	DEBUG(MSG_DATA, "RTCP DATA : %d bytes\n", size);
 
-	while(done < a_size)
+	const unsigned char* p = buffer;
+	const unsigned char* end = buffer + size;
+	while (end - p >= 4)
 	{
-		val = ntohl(*buffer);
-		pt = ( val & 0x00ff0000 ) >> 16 ;
-		length = val & 0x0000ffff;
+		const int version = p[0] >> 6;
+		const int count = p[0] & 0x1f;
+		const int pt = p[1];
+		const int length = (rd16(p + 2) + 1) * 4;
+
+		if (version != 2 || length > end - p) {
+			DEBUG_RL(MSG_NET, pt, "RTCP: malformed packet, version %d, PT %d, length %d of %d\n",
+				version, pt, length, static_cast<int>(end - p));
+			break;
+		}
+
+		int body_size = length - 4;
+		if ((p[0] & 0x20) && p[length - 1] <= body_size)
+			body_size -= p[length - 1]; // padding
+		const unsigned char* body = p + 4;
 
 		switch(pt)
 		{
-			case 204:
-				if (length > 1)
-				{
-					val = buffer[2];
-					DEBUG(MSG_DATA,"RTCP: app defined (204) name: %c%c%c%c\n",
-						val & 0x000000ff,
-						val >> 8 & 0x000000ff,
-						val >> 16 & 0x000000ff,
-						val >> 24 & 0x000000ff);
-
-					val = htonl(buffer[3]) & 0x0000ffff; // string_length
-					if (val > 0) {
-						const std::string payload(reinterpret_cast<char*>(&buffer[4]), val);
-						DEBUG(MSG_DATA, "RTCP APP string Payload : %s\n", payload.c_str());
-						parseRtcpAppPayload(payload.c_str());
-					}
-				}
+			case RTCP_SR:
+				handleSenderReport(body, body_size);
+				if (body_size >= 24)
+					handleReportBlocks(body + 24, count, body_size - 24);
+				break;
 
+			case RTCP_RR:
+				if (body_size >= 4)
+					handleReportBlocks(body + 4, count, body_size - 4);
+				break;
+
+			case RTCP_SDES:
+				handleSdes(body, count, body_size);
+				break;
+
+			case RTCP_BYE:
+				handleBye(body, count, body_size);
+				break;
+
+			case RTCP_APP:
+				handleApp(body, body_size);
 				break;
 
 			default:
@@ -238,78 +543,152 @@ void satipRTP::rtcpData(unsigned char* a_buffer, int a_size)
 				break;
 		}
 
-		buffer += length + 1;
-		done += (length + 1) * 4;
+		p += length;
 	}
 }
 
-int satipRTP::Write(int fd, unsigned char *buffer, int size)
+// The server restarted the stream: sequence numbers, continuity counters
+// and the clock mapping start over
+void satipRTP::serverRestart(const char* reason)
+{
+	INFO(MSG_NET, "RTP: server stream restarted (%s)\n", reason);
+	m_stats_pseq_valid = false;
+	memset(m_ts_cc, 0xff, sizeof(m_ts_cc));
+	m_sr_first.valid = false;
+	++m_stats.restarts;
+	m_telemetry.publish(m_stats);
+}
+
+void satipRTP::checkServerSsrc(uint32_t ssrc, const char* source)
+{
+	if (m_server_ssrc_valid && ssrc != m_server_ssrc)
+		serverRestart(source);
+	m_server_ssrc = ssrc;
+	m_server_ssrc_valid = true;
+}
+
+const unsigned char* satipRTP::checkRtpHeader(const unsigned char *buffer, int size)
 {
-	int count = 0;
 	// Check for begin of RTP Header, then get packet sequence number
-	if (buffer[0] == 0x80 && buffer[1] == 0x21) {
+	if (size >= 12 && buffer[0] == 0x80 && buffer[1] == 0x21) {
 		const uint16_t pseq = (buffer[2] << 8) + buffer[3];
+		const uint32_t ssrc = rd32(buffer + 8);
+		if (ssrc != m_server_ssrc || !m_server_ssrc_valid)
+			checkServerSsrc(ssrc, "SSRC change");
 		++m_rtp_pseq;
 		m_rtp_pseq %= 0x10000;
 		if (m_rtp_pseq != pseq) {
-			DEBUG(MSG_NET, "RTP/AVP Data Continuity error. expected: %d - packet: %d\n", m_rtp_pseq, pseq);
+			const uint16_t lost = pseq - m_rtp_pseq;
+			if (m_stats_pseq_valid && lost < 0x8000) {
+				m_stats.rtp_lost += lost;
+				m_stats.window_errors += lost * TS_PER_RTP;
+			}
+			DEBUG_RL(MSG_NET, pseq, "RTP/AVP Data Continuity error. expected: %d - packet: %d\n", m_rtp_pseq, pseq);
 			m_rtp_pseq = pseq;
 		}
-		count = 12;
+		m_stats_pseq_valid = true;
+		return buffer + 12;
 	}
-	while(count < size) {
-		const auto write_res = ::write(fd, buffer + count, size - count);
-		if (write_res == 0) {
-			return -1;
-		}
+	return buffer;
+}
 
-		if (write_res == -1) {
-			if (errno == EINTR)	{
-				DEBUG(MSG_MAIN, "WRITE : raise EINTR..continue.\n");
-				continue;
-			}
+int satipRTP::Write(const unsigned char *buffer, int size)
+{
+	checkStatsReset();
+	const unsigned char *payload = checkRtpHeader(buffer, size);
+	struct iovec iov;
+	iov.iov_base = const_cast<unsigned char *>(payload);
+	iov.iov_len = size - (payload - buffer);
+	return writeData(&iov, 1);
+}
 
-			perror("RTP Read.");
-			return write_res;
+// Copy the TS packets with a selected PID to m_filter_buf, returns the size
+int satipRTP::filterData(const struct iovec *iov, int iovcnt)
+{
+	unsigned char *out = m_filter_buf.get();
+	int len = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		const unsigned char *ts = static_cast<const unsigned char *>(iov[i].iov_base);
+		size_t size = iov[i].iov_len;
+		for (; size >= TS_PACKET_SIZE && len + TS_PACKET_SIZE <= FILTER_BUFFER_SIZE;
+				ts += TS_PACKET_SIZE, size -= TS_PACKET_SIZE) {
+			const int pid = ((ts[1] & 0x1f) << 8) | ts[2];
+			if (m_pid_filter->test(pid)) {
+				memcpy(out + len, ts, TS_PACKET_SIZE);
+				len += TS_PACKET_SIZE;
+			}
 		}
-
-		count += write_res;
 	}
-	return count;
+	return len;
 }
 
-ssize_t satipRTP::Read(int fd, unsigned char *buffer, int size)
+int satipRTP::writeData(struct iovec *iov, int iovcnt)
 {
-	ssize_t recv_res;
-	while(1)
-	{
-		recv_res = recv(fd, buffer, size, 0);
-		if (recv_res == -1)
-		{
-			if (errno == EINTR)
-			{
-				DEBUG(MSG_MAIN, "READ : raise EINTR..continue.\n");
-				continue;
-			}
+	scanTsPackets(iov, iovcnt);
+
+	// guests always filter into their own buffer, iov stays untouched
+	if (m_has_guests.load(std::memory_order_acquire)) {
+		pthread_mutex_lock(&m_guest_lock);
+		for (satipRTP* guest : m_guests)
+			guest->deliver(iov, iovcnt);
+		pthread_mutex_unlock(&m_guest_lock);
+	}
 
-			perror("RTP Read.");
-			return recv_res;
-		}
+	// leftovers of our own stream while we get the owner's
+	if (m_share_source.load(std::memory_order_relaxed))
+		return 0;
 
-		break; /* one read */
+	return deliver(iov, iovcnt);
+}
+
+// PID filter and output, from our own data path or the owner's
+int satipRTP::deliver(struct iovec *iov, int iovcnt)
+{
+	pthread_mutex_lock(&m_write_lock);
+	struct iovec filtered;
+	if (m_pid_filter && m_pid_filter->isEnabled()) {
+		filtered.iov_base = m_filter_buf.get();
+		filtered.iov_len = filterData(iov, iovcnt);
+		if (filtered.iov_len == 0) {
+			pthread_mutex_unlock(&m_write_lock);
+			return 0;
+		}
+		iov = &filtered;
+		iovcnt = 1;
 	}
 
-	return recv_res;
+	int count;
+	if (m_pacer) {
+		if (m_pid_filter && m_pid_filter->changes() != m_pid_changes) {
+			m_pid_changes = m_pid_filter->changes();
+			m_pacer->reset();
+		}
+		count = m_pacer->push(iov, iovcnt);
+	} else {
+		// before the write, it may modify the iovec array
+		[[maybe_unused]] const size_t bytes = iovBytes(iov, iovcnt);
+		count = m_output->write(iov, iovcnt);
+		TRACE_PACKET_WRITTEN(bytes, count);
+	}
+	pthread_mutex_unlock(&m_write_lock);
+	return count;
 }
 
-
 void* satipRTP::rtpDump()
 {
-	unsigned char rx_data[BUFFER_SIZE];
+	threadRoleScope role(THREAD_ROLE_RTP, "satip-rtp");
+	unsigned char rx_data[RTP_BATCH][BUFFER_SIZE];
+	struct iovec rx_iov[RTP_BATCH];
+	struct mmsghdr rx_msgs[RTP_BATCH];
 	struct pollfd pollfds[2];
 
-	int rx_bytes;
-	int wr_bytes;
+	memset(rx_msgs, 0, sizeof(rx_msgs));
+	for (int i = 0; i < RTP_BATCH; ++i) {
+		rx_iov[i].iov_base = rx_data[i];
+		rx_iov[i].iov_len = BUFFER_SIZE;
+		rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+		rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
 	pollfds[0].fd = m_rtp_socket;
 	pollfds[0].events = POLLIN;
@@ -330,22 +709,19 @@ void* satipRTP::rtpDump()
 
 		if (pollfds[0].revents & POLLIN)
 		{
-			rx_bytes = Read(pollfds[0].fd, rx_data, sizeof(rx_data));
-
-			if (rx_bytes > 12 && rx_data[12] == 0x47)  {
-				wr_bytes = Write(m_vtuner_fd, &rx_data[0], rx_bytes);
-				DEBUG(MSG_DATA, "RTP DATA : read %d bytes, write %d bytes\n", rx_bytes, wr_bytes);
-			}
+			// Read all queued datagrams and write their payload at once
+			const int count = recvmmsg(pollfds[0].fd, rx_msgs, RTP_BATCH, MSG_DONTWAIT, NULL);
+			if (count == -1 && errno != EINTR && errno != EAGAIN)
+				perror("RTP Read.");
+			if (count > 0)
+				rtpUdpData(rx_msgs, count);
 		}
 
 		if (pollfds[1].revents & POLLIN)
 		{
-			rx_bytes = recv(pollfds[1].fd, rx_data, sizeof(rx_data), 0);
+			const int rx_bytes = recv(pollfds[1].fd, rx_data[0], sizeof(rx_data[0]), 0);
 			if (rx_bytes > 0)
-			{
-				DEBUG(MSG_DATA,"RTCP DATA : read %d bytes\n", rx_bytes);
-				rtcpData(rx_data, rx_bytes);
-			}
+				rtcpUdpData(rx_data[0], rx_bytes);
 		}
 
 	}
@@ -353,16 +729,55 @@ void* satipRTP::rtpDump()
 	return 0;
 }
 
-void satipRTP::rtpTcpData(unsigned char *data, int size)
+// At most RTP_BATCH datagrams
+void satipRTP::rtpUdpData(const struct mmsghdr *msgs, int count)
+{
+	struct iovec wr_iov[RTP_BATCH];
+	const uint64_t capture_time = m_capture ? m_capture->now() : 0;
+
+	checkStatsReset();
+	int wr_count = 0;
+	int rx_bytes = 0;
+	for (int i = 0; i < count; ++i) {
+		const unsigned char *data = static_cast<const unsigned char *>(msgs[i].msg_hdr.msg_iov->iov_base);
+		const int len = msgs[i].msg_len;
+		TRACE_PACKET_RECEIVED(len, 0);
+		if (m_capture)
+			m_capture->add(CAPTURE_RTP, 0, capture_time, data, len);
+		if (len > 12 && data[12] == 0x47) {
+			const unsigned char *payload = checkRtpHeader(data, len);
+			wr_iov[wr_count].iov_base = const_cast<unsigned char *>(payload);
+			wr_iov[wr_count].iov_len = len - (payload - data);
+			++wr_count;
+			rx_bytes += len;
+		}
+	}
+	if (wr_count > 0) {
+		const int wr_bytes = writeData(wr_iov, wr_count);
+		DEBUG(MSG_DATA, "RTP DATA : read %d bytes (%d datagrams), write %d bytes\n", rx_bytes, count, wr_bytes);
+	}
+}
+
+void satipRTP::rtcpUdpData(const unsigned char *data, int size)
+{
+	if (m_capture)
+		m_capture->add(CAPTURE_RTCP, 0, m_capture->now(), data, size);
+	DEBUG(MSG_DATA,"RTCP DATA : read %d bytes\n", size);
+	rtcpData(data, size);
+}
+
+void satipRTP::rtpTcpData(const unsigned char *data, int size)
 {
-	if (size <= 4 + 12)	{
+	TRACE_PACKET_RECEIVED(size, 1);
+	if (size <= 4 + 4)	{
 		return;
 	}
 
-	if (data[1] == 0) {
-		const int wr = Write(m_vtuner_fd, data + 4, size - 4);
+	// even channel RTP, odd channel RTCP, whatever pair the session has
+	if ((data[1] & 1) == 0 && size > 4 + 12) {
+		const int wr = Write(data + 4, size - 4);
 		DEBUG(MSG_DATA, "RTP TCP DATA : read %d bytes, write %d bytes\n", size - 4, wr);
-	} else if (data[1] == 1) {
+	} else if (data[1] & 1) {
 		rtcpData(data + 4, size - 4);
 		DEBUG(MSG_DATA, "RTCP TCP DATA : read %d bytes\n", size - 4);
 	}
@@ -376,6 +791,8 @@ void *satipRTP::thread_wrapper(void *ptr)
 void satipRTP::run()
 {
 	m_running = true;
+	if (m_pacer)
+		m_pacer->run();
 	if (!m_tcp_data)
 		pthread_create( &m_thread, NULL, thread_wrapper, this);
 }
@@ -396,5 +813,7 @@ void satipRTP::stop()
 		DEBUG(MSG_MAIN,"RTP thread END.\n");
 		m_thread = 0;
 	}
+	if (m_pacer)
+		m_pacer->stop();
 }
 
@@ -20,13 +20,31 @@
 #ifndef _SATIP_RTP_H
 #define _SATIP_RTP_H
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <vector>
 
 #include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "capture.h"
+#include "option.h"
+#include "output.h"
+#include "recorder.h"
+#include "httpstream.h"
+#include "pacer.h"
+#include "pidset.h"
+#include "telemetry.h"
 
 class satipRTP
 {
-	int m_vtuner_fd;;
+	friend class satipMicroBench; // bench/bench_micro.cpp
+
+	std::unique_ptr<outputSink> m_output;
+	std::unique_ptr<packetCapture> m_capture; // capture:<path>
 	int m_rtp_port;
 	int m_rtp_socket;
 	int m_rtcp_port;
@@ -37,24 +55,70 @@ class satipRTP
 	int m_rtp_net_buffer_size_mb;
 	uint16_t m_rtp_pseq;
 
-	/* rtcp data */
-	bool m_hasLock;
-	int m_signalStrength;
-	int m_signalQuality;
+	/* client side PID selection (pids=all mode) */
+	const pidFilter* m_pid_filter;
+	std::unique_ptr<unsigned char[]> m_filter_buf;
+
+	/* PCR paced output, optional */
+	std::unique_ptr<satipPacer> m_pacer;
+	unsigned int m_pid_changes; // of m_pid_filter, the pacer is reset on a new PID set
+
+	/* transponder sharing: the owner writes its TS to the guests too */
+	pthread_mutex_t m_write_lock; // output path, used by the owner while we are a guest
+	pthread_mutex_t m_guest_lock;
+	std::vector<satipRTP*> m_guests;
+	std::atomic<bool> m_has_guests;
+	std::atomic<const satipRTP*> m_share_source; // owner while we are a guest
+
+	/* frontend telemetry, m_stats is owned by the thread receiving the data */
+	telemetrySeqlock m_telemetry;
+	frontendTelemetry m_stats;
+	std::atomic<bool> m_stats_reset;
+	bool m_stats_pseq_valid;
+	struct timespec m_window_start;
+	uint8_t m_ts_cc[pidSet::PID_COUNT]; // last continuity counter, 0xff unknown
 
-	void parseRtcpAppPayload(const char* buffer);
-	void rtcpData(unsigned char* buffer, int rx);
+	void checkStatsReset();
+	void scanTsPackets(const struct iovec *iov, int iovcnt);
+
+	/* server stream and clock, from RTP and RTCP sender reports */
+	struct rtcpClockMapping
+	{
+		bool valid;
+		uint64_t ntp;
+		uint32_t rtp_ts;
+		struct timespec local; // CLOCK_MONOTONIC at receive
+	};
+	uint32_t m_server_ssrc;
+	bool m_server_ssrc_valid;
+	rtcpClockMapping m_sr_first;
+	double m_sr_min_offset;
+	unsigned int m_rtcp_app_count;
+
+	void parseRtcpAppPayload(const char* buffer, int size);
+	void handleSenderReport(const unsigned char* body, int size);
+	void handleReportBlocks(const unsigned char* blocks, int count, int size);
+	void handleSdes(const unsigned char* body, int count, int size);
+	void handleBye(const unsigned char* body, int count, int size);
+	void handleApp(const unsigned char* body, int size);
+	void rtcpData(const unsigned char* buffer, int size);
+	void serverRestart(const char* reason);
+	void checkServerSsrc(uint32_t ssrc, const char* source);
 	void* rtpDump();
 	static void *thread_wrapper(void *ptr);
 	
 	bool m_openok;
 	int openRTP();
+	void setNetBuffer(int sock);
 
-	int Write(int fd, unsigned char *buffer, int size);
-	ssize_t Read(int fd, unsigned char *buffer, int size);
+	int Write(const unsigned char *buffer, int size);
+	const unsigned char* checkRtpHeader(const unsigned char *buffer, int size);
+	int writeData(struct iovec *iov, int iovcnt);
+	int deliver(struct iovec *iov, int iovcnt);
+	int filterData(const struct iovec *iov, int iovcnt);
 
 public:
-	satipRTP(int vtuner_fd, bool tcp_data, int rtp_net_buffer_size_mb);
+	satipRTP(int vtuner_fd, const vtunerOpt* settings, const pidFilter* pid_filter);
 	virtual ~satipRTP();
 	void unset();
 	int get_rtp_port() { return m_rtp_port; }
@@ -62,13 +126,30 @@ public:
 	int get_rtcp_port() { return m_rtcp_port; }
 	int get_rtcp_socket() { return m_rtcp_socket; }
 	bool isOpened() { return m_openok; }
-	void rtpTcpData(unsigned char *data, int size);
+	void resizeNetBuffer(int size_mb);
+	static constexpr int RTP_BATCH = 32; // datagrams per recvmmsg()
+	static constexpr int TS_PER_RTP = 7; // TS packets assumed per lost RTP packet
+
+	/* what arrives from the server: datagrams of one receive, RTCP, an interleaved frame */
+	void rtpUdpData(const struct mmsghdr *msgs, int count);
+	void rtcpUdpData(const unsigned char *data, int size);
+	void rtpTcpData(const unsigned char *data, int size);
+	packetCapture* getCapture() { return m_capture.get(); }
+	// by the thread receiving the data, publish now rather than at the end of the window
+	void publishTelemetry() { m_telemetry.publish(m_stats); }
 	void run();
 	void stop();
 
-	int getHasLock() { return m_hasLock; }
-	int getSignalStrength() { return m_signalStrength; }
-	int getSignalQuality() { return m_signalQuality; }
+	void addGuest(satipRTP* guest);
+	void removeGuest(satipRTP* guest);
+	void setShareSource(const satipRTP* owner) { m_share_source.store(owner, std::memory_order_release); }
+
+	// a guest reports the frontend of its owner
+	frontendTelemetry getTelemetry() const
+	{
+		const satipRTP* owner = m_share_source.load(std::memory_order_acquire);
+		return (owner ? owner : this)->m_telemetry.read();
+	}
 };
 
 #endif
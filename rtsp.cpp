@@ -22,27 +22,71 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 #include <poll.h>
 
-#include <sstream> // std::ostringstream
+#include <charconv>
+#include <algorithm>
 #include <cstring>
 #include <string>
 #include <string_view>
 
+#include "capture.h"
 #include "config.h"
 #include "rtsp.h"
+#include "serverpool.h"
+#include "coordinator.h"
+#include "sharing.h"
 #include "timer.h"
 #include "log.h"
+#include "trace.h"
 
 static const std::string user_agent("satip-client");
 
-static std::string_view findRTSPResponse(
+#define ZEROCOPY_MAP_SIZE (1024 * 1024) /* multiple of page size */
+
+// Position of the value of header 'name' in an RTSP message
+bool satipRTSP::findHeader(const std::string_view msg, const std::string_view name, size_t& pos, size_t& len) {
+	size_t line = 0;
+	while (line < msg.size()) {
+		size_t end = msg.find("\r\n", line);
+		if (end == std::string_view::npos) {
+			end = msg.size();
+		}
+		if (end == line) {
+			break; // end of the headers
+		}
+		if (end - line > name.size() && msg[line + name.size()] == ':' &&
+				strncasecmp(msg.data() + line, name.data(), name.size()) == 0) {
+			pos = line + name.size() + 1;
+			while (pos < end && msg[pos] == ' ') {
+				++pos;
+			}
+			len = end - pos;
+			return true;
+		}
+		line = end + 2;
+	}
+	return false;
+}
+
+std::string_view satipRTSP::headerValue(const std::string_view msg, const std::string_view name) {
+	size_t pos, len;
+	if (!findHeader(msg, name, pos, len)) {
+		return "";
+	}
+	return msg.substr(pos, len);
+}
+
+std::string_view satipRTSP::findRTSPResponse(
 		const std::string_view msg,
 		std::string_view::size_type& begin) {
 	begin = msg.find("RTSP/", 0);
@@ -53,42 +97,59 @@ static std::string_view findRTSPResponse(
 	if (end == std::string::npos) {
 		return "";
 	}
-	return msg.substr(begin, end - begin + 4);
+	// with the body (SDP of DESCRIBE), once it is complete
+	std::string::size_type length = 0;
+	const std::string_view value = headerValue(msg.substr(begin, end - begin), "Content-Length");
+	if (!value.empty()) {
+		std::from_chars(value.data(), value.data() + value.size(), length);
+		if (msg.size() < end + 4 + length) {
+			return "";
+		}
+	}
+	return msg.substr(begin, end - begin + 4 + length);
 }
 
-static std::string findParameter(
-		const std::string& msg,
-		const std::string& param,
+// The value in 'msg', which it points into
+std::string_view satipRTSP::findParameter(
+		const std::string_view msg,
+		const std::string_view param,
 		const char sep) {
-	std::string::size_type p = 0;
-	std::string::size_type e = 0;
+	std::string_view::size_type p = 0;
+	std::string_view::size_type e = 0;
 
 	// get requested param
 	p = msg.find(param, 0);
-	if (p == std::string::npos) {
+	if (p == std::string_view::npos) {
 		return "";
 	}
 	// find requested seperator
 	p = msg.find_first_of(sep, p);
-	if (p == std::string::npos) {
+	if (p == std::string_view::npos) {
 		return "";
 	}
 	// find end
 	e = msg.find_first_of(";\r", p + 1);
-	if (e == std::string::npos) {
+	if (e == std::string_view::npos) {
 		return "";
 	}
-	std::string value = msg.substr(p + 1, e - p - 1);
+	std::string_view value = msg.substr(p + 1, e - p - 1);
 	// Remove leading and trailing spaces
-	while (value[0] == ' ') {
-		value.erase(0, 1);
+	while (!value.empty() && value.front() == ' ') {
+		value.remove_prefix(1);
 	}
-	while (value.back() == ' ') {
-		value.pop_back();
+	while (!value.empty() && value.back() == ' ') {
+		value.remove_suffix(1);
 	}
 	return value;
 }
 
+// -1 if 'value' does not start with a number
+int satipRTSP::parseNumber(const std::string_view value) {
+	int number = -1;
+	std::from_chars(value.data(), value.data() + value.size(), number);
+	return number;
+}
+
 satipRTSP::satipRTSP(satipConfig* satip_config,
 	const char* host,
 	const char* rtsp_port,
@@ -97,16 +158,33 @@ satipRTSP::satipRTSP(satipConfig* satip_config,
 		m_port(rtsp_port),
 		m_rtp(rtp),
 		m_satip_config(satip_config),
+		m_satip_timer(RTSP_TIMER_COUNT),
 		m_timer_reset_connect(NULL),
 		m_timer_keep_alive(NULL),
+		m_tx_data(RTSP_TX_DATA_SIZE),
 		m_fd(-1),
+		m_mux(nullptr),
+		m_mux_id(0),
+		m_interleaved(0),
 		m_rx_data_wpos(0),
+		m_zc_addr(nullptr),
+		m_zc_len(0),
+		m_zc_mapped_bytes(0),
+		m_zc_copied_bytes(0),
 		m_rtsp_status(RTSP_STATUS_CONFIG_WAITING),
 		m_rtsp_request(RTSP_REQUEST_NONE),
 		m_wait_response(false),
-		m_channel_changed(false)
+		m_channel_changed(false),
+		m_placed(false),
+		m_reserved{-1, 0, 0, 0},
+		m_reserve_retry(false)
 {
-	if (satip_config->isTcpData()) {
+	if (satip_config->isTcpShared()) {
+		// the data goes from the shared connection to m_rtp, we only get responses
+		DEBUG(MSG_MAIN,"Create RTSP. (host : %s, port : %s, shared TCP connection)\n", m_host.c_str(), m_port.c_str());
+		m_mux = rtspMuxPool::getInstance()->get(m_host, m_port);
+		m_rx_data_len = 16*1024;
+	} else if (satip_config->isTcpData()) {
 		DEBUG(MSG_MAIN,"Create RTSP. (host : %s, port : %s, TCP data mode)\n", m_host.c_str(), m_port.c_str());
 		m_rx_data_len = 256*1024;
 	} else {
@@ -114,18 +192,98 @@ satipRTSP::satipRTSP(satipConfig* satip_config,
 		m_rx_data_len = 2048;
 	}
 	m_rx_data = std::make_unique<char[]>(m_rx_data_len);
+	m_rtsp_session_id.reserve(RTSP_SESSION_ID_SIZE);
 
 	m_timer_reset_connect = m_satip_timer.create(timeoutConnect, static_cast<void *>(this), "reset connect");
 	m_timer_keep_alive = m_satip_timer.create(timeoutKeepAlive, static_cast<void *>(this), "keep alive message");
+	m_timer_reserve = m_satip_timer.create(timeoutReserve, static_cast<void *>(this), "frontend reservation");
 
 	resetConnect();
 }
 
-satipRTSP::~satipRTSP() = default;
+satipRTSP::~satipRTSP()
+{
+	// the server frees the frontend now, not at the session timeout
+	if (m_fd != -1 && m_rtsp_stream_id != -1 && !m_rtsp_session_id.empty())
+		sendTearDown();
+	resetConnect();
+	transponderRegistry::getInstance()->detach(m_satip_config);
+}
+
+std::string satipRTSP::shareKey()
+{
+	std::string servers;
+	for (const std::string& server : m_satip_config->getServers())
+		servers += server + "|";
+	if (servers.empty())
+		servers = m_host;
+	return servers + ":" + m_port + "/" + m_satip_config->getTuningKey();
+}
+
+// Pick the server of the pool for the new tuning
+void satipRTSP::placeSession()
+{
+	if (m_placed)
+		serverPool::getInstance()->release(m_host, m_port);
+	m_placed = false;
+	if (!m_satip_config->isServerPool())
+		return;
+
+	m_host = serverPool::getInstance()->place(m_satip_config->getServers(), m_port, m_satip_config->getTransponder());
+	m_placed = true;
+	if (m_satip_config->isTcpShared())
+		m_mux = rtspMuxPool::getInstance()->get(m_host, m_port);
+}
+
+// Take the TS of a session already streaming the new tuning
+bool satipRTSP::attachShared()
+{
+	if (!m_satip_config->isShareTransponder())
+		return false;
+
+	m_satip_config->setShared(true);
+	if (!transponderRegistry::getInstance()->attach(shareKey(), m_satip_config, m_rtp,
+			m_satip_config->commitSharedPids())) {
+		m_satip_config->setShared(false);
+		return false;
+	}
+	m_satip_config->setChannelStable();
+	m_rtp->unset();
+	return true;
+}
+
+// Let sessions with the same tuning use our stream
+void satipRTSP::claimShared()
+{
+	if (!m_satip_config->isShareTransponder())
+		return;
+
+	const std::string key = shareKey();
+	if (key == m_share_key)
+		return;
+	releaseShared();
+	if (transponderRegistry::getInstance()->claim(key, m_satip_config, m_rtp))
+		m_share_key = key;
+}
+
+void satipRTSP::releaseShared()
+{
+	if (m_share_key.empty())
+		return;
+	transponderRegistry::getInstance()->release(m_satip_config);
+	m_share_key.clear();
+}
 
 void satipRTSP::resetConnect()
 {
 	DEBUG(MSG_MAIN, "resetConnect\n");
+	if (m_placed)
+	{
+		if (m_rtsp_status == RTSP_STATUS_SERVER_CONNECTING)
+			serverPool::getInstance()->reportUnreachable(m_host, m_port);
+		serverPool::getInstance()->release(m_host, m_port);
+		m_placed = false;
+	}
 	m_rtsp_status = RTSP_STATUS_CONFIG_WAITING;
 	m_rtsp_request = RTSP_REQUEST_NONE;
 	m_rtsp_cseq = 1;
@@ -138,6 +296,20 @@ void satipRTSP::resetConnect()
 	m_wait_response = false;
 	m_channel_changed = false;
 
+	satipCoordinator::getInstance()->release(this);
+	m_timer_reserve->stop();
+	m_reserve_retry = false;
+
+	releaseShared();
+	closeZeroCopy();
+
+	if (m_mux_id)
+	{
+		m_mux->detach(m_mux_id);
+		m_mux_id = 0;
+		m_interleaved = 0;
+	}
+
 	if (m_fd != -1)
 	{
 		close(m_fd);
@@ -155,6 +327,60 @@ void satipRTSP::timeoutConnect(void *ptr)
 	_this->resetConnect();
 }
 
+void satipRTSP::timeoutReserve(void *ptr)
+{
+	DEBUG(MSG_MAIN, "timeoutReserve\n");
+	satipRTSP* _this = static_cast<satipRTSP*>(ptr);
+	_this->handleReserved();
+}
+
+// RESERVE_WAIT_MS after the reservation, or RESERVE_RETRY_MS after losing one
+void satipRTSP::handleReserved()
+{
+	if (m_reserve_retry)
+	{
+		m_reserve_retry = false;
+		m_rtsp_status = RTSP_STATUS_CONFIG_WAITING; // place and reserve again
+		return;
+	}
+
+	if (m_satip_config->getChannelStatus() != CONFIG_STATUS_CHANNEL_CHANGED ||
+		!(m_satip_config->getTransponder() == m_reserved))
+	{
+		// tuned elsewhere meanwhile
+		resetConnect();
+		return;
+	}
+
+	if (satipCoordinator::getInstance()->confirm(this))
+	{
+		startSession();
+		return;
+	}
+
+	// another instance takes the last frontend
+	resetConnect();
+	m_rtsp_status = RTSP_STATUS_RESERVING;
+	m_reserve_retry = true;
+	m_timer_reserve->start(satipCoordinator::RESERVE_RETRY_MS, true);
+}
+
+void satipRTSP::startSession()
+{
+	if (connectToServer() == RTSP_OK)
+	{
+		m_rtsp_status = RTSP_STATUS_SERVER_CONNECTING;
+		startTimerResetConnect(5000);
+	}
+	else
+	{
+		DEBUG(MSG_MAIN, "Connect to server failed!\n");
+		if (m_placed)
+			serverPool::getInstance()->reportUnreachable(m_host, m_port);
+		m_rtsp_status = RTSP_STATUS_CONFIG_WAITING;
+	}
+}
+
 void satipRTSP::timeoutKeepAlive(void *ptr)
 {
 	DEBUG(MSG_MAIN, "timeoutKeepAlive\n");
@@ -169,6 +395,27 @@ void satipRTSP::timeoutStreamInfo(void *ptr)
 	_this->sendRequest(RTSP_REQUEST_DESCRIBE);
 }
 
+void satipRTSP::setNetBuffer(int fd)
+{
+	int len = m_satip_config->getRtpNetBufferSizeMB() * 1024 * 1024;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &len, sizeof(len)))
+		WARN(MSG_MAIN, "unable to set TCP buffer (force) size to %d\n", len);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len)))
+		WARN(MSG_MAIN, "unable to set TCP buffer size to %d\n", len);
+
+	socklen_t sl = sizeof(int);
+	if (!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &len, &sl))
+		DEBUG(MSG_DATA, "TCP buffer size is %d bytes\n", len);
+}
+
+// Config reload. A shared connection keeps its size until it is reopened.
+void satipRTSP::resizeNetBuffer()
+{
+	if (m_satip_config->isTcpData() && !m_mux && m_fd != -1)
+		setNetBuffer(m_fd);
+}
+
 int satipRTSP::connectToServer()
 {
 	int fd;
@@ -178,6 +425,13 @@ int satipRTSP::connectToServer()
 	struct addrinfo *result;
 	struct addrinfo *rp;
 
+	if (m_mux)
+	{
+		m_fd = m_mux->attach(m_rtp, m_satip_config->getRtpNetBufferSizeMB() * 1024 * 1024,
+			m_satip_config->getTcpDataTimeout(), m_interleaved, m_mux_id);
+		return m_fd == -1 ? RTSP_ERROR : RTSP_OK;
+	}
+
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC;    /* IPv4 or IPv6 */
 	hints.ai_socktype = SOCK_STREAM; 
@@ -229,24 +483,148 @@ int satipRTSP::connectToServer()
 		return RTSP_ERROR;
 	}
 
-	if (m_satip_config->isTcpData()) {
-		int len = m_satip_config->getRtpNetBufferSizeMB() * 1024 * 1024;
-		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &len, sizeof(len)))
-			WARN(MSG_MAIN, "unable to set TCP buffer (force) size to %d\n", len);
+	if (m_satip_config->isTcpData())
+		setNetBuffer(fd);
 
-		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len)))
-			WARN(MSG_MAIN, "unable to set TCP buffer size to %d\n", len);
+	freeaddrinfo(result);
+
+	m_fd = fd;
 
-		socklen_t sl = sizeof(int);
-		if (!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &len, &sl))
-			DEBUG(MSG_DATA, "TCP buffer size is %d bytes\n", len);
+	if (m_satip_config->isTcpZeroCopy()) {
+		openZeroCopy();
 	}
 
-	freeaddrinfo(result);
+	return RTSP_OK;
+}
 
-	m_fd = fd;
+void satipRTSP::openZeroCopy()
+{
+#ifdef TCP_ZEROCOPY_RECEIVE
+	void *addr = mmap(NULL, ZEROCOPY_MAP_SIZE, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (addr == MAP_FAILED) {
+		WARN(MSG_NET, "TCP zero-copy receive not available (%s), using recv()\n", strerror(errno));
+		return;
+	}
+	m_zc_addr = addr;
+	m_zc_len = ZEROCOPY_MAP_SIZE;
+	m_zc_mapped_bytes = 0;
+	m_zc_copied_bytes = 0;
+	DEBUG(MSG_NET, "TCP zero-copy receive enabled (%zu bytes mapping)\n", m_zc_len);
+#else
+	WARN(MSG_NET, "TCP zero-copy receive not supported by this build, using recv()\n");
+#endif
+}
+
+void satipRTSP::closeZeroCopy()
+{
+	if (m_zc_addr == nullptr) {
+		return;
+	}
+	INFO(MSG_NET, "TCP zero-copy receive: %llu bytes mapped, %llu bytes copied\n",
+		m_zc_mapped_bytes, m_zc_copied_bytes);
+	munmap(m_zc_addr, m_zc_len);
+	m_zc_addr = nullptr;
+	m_zc_len = 0;
+}
+
+int satipRTSP::handleZeroCopyData()
+{
+#ifdef TCP_ZEROCOPY_RECEIVE
+	// What is mapped is taken off the socket. Map no more than the copy
+	// buffer can take, so what is not parsed in place is never dropped;
+	// with less than a page free recv() fills the buffer instead.
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	const size_t map_len = std::min(m_zc_len,
+		static_cast<size_t>(m_rx_data_len - m_rx_data_wpos) / page_size * page_size);
+	if (map_len == 0) {
+		return RTSP_FAILED;
+	}
+
+	struct tcp_zerocopy_receive zc;
+	memset(&zc, 0, sizeof(zc));
+	zc.address = reinterpret_cast<uintptr_t>(m_zc_addr);
+	zc.length = map_len;
+	socklen_t zc_len = sizeof(zc);
+
+	if (getsockopt(m_fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zc_len) == -1) {
+		WARN(MSG_NET, "TCP_ZEROCOPY_RECEIVE failed (%s), falling back to recv()\n", strerror(errno));
+		closeZeroCopy();
+		return RTSP_FAILED;
+	}
 
+	// Nothing mapped and nothing to skip: let recv() handle it (EOF)
+	if (zc.length == 0 && zc.recv_skip_hint == 0) {
+		return RTSP_FAILED;
+	}
+
+	const unsigned char *data = static_cast<const unsigned char *>(m_zc_addr);
+	size_t size = zc.length;
+	m_zc_mapped_bytes += size;
+	if (packetCapture* capture = m_rtp->getCapture())
+		capture->addStream(CAPTURE_TCP_RX, capture->now(), data, size);
+
+	// Complete a frame that started in the copy buffer, it has room for all
+	// that was mapped. Anything but a frame there is appended below and
+	// handleInterleavedData() skips to the next frame.
+	while (size > 0 && m_rx_data_wpos > 0) {
+		const auto *hdr = reinterpret_cast<const unsigned char *>(m_rx_data.get());
+		if (m_rx_data_wpos > 4 && !isInterleavedFrame(hdr)) {
+			break;
+		}
+		size_t missing = 4 - std::min(m_rx_data_wpos, 4);
+		if (missing == 0) {
+			const size_t frame = 4 + ((hdr[2] << 8) + hdr[3]);
+			missing = frame > static_cast<size_t>(m_rx_data_wpos) ? frame - m_rx_data_wpos : 0;
+		}
+		missing = std::min(missing, size);
+		if (missing == 0) {
+			break;
+		}
+		memcpy(m_rx_data.get() + m_rx_data_wpos, data, missing);
+		m_rx_data_wpos += missing;
+		m_zc_copied_bytes += missing;
+		data += missing;
+		size -= missing;
+		handleInterleavedData();
+	}
+
+	// Parse whole frames directly from the mapped pages
+	if (m_rx_data_wpos == 0 && size > 0) {
+		const size_t done = extractInterleavedData(data, size);
+		if (done > 0) {
+			startTimerResetConnect(4000);
+		}
+		data += done;
+		size -= done;
+	}
+
+	// Partial or misaligned data is kept in the copy buffer
+	if (size > 0) {
+		memcpy(m_rx_data.get() + m_rx_data_wpos, data, size);
+		m_rx_data_wpos += size;
+		m_zc_copied_bytes += size;
+		handleInterleavedData();
+	}
+
+	// Bytes the kernel could not map (not page aligned) are read as usual
+	if (zc.recv_skip_hint > 0) {
+		const size_t availableSize = std::min(static_cast<size_t>(zc.recv_skip_hint),
+			static_cast<size_t>(m_rx_data_len - m_rx_data_wpos));
+		const ssize_t read_data = recv(m_fd, m_rx_data.get() + m_rx_data_wpos, availableSize, 0);
+		if (read_data == -1) {
+			DEBUG(MSG_NET,"RTSP recv: %d\n", read_data);
+			return RTSP_ERROR;
+		}
+		if (packetCapture* capture = m_rtp->getCapture())
+			capture->addStream(CAPTURE_TCP_RX, capture->now(), m_rx_data.get() + m_rx_data_wpos, read_data);
+		m_rx_data_wpos += read_data;
+		m_zc_copied_bytes += read_data;
+		handleInterleavedData();
+	}
 	return RTSP_OK;
+#else
+	return RTSP_FAILED;
+#endif
 }
 
 int satipRTSP::handleResponse()
@@ -255,6 +633,16 @@ int satipRTSP::handleResponse()
 	const size_t availableSize = m_rx_data_len - m_rx_data_wpos;
 	int res = RTSP_ERROR;
 
+	// In TCP data mode with only stream data expected, map it instead of copying
+	if (m_zc_addr != nullptr && !m_wait_response && !m_channel_changed &&
+	    (m_rx_data_wpos == 0 || m_rx_data[0] == '$')) {
+		res = handleZeroCopyData();
+		if (res != RTSP_FAILED) {
+			return res;
+		}
+		res = RTSP_ERROR;
+	}
+
 	if (availableSize > 0) {
 		if (overrun) {
 			DEBUG(MSG_NET,"RTSP Recovered from buffer overrun: len %d  wpos %d\n", m_rx_data_len, m_rx_data_wpos);
@@ -265,6 +653,8 @@ int satipRTSP::handleResponse()
 			DEBUG(MSG_NET,"RTSP recv: %d\n", read_data);
 			return RTSP_ERROR;
 		}
+		if (packetCapture* capture = m_rtp->getCapture())
+			capture->addStream(CAPTURE_TCP_RX, capture->now(), m_rx_data.get() + m_rx_data_wpos, read_data);
 		m_rx_data_wpos += read_data;
 	} else if (!overrun) {
 		DEBUG(MSG_NET,"RTSP buffer overrun: len %d  wpos %d\n", m_rx_data_len, m_rx_data_wpos);
@@ -275,19 +665,15 @@ int satipRTSP::handleResponse()
 	if (m_wait_response) {
 		std::string_view::size_type begin = 0;
 		std::string_view msg(m_rx_data.get(), m_rx_data_wpos);
-		const std::string_view response_view = findRTSPResponse(msg, begin);
-		if (!response_view.empty()) {
-			const std::string response(response_view.data(), response_view.size());
-			DEBUG(MSG_NET,"RTSP rx data: \n%s\n", response.c_str());
-			if (m_satip_config->isTcpData()) {
-				// Cut away RTSP response from embedded data
-				char *beginPtr = m_rx_data.get() + begin;
-				std::memmove(beginPtr, beginPtr + response.size(), m_rx_data_wpos - response.size());
-				m_rx_data_wpos -= response.size();
-			} else {
-				m_rx_data_wpos = 0;
-			}
-			const int res_code = std::stoi(findParameter(response, "RTSP/", ' '));
+		// parsed in place, it is cut away from the buffer afterwards
+		const std::string_view response = findRTSPResponse(msg, begin);
+		if (!response.empty()) {
+			DEBUG(MSG_NET,"RTSP rx data: \n%.*s\n", static_cast<int>(response.size()), response.data());
+			if (packetCapture* capture = m_rtp->getCapture())
+				capture->add(CAPTURE_RTSP_RX, 0, capture->now(), response.data(), response.size());
+			const int res_code = parseNumber(findParameter(response, "RTSP/", ' '));
+			TRACE_RTSP_RESPONSE_PARSED(m_rtsp_request, res_code);
+			bool drop_data = false;
 			if (res_code == 200) {
 				switch(m_rtsp_request) {
 					case RTSP_REQUEST_NONE:
@@ -298,28 +684,40 @@ int satipRTSP::handleResponse()
 						break;
 					case RTSP_REQUEST_SETUP:
 						res = handleResponseSetup(response);
-						if (m_channel_changed) {
-							m_rx_data_wpos = 0;
-							m_channel_changed = false;
-						}
+						drop_data = m_channel_changed;
 						break;
 					case RTSP_REQUEST_PLAY:
 						res = handleResponsePlay(response);
-						if (m_channel_changed) {
-							m_rx_data_wpos = 0;
-							m_channel_changed = false;
-						}
+						drop_data = m_channel_changed;
 						break;
 					case RTSP_REQUEST_TEARDOWN:
 						res = handleResponseTeardown(response);
 						break;
+					case RTSP_REQUEST_DESCRIBE:
+						res = handleResponseDescribe(response);
+						break;
 					default:
 						break;
 				}
 			} else {
 				DEBUG(MSG_MAIN, "No RTSP Response code 200\n");
+				if (m_placed && (m_rtsp_request == RTSP_REQUEST_SETUP || m_rtsp_request == RTSP_REQUEST_PLAY))
+					serverPool::getInstance()->reportRefused(m_host, m_port, m_satip_config->getTransponder(), res_code);
 				res = RTSP_ERROR;
 			}
+			if (m_satip_config->isTcpData()) {
+				// Cut away RTSP response from embedded data, on a channel change the data of the
+				// previous channel before it too. What follows it starts with a frame, keep it.
+				const size_t cut_begin = drop_data ? 0 : begin;
+				const size_t cut_end = begin + response.size();
+				std::memmove(m_rx_data.get() + cut_begin, m_rx_data.get() + cut_end, m_rx_data_wpos - cut_end);
+				m_rx_data_wpos -= cut_end - cut_begin;
+			} else {
+				m_rx_data_wpos = 0;
+			}
+			if (drop_data) {
+				m_channel_changed = false;
+			}
 			switch(res) {
 				case RTSP_RESPONSE_COMPLETE:
 					DEBUG(MSG_MAIN, "RTSP_RESPONSE_COMPLETE\n");
@@ -340,41 +738,63 @@ int satipRTSP::handleResponse()
 
 	// Are we expecting embedded RTP data? then extract it
 	if (m_satip_config->isTcpData() && !m_channel_changed) {
-		// extract embedded data
-		size_t dataSize = m_rx_data_wpos;
-		if (dataSize >= 4) {
-			auto *ptr = reinterpret_cast<unsigned char *>(m_rx_data.get());
-			if (!(ptr[0] == '$' && ptr[4] == 0x80 && (ptr[1] == 0x00 || ptr[1] == 0x01))) {
-				DEBUG(MSG_NET,"RTP/TCP not aligned correctly.. maybe try to find it?\n");
-				// try to recover here?
+		if (handleInterleavedData() == RTSP_OK) {
+			res = RTSP_OK;
+		}
+	}
+	return res;
+}
+
+int satipRTSP::handleInterleavedData()
+{
+	int res = RTSP_ERROR;
+	const size_t dataSize = m_rx_data_wpos;
+	if (dataSize > 4) {
+		auto *ptr = reinterpret_cast<unsigned char *>(m_rx_data.get());
+		size_t skip = 0;
+		if (!m_wait_response) {
+			// no response can be in front, skip to the next frame
+			while (skip + 4 < dataSize && !isInterleavedFrame(ptr + skip)) {
+				++skip;
 			}
-			while (ptr[0] == '$' && ptr[4] == 0x80 && (ptr[1] == 0x00 || ptr[1] == 0x01)) {
-				if (dataSize < 4) {
-					res = RTSP_OK;
-					break;
-				}
-				const size_t packetSize = 4 + ((ptr[2] << 8) + ptr[3]);
-				if (dataSize < packetSize) {
-					res = RTSP_OK;
-					break;
-				}
-				m_rtp->rtpTcpData(ptr, packetSize);
-				ptr += packetSize;
-				dataSize -= packetSize;
+			if (skip > 0) {
+				DEBUG_RL(MSG_NET, skip, "RTP/TCP not aligned correctly, %zu bytes skipped\n", skip);
 			}
-			if (reinterpret_cast<unsigned char *>(m_rx_data.get()) != ptr) {
-				startTimerResetConnect(4000);
-				m_rx_data_wpos = dataSize;
-				if (dataSize > 0) {
-					memmove(m_rx_data.get(), ptr, dataSize);
-				}
+		}
+		const size_t done = skip + extractInterleavedData(ptr + skip, dataSize - skip);
+		if (done < dataSize && ptr[done] == '$') {
+			res = RTSP_OK;
+		}
+		if (done > 0) {
+			startTimerResetConnect(4000);
+			m_rx_data_wpos = dataSize - done;
+			if (m_rx_data_wpos > 0) {
+				memmove(ptr, ptr + done, m_rx_data_wpos);
 			}
 		}
 	}
 	return res;
 }
 
-int satipRTSP::handleResponseSetup(const std::string& msg)
+size_t satipRTSP::extractInterleavedData(const unsigned char *data, size_t size)
+{
+	size_t done = 0;
+	while (size - done > 4) {
+		const unsigned char *ptr = data + done;
+		if (!isInterleavedFrame(ptr)) {
+			break;
+		}
+		const size_t packetSize = 4 + ((ptr[2] << 8) + ptr[3]);
+		if (size - done < packetSize) {
+			break;
+		}
+		m_rtp->rtpTcpData(ptr, packetSize);
+		done += packetSize;
+	}
+	return done;
+}
+
+int satipRTSP::handleResponseSetup(const std::string_view msg)
 {
 	/*
 	RTSP/1.0 200 OK
@@ -398,17 +818,17 @@ int satipRTSP::handleResponseSetup(const std::string& msg)
 	}
 
 	// get timeout
-	std::string timeout = findParameter(msg, "timeout", '=');
-	if (!timeout.empty()) {
-		m_rtsp_timeout = std::stoi(timeout);
+	const int timeout = parseNumber(findParameter(msg, "timeout", '='));
+	if (timeout > 0) {
+		m_rtsp_timeout = timeout;
 	}
 
 	// get stream id
-	std::string id = findParameter(msg, "com.ses.streamID", ':');
-	if (id.empty()) {
+	const int id = parseNumber(findParameter(msg, "com.ses.streamID", ':'));
+	if (id < 0) {
 		return RTSP_ERROR;
 	}
-	m_rtsp_stream_id = std::stoi(id);
+	m_rtsp_stream_id = id;
 
 	DEBUG(MSG_MAIN, "Session ID : %s\n", m_rtsp_session_id.c_str());
 	DEBUG(MSG_MAIN, "Timeout : %d\n", m_rtsp_timeout);
@@ -416,23 +836,26 @@ int satipRTSP::handleResponseSetup(const std::string& msg)
 	return RTSP_RESPONSE_COMPLETE;
 }
 
-int satipRTSP::handleResponsePlay(const std::string& /*msg*/)
+int satipRTSP::handleResponsePlay(const std::string_view /*msg*/)
 {
 	return RTSP_RESPONSE_COMPLETE;
 }
 
-int satipRTSP::handleResponseOption(const std::string& /*msg*/)
+int satipRTSP::handleResponseOption(const std::string_view /*msg*/)
 {
 	return RTSP_RESPONSE_COMPLETE;
 }
 
-int satipRTSP::handleResponseTeardown(const std::string& /*msg*/)
+int satipRTSP::handleResponseTeardown(const std::string_view /*msg*/)
 {
 	return RTSP_RESPONSE_COMPLETE;
 }
 
-int satipRTSP::handleResponseDescribe(const std::string& /*msg*/)
+int satipRTSP::handleResponseDescribe(const std::string_view msg)
 {
+	// occupancy of the server, for placing the sessions of the pool
+	if (m_satip_config->isServerPool())
+		serverPool::getInstance()->updateFromDescribe(m_host, m_port, msg);
 	return RTSP_RESPONSE_COMPLETE;
 }
 
@@ -476,6 +899,7 @@ int satipRTSP::sendRequest(int request)
 
 	if (res == RTSP_OK)
 	{
+		TRACE_RTSP_REQUEST_SENT(request, m_rtsp_cseq - 1);
 		m_wait_response = true;
 		m_rtsp_request = request;
 		startTimerResetConnect(6000); // server connect timer start
@@ -514,8 +938,8 @@ int satipRTSP::sendRequest(int request)
 
 int satipRTSP::sendSetup()
 {
-	std::string tx_data;
-	std::ostringstream oss_tx_data;
+	textBuffer& oss_tx_data = m_tx_data;
+	oss_tx_data.clear();
 	/* 
 	str = SETUP rtsp://192.168.100.101/?src=1&freq=10202&pol=v&msys=dvbs&sr=27500&fec=34&pids=0,16,25,104 RTSP/1.0
 	CSeq: 1
@@ -529,13 +953,15 @@ int satipRTSP::sendSetup()
 
 	const auto [data, channelChanged] = m_satip_config->getSetupData();
 	m_channel_changed = channelChanged;
+	if (channelChanged)
+		claimShared();
 	oss_tx_data << data << " RTSP/1.0\r\n";
 	oss_tx_data << "CSeq: " << m_rtsp_cseq++ << "\r\n";
 	if (!m_rtsp_session_id.empty())
 		oss_tx_data << "Session: " << m_rtsp_session_id << "\r\n";
 
 	if (m_satip_config->isTcpData()) {
-		oss_tx_data << "Transport: RTP/AVP/TCP;interleaved=0-1\r\n";
+		oss_tx_data << "Transport: RTP/AVP/TCP;interleaved=" << m_interleaved << "-" << m_interleaved + 1 << "\r\n";
 	} else {
 		int rtp_port = m_rtp->get_rtp_port();
 		oss_tx_data << "Transport: RTP/AVP;unicast;client_port=" << rtp_port << "-" << rtp_port+1 << "\r\n";
@@ -543,21 +969,15 @@ int satipRTSP::sendSetup()
 	oss_tx_data << "User-Agent: " << user_agent << "\r\n";
 	oss_tx_data << "\r\n";
 
-	tx_data = oss_tx_data.str();
+	DEBUG(MSG_MAIN, "SETUP DATA : \n%s\n", oss_tx_data.c_str());
 
-	DEBUG(MSG_MAIN, "SETUP DATA : \n%s\n", tx_data.c_str());
-
-	if (send(m_fd, tx_data.c_str(), tx_data.size(), 0) < 0) {
-		return RTSP_ERROR;
-	}
-
-	return RTSP_OK;
+	return sendTxData();
 }
 
 int satipRTSP::sendPlay()
 {
-	std::string tx_data;
-	std::ostringstream oss_tx_data;
+	textBuffer& oss_tx_data = m_tx_data;
+	oss_tx_data.clear();
 	/*
 	PLAY rtsp://192.168.128.5/stream=1 RTSP/1.0
 	CSeq: 2
@@ -579,6 +999,8 @@ int satipRTSP::sendPlay()
 	}
 	const auto [data, channelChanged] = m_satip_config->getPlayData();
 	m_channel_changed = channelChanged;
+	if (channelChanged)
+		claimShared();
 	oss_tx_data << "PLAY rtsp://" << m_host << ":" << m_port << "/" << "stream=" << m_rtsp_stream_id;
 	oss_tx_data << data << " RTSP/1.0\r\n";
 	oss_tx_data << "CSeq: " << m_rtsp_cseq++ << "\r\n";
@@ -586,21 +1008,15 @@ int satipRTSP::sendPlay()
 	oss_tx_data << "User-Agent: " << user_agent << "\r\n";
 	oss_tx_data << "\r\n";
 
-	tx_data = oss_tx_data.str();
-
-	DEBUG(MSG_MAIN, "PLAY DATA : \n%s\n", tx_data.c_str());
-
-	if (send(m_fd, tx_data.c_str(), tx_data.size(), 0) < 0) {
-		return RTSP_ERROR;
-	}
+	DEBUG(MSG_MAIN, "PLAY DATA : \n%s\n", oss_tx_data.c_str());
 
-	return RTSP_OK;
+	return sendTxData();
 }
 
 int satipRTSP::sendOption()
 {
-	std::string tx_data;
-	std::ostringstream oss_tx_data;
+	textBuffer& oss_tx_data = m_tx_data;
+	oss_tx_data.clear();
 	/*
 	OPTIONS rtsp://192.168.178.57:554/ RTSP/1.0
 	CSeq:5
@@ -625,20 +1041,15 @@ int satipRTSP::sendOption()
 	oss_tx_data << "User-Agent: " << user_agent << "\r\n";
 	oss_tx_data << "\r\n";
 
-	tx_data = oss_tx_data.str();
-
-	DEBUG(MSG_MAIN, "OPTIONS DATA : \n%s\n", tx_data.c_str());
+	DEBUG(MSG_MAIN, "OPTIONS DATA : \n%s\n", oss_tx_data.c_str());
 
-	if (send(m_fd, tx_data.c_str(), tx_data.size(), 0) < 0)
-		return RTSP_ERROR;
-
-	return RTSP_OK;
+	return sendTxData();
 }
 
 int satipRTSP::sendTearDown()
 {
-	std::string tx_data;
-	std::ostringstream oss_tx_data;
+	textBuffer& oss_tx_data = m_tx_data;
+	oss_tx_data.clear();
 
 	/*
 	TEARDOWN rtsp://192.168.178.57:554/stream=2 RTSP/1.0
@@ -659,18 +1070,13 @@ int satipRTSP::sendTearDown()
 	oss_tx_data << "User-Agent: " << user_agent << "\r\n";
 	oss_tx_data << "\r\n";
 
-	tx_data = oss_tx_data.str();
-
-	if (send(m_fd, tx_data.c_str(), tx_data.size(), 0) < 0)
-		return RTSP_ERROR;
-
-	return RTSP_OK;
+	return sendTxData();
 }
 
 int satipRTSP::sendDescribe()
 {
-	std::string tx_data;
-	std::ostringstream oss_tx_data;
+	textBuffer& oss_tx_data = m_tx_data;
+	oss_tx_data.clear();
 
 	/*
 	DESCRIBE rtsp://192.168.128.5/
@@ -688,34 +1094,59 @@ int satipRTSP::sendDescribe()
 	oss_tx_data << "User-Agent: " << user_agent << "\r\n";
 	oss_tx_data << "\r\n";
 
-	tx_data = oss_tx_data.str();
+	return sendTxData();
+}
+
+int satipRTSP::sendTxData()
+{
+	if (m_tx_data.overflow()) {
+		ERROR(MSG_MAIN, "RTSP request longer than %zu bytes, not sent\n", m_tx_data.size());
+		return RTSP_ERROR;
+	}
 
-	if (send(m_fd, tx_data.c_str(), tx_data.size(), 0) < 0)
+	if (send(m_fd, m_tx_data.c_str(), m_tx_data.size(), 0) < 0)
 		return RTSP_ERROR;
 
+	if (packetCapture* capture = m_rtp->getCapture())
+		capture->add(CAPTURE_RTSP_TX, 0, capture->now(), m_tx_data.c_str(), m_tx_data.size());
+
 	return RTSP_OK;
 }
 
 void satipRTSP::handleRTSPStatus()
 {
+	m_satip_config->applyGuestPids();
+
 	switch(m_rtsp_status)
 	{
 		case RTSP_STATUS_CONFIG_WAITING:
 			//DEBUG(MSG_MAIN, "RTSP STATUS : RTSP_STATUS_CONFIG_WAITING\n");
 			if (m_satip_config->getChannelStatus() == CONFIG_STATUS_CHANNEL_CHANGED)
 			{
-				if (connectToServer() == RTSP_OK)
+				if (attachShared())
 				{
-					m_rtsp_status = RTSP_STATUS_SERVER_CONNECTING;
-					startTimerResetConnect(5000);
+					m_rtsp_status = RTSP_STATUS_SESSION_SHARED;
+					break;
 				}
-				else
+				claimShared();
+				placeSession();
+				m_reserved = m_satip_config->getTransponder();
+				// the tuning key is only built for the coordination, it allocates
+				if (satipCoordinator::getInstance()->isEnabled() &&
+					!satipCoordinator::getInstance()->reserve(this, m_host, m_port, m_reserved,
+						m_satip_config->getTuningKey()))
 				{
-					DEBUG(MSG_MAIN, "Connect to server failed!\n");
+					m_rtsp_status = RTSP_STATUS_RESERVING;
+					m_timer_reserve->start(satipCoordinator::RESERVE_WAIT_MS, true);
+					break;
 				}
+				startSession();
 			}
 			break;
 
+		case RTSP_STATUS_RESERVING: // m_timer_reserve goes on
+			break;
+
 		case RTSP_STATUS_SERVER_CONNECTING: // connected to serverm check if server ready to send RTSP requests.
 			DEBUG(MSG_MAIN, "RTSP STATUS : RTSP_STATUS_SERVER_CONNECTING\n");
 			break;
@@ -745,8 +1176,18 @@ void satipRTSP::handleRTSPStatus()
 					DEBUG(MSG_MAIN, "PID STATUS : CONFIG_STATUS_PID_CHANGED\n");
 				}
 
-				if ((channel_status == CONFIG_STATUS_CHANNEL_CHANGED) || (pid_status == CONFIG_STATUS_PID_CHANGED))
+				if (channel_status == CONFIG_STATUS_CHANNEL_CHANGED && m_satip_config->isShareTransponder() &&
+					transponderRegistry::getInstance()->hasOwner(shareKey(), m_satip_config))
+				{
+					// another session streams the new transponder, join it after the teardown
+					if (sendRequest(RTSP_REQUEST_TEARDOWN) == RTSP_OK)
+						m_rtsp_status = RTSP_STATUS_SESSION_TEARDOWNING;
+				}
+				else if ((channel_status == CONFIG_STATUS_CHANNEL_CHANGED) || (pid_status == CONFIG_STATUS_PID_CHANGED))
 				{
+					if (channel_status == CONFIG_STATUS_CHANNEL_CHANGED && satipCoordinator::getInstance()->isEnabled())
+						satipCoordinator::getInstance()->retune(this, m_satip_config->getTransponder(),
+							m_satip_config->getTuningKey());
 					if (sendRequest(RTSP_REQUEST_PLAY) == RTSP_OK) // send ok
 					{
 						m_rtsp_status = RTSP_STATUS_SESSION_PLAYING;
@@ -771,6 +1212,27 @@ void satipRTSP::handleRTSPStatus()
 			DEBUG(MSG_MAIN, "RTSP STATUS : RTSP_STATUS_SESSION_TEARDOWNING\n");
 			break;
 
+		case RTSP_STATUS_SESSION_SHARED: // TS from the owner of the transponder, PIDs go to the owner
+			{
+				const bool lost = m_satip_config->takeShareLost();
+				const t_channel_status channel_status = m_satip_config->getChannelStatus();
+
+				if (lost || channel_status != CONFIG_STATUS_CHANNEL_STABLE)
+				{
+					transponderRegistry::getInstance()->detach(m_satip_config);
+					m_satip_config->setShared(false);
+					if (lost && channel_status == CONFIG_STATUS_CHANNEL_STABLE)
+						m_satip_config->setChannelChanged(); // tune on our own
+					m_rtsp_status = RTSP_STATUS_CONFIG_WAITING;
+				}
+				else if (m_satip_config->getPidStatus() == CONFIG_STATUS_PID_CHANGED)
+				{
+					transponderRegistry::getInstance()->updateGuestPids(m_satip_config,
+						m_satip_config->commitSharedPids());
+				}
+				break;
+			}
+
 		default:
 			break;
 	}
@@ -935,3 +1397,43 @@ int satipRTSP::getRtspSocketFd()
 	return m_fd;
 }
 
+void satipRTSP::replayConnect(int fd)
+{
+	resetConnect();
+	m_fd = fd;
+	m_rtsp_status = RTSP_STATUS_SESSION_ESTABLISHING;
+}
+
+// The state sendRequest() leaves, without sending
+void satipRTSP::replayRequest(const std::string_view request)
+{
+	static const struct {
+		std::string_view method;
+		int request;
+		int status;
+	} methods[] = {
+		{ "SETUP ", RTSP_REQUEST_SETUP, RTSP_STATUS_SESSION_ESTABLISHING },
+		{ "PLAY ", RTSP_REQUEST_PLAY, RTSP_STATUS_SESSION_PLAYING },
+		{ "OPTIONS ", RTSP_REQUEST_OPTION, RTSP_STATUS_SESSION_TRANSMITTING },
+		{ "DESCRIBE ", RTSP_REQUEST_DESCRIBE, RTSP_STATUS_SESSION_TRANSMITTING },
+		{ "TEARDOWN ", RTSP_REQUEST_TEARDOWN, RTSP_STATUS_SESSION_TEARDOWNING },
+	};
+	for (const auto& m : methods) {
+		if (request.substr(0, m.method.size()) != m.method)
+			continue;
+		const std::string_view line = request.substr(0, request.find("\r\n"));
+		m_rtsp_request = m.request;
+		m_rtsp_status = m.status;
+		m_wait_response = true;
+		// tuning in the request: the data before the response is of the old channel
+		m_channel_changed = (m.request == RTSP_REQUEST_SETUP || m.request == RTSP_REQUEST_PLAY) &&
+			line.find("freq=") != std::string_view::npos;
+		return;
+	}
+}
+
+void satipRTSP::replayReceive()
+{
+	handlePollEvents(POLLIN);
+}
+
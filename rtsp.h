@@ -23,9 +23,12 @@
 #include "timer.h"
 #include "config.h"
 #include "rtp.h"
+#include "rtspmux.h"
+#include "textbuffer.h"
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <cstdint>
 
 enum 
@@ -36,6 +39,8 @@ enum
 	RTSP_STATUS_SESSION_PLAYING, // session established, send to play and wait until receive play ok.
 	RTSP_STATUS_SESSION_TRANSMITTING,// play ok, data transmitting..check channel or pid changed. if tuner config invalid, status move to teardown.
 	RTSP_STATUS_SESSION_TEARDOWNING, // send teardown and if receive, go to waiting.
+	RTSP_STATUS_SESSION_SHARED, // no own session, the TS comes from a session on the same transponder.
+	RTSP_STATUS_RESERVING, // frontend reserved, other instances may object before we connect.
 };
 
 enum
@@ -50,6 +55,8 @@ enum
 
 class satipRTSP
 {
+	friend class satipMicroBench; // bench/bench_micro.cpp
+
 public:
 	satipRTSP(satipConfig* satip_config,
 			     const char* host, 
@@ -62,12 +69,29 @@ public:
 	int getPollTimeout();
 	void handleNextTimer();
 	void handlePollEvents(short events);
+	void resizeNetBuffer();
+
+	/* replay of a capture (tools/replay.cpp), 'fd' stands in for the server connection */
+	void replayConnect(int fd);
+	void replayRequest(const std::string_view request); // wait for its response
+	void replayReceive(); // read 'fd' as on POLLIN
+	bool isWaitingResponse() const { return m_wait_response; }
+
+	/* header names are matched case-insensitively, the value points into 'msg' */
+	static bool findHeader(const std::string_view msg, const std::string_view name, size_t& pos, size_t& len);
+	static std::string_view headerValue(const std::string_view msg, const std::string_view name);
 
 	static void timeoutConnect(void *ptr);
 	static void timeoutKeepAlive(void *ptr);
 	static void timeoutStreamInfo(void *ptr);
+	static void timeoutReserve(void *ptr);
 
 private:
+	/* allocated with the session, see textBuffer */
+	static constexpr int RTSP_TIMER_COUNT = 3;
+	static constexpr size_t RTSP_TX_DATA_SIZE = satipConfig::REQUEST_DATA_SIZE + 512;
+	static constexpr size_t RTSP_SESSION_ID_SIZE = 64;
+
 	std::string m_host;
 	std::string m_port;
 	satipRTP *m_rtp;
@@ -75,12 +99,25 @@ private:
 	satipTimer m_satip_timer;
 	timer_elem *m_timer_reset_connect;
 	timer_elem *m_timer_keep_alive;
+	timer_elem *m_timer_reserve;
+	textBuffer m_tx_data;
 	int m_fd;
 
+	/* shared server connection (tcpdata_shared), m_fd is then our end of it */
+	rtspMux* m_mux;
+	uint64_t m_mux_id;
+	int m_interleaved;
+
 	std::unique_ptr<char[]> m_rx_data;
 	int m_rx_data_len;
 	int m_rx_data_wpos;
 
+	/* TCP_ZEROCOPY_RECEIVE mapping of the RTSP socket */
+	void *m_zc_addr;
+	size_t m_zc_len;
+	unsigned long long m_zc_mapped_bytes;
+	unsigned long long m_zc_copied_bytes;
+
 	int m_rtsp_status;
 	int m_rtsp_request;
 
@@ -97,18 +134,50 @@ private:
 	int m_rtsp_cseq;
 	bool m_wait_response;
 	bool m_channel_changed;
+
+	/* tuner pool (ipaddr:a|b), m_host is then the server we were placed on */
+	bool m_placed;
+	void placeSession();
+
+	/* coordination with other instances, the transponder reserved for */
+	transponderId m_reserved;
+	bool m_reserve_retry;
+	void handleReserved();
+	void startSession();
+
+	/* transponder sharing, the key we own */
+	std::string m_share_key;
+	std::string shareKey();
+	bool attachShared();
+	void claimShared();
+	void releaseShared();
 	
 	void resetConnect();
 	int connectToServer();
+	void setNetBuffer(int fd);
 
 	int rtpData(size_t len);
 
+	/* responses are parsed in place, the views point into 'msg' */
+	static std::string_view findRTSPResponse(const std::string_view msg, std::string_view::size_type& begin);
+	static std::string_view findParameter(const std::string_view msg, const std::string_view param, const char sep);
+	static int parseNumber(const std::string_view value);
+
 	int handleResponse();
-	int handleResponseSetup(const std::string& msg);
-	int handleResponsePlay(const std::string& msg);
-	int handleResponseOption(const std::string& msg);
-	int handleResponseTeardown(const std::string& msg);
-	int handleResponseDescribe(const std::string& msg);
+	int handleInterleavedData();
+	static bool isInterleavedFrame(const unsigned char *ptr)
+	{
+		return ptr[0] == '$' && ptr[4] == 0x80 && (ptr[1] == 0x00 || ptr[1] == 0x01);
+	}
+	size_t extractInterleavedData(const unsigned char *data, size_t size);
+	void openZeroCopy();
+	void closeZeroCopy();
+	int handleZeroCopyData();
+	int handleResponseSetup(const std::string_view msg);
+	int handleResponsePlay(const std::string_view msg);
+	int handleResponseOption(const std::string_view msg);
+	int handleResponseTeardown(const std::string_view msg);
+	int handleResponseDescribe(const std::string_view msg);
 
 	int sendRequest(int request);
 	int sendSetup();
@@ -116,6 +185,7 @@ private:
 	int sendOption();
 	int sendTearDown();
 	int sendDescribe();
+	int sendTxData();
 	int setTuneParams();
 	int getPidList(int get_changed = 0);
 
@@ -0,0 +1,531 @@
+/*
+ * satip: RTSP sessions sharing one TCP connection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "capture.h"
+#include "rtspmux.h"
+#include "rtp.h"
+#include "rtsp.h"
+#include "log.h"
+#include "threadpolicy.h"
+
+#define REQUEST_BUFFER_SIZE (16 * 1024)
+
+static std::string replaceHeader(std::string_view msg, std::string_view name, const std::string& value)
+{
+	std::string res(msg);
+	size_t pos, len;
+	if (satipRTSP::findHeader(msg, name, pos, len))
+		res.replace(pos, len, value);
+	return res;
+}
+
+static long elapsedMs(const struct timespec& from, const struct timespec& to)
+{
+	return (to.tv_sec - from.tv_sec) * 1000 + (to.tv_nsec - from.tv_nsec) / 1000000;
+}
+
+rtspMux::rtspMux(const std::string& host, const std::string& port) :
+	m_host(host),
+	m_port(port),
+	m_fd(-1),
+	m_connected(false),
+	m_thread(0),
+	m_running(false),
+	m_cseq(0),
+	m_next_id(0),
+	m_rcvbuf(0),
+	m_rx(std::make_unique<unsigned char[]>(RX_BUFFER_SIZE)),
+	m_rx_len(0),
+	m_frames(0),
+	m_responses(0)
+{
+	DEBUG(MSG_MAIN, "Create RTSP connection to %s:%s.\n", m_host.c_str(), m_port.c_str());
+	pthread_mutex_init(&m_lock, NULL);
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_running = true;
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+}
+
+rtspMux::~rtspMux()
+{
+	stop();
+	if (m_event_fd >= 0)
+		close(m_event_fd);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void rtspMux::stop()
+{
+	if (!m_running.exchange(false))
+		return;
+	eventfd_write(m_event_fd, 1);
+	pthread_join(m_thread, nullptr);
+	m_thread = 0;
+
+	pthread_mutex_lock(&m_lock);
+	closeConnection(nullptr);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void* rtspMux::thread_wrapper(void* ptr)
+{
+	return static_cast<rtspMux*>(ptr)->muxLoop();
+}
+
+// A non-blocking connection to the server, -1 if it can't be opened; runs without m_lock
+int rtspMux::connectToServer(int rcvbuf, bool& connected) const
+{
+	struct addrinfo hints;
+	struct addrinfo* result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	const int error = getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &result);
+	if (error) {
+		ERROR(MSG_NET, "getaddrinfo: %s\n", error == EAI_SYSTEM ? strerror(errno) : gai_strerror(error));
+		return -1;
+	}
+
+	int fd = -1;
+	connected = false;
+	for (struct addrinfo* rp = result; rp != NULL; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+			connected = true;
+			break;
+		}
+		if (errno == EINPROGRESS)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	if (fd == -1) {
+		DEBUG(MSG_NET, "Could not connect to %s:%s\n", m_host.c_str(), m_port.c_str());
+		return -1;
+	}
+
+	if (rcvbuf > 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) &&
+				setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+			WARN(MSG_MAIN, "unable to set TCP buffer size to %d\n", rcvbuf);
+	}
+	return fd;
+}
+
+// Drop the server connection and with it all sessions, they reconnect
+void rtspMux::closeConnection(const char* reason)
+{
+	if (reason)
+		INFO(MSG_NET, "RTSP connection to %s:%s closed (%s), %llu frames, %llu responses\n",
+			m_host.c_str(), m_port.c_str(), reason,
+			static_cast<unsigned long long>(m_frames), static_cast<unsigned long long>(m_responses));
+	while (!m_channels.empty())
+		closeChannel(m_channels.begin());
+	if (m_fd >= 0)
+		close(m_fd);
+	m_fd = -1;
+	m_connected = false;
+	m_tx.clear();
+	m_rx_len = 0;
+	m_pending.clear();
+	m_sessions.clear();
+}
+
+// The session sees the socketpair hang up and resets its RTSP state
+void rtspMux::closeChannel(std::map<int, channel>::iterator it)
+{
+	const uint64_t id = it->second.id;
+	close(it->second.fd);
+	m_channels.erase(it);
+
+	for (auto p = m_pending.begin(); p != m_pending.end(); )
+		p = p->second.id == id ? m_pending.erase(p) : std::next(p);
+	for (auto s = m_sessions.begin(); s != m_sessions.end(); )
+		s = s->second == id ? m_sessions.erase(s) : std::next(s);
+}
+
+rtspMux::channel* rtspMux::findChannel(uint64_t id)
+{
+	for (auto& [pair, ch] : m_channels)
+		if (ch.id == id)
+			return &ch;
+	return nullptr;
+}
+
+int rtspMux::attach(satipRTP* rtp, int rcvbuf, int stall_ms, int& interleaved, uint64_t& id)
+{
+	int sv[2];
+	int pair = -1;
+
+	// resolving and connecting can take long, the connection thread must not wait on it
+	int fd = -1;
+	bool connected = false;
+	pthread_mutex_lock(&m_lock);
+	const bool need_connection = m_fd < 0;
+	const int connect_rcvbuf = std::max(rcvbuf, m_rcvbuf);
+	pthread_mutex_unlock(&m_lock);
+	if (need_connection && (fd = connectToServer(connect_rcvbuf, connected)) < 0)
+		return -1;
+
+	pthread_mutex_lock(&m_lock);
+	bool fresh = false; // has the receive buffer of this session already
+	if (fd >= 0) {
+		if (m_fd < 0) {
+			m_fd = fd;
+			m_connected = connected;
+			m_rx_len = 0;
+			fresh = true;
+		} else {
+			close(fd); // another session connected first
+		}
+	}
+	if (m_fd < 0) {
+		// closed again while it connected, the session retries
+		pthread_mutex_unlock(&m_lock);
+		return -1;
+	}
+	for (int i = 0; i < MAX_PAIRS && pair < 0; ++i)
+		if (m_channels.find(i) == m_channels.end())
+			pair = i;
+	if (pair < 0) {
+		pthread_mutex_unlock(&m_lock);
+		ERROR(MSG_NET, "RTSP connection to %s:%s: no free interleaved channel\n", m_host.c_str(), m_port.c_str());
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv)) {
+		pthread_mutex_unlock(&m_lock);
+		ERROR(MSG_NET, "socketpair: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// the first session sets the receive buffer, later ones can only grow it
+	if (rcvbuf > m_rcvbuf) {
+		m_rcvbuf = rcvbuf;
+		if (!fresh)
+			setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &m_rcvbuf, sizeof(m_rcvbuf));
+	}
+
+	channel& ch = m_channels[pair];
+	ch.fd = sv[0];
+	ch.rtp = rtp;
+	ch.id = ++m_next_id;
+	ch.last_data = {0, 0};
+	ch.data_seen = false;
+	ch.stall_ms = stall_ms;
+	interleaved = pair * 2;
+	id = ch.id;
+	pthread_mutex_unlock(&m_lock);
+
+	DEBUG(MSG_NET, "RTSP connection to %s:%s: session on channels %d-%d\n",
+		m_host.c_str(), m_port.c_str(), interleaved, interleaved + 1);
+	eventfd_write(m_event_fd, 1);
+	return sv[1];
+}
+
+void rtspMux::detach(uint64_t id)
+{
+	pthread_mutex_lock(&m_lock);
+	for (auto it = m_channels.begin(); it != m_channels.end(); ++it) {
+		if (it->second.id == id) {
+			closeChannel(it);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+	eventfd_write(m_event_fd, 1);
+}
+
+bool rtspMux::flushTx()
+{
+	while (!m_tx.empty()) {
+		const ssize_t res = send(m_fd, m_tx.data(), m_tx.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (res < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		m_tx.erase(0, res);
+	}
+	return true;
+}
+
+// A request of a session: give it a CSeq of the connection and queue it
+void rtspMux::forwardRequest(channel& ch, int pair)
+{
+	char buf[REQUEST_BUFFER_SIZE];
+	const ssize_t len = recv(ch.fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		closeChannel(m_channels.find(pair));
+		return;
+	}
+
+	const std::string_view msg(buf, len);
+	const unsigned int cseq = ++m_cseq;
+	m_pending[cseq] = pendingRequest{ch.id, std::string(satipRTSP::headerValue(msg, "CSeq"))};
+	m_tx += replaceHeader(msg, "CSeq", std::to_string(cseq));
+	DEBUG(MSG_NET, "RTSP channel %d request, CSeq %u\n", pair * 2, cseq);
+}
+
+void rtspMux::routeResponse(std::string_view msg)
+{
+	++m_responses;
+	uint64_t id = 0;
+	std::string response;
+
+	const std::string_view cseq = satipRTSP::headerValue(msg, "CSeq");
+	const auto p = m_pending.find(strtoul(std::string(cseq).c_str(), nullptr, 10));
+	if (!cseq.empty() && p != m_pending.end()) {
+		id = p->second.id;
+		response = replaceHeader(msg, "CSeq", p->second.cseq);
+		m_pending.erase(p);
+	}
+
+	std::string_view session = satipRTSP::headerValue(msg, "Session");
+	session = session.substr(0, session.find(';'));
+	if (id == 0 && !session.empty()) {
+		const auto s = m_sessions.find(std::string(session));
+		if (s != m_sessions.end()) {
+			id = s->second;
+			response = std::string(msg);
+		}
+	}
+
+	channel* ch = id ? findChannel(id) : nullptr;
+	if (!ch) {
+		DEBUG_RL(MSG_NET, 0, "RTSP response without a session dropped (CSeq %.*s)\n",
+			static_cast<int>(cseq.size()), cseq.data());
+		return;
+	}
+	if (!session.empty())
+		m_sessions[std::string(session)] = id;
+
+	if (send(ch->fd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		WARN(MSG_NET, "RTSP response for channel lost: %s\n", strerror(errno));
+}
+
+// Interleaved frames and responses, returns the bytes consumed
+size_t rtspMux::parseServer(const unsigned char* data, size_t size)
+{
+	static const std::string_view rtsp_version("RTSP/");
+	size_t done = 0;
+	while (done < size) {
+		const unsigned char* ptr = data + done;
+		const size_t left = size - done;
+
+		if (ptr[0] == '$') {
+			if (left < 4)
+				break;
+			const size_t len = 4 + ((ptr[2] << 8) | ptr[3]);
+			if (left < len)
+				break;
+			const auto it = m_channels.find(ptr[1] >> 1);
+			if (it != m_channels.end()) {
+				if (packetCapture* capture = it->second.rtp->getCapture())
+					capture->add(CAPTURE_INTERLEAVED, ptr[1], capture->now(), ptr, len);
+				it->second.rtp->rtpTcpData(ptr, len);
+				clock_gettime(CLOCK_MONOTONIC_COARSE, &it->second.last_data);
+				it->second.data_seen = true;
+			}
+			++m_frames;
+			done += len;
+			continue;
+		}
+
+		const std::string_view msg(reinterpret_cast<const char*>(ptr), left);
+		if (msg.substr(0, rtsp_version.size()) == rtsp_version.substr(0, left)) {
+			if (left < rtsp_version.size())
+				break;
+			const size_t end = msg.find("\r\n\r\n");
+			if (end == std::string_view::npos)
+				break;
+			const std::string_view length = satipRTSP::headerValue(msg.substr(0, end + 4), "Content-Length");
+			const size_t total = end + 4 + (length.empty() ? 0 : strtoul(std::string(length).c_str(), nullptr, 10));
+			if (left < total)
+				break;
+			routeResponse(msg.substr(0, total));
+			done += total;
+			continue;
+		}
+
+		// lost the framing, skip to the next frame or response
+		size_t next = 1;
+		while (next < left && ptr[next] != '$' && ptr[next] != 'R')
+			++next;
+		DEBUG_RL(MSG_NET, next, "RTSP connection: skipped %zu bytes\n", next);
+		done += next;
+	}
+	return done;
+}
+
+bool rtspMux::readServer()
+{
+	const ssize_t len = recv(m_fd, m_rx.get() + m_rx_len, RX_BUFFER_SIZE - m_rx_len, 0);
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR;
+	if (len == 0)
+		return false;
+	m_rx_len += len;
+
+	const size_t done = parseServer(m_rx.get(), m_rx_len);
+	if (done == 0 && m_rx_len == RX_BUFFER_SIZE)
+		return false; // no progress with a full buffer
+	m_rx_len -= done;
+	if (m_rx_len > 0)
+		memmove(m_rx.get(), m_rx.get() + done, m_rx_len);
+	return true;
+}
+
+// A stream that stopped: reset its session, like a connection of its own would be
+void rtspMux::checkStalled()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	for (auto it = m_channels.begin(); it != m_channels.end(); ) {
+		auto next = std::next(it);
+		if (it->second.data_seen && elapsedMs(it->second.last_data, now) > it->second.stall_ms) {
+			WARN(MSG_NET, "RTSP connection to %s:%s: no data on channel %d, resetting its session\n",
+				m_host.c_str(), m_port.c_str(), it->first * 2);
+			closeChannel(it);
+		}
+		it = next;
+	}
+}
+
+void* rtspMux::muxLoop()
+{
+	threadRoleScope role(THREAD_ROLE_RTP, "satip-rtspmux");
+	DEBUG(MSG_MAIN, "RTSP CONNECTION LOOP START (%s:%s)\n", m_host.c_str(), m_port.c_str());
+	std::vector<struct pollfd> fds;
+	std::vector<uint64_t> ids; // channel of each poll entry, 0 for ours
+
+	while (m_running)
+	{
+		fds.clear();
+		ids.clear();
+		pthread_mutex_lock(&m_lock);
+		fds.push_back({m_event_fd, POLLIN, 0});
+		ids.push_back(0);
+		const int server_fd = m_fd;
+		if (m_fd >= 0) {
+			fds.push_back({m_fd, static_cast<short>(POLLIN | (!m_connected || !m_tx.empty() ? POLLOUT : 0)), 0});
+			ids.push_back(0);
+		}
+		for (const auto& [pair, ch] : m_channels) {
+			fds.push_back({ch.fd, POLLIN, 0});
+			ids.push_back(ch.id);
+		}
+		pthread_mutex_unlock(&m_lock);
+
+		if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+			ERROR(MSG_NET, "RTSP connection poll: %s\n", strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&m_lock);
+		if (fds[0].revents) {
+			eventfd_t value;
+			eventfd_read(m_event_fd, &value);
+		}
+
+		size_t first_channel = 1;
+		if (server_fd >= 0) {
+			const short revents = fds[1].revents;
+			first_channel = 2;
+			if (!m_connected && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err) {
+					WARN(MSG_NET, "RTSP connection to %s:%s failed: %s\n", m_host.c_str(), m_port.c_str(), strerror(err));
+					closeConnection(nullptr);
+				} else {
+					m_connected = true;
+					DEBUG(MSG_NET, "RTSP connection to %s:%s established\n", m_host.c_str(), m_port.c_str());
+				}
+			}
+			if (m_fd >= 0 && m_connected && (revents & POLLIN) && !readServer())
+				closeConnection("closed by the server");
+			else if (m_fd >= 0 && m_connected && (revents & (POLLERR | POLLHUP)))
+				closeConnection("error");
+		}
+
+		for (size_t i = first_channel; i < fds.size(); ++i) {
+			if (!fds[i].revents)
+				continue;
+			for (auto it = m_channels.begin(); it != m_channels.end(); ++it) {
+				if (it->second.id != ids[i])
+					continue;
+				if (fds[i].revents & POLLIN)
+					forwardRequest(it->second, it->first);
+				else
+					closeChannel(it);
+				break;
+			}
+		}
+
+		if (m_fd >= 0 && m_connected && !m_tx.empty() && !flushTx())
+			closeConnection("send failed");
+
+		checkStalled();
+
+		// the last session went away
+		if (m_channels.empty() && m_fd >= 0)
+			closeConnection("idle");
+		pthread_mutex_unlock(&m_lock);
+	}
+	DEBUG(MSG_MAIN, "RTSP CONNECTION LOOP END.\n");
+	return 0;
+}
+
+rtspMuxPool::rtspMuxPool()
+{
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+rtspMuxPool::~rtspMuxPool()
+{
+	m_muxes.clear();
+	pthread_mutex_destroy(&m_lock);
+}
+
+rtspMux* rtspMuxPool::get(const std::string& host, const std::string& port)
+{
+	pthread_mutex_lock(&m_lock);
+	std::unique_ptr<rtspMux>& mux = m_muxes[host + ":" + port];
+	if (!mux)
+		mux = std::make_unique<rtspMux>(host, port);
+	rtspMux* res = mux.get();
+	pthread_mutex_unlock(&m_lock);
+	return res;
+}
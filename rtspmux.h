@@ -0,0 +1,136 @@
+/*
+ * satip: RTSP sessions sharing one TCP connection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_RTSPMUX_H
+#define _SATIP_RTSPMUX_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <pthread.h>
+#include <time.h>
+
+class satipRTP;
+
+/*
+ * One TCP connection to a server carrying the RTSP sessions of several
+ * tuners, each with its own interleaved channel pair (0-1, 2-3, ...).
+ *
+ * A session talks RTSP over its end of a SOCK_SEQPACKET socketpair as if it
+ * were the server connection, so the RTSP state machine is unchanged. The
+ * connection thread forwards the requests with a connection wide CSeq and
+ * routes the responses back by CSeq, or by the Session header. Interleaved
+ * data goes from the connection thread straight to the satipRTP of the
+ * channel pair.
+ */
+class rtspMux
+{
+	struct channel
+	{
+		int fd;           // our end of the socketpair
+		satipRTP* rtp;
+		uint64_t id;
+		struct timespec last_data;
+		bool data_seen;
+		int stall_ms;     // tcpdata_timeout of the session
+	};
+
+	struct pendingRequest
+	{
+		uint64_t id;
+		std::string cseq; // CSeq of the session
+	};
+
+	static constexpr int MAX_PAIRS = 128; // channels 0 - 255
+	static constexpr size_t RX_BUFFER_SIZE = 256 * 1024;
+
+	std::string m_host;
+	std::string m_port;
+	int m_fd;
+	bool m_connected;
+	int m_event_fd;
+	pthread_t m_thread;
+	std::atomic<bool> m_running;
+
+	/* guarded by m_lock, held by the connection thread while it works */
+	pthread_mutex_t m_lock;
+	std::map<int, channel> m_channels; // by pair index
+	std::map<unsigned int, pendingRequest> m_pending; // by CSeq on the connection
+	std::map<std::string, uint64_t> m_sessions;       // Session header to channel
+	unsigned int m_cseq;
+	uint64_t m_next_id;
+	int m_rcvbuf;
+	std::string m_tx;
+	std::unique_ptr<unsigned char[]> m_rx;
+	size_t m_rx_len;
+
+	/* statistics */
+	uint64_t m_frames;
+	uint64_t m_responses;
+
+	static void* thread_wrapper(void* ptr);
+	void* muxLoop();
+
+	int connectToServer(int rcvbuf, bool& connected) const;
+	void closeConnection(const char* reason);
+	void closeChannel(std::map<int, channel>::iterator it);
+	channel* findChannel(uint64_t id);
+
+	bool flushTx();
+	void forwardRequest(channel& ch, int pair);
+	bool readServer();
+	size_t parseServer(const unsigned char* data, size_t size);
+	void routeResponse(std::string_view msg);
+	void checkStalled();
+
+public:
+	rtspMux(const std::string& host, const std::string& port);
+	virtual ~rtspMux();
+
+	void stop();
+
+	// the session's end of a socketpair or -1; 'id' identifies it for detach(),
+	// the session is reset after 'stall_ms' without data on its channels
+	int attach(satipRTP* rtp, int rcvbuf, int stall_ms, int& interleaved, uint64_t& id);
+	// after this the connection thread no longer uses the satipRTP
+	void detach(uint64_t id);
+};
+
+/* One rtspMux per server */
+class rtspMuxPool
+{
+	pthread_mutex_t m_lock;
+	std::map<std::string, std::unique_ptr<rtspMux>> m_muxes;
+
+public:
+	rtspMuxPool();
+	virtual ~rtspMuxPool();
+
+	rtspMux* get(const std::string& host, const std::string& port);
+
+	static rtspMuxPool* getInstance()
+	{
+		static rtspMuxPool instance;
+		return &instance;
+	}
+};
+
+#endif
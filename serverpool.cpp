@@ -0,0 +1,416 @@
+/*
+ * satip: tuner pool over several servers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "serverpool.h"
+#include "coordinator.h"
+#include "rtsp.h"
+#include "log.h"
+#include "threadpolicy.h"
+
+#define DESCRIBE_TIMEOUT_MS 2000
+
+static const char* fe_type_name[3] = {"DVB-S", "DVB-C", "DVB-T"};
+
+static std::vector<std::string_view> splitView(std::string_view str, char sep)
+{
+	std::vector<std::string_view> res;
+	size_t pos = 0;
+	for (;;) {
+		const size_t end = str.find(sep, pos);
+		res.push_back(str.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+		if (end == std::string_view::npos)
+			break;
+		pos = end + 1;
+	}
+	return res;
+}
+
+static int toInt(std::string_view str)
+{
+	return atoi(std::string(str).c_str());
+}
+
+static int msysType(std::string_view msys)
+{
+	if (msys.substr(0, 4) == "dvbs")
+		return FE_TYPE_SAT;
+	if (msys.substr(0, 4) == "dvbc")
+		return FE_TYPE_CABLE;
+	if (msys.substr(0, 4) == "dvbt")
+		return FE_TYPE_TERRESTRIAL;
+	return -1;
+}
+
+/*
+	s=SatIPServer:1 4,0,2
+	m=video 0 RTP/AVP 33
+	a=control:stream=1
+	a=fmtp:33 ver=1.0;src=1;tuner=1,240,1,7,12402.00,v,dvbs,,off,,22000,34;pids=0,100
+*/
+bool serverPool::parseSdp(std::string_view sdp, serverState& state)
+{
+	state.described = false;
+	for (int i = 0; i < 3; ++i) {
+		state.frontends[i] = -1;
+		state.used[i].clear();
+	}
+	state.streams.clear();
+
+	if (sdp.substr(0, 5) == "RTSP/") {
+		const size_t body = sdp.find("\r\n\r\n");
+		sdp = body == std::string_view::npos ? std::string_view() : sdp.substr(body + 4);
+	}
+
+	for (std::string_view line : splitView(sdp, '\n')) {
+		if (!line.empty() && line.back() == '\r')
+			line.remove_suffix(1);
+
+		if (line.substr(0, 16) == "s=SatIPServer:1 ") {
+			// DVB-S2, DVB-T, DVB-C frontends
+			const std::vector<std::string_view> counts = splitView(line.substr(16), ',');
+			static const int order[3] = {FE_TYPE_SAT, FE_TYPE_TERRESTRIAL, FE_TYPE_CABLE};
+			for (size_t i = 0; i < 3; ++i)
+				state.frontends[order[i]] = i < counts.size() ? toInt(counts[i]) : 0;
+			state.described = true;
+		} else if (line.substr(0, 7) == "a=fmtp:") {
+			transponderId tp = {-1, 0, 0, 0};
+			int fe_id = -1;
+			for (std::string_view param : splitView(line.substr(line.find(' ') + 1), ';')) {
+				if (param.substr(0, 4) == "src=") {
+					tp.src = toInt(param.substr(4));
+				} else if (param.substr(0, 6) == "tuner=") {
+					// feID,level,lock,quality,freq,pol or bw,msys,...
+					const std::vector<std::string_view> f = splitView(param.substr(6), ',');
+					if (f.size() < 7)
+						continue;
+					fe_id = toInt(f[0]);
+					tp.freq = lround(strtod(std::string(f[4]).c_str(), nullptr) * 10);
+					tp.fe_type = msysType(f[6]);
+					if (tp.fe_type == FE_TYPE_SAT && !f[5].empty())
+						tp.pol = f[5][0];
+				}
+			}
+			if (tp.fe_type < 0)
+				continue;
+			if (tp.fe_type != FE_TYPE_SAT)
+				tp.src = 0;
+			state.used[tp.fe_type].insert(fe_id);
+			state.streams.push_back(tp);
+		}
+	}
+	return state.described;
+}
+
+serverPool::serverPool() :
+	m_thread(0),
+	m_running(false)
+{
+	pthread_mutex_init(&m_lock, NULL);
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+serverPool::~serverPool()
+{
+	stop();
+	close(m_event_fd);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void serverPool::addServers(const std::vector<std::string>& hosts, const std::string& port)
+{
+	pthread_mutex_lock(&m_lock);
+	for (const std::string& host : hosts) {
+		server& s = m_servers[host + ":" + port];
+		if (s.host.empty()) {
+			s.host = host;
+			s.port = port;
+			s.state = serverState();
+			parseSdp("", s.state);
+			s.placed = 0;
+			s.unreachable_until = 0;
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void serverPool::start()
+{
+	if (m_running.exchange(true))
+		return;
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+}
+
+void serverPool::stop()
+{
+	if (!m_running.exchange(false))
+		return;
+	eventfd_write(m_event_fd, 1);
+	pthread_join(m_thread, nullptr);
+	m_thread = 0;
+}
+
+void* serverPool::thread_wrapper(void* ptr)
+{
+	return static_cast<serverPool*>(ptr)->probeLoop();
+}
+
+// One DESCRIBE request on a connection of its own
+bool serverPool::describe(const std::string& host, const std::string& port, std::string& response)
+{
+	struct addrinfo hints;
+	struct addrinfo* result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result))
+		return false;
+
+	int fd = socket(result->ai_family, result->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, result->ai_protocol);
+	if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) && errno != EINPROGRESS) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	if (fd < 0)
+		return false;
+
+	struct pollfd pfd = {fd, POLLOUT, 0};
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (poll(&pfd, 1, DESCRIBE_TIMEOUT_MS) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		close(fd);
+		return false;
+	}
+
+	const std::string request = "DESCRIBE rtsp://" + host + ":" + port + "/ RTSP/1.0\r\n"
+		"CSeq: 1\r\nAccept: application/sdp\r\nUser-Agent: satip-client\r\n\r\n";
+	if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+		close(fd);
+		return false;
+	}
+
+	// until the headers and Content-Length bytes of body are in
+	response.clear();
+	size_t want = std::string::npos;
+	pfd.events = POLLIN;
+	while (response.size() < want && poll(&pfd, 1, DESCRIBE_TIMEOUT_MS) == 1) {
+		char buf[4096];
+		const ssize_t res = recv(fd, buf, sizeof(buf), 0);
+		if (res <= 0)
+			break;
+		response.append(buf, res);
+		const size_t end = response.find("\r\n\r\n");
+		if (want == std::string::npos && end != std::string::npos) {
+			const std::string_view length = satipRTSP::headerValue(std::string_view(response).substr(0, end + 4), "Content-Length");
+			want = end + 4 + (length.empty() ? 0 : strtoul(std::string(length).c_str(), nullptr, 10));
+		}
+	}
+	close(fd);
+	return response.substr(0, 5) == "RTSP/";
+}
+
+void serverPool::updateFromDescribe(const std::string& host, const std::string& port, std::string_view response)
+{
+	const int status = response.size() > 9 ? toInt(response.substr(9, 3)) : 0;
+	serverState state;
+	parseSdp(status == 200 ? response : std::string_view(), state);
+
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_servers.find(host + ":" + port);
+	if (it != m_servers.end()) {
+		server& s = it->second;
+		if (status == 200) {
+			if (!state.described) // streams without the capacity line, keep what we know
+				std::copy(s.state.frontends, s.state.frontends + 3, state.frontends);
+			s.state = state;
+		} else if (status == 404) {
+			// no streams on the server
+			for (int i = 0; i < 3; ++i)
+				s.state.used[i].clear();
+			s.state.streams.clear();
+		}
+		s.unreachable_until = 0;
+		DEBUG(MSG_NET, "server %s: DESCRIBE %d, DVB-S %d/%d, DVB-C %d/%d, DVB-T %d/%d frontends used, %zu streams\n",
+			it->first.c_str(), status,
+			static_cast<int>(s.state.used[FE_TYPE_SAT].size()), s.state.frontends[FE_TYPE_SAT],
+			static_cast<int>(s.state.used[FE_TYPE_CABLE].size()), s.state.frontends[FE_TYPE_CABLE],
+			static_cast<int>(s.state.used[FE_TYPE_TERRESTRIAL].size()), s.state.frontends[FE_TYPE_TERRESTRIAL],
+			s.state.streams.size());
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void serverPool::probe(const std::string& key)
+{
+	pthread_mutex_lock(&m_lock);
+	const std::string host = m_servers[key].host;
+	const std::string port = m_servers[key].port;
+	pthread_mutex_unlock(&m_lock);
+
+	std::string response;
+	if (describe(host, port, response))
+		updateFromDescribe(host, port, response);
+	else
+		reportUnreachable(host, port);
+}
+
+void* serverPool::probeLoop()
+{
+	threadRoleScope role(THREAD_ROLE_SESSION, "satip-pool");
+	DEBUG(MSG_MAIN, "SERVER POOL LOOP START\n");
+	while (m_running)
+	{
+		std::vector<std::string> keys;
+		pthread_mutex_lock(&m_lock);
+		for (const auto& [key, s] : m_servers)
+			keys.push_back(key);
+		pthread_mutex_unlock(&m_lock);
+
+		for (const std::string& key : keys)
+			if (m_running)
+				probe(key);
+
+		struct pollfd pfd = {m_event_fd, POLLIN, 0};
+		if (poll(&pfd, 1, PROBE_INTERVAL * 1000) > 0) {
+			eventfd_t value;
+			eventfd_read(m_event_fd, &value);
+		}
+	}
+	DEBUG(MSG_MAIN, "SERVER POOL LOOP END.\n");
+	return 0;
+}
+
+bool serverPool::isRefused(server& s, const transponderId& tp, time_t now)
+{
+	s.refused.erase(std::remove_if(s.refused.begin(), s.refused.end(),
+		[now](const std::pair<transponderId, time_t>& r) { return r.second <= now; }), s.refused.end());
+	for (const auto& r : s.refused)
+		if (r.first == tp)
+			return true;
+	return false;
+}
+
+std::string serverPool::place(const std::vector<std::string>& hosts, const std::string& port, const transponderId& tp)
+{
+	const time_t now = time(NULL);
+	server* best = nullptr;
+	int best_rank[4] = {0, 0, 0, 0};
+
+	pthread_mutex_lock(&m_lock);
+	for (int pass = 0; pass < 2 && !best; ++pass) {
+		for (const std::string& host : hosts) {
+			const auto it = m_servers.find(host + ":" + port);
+			if (it == m_servers.end())
+				continue;
+			server& s = it->second;
+			// the second pass takes any server, all are in backoff
+			if (pass == 0 && (s.unreachable_until > now || isRefused(s, tp, now)))
+				continue;
+
+			// frontends other instances hold or reserve, newer than the last DESCRIBE
+			const std::vector<transponderId> remote = satipCoordinator::getInstance()->remoteTransponders(it->first);
+			const int remote_used = std::count_if(remote.begin(), remote.end(),
+				[&tp](const transponderId& r) { return r.fe_type == tp.fe_type; });
+
+			const bool streaming = std::find(s.state.streams.begin(), s.state.streams.end(), tp) != s.state.streams.end() ||
+				std::find(remote.begin(), remote.end(), tp) != remote.end();
+			const int total = tp.fe_type >= 0 && tp.fe_type < 3 ? s.state.frontends[tp.fe_type] : -1;
+			const int used = std::max(static_cast<int>(total >= 0 ? s.state.used[tp.fe_type].size() : 0), s.placed + remote_used);
+			const int free_fe = total >= 0 ? total - used : 0;
+
+			// transponder streamed, free frontends (or unknown), how many, fewest of ours
+			const int rank[4] = {streaming, total < 0 || free_fe > 0, free_fe, -s.placed};
+			if (!best || std::lexicographical_compare(best_rank, best_rank + 4, rank, rank + 4)) {
+				best = &s;
+				std::copy(rank, rank + 4, best_rank);
+			}
+		}
+	}
+
+	std::string host = hosts.empty() ? std::string() : hosts[0];
+	if (best) {
+		++best->placed;
+		host = best->host;
+		INFO(MSG_MAIN, "%s transponder %u goes to %s (%s, %d of %d frontends in use)\n",
+			tp.fe_type >= 0 && tp.fe_type < 3 ? fe_type_name[tp.fe_type] : "?", tp.freq / 10, host.c_str(),
+			best_rank[0] ? "already streamed" : "least loaded",
+			tp.fe_type >= 0 && tp.fe_type < 3 ? static_cast<int>(best->state.used[tp.fe_type].size()) : 0,
+			tp.fe_type >= 0 && tp.fe_type < 3 ? best->state.frontends[tp.fe_type] : -1);
+	}
+	pthread_mutex_unlock(&m_lock);
+	return host;
+}
+
+void serverPool::release(const std::string& host, const std::string& port)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_servers.find(host + ":" + port);
+	if (it != m_servers.end() && it->second.placed > 0)
+		--it->second.placed;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void serverPool::reportUnreachable(const std::string& host, const std::string& port)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_servers.find(host + ":" + port);
+	if (it != m_servers.end()) {
+		if (it->second.unreachable_until <= time(NULL))
+			WARN(MSG_NET, "server %s unreachable, avoided for %d s\n", it->first.c_str(), UNREACHABLE_BACKOFF);
+		it->second.unreachable_until = time(NULL) + UNREACHABLE_BACKOFF;
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void serverPool::reportRefused(const std::string& host, const std::string& port, const transponderId& tp, int status)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_servers.find(host + ":" + port);
+	if (it != m_servers.end()) {
+		WARN(MSG_NET, "server %s refused transponder %u (RTSP %d), avoided for it for %d s\n",
+			it->first.c_str(), tp.freq / 10, status, REFUSED_BACKOFF);
+		it->second.refused.emplace_back(tp, time(NULL) + REFUSED_BACKOFF);
+	}
+	pthread_mutex_unlock(&m_lock);
+	// 503: out of frontends, our idea of its load is off
+	if (status == 503)
+		eventfd_write(m_event_fd, 1);
+}
+
+bool serverPool::getState(const std::string& host, const std::string& port, serverState& state)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_servers.find(host + ":" + port);
+	const bool found = it != m_servers.end();
+	if (found)
+		state = it->second.state;
+	pthread_mutex_unlock(&m_lock);
+	return found;
+}
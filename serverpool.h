@@ -0,0 +1,112 @@
+/*
+ * satip: tuner pool over several servers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_SERVERPOOL_H
+#define _SATIP_SERVERPOOL_H
+
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "config.h"
+
+/*
+ * State of the servers of the vtuners with several ipaddr. A thread sends
+ * DESCRIBE to each server every PROBE_INTERVAL seconds; the SDP gives the
+ * number of frontends per type (s=SatIPServer:1 S,T,C) and the streams, with
+ * the frontend and transponder of each (a=fmtp:33 ...;tuner=...).
+ *
+ * A new session goes to the server already streaming its transponder, else
+ * to the one with the most free frontends of its type. Servers that could
+ * not be reached or refused a transponder are avoided for a while. With
+ * coordination the transponders of other instances count as in use too.
+ */
+class serverPool
+{
+public:
+	static constexpr int PROBE_INTERVAL = 30;  // sec
+	static constexpr int UNREACHABLE_BACKOFF = 30; // sec
+	static constexpr int REFUSED_BACKOFF = 120; // sec
+
+	// contents of one DESCRIBE response
+	struct serverState
+	{
+		bool described;   // capacity known
+		int frontends[3]; // by FE_TYPE_*, -1 unknown
+		std::set<int> used[3];
+		std::vector<transponderId> streams;
+	};
+
+	// parse the SDP of a DESCRIBE response into 'state'
+	static bool parseSdp(std::string_view sdp, serverState& state);
+
+private:
+	struct server
+	{
+		std::string host;
+		std::string port;
+		serverState state;
+		int placed;             // our sessions on it
+		time_t unreachable_until;
+		std::vector<std::pair<transponderId, time_t>> refused;
+	};
+
+	pthread_mutex_t m_lock;
+	std::map<std::string, server> m_servers; // by host:port
+	pthread_t m_thread;
+	std::atomic<bool> m_running;
+	int m_event_fd;
+
+	static void* thread_wrapper(void* ptr);
+	void* probeLoop();
+	bool describe(const std::string& host, const std::string& port, std::string& response);
+	void probe(const std::string& key);
+
+	bool isRefused(server& s, const transponderId& tp, time_t now);
+
+public:
+	serverPool();
+	virtual ~serverPool();
+
+	void addServers(const std::vector<std::string>& hosts, const std::string& port);
+	void start();
+	void stop();
+
+	// the host for a new session on 'tp', counted as placed until release()
+	std::string place(const std::vector<std::string>& hosts, const std::string& port, const transponderId& tp);
+	void release(const std::string& host, const std::string& port);
+
+	void reportUnreachable(const std::string& host, const std::string& port);
+	void reportRefused(const std::string& host, const std::string& port, const transponderId& tp, int status);
+	void updateFromDescribe(const std::string& host, const std::string& port, std::string_view response);
+	// what the last DESCRIBE of host:port told, false if it is not in the pool
+	bool getState(const std::string& host, const std::string& port, serverState& state);
+
+	static serverPool* getInstance()
+	{
+		static serverPool instance;
+		return &instance;
+	}
+};
+
+#endif
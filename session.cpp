@@ -28,6 +28,7 @@
 #include "rtsp.h"
 #include "log.h"
 #include "option.h"
+#include "threadpolicy.h"
 
 satipSession::satipSession(const char* host,
 							const char* rtsp_port,
@@ -45,13 +46,19 @@ satipSession::satipSession(const char* host,
 		host, rtsp_port, fe_type);
 	m_satip_config = new satipConfig(fe_type, settings);
 	m_satip_vtuner = new satipVtuner(m_satip_config);
-	m_satip_rtp  = new satipRTP(m_satip_vtuner->getVtunerFd(), settings->m_tcpdata, settings->m_rtp_net_buffer_size_mb);
+	m_satip_rtp  = new satipRTP(m_satip_vtuner->getVtunerFd(), settings, m_satip_config->getPidFilter());
 
 	m_satip_vtuner->setSatipRTP(m_satip_rtp); // for receive RTCP data
 
 	m_satip_rtsp = new satipRTSP(m_satip_config, host, rtsp_port, m_satip_rtp);
 
-	if (m_satip_vtuner->isOpened() && m_satip_rtp->isOpened())
+	// other outputs work without a vtuner device, there is just no frontend control
+	if (!m_satip_vtuner->isOpened() && !outputSink::isVtuner(settings->m_output))
+		WARN(MSG_MAIN, "no vtuner device, running without frontend control\n");
+	else if (!m_satip_vtuner->isOpened())
+		return;
+
+	if (m_satip_rtp->isOpened())
 		initok = 1;
 }
 
@@ -80,25 +87,36 @@ void *satipSession::thread_wrapper(void *ptr)
 
 void *satipSession::satipMainLoop()
 {
-	struct pollfd poll_fds[2];
+	threadRoleScope role(THREAD_ROLE_SESSION, "satip-session");
+	struct pollfd poll_fds[3];
 	int poll_nfds;
 	int poll_ret;
 	int poll_timeout = 1000;
 
-	poll_fds[0].fd = m_satip_vtuner->getVtunerFd();
-	poll_fds[0].events = POLLPRI;
-	poll_nfds=1;
+	poll_fds[0].fd = m_satip_vtuner->getPollFd();
+	poll_fds[0].events = m_satip_vtuner->getPollEvents();
+	// PID changes of sessions sharing our transponder and vice versa, config reloads
+	poll_fds[1].fd = m_satip_config->getEventFd();
+	poll_fds[1].events = POLLIN;
+	poll_nfds=2;
 
 	while (m_running)
 	{
+		if (m_satip_config->applyReloadSettings())
+		{
+			m_satip_rtp->resizeNetBuffer(m_satip_config->getRtpNetBufferSizeMB());
+			m_satip_rtsp->resizeNetBuffer();
+		}
+		m_satip_config->applyPendingTuning();
+
 		/* loop */
 		m_satip_rtsp->handleRTSPStatus();
 
-		poll_nfds = 1;
-		poll_fds[1].fd = m_satip_rtsp->getRtspSocketFd();
-		poll_fds[1].events = m_satip_rtsp->getPollEvent();
-		poll_fds[1].revents = 0;
-		if (poll_fds[1].events != 0)
+		poll_nfds = 2;
+		poll_fds[2].fd = m_satip_rtsp->getRtspSocketFd();
+		poll_fds[2].events = m_satip_rtsp->getPollEvent();
+		poll_fds[2].revents = 0;
+		if (poll_fds[2].events != 0)
 		{
 			poll_nfds++;
 		}
@@ -120,13 +138,17 @@ void *satipSession::satipMainLoop()
 			break;
 		}
 
-		m_satip_rtsp->handleNextTimer();
-
+		// frontend requests first, the frontend is waiting for the answer
 		if (poll_fds[0].revents != 0)
 			m_satip_vtuner->vtunerEvent();
 
 		if (poll_fds[1].revents != 0)
-			m_satip_rtsp->handlePollEvents(poll_fds[1].revents);
+			m_satip_config->clearEvent(); // handled at the top of the loop and by handleRTSPStatus()
+
+		m_satip_rtsp->handleNextTimer();
+
+		if (poll_nfds > 2 && poll_fds[2].revents != 0)
+			m_satip_rtsp->handlePollEvents(poll_fds[2].revents);
 
 	}
 	return 0;
@@ -148,6 +170,7 @@ void satipSession::stop()
 {
 	m_satip_rtp->stop();
 	m_running = false;
+	m_satip_config->wakeUp(); // don't wait for the poll timeout
 }
 
 void satipSession::join()
@@ -160,3 +183,15 @@ void satipSession::join()
 	}
 }
 
+
+// Options a running session takes over, applied on the session thread
+void satipSession::reload(const vtunerOpt& settings)
+{
+	m_satip_config->setReloadSettings(settings);
+}
+
+// Tuning of a session without vtuner device, applied on the session thread
+void satipSession::tune(const tuningRequest& tuning)
+{
+	m_satip_config->setPendingTuning(tuning);
+}
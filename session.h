@@ -35,6 +35,7 @@ public:
 		virtual void run() = 0;
 		virtual void stop() = 0;
 		virtual void join() = 0;
+		virtual void reload(const vtunerOpt& settings) = 0;
 		virtual ~Session() {};
 };
 
@@ -62,6 +63,8 @@ public:
 	void run();
 	void stop();
 	void join();
+	void reload(const vtunerOpt& settings);
+	void tune(const tuningRequest& tuning); // any thread
 };
 
 #endif // __SESSION_H__
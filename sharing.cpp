@@ -0,0 +1,142 @@
+/*
+ * satip: transponder sharing between local tuners
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "sharing.h"
+#include "config.h"
+#include "rtp.h"
+#include "log.h"
+
+transponderRegistry::transponderRegistry()
+{
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+transponderRegistry::~transponderRegistry()
+{
+	pthread_mutex_destroy(&m_lock);
+}
+
+void transponderRegistry::updateOwnerPids(entry& e)
+{
+	pidSet pids;
+	for (const guest& g : e.guests)
+		pids |= g.pids;
+	e.config->setGuestPids(pids, !e.guests.empty());
+}
+
+bool transponderRegistry::claim(const std::string& key, satipConfig* config, satipRTP* rtp)
+{
+	pthread_mutex_lock(&m_lock);
+	const bool claimed = m_entries.find(key) == m_entries.end();
+	if (claimed)
+		m_entries[key] = entry{config, rtp, {}};
+	pthread_mutex_unlock(&m_lock);
+	return claimed;
+}
+
+void transponderRegistry::release(satipConfig* config)
+{
+	pthread_mutex_lock(&m_lock);
+	for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+	{
+		entry& e = it->second;
+		if (e.config != config)
+			continue;
+
+		for (guest& g : e.guests)
+		{
+			e.rtp->removeGuest(g.rtp);
+			g.rtp->setShareSource(nullptr);
+			g.config->setShareLost();
+			INFO(MSG_MAIN, "tuner %d: stream of tuner %d ended, tuning on its own\n",
+				g.config->getTunerIndex(), config->getTunerIndex());
+		}
+		if (!e.guests.empty())
+			config->setGuestPids(pidSet(), false);
+		m_entries.erase(it);
+		break;
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+bool transponderRegistry::hasOwner(const std::string& key, const satipConfig* config)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_entries.find(key);
+	const bool found = it != m_entries.end() && it->second.config != config;
+	pthread_mutex_unlock(&m_lock);
+	return found;
+}
+
+bool transponderRegistry::attach(const std::string& key, satipConfig* config, satipRTP* rtp, const pidSet& pids)
+{
+	pthread_mutex_lock(&m_lock);
+	const auto it = m_entries.find(key);
+	const bool attached = it != m_entries.end() && it->second.config != config;
+	if (attached)
+	{
+		entry& e = it->second;
+		e.guests.push_back(guest{config, rtp, pids});
+		rtp->setShareSource(e.rtp);
+		e.rtp->addGuest(rtp);
+		updateOwnerPids(e);
+		INFO(MSG_MAIN, "tuner %d: sharing the stream of tuner %d\n",
+			config->getTunerIndex(), e.config->getTunerIndex());
+	}
+	pthread_mutex_unlock(&m_lock);
+	return attached;
+}
+
+void transponderRegistry::detach(satipConfig* config)
+{
+	pthread_mutex_lock(&m_lock);
+	for (auto& [key, e] : m_entries)
+	{
+		for (auto it = e.guests.begin(); it != e.guests.end(); ++it)
+		{
+			if (it->config != config)
+				continue;
+			e.rtp->removeGuest(it->rtp);
+			it->rtp->setShareSource(nullptr);
+			e.guests.erase(it);
+			updateOwnerPids(e);
+			DEBUG(MSG_MAIN, "tuner %d: left the stream of tuner %d\n",
+				config->getTunerIndex(), e.config->getTunerIndex());
+			pthread_mutex_unlock(&m_lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void transponderRegistry::updateGuestPids(satipConfig* config, const pidSet& pids)
+{
+	pthread_mutex_lock(&m_lock);
+	for (auto& [key, e] : m_entries)
+	{
+		for (guest& g : e.guests)
+		{
+			if (g.config == config)
+			{
+				g.pids = pids;
+				updateOwnerPids(e);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+}
@@ -0,0 +1,86 @@
+/*
+ * satip: transponder sharing between local tuners
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_SHARING_H
+#define _SATIP_SHARING_H
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <pthread.h>
+
+#include "pidset.h"
+
+class satipConfig;
+class satipRTP;
+
+/*
+ * Sessions tuned to the same transponder of the same server (same server
+ * address and tuning string) share one RTSP session. The first one, the
+ * owner, requests the union of the PIDs of all of them; the others, the
+ * guests, get the owner's TS filtered by their own PIDs. When the owner
+ * retunes or stops, its guests are detached and set up their own stream.
+ *
+ * Called from the session threads; the configs are only told about changes
+ * and apply them on their own thread.
+ */
+class transponderRegistry
+{
+	struct guest
+	{
+		satipConfig* config;
+		satipRTP* rtp;
+		pidSet pids;
+	};
+
+	struct entry
+	{
+		satipConfig* config;
+		satipRTP* rtp;
+		std::list<guest> guests;
+	};
+
+	pthread_mutex_t m_lock;
+	std::map<std::string, entry> m_entries;
+
+	void updateOwnerPids(entry& e);
+
+public:
+	transponderRegistry();
+	virtual ~transponderRegistry();
+
+	// become the owner of 'key', false if it has one
+	bool claim(const std::string& key, satipConfig* config, satipRTP* rtp);
+	// give up the ownership, the guests are detached
+	void release(satipConfig* config);
+	// true if 'key' is streamed by another session
+	bool hasOwner(const std::string& key, const satipConfig* config);
+
+	// join the stream of the owner of 'key' with 'pids'
+	bool attach(const std::string& key, satipConfig* config, satipRTP* rtp, const pidSet& pids);
+	void detach(satipConfig* config);
+	void updateGuestPids(satipConfig* config, const pidSet& pids);
+
+	static transponderRegistry* getInstance()
+	{
+		static transponderRegistry instance;
+		return &instance;
+	}
+};
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * satip: frontend telemetry
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <atomic>
+#include <cstdint>
+
+/* State of one tuner as seen through RTCP and the received stream */
+struct frontendTelemetry
+{
+	uint32_t has_lock;
+	uint32_t signal_strength; // 0 - 65535
+	uint32_t signal_quality;  // 0 - 65535
+
+	/* last completed window */
+	uint32_t window_ts_packets;
+	uint32_t window_errors;   // lost + cc errors + tei
+
+	/* totals since tuning */
+	uint32_t rtp_lost;        // RTP packets
+	uint32_t cc_errors;       // TS continuity errors
+	uint32_t tei_packets;     // transport error indicator set
+	uint32_t restarts;        // server side stream restarts (BYE, SSRC change)
+
+	/* from the RTCP sender reports */
+	int32_t clock_drift_ppm;  // server clock against ours
+	int32_t sr_offset_us;     // receive time - send time
+	uint32_t sr_delay_excess_us; // offset above the lowest seen
+};
+
+static_assert(sizeof(frontendTelemetry) % sizeof(uint32_t) == 0, "frontendTelemetry is copied in words");
+
+/*
+ * Seqlock around a frontendTelemetry. Writers (RTP thread, RTCP parser,
+ * unset on tuning) are serialised by moving the sequence from even to odd,
+ * readers retry while a write is in progress. Neither side blocks.
+ */
+class telemetrySeqlock
+{
+	static constexpr int WORDS = sizeof(frontendTelemetry) / sizeof(uint32_t);
+
+	std::atomic<uint32_t> m_seq;
+	std::atomic<uint32_t> m_data[WORDS];
+
+public:
+	telemetrySeqlock() : m_seq(0)
+	{
+		for (auto& w : m_data)
+			w.store(0, std::memory_order_relaxed);
+	}
+
+	void publish(const frontendTelemetry& t)
+	{
+		uint32_t seq = m_seq.load(std::memory_order_relaxed);
+		for (;;) {
+			if (!(seq & 1) && m_seq.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire))
+				break;
+			seq = m_seq.load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_release);
+
+		const uint32_t* src = reinterpret_cast<const uint32_t*>(&t);
+		for (int i = 0; i < WORDS; ++i)
+			m_data[i].store(src[i], std::memory_order_relaxed);
+
+		m_seq.store(seq + 2, std::memory_order_release);
+	}
+
+	frontendTelemetry read() const
+	{
+		frontendTelemetry t;
+		uint32_t* dst = reinterpret_cast<uint32_t*>(&t);
+		uint32_t seq;
+		do {
+			seq = m_seq.load(std::memory_order_acquire);
+			for (int i = 0; i < WORDS; ++i)
+				dst[i] = m_data[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		} while ((seq & 1) || seq != m_seq.load(std::memory_order_relaxed));
+		return t;
+	}
+};
+
+#endif // __TELEMETRY_H__
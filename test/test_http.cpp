@@ -0,0 +1,147 @@
+/*
+ * satip: HTTP streaming checks
+ *
+ * A stream that ends closes its clients, and the server thread must not
+ * look at the ring again: again and again a client gets the live TS of a
+ * ring, the ring is destroyed while the server loop runs, the client sees
+ * the close, and in the end the loop still serves a new ring of the same
+ * tuner. Build with -fsanitize=address to catch any access to a destroyed
+ * ring, e.g. by the next pass of the loop.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+#include "httpstream.h"
+#include "log.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define TS_PACKET_SIZE 188
+#define LOOP_PASS_US 250000 // more than two passes of an idle server loop
+#define STREAMS 500
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+// A client of /tuner/0 that got the response header, -1 on errors
+static int connectClient(int port)
+{
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	struct timeval tv = {2, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	static const char request[] = "GET /tuner/0 HTTP/1.0\r\n\r\n";
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+			send(fd, request, sizeof(request) - 1, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	std::string header;
+	char c;
+	while (header.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1)
+		header += c;
+	if (header.compare(0, 12, "HTTP/1.0 200") != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void writePackets(streamRing* ring, int count)
+{
+	std::vector<unsigned char> data(count * TS_PACKET_SIZE, 0xff);
+	for (int i = 0; i < count; ++i)
+		data[i * TS_PACKET_SIZE] = 0x47;
+	struct iovec iov = {data.data(), data.size()};
+	ring->write(&iov, 1);
+}
+
+// Bytes received until 'want' or the timeout, 0 on a close
+static ssize_t receive(int fd, size_t want)
+{
+	std::vector<char> buf(want);
+	size_t got = 0;
+	while (got < want) {
+		const ssize_t res = recv(fd, buf.data() + got, want - got, 0);
+		if (res <= 0)
+			return got > 0 ? static_cast<ssize_t>(got) : res;
+		got += res;
+	}
+	return got;
+}
+
+int main()
+{
+	httpServer server;
+	const int port = server.start(0);
+	if (port < 0) {
+		printf("FAIL: server did not start\n");
+		return 1;
+	}
+
+	// the ring goes away at any point of a pass, often enough to hit the
+	// gap between two passes
+	for (int n = 0; n < STREAMS && failures == 0; ++n) {
+		streamRing* ring = new streamRing(&server, 0);
+		const int fd = connectClient(port);
+		check(fd >= 0, "client accepted");
+		if (fd < 0) {
+			delete ring;
+			break;
+		}
+		writePackets(ring, 10);
+		check(receive(fd, 10 * TS_PACKET_SIZE) == 10 * TS_PACKET_SIZE, "client gets the TS");
+		delete ring;
+		check(receive(fd, 1) == 0, "client closed when the stream ended");
+		close(fd);
+	}
+
+	// the loop still runs
+	usleep(LOOP_PASS_US);
+	streamRing* ring = new streamRing(&server, 0);
+	const int fd = connectClient(port);
+	check(fd >= 0, "client of the last ring accepted");
+	writePackets(ring, 10);
+	check(fd >= 0 && receive(fd, 10 * TS_PACKET_SIZE) == 10 * TS_PACKET_SIZE, "client of the last ring gets the TS");
+	if (fd >= 0)
+		close(fd);
+
+	server.stop();
+	delete ring;
+
+	if (failures == 0)
+		printf("test_http: ok\n");
+	return failures == 0 ? 0 : 1;
+}
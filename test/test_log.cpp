@@ -0,0 +1,117 @@
+/*
+ * satip: asynchronous logger checks
+ *
+ * String arguments longer than the record can hold are truncated, not
+ * copied past it: the first string is kept, the second is cut at the end of
+ * the record and the ones after it are logged empty. The precision in the
+ * format keeps the formatted line short. Build with -fsanitize=address to
+ * catch any access past the record as well.
+ *
+ * The summary of suppressed rate limited messages names the call site and
+ * its values, not the format string of the message.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "log.h"
+
+int dbg_level = MSG_DEBUG;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define LOG_RING_SIZE 64 // as in log.cpp
+#define LONG_STR 600
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	if (!ok) {
+		fprintf(stdout, "FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+// Run 'fn' with stderr sent to a temporary file, returns what was written
+template <typename F>
+static std::string captureStderr(F fn)
+{
+	FILE* tmp = tmpfile();
+	if (tmp == NULL) {
+		perror("tmpfile");
+		exit(2);
+	}
+	fflush(stderr);
+	const int saved = dup(STDERR_FILENO);
+	dup2(fileno(tmp), STDERR_FILENO);
+
+	fn();
+
+	fflush(stderr);
+	dup2(saved, STDERR_FILENO);
+	close(saved);
+
+	std::string out;
+	char buf[4096];
+	rewind(tmp);
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0)
+		out.append(buf, n);
+	fclose(tmp);
+	return out;
+}
+
+int main()
+{
+	const std::string a(LONG_STR, 'a');
+	const std::string b(LONG_STR, 'b');
+	const std::string c(LONG_STR, 'c');
+	const std::string d(LONG_STR, 'd');
+
+	const std::string out = captureStderr([&] {
+		log_start();
+		// Fill the ring up to its last slot so the long record is the one
+		// at the end of the allocation
+		for (int i = 0; i < LOG_RING_SIZE - 1; ++i)
+			write_message(MSG_MAIN, MSG_INFO, "fill %d\n", i);
+		write_message(MSG_MAIN, MSG_INFO, "long <%.4s|%.4s|%.4s|%.4s> %d\n", a.c_str(), b.c_str(), c.c_str(), d.c_str(), 42);
+		write_message(MSG_MAIN, MSG_INFO, "after\n");
+		log_stop();
+	});
+
+	check(out.find("long <aaaa|bbbb||> 42\n") != std::string::npos, "long strings truncated, int kept");
+	check(out.find("after") != std::string::npos || out.find("log records dropped") != std::string::npos,
+		"record after the long one written or counted");
+	check(out.find("fill 0\n") != std::string::npos && out.find("fill 62\n") != std::string::npos,
+		"fill records written");
+
+	const std::string summary = captureStderr([&] {
+		log_set_ratelimit(MSG_NET, 1.0, 1.0);
+		for (int i = 0; i < 10; ++i)
+			WARN_RL(MSG_NET, i, "lost %d packets\n", i);
+		log_flush_ratelimits(true);
+	});
+
+	check(summary.find("lost 0 packets\n") != std::string::npos, "first rate limited message written");
+	check(summary.find("9 occurrences") != std::string::npos, "suppressed messages summarised");
+	check(summary.find("first/last value 1/9\n") != std::string::npos, "summary has the values");
+	check(summary.find('%') == std::string::npos, "summary has no format string");
+
+	if (failures == 0)
+		printf("test_log: ok\n");
+	return failures == 0 ? 0 : 1;
+}
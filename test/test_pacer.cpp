@@ -0,0 +1,160 @@
+/*
+ * satip: PCR pacing across zaps
+ *
+ * A stream with the PCR on one PID, a zap (reset()) to a service with the
+ * PCR on another PID and a different clock, then back to the first PID
+ * without a reset. The data arrives in 100ms bursts; paced, each burst is
+ * written in many small chunks, passed through it goes out in one write.
+ * Pacing has to come back after each zap.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "log.h"
+#include "output.h"
+#include "pacer.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define TS_PACKET_SIZE 188
+#define BURST_NS 100000000ULL
+#define PACKETS_PER_BURST 140 // about 2Mbit/s
+#define PCR_EVERY 50 // packets, 36ms
+#define LATENCY_MS 100
+#define MIN_WRITES_PER_BURST 4
+
+class countingSink : public outputSink
+{
+public:
+	std::atomic<unsigned int> writes{0};
+
+	int write(struct iovec* iov, int iovcnt) override
+	{
+		int bytes = 0;
+		for (int i = 0; i < iovcnt; ++i)
+			bytes += iov[i].iov_len;
+		writes.fetch_add(1, std::memory_order_relaxed);
+		return bytes;
+	}
+	const char* describe() const override { return "counter"; }
+};
+
+static uint64_t monotonicNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+		;
+}
+
+/* TS of one service, the PCR on 'pcr_pid' follows the stream time */
+class tsService
+{
+	int m_pcr_pid;
+	uint64_t m_pcr_offset;
+	uint64_t m_packets;
+	unsigned char m_burst[PACKETS_PER_BURST * TS_PACKET_SIZE];
+
+public:
+	tsService(int pcr_pid, uint64_t pcr_offset) : m_pcr_pid(pcr_pid), m_pcr_offset(pcr_offset), m_packets(0) {}
+
+	// one burst of data, BURST_NS of stream time
+	const unsigned char* burst()
+	{
+		memset(m_burst, 0xff, sizeof(m_burst));
+		for (int i = 0; i < PACKETS_PER_BURST; ++i, ++m_packets) {
+			unsigned char* ts = m_burst + i * TS_PACKET_SIZE;
+			ts[0] = 0x47;
+			ts[1] = (m_pcr_pid >> 8) & 0x1f;
+			ts[2] = m_pcr_pid & 0xff;
+			ts[3] = 0x10 | (m_packets & 0x0f);
+			if (m_packets % PCR_EVERY)
+				continue;
+			const uint64_t pcr = m_pcr_offset + m_packets * BURST_NS / PACKETS_PER_BURST * 27 / 1000;
+			const uint64_t base = pcr / 300;
+			ts[3] |= 0x20;
+			ts[4] = 7;
+			ts[5] = 0x10;
+			ts[6] = base >> 25;
+			ts[7] = base >> 17;
+			ts[8] = base >> 9;
+			ts[9] = base >> 1;
+			ts[10] = ((base & 1) << 7) | 0x7e | ((pcr % 300) >> 8);
+			ts[11] = pcr % 300;
+		}
+		return m_burst;
+	}
+};
+
+static int failures = 0;
+
+// Stream 'bursts', returns the writes per burst over the last 'measured'
+static double stream(satipPacer& pacer, countingSink& sink, tsService& service, int bursts, int measured)
+{
+	uint64_t next = monotonicNs();
+	unsigned int writes = 0;
+	for (int i = 0; i < bursts; ++i) {
+		if (i == bursts - measured)
+			writes = sink.writes.load();
+		struct iovec iov;
+		iov.iov_base = const_cast<unsigned char*>(service.burst());
+		iov.iov_len = PACKETS_PER_BURST * TS_PACKET_SIZE;
+		pacer.push(&iov, 1);
+		next += BURST_NS;
+		sleepUntil(next);
+	}
+	return static_cast<double>(sink.writes.load() - writes) / measured;
+}
+
+static void check(double writes_per_burst, const char* phase)
+{
+	const bool ok = writes_per_burst >= MIN_WRITES_PER_BURST;
+	printf("%s: %.1f writes per burst%s\n", phase, writes_per_burst, ok ? "" : ", not paced");
+	if (!ok)
+		++failures;
+}
+
+int main()
+{
+	countingSink sink;
+	satipPacer pacer(&sink, -1, LATENCY_MS);
+	tsService first(100, 0);
+	tsService second(200, 27000000ULL * 3600);
+	pacer.run();
+
+	check(stream(pacer, sink, first, 10, 5), "PCR PID 100");
+
+	pacer.reset();
+	check(stream(pacer, sink, second, 20, 5), "zap to PCR PID 200");
+
+	// no reset, the PCR PID is found again after a second without
+	check(stream(pacer, sink, first, 25, 5), "back to PCR PID 100 without reset");
+
+	pacer.stop();
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+/*
+ * satip: pids=all switchover
+ *
+ * With many PIDs the client asks the server for pids=all and filters the
+ * TS itself; it switches on at pids_all_count PIDs and back off only below
+ * three quarters of it, so a PID more or less at the limit does not send
+ * a new PLAY each time. Many PID changes within a minute (pids_all_churn)
+ * switch it on as well, pids_all forces it. The filter is on whenever the
+ * server sends pids=all. The churn falling back off takes minutes and is
+ * not checked here.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+
+#include "config.h"
+#include "log.h"
+#include "option.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		++failures;
+	}
+}
+
+// PIDs first .. first + count - 1
+static void tune(satipConfig& config, int first, int count)
+{
+	pidSet pids;
+	for (int i = 0; i < count; ++i)
+		pids.set(first + i);
+	config.updatePidList(pids);
+}
+
+static void checkMode(satipConfig& config, bool on, const char* what)
+{
+	check(config.isPidsAll() == on, what);
+	check(config.getPidFilter()->isEnabled() == on, what);
+}
+
+int main()
+{
+	/* PID count, 8 on and 6 stays on */
+	{
+		vtunerOpt settings;
+		settings.m_pids_all_count = 8;
+		satipConfig config(FE_TYPE_SAT, &settings);
+
+		tune(config, 0x100, 7);
+		checkMode(config, false, "off below the count");
+		tune(config, 0x100, 8);
+		checkMode(config, true, "on at the count");
+		check(config.getPidFilter()->test(0x107) && !config.getPidFilter()->test(0x108), "filter has the PIDs");
+		tune(config, 0x100, 6);
+		checkMode(config, true, "stays on at 3/4 of the count");
+		tune(config, 0x100, 5);
+		checkMode(config, false, "off below 3/4 of the count");
+		tune(config, 0x100, 7);
+		checkMode(config, false, "stays off below the count");
+		tune(config, 0x100, 8);
+		checkMode(config, true, "on again at the count");
+	}
+
+	/* PID changes per minute, more than 8 */
+	{
+		vtunerOpt settings;
+		settings.m_pids_all_churn = 8;
+		satipConfig config(FE_TYPE_SAT, &settings);
+
+		tune(config, 0x100, 2); // 2 changes
+		tune(config, 0x200, 2); // 6
+		tune(config, 0x200, 4); // 8
+		checkMode(config, false, "off at the churn limit");
+		tune(config, 0x200, 5); // 9
+		checkMode(config, true, "on above the churn limit");
+		tune(config, 0x200, 5); // no change
+		checkMode(config, true, "stays on without changes");
+	}
+
+	/* forced, also with a single PID */
+	{
+		vtunerOpt settings;
+		settings.m_pids_all = true;
+		satipConfig config(FE_TYPE_SAT, &settings);
+
+		tune(config, 0x100, 1);
+		checkMode(config, true, "on when forced");
+	}
+
+	if (failures == 0)
+		printf("test_pidsall: ok\n");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+/*
+ * satip: recorder segment checks
+ *
+ * A TS of numbered packets goes through the recorder, writeback and
+ * O_DIRECT, in segments rotated by size. Every segment has to hold whole
+ * TS packets, start on a sync byte, and the segments together have to be
+ * the input.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "recorder.h"
+#include "log.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define TS_PACKET_SIZE 188
+#define TS_PER_WRITE 7
+#define PACKETS 40000 // 7.5MB, segments of 2MB
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, const char* mode)
+{
+	if (!ok) {
+		printf("FAIL: %s: %s\n", mode, what);
+		++failures;
+	}
+}
+
+static std::string readFile(const std::string& path)
+{
+	std::string data;
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+		return data;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, n);
+	fclose(f);
+	return data;
+}
+
+// The segments in the order written (by their index), removed
+static std::vector<std::string> takeSegments(const std::string& dir)
+{
+	std::vector<std::pair<int, std::string>> found;
+	DIR* d = opendir(dir.c_str());
+	while (struct dirent* e = d ? readdir(d) : nullptr) {
+		const char* name = e->d_name;
+		const char* dash = strrchr(name, '-');
+		if (strncmp(name, "seg-", 4) || !dash)
+			continue;
+		found.emplace_back(atoi(dash + 1), dir + "/" + name);
+	}
+	if (d)
+		closedir(d);
+	std::sort(found.begin(), found.end());
+
+	std::vector<std::string> segments;
+	for (const auto& [index, path] : found) {
+		segments.push_back(readFile(path));
+		unlink(path.c_str());
+	}
+	return segments;
+}
+
+int main()
+{
+	char dir[] = "/tmp/test_recorder.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 2;
+	}
+
+	std::string ts;
+	for (int i = 0; i < PACKETS; ++i) {
+		std::string packet(TS_PACKET_SIZE, static_cast<char>(0xff));
+		packet[0] = 0x47;
+		memcpy(&packet[4], &i, sizeof(i));
+		ts += packet;
+	}
+
+	for (int direct = 0; direct <= 1; ++direct) {
+		const char* mode = direct ? "direct" : "writeback";
+		recorderSink::settings s;
+		s.prefix = std::string(dir) + "/seg";
+		s.segment_bytes = 2 * 1024 * 1024;
+		s.segment_sec = 0;
+		s.direct = direct;
+		s.blocks = ts.size() / recorderSink::BLOCK_SIZE + 2; // nothing dropped
+
+		{
+			recorderSink rec(s);
+			check(rec.isOpened(), "recorder started", mode);
+			for (size_t pos = 0; pos < ts.size(); pos += TS_PER_WRITE * TS_PACKET_SIZE) {
+				struct iovec iov;
+				iov.iov_base = &ts[pos];
+				iov.iov_len = std::min<size_t>(TS_PER_WRITE * TS_PACKET_SIZE, ts.size() - pos);
+				rec.write(&iov, 1);
+			}
+			check(rec.getDropped() == 0, "nothing dropped", mode);
+		}
+
+		const std::vector<std::string> segments = takeSegments(dir);
+		check(segments.size() > 2, "rotated", mode);
+		std::string all;
+		for (const std::string& seg : segments) {
+			check(seg.size() % TS_PACKET_SIZE == 0, "segment of whole TS packets", mode);
+			check(!seg.empty() && seg[0] == 0x47, "segment starts on a sync byte", mode);
+			all += seg;
+		}
+		check(all == ts, "segments are the input", mode);
+	}
+
+	rmdir(dir);
+	if (failures == 0)
+		printf("test_recorder: ok\n");
+	return failures == 0 ? 0 : 1;
+}
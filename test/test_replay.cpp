@@ -0,0 +1,185 @@
+/*
+ * satip: replay of RTSP connection reads split at any byte
+ *
+ * A capture of a session in TCP data mode: SETUP, PLAY and OPTIONS with
+ * their responses and then 40 "$" frames of TS, the OPTIONS response
+ * between two of them. The bytes of the connection are cut into reads of 1, 2, 3,
+ * ... bytes, so frame headers, RTP headers and responses are split across
+ * reads, and replayed through satipRTSP. Every split has to parse the three
+ * responses and write the TS of every frame, in order, without a reset.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "capture.h"
+#include "log.h"
+#include "tools/replay.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+#define TS_PACKET_SIZE 188
+#define TS_PER_FRAME 7
+#define FRAMES 40
+#define OPTIONS_AFTER 20 // frames before the OPTIONS response
+
+static const char setup_request[] =
+	"SETUP rtsp://127.0.0.1:554/?src=1&freq=11538&pol=v&msys=dvbs&sr=22000&fec=56&pids=0,100 RTSP/1.0\r\n"
+	"CSeq: 1\r\nTransport: RTP/AVP/TCP;interleaved=0-1\r\n\r\n";
+static const char setup_response[] =
+	"RTSP/1.0 200 OK\r\nCSeq: 1\r\nSession: 12345678;timeout=60\r\n"
+	"Transport: RTP/AVP/TCP;interleaved=0-1\r\ncom.ses.streamID: 1\r\n\r\n";
+static const char play_request[] =
+	"PLAY rtsp://127.0.0.1:554/stream=1 RTSP/1.0\r\nCSeq: 2\r\nSession: 12345678\r\n\r\n";
+static const char play_response[] =
+	"RTSP/1.0 200 OK\r\nCSeq: 2\r\nSession: 12345678\r\n\r\n";
+static const char options_request[] =
+	"OPTIONS rtsp://127.0.0.1:554/ RTSP/1.0\r\nCSeq: 3\r\nSession: 12345678\r\n\r\n";
+static const char options_response[] =
+	"RTSP/1.0 200 OK\r\nCSeq: 3\r\nSession: 12345678\r\nPublic: OPTIONS, SETUP, PLAY, TEARDOWN\r\n\r\n";
+
+static int failures = 0;
+
+// One "$" frame of 7 TS packets, their TS appended to 'ts'
+static std::string frame(int n, std::string& ts)
+{
+	std::string f(4 + 12, '\0');
+	f[0] = '$';
+	f[1] = 0;
+	f[2] = (12 + TS_PER_FRAME * TS_PACKET_SIZE) >> 8;
+	f[3] = (12 + TS_PER_FRAME * TS_PACKET_SIZE) & 0xff;
+	f[4] = static_cast<char>(0x80);
+	f[5] = 0x21;
+	f[6] = n >> 8;
+	f[7] = n & 0xff;
+	f[15] = 1; // SSRC
+	for (int i = 0; i < TS_PER_FRAME; ++i) {
+		std::string packet(TS_PACKET_SIZE, static_cast<char>(0xff));
+		packet[0] = 0x47;
+		packet[1] = 0;
+		packet[2] = 100;
+		packet[3] = 0x10 | ((n * TS_PER_FRAME + i) & 0x0f);
+		packet[4] = n; // tells the frames apart
+		packet[5] = i;
+		f += packet;
+		ts += packet;
+	}
+	return f;
+}
+
+static std::string tempPath(const char* name)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/%s.XXXXXX", name);
+	const int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(2);
+	}
+	close(fd);
+	return path;
+}
+
+static std::string readFile(const std::string& path)
+{
+	std::string data;
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+		return data;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.append(buf, n);
+	fclose(f);
+	return data;
+}
+
+// Capture of the session with the connection read 'split' bytes at a time
+static void writeCapture(const std::string& path, const std::string& stream, size_t options_at, size_t split)
+{
+	packetCapture capture(path);
+	const auto add = [&](captureType type, const std::string& data) {
+		if (type == CAPTURE_TCP_RX)
+			capture.addStream(type, capture.now(), data.data(), data.size());
+		else
+			capture.add(type, 0, capture.now(), data.data(), data.size());
+	};
+
+	const auto exchange = [&](const std::string& request, const std::string& response) {
+		add(CAPTURE_RTSP_TX, request);
+		for (size_t pos = 0; pos < response.size(); pos += split)
+			add(CAPTURE_TCP_RX, response.substr(pos, split));
+	};
+	exchange(setup_request, setup_response);
+	exchange(play_request, play_response);
+
+	// the OPTIONS request goes out before the read its response starts in
+	bool options_sent = false;
+	for (size_t pos = 0; pos < stream.size(); pos += split) {
+		if (!options_sent && pos + split > options_at) {
+			add(CAPTURE_RTSP_TX, options_request);
+			options_sent = true;
+		}
+		add(CAPTURE_TCP_RX, stream.substr(pos, split));
+	}
+}
+
+int main()
+{
+	std::string ts;
+	std::string stream;
+	for (int n = 0; n < OPTIONS_AFTER; ++n)
+		stream += frame(n, ts);
+	const size_t options_at = stream.size();
+	stream += options_response;
+	for (int n = OPTIONS_AFTER; n < FRAMES; ++n)
+		stream += frame(n, ts);
+
+	const std::string capture_path = tempPath("test_replay_cap");
+	const std::string output_path = tempPath("test_replay_ts");
+	const size_t splits[] = { 1, 2, 3, 4, 5, 11, 16, 17, 188, 1331, 1332, 1333, 4096, stream.size() };
+
+	for (size_t split : splits) {
+		writeCapture(capture_path, stream, options_at, split);
+
+		captureReplay::result r;
+		{
+			captureReplay replay("file:" + output_path, false);
+			if (!replay.isOpened() || !replay.run(capture_path.c_str(), true)) {
+				printf("FAIL: split %zu: replay did not run\n", split);
+				++failures;
+				continue;
+			}
+			r = replay.getResult();
+		}
+		const std::string out = readFile(output_path);
+		const bool ok = r.responses == 3 && r.resets == 0 && out == ts && r.telemetry.rtp_lost == 0;
+		if (!ok) {
+			printf("FAIL: split %zu: %u responses, %u resets, %zu of %zu TS bytes%s, %u RTP lost\n",
+				split, r.responses, r.resets, out.size(), ts.size(),
+				out.size() == ts.size() && out != ts ? " (different)" : "", r.telemetry.rtp_lost);
+			++failures;
+		}
+	}
+
+	unlink(capture_path.c_str());
+	unlink(output_path.c_str());
+	if (failures == 0)
+		printf("test_replay: ok\n");
+	return failures == 0 ? 0 : 1;
+}
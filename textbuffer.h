@@ -0,0 +1,96 @@
+/*
+ * satip: text built in a buffer allocated once
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_TEXTBUFFER_H
+#define _SATIP_TEXTBUFFER_H
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+
+/*
+ * Like std::ostringstream for the RTSP requests, but in a buffer sized when
+ * the session is created: building a request on a zap or a PID change does
+ * not allocate. Text that does not fit is cut, overflow() tells so.
+ */
+class textBuffer
+{
+	std::unique_ptr<char[]> m_data;
+	size_t m_size; // without the terminating null
+	size_t m_len;
+	bool m_overflow;
+
+public:
+	explicit textBuffer(size_t size)
+		: m_data(std::make_unique<char[]>(size + 1)), m_size(size), m_len(0), m_overflow(false)
+	{
+		m_data[0] = 0;
+	}
+
+	void clear()
+	{
+		m_len = 0;
+		m_overflow = false;
+		m_data[0] = 0;
+	}
+
+	void erase(size_t pos, size_t count)
+	{
+		if (pos >= m_len)
+			return;
+		count = std::min(count, m_len - pos);
+		memmove(m_data.get() + pos, m_data.get() + pos + count, m_len - pos - count + 1);
+		m_len -= count;
+	}
+
+	const char* c_str() const { return m_data.get(); }
+	size_t size() const { return m_len; }
+	bool empty() const { return m_len == 0; }
+	bool overflow() const { return m_overflow; }
+	std::string_view view() const { return std::string_view(m_data.get(), m_len); }
+	char operator[](size_t pos) const { return m_data[pos]; }
+
+	textBuffer& operator<<(std::string_view str)
+	{
+		size_t count = str.size();
+		if (count > m_size - m_len)
+		{
+			count = m_size - m_len;
+			m_overflow = true;
+		}
+		memcpy(m_data.get() + m_len, str.data(), count);
+		m_len += count;
+		m_data[m_len] = 0;
+		return *this;
+	}
+
+	textBuffer& operator<<(const char* str) { return *this << std::string_view(str); }
+	textBuffer& operator<<(char c) { return *this << std::string_view(&c, 1); }
+
+	template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+	textBuffer& operator<<(T value)
+	{
+		char digits[24];
+		const std::to_chars_result res = std::to_chars(digits, digits + sizeof(digits), value);
+		return *this << std::string_view(digits, res.ptr - digits);
+	}
+};
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * satip: scheduling and CPU affinity of the threads by role
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <sstream>
+#include <vector>
+
+#include "threadpolicy.h"
+#include "log.h"
+
+static const char* role_names[THREAD_ROLE_COUNT] = {"rtp", "writer", "session", "logger"};
+
+static const struct {
+	const char* name;
+	int sched;
+} sched_names[] = {
+	{"other", SCHED_OTHER},
+	{"batch", SCHED_BATCH},
+	{"idle", SCHED_IDLE},
+	{"fifo", SCHED_FIFO},
+	{"rr", SCHED_RR},
+};
+
+static bool isRealtime(int sched)
+{
+	return sched == SCHED_FIFO || sched == SCHED_RR;
+}
+
+static pid_t currentTid()
+{
+	return static_cast<pid_t>(syscall(SYS_gettid));
+}
+
+static std::string describe(const threadPolicies::policy& p)
+{
+	std::string res = "sched as process";
+	for (const auto& s : sched_names)
+		if (s.sched == p.sched)
+			res = s.name;
+	char buf[64];
+	if (isRealtime(p.sched))
+		snprintf(buf, sizeof(buf), " %d", p.priority);
+	else if (p.has_nice)
+		snprintf(buf, sizeof(buf), " nice %d", p.nice);
+	else
+		buf[0] = 0;
+	res += buf;
+
+	unsigned long long mask = 0;
+	for (int cpu = 0; cpu < 64; ++cpu)
+		if (CPU_ISSET(cpu, &p.cpus))
+			mask |= 1ULL << cpu;
+	if (mask)
+		snprintf(buf, sizeof(buf), ", cpus 0x%llx", mask);
+	else
+		snprintf(buf, sizeof(buf), ", all cpus");
+	return res + buf;
+}
+
+static bool samePolicy(const threadPolicies::policy& a, const threadPolicies::policy& b)
+{
+	return a.sched == b.sched && a.priority == b.priority && a.has_nice == b.has_nice && a.nice == b.nice &&
+		CPU_EQUAL(&a.cpus, &b.cpus);
+}
+
+const char* threadPolicies::roleName(int role)
+{
+	return role >= 0 && role < THREAD_ROLE_COUNT ? role_names[role] : "?";
+}
+
+int threadPolicies::roleByName(const std::string& name)
+{
+	for (int role = 0; role < THREAD_ROLE_COUNT; ++role)
+		if (name == role_names[role])
+			return role;
+	return -1;
+}
+
+bool threadPolicies::parse(const std::string& options, policy& p)
+{
+	bool ok = true;
+	std::stringstream ss(options);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		const size_t colon = item.find(':');
+		const std::string key = item.substr(0, colon);
+		const std::string value = colon == std::string::npos ? std::string() : item.substr(colon + 1);
+		char* end = nullptr;
+
+		if (key == "sched")
+		{
+			bool found = false;
+			for (const auto& s : sched_names)
+				if (value == s.name)
+				{
+					p.sched = s.sched;
+					found = true;
+				}
+			ok &= found;
+		}
+		else if (key == "priority")
+		{
+			const long prio = strtol(value.c_str(), &end, 10);
+			if (value.empty() || *end || prio < 1 || prio > 99)
+				ok = false;
+			else
+				p.priority = prio;
+		}
+		else if (key == "nice")
+		{
+			const long nice = strtol(value.c_str(), &end, 10);
+			if (value.empty() || *end || nice < -20 || nice > 19)
+				ok = false;
+			else
+			{
+				p.has_nice = true;
+				p.nice = nice;
+			}
+		}
+		else if (key == "affinity")
+		{
+			// CPU mask like taskset, 0 for all CPUs
+			const unsigned long long mask = strtoull(value.c_str(), &end, 0);
+			if (value.empty() || *end)
+				ok = false;
+			else
+			{
+				CPU_ZERO(&p.cpus);
+				for (int cpu = 0; cpu < 64; ++cpu)
+					if (mask & (1ULL << cpu))
+						CPU_SET(cpu, &p.cpus);
+			}
+		}
+		else
+			ok = false;
+	}
+	return ok;
+}
+
+threadPolicies::policy threadPolicies::defaults(int role, int ncpu)
+{
+	policy p;
+	p.sched = -1;
+	p.priority = 0;
+	p.has_nice = false;
+	p.nice = 0;
+	CPU_ZERO(&p.cpus);
+
+#ifdef RT_SCHEDULING
+	/*
+	 * The data path runs SCHED_FIFO, above the GUI of the box but below the
+	 * threaded interrupt handlers (50), on the last CPUs: the last two of 4
+	 * or more, the last one of 2 or 3. The first CPU usually takes the
+	 * interrupts and the GUI. Sessions get a little boost, the logger
+	 * stays out of the way on the other CPUs.
+	 */
+	cpu_set_t data_cpus;
+	CPU_ZERO(&data_cpus);
+	if (ncpu >= 4)
+	{
+		CPU_SET(ncpu - 2, &data_cpus);
+		CPU_SET(ncpu - 1, &data_cpus);
+	}
+	else if (ncpu >= 2)
+		CPU_SET(ncpu - 1, &data_cpus);
+
+	switch (role)
+	{
+		case THREAD_ROLE_RTP:
+			p.sched = SCHED_FIFO;
+			p.priority = 20;
+			p.cpus = data_cpus;
+			break;
+		case THREAD_ROLE_WRITER:
+			p.sched = SCHED_FIFO;
+			p.priority = 15;
+			p.cpus = data_cpus;
+			break;
+		case THREAD_ROLE_SESSION:
+			p.sched = SCHED_OTHER;
+			p.has_nice = true;
+			p.nice = -5;
+			break;
+		case THREAD_ROLE_LOGGER:
+			p.sched = SCHED_OTHER;
+			p.has_nice = true;
+			p.nice = 10;
+			if (CPU_COUNT(&data_cpus))
+				for (int cpu = 0; cpu < ncpu; ++cpu)
+					if (!CPU_ISSET(cpu, &data_cpus))
+						CPU_SET(cpu, &p.cpus);
+			break;
+		default:
+			break;
+	}
+#else
+	(void) role;
+	(void) ncpu;
+#endif
+	return p;
+}
+
+threadPolicies::threadPolicies()
+{
+	pthread_mutex_init(&m_lock, NULL);
+
+	const int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int role = 0; role < THREAD_ROLE_COUNT; ++role)
+		m_policies[role] = defaults(role, ncpu);
+
+	// what the threads inherit, for roles going back to "as the process"
+	struct sched_param sp;
+	m_base.sched = sched_getscheduler(0);
+	m_base.priority = sched_getparam(0, &sp) ? 0 : sp.sched_priority;
+	errno = 0;
+	m_base.nice = getpriority(PRIO_PROCESS, 0);
+	m_base.has_nice = errno == 0;
+	if (sched_getaffinity(0, sizeof(m_base.cpus), &m_base.cpus))
+		CPU_ZERO(&m_base.cpus);
+}
+
+threadPolicies::~threadPolicies()
+{
+	pthread_mutex_destroy(&m_lock);
+}
+
+void threadPolicies::apply(int role, pid_t tid)
+{
+	const policy& p = m_policies[role];
+
+	const int sched = p.sched >= 0 ? p.sched : m_base.sched;
+	struct sched_param sp;
+	memset(&sp, 0, sizeof(sp));
+	if (isRealtime(sched))
+		sp.sched_priority = p.sched >= 0 ? p.priority : m_base.priority;
+	if (sched >= 0 && sched_setscheduler(tid, sched, &sp))
+		WARN(MSG_MAIN, "thread %d (%s): scheduler not set: %s\n", tid, roleName(role), strerror(errno));
+
+	const bool has_nice = p.has_nice || m_base.has_nice;
+	if (!isRealtime(sched) && has_nice && setpriority(PRIO_PROCESS, tid, p.has_nice ? p.nice : m_base.nice))
+		WARN(MSG_MAIN, "thread %d (%s): nice not set: %s\n", tid, roleName(role), strerror(errno));
+
+	const cpu_set_t* cpus = CPU_COUNT(&p.cpus) ? &p.cpus : &m_base.cpus;
+	if (CPU_COUNT(cpus) && sched_setaffinity(tid, sizeof(*cpus), cpus))
+		WARN(MSG_MAIN, "thread %d (%s): affinity not set: %s\n", tid, roleName(role), strerror(errno));
+}
+
+void threadPolicies::configure(const std::map<std::string, std::string>& lines)
+{
+	const int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	policy fresh[THREAD_ROLE_COUNT];
+	for (int role = 0; role < THREAD_ROLE_COUNT; ++role)
+		fresh[role] = defaults(role, ncpu);
+
+	for (const auto& [name, options] : lines)
+	{
+		const int role = roleByName(name);
+		if (role < 0)
+		{
+			WARN(MSG_MAIN, "thread.%s: unknown thread role (rtp, writer, session, logger)\n", name.c_str());
+			continue;
+		}
+		if (!parse(options, fresh[role]))
+			WARN(MSG_MAIN, "thread.%s: bad options in '%s', want sched:other|batch|idle|fifo|rr,"
+				"priority:1-99,nice:-20-19,affinity:<cpu mask>\n", name.c_str(), options.c_str());
+	}
+
+	pthread_mutex_lock(&m_lock);
+	for (int role = 0; role < THREAD_ROLE_COUNT; ++role)
+	{
+		if (samePolicy(fresh[role], m_policies[role]))
+			continue;
+		m_policies[role] = fresh[role];
+		INFO(MSG_MAIN, "thread policy %s: %s\n", roleName(role), describe(fresh[role]).c_str());
+		const auto range = m_threads.equal_range(role);
+		for (auto it = range.first; it != range.second; ++it)
+			apply(role, it->second);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void threadPolicies::enter(int role, const char* name)
+{
+	if (role < 0 || role >= THREAD_ROLE_COUNT)
+		return;
+	pthread_setname_np(pthread_self(), name);
+
+	const pid_t tid = currentTid();
+	pthread_mutex_lock(&m_lock);
+	m_threads.emplace(role, tid);
+	const policy& p = m_policies[role];
+	if (p.sched >= 0 || p.has_nice || CPU_COUNT(&p.cpus)) // else it inherited the process' one
+		apply(role, tid);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void threadPolicies::leave()
+{
+	const pid_t tid = currentTid();
+	pthread_mutex_lock(&m_lock);
+	for (auto it = m_threads.begin(); it != m_threads.end(); ++it)
+	{
+		if (it->second == tid)
+		{
+			m_threads.erase(it);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&m_lock);
+}
@@ -0,0 +1,95 @@
+/*
+ * satip: scheduling and CPU affinity of the threads by role
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_THREADPOLICY_H
+#define _SATIP_THREADPOLICY_H
+
+#include <map>
+#include <string>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+
+enum threadRole
+{
+	THREAD_ROLE_RTP = 0, // RTP receive, shared RTSP connections
+	THREAD_ROLE_WRITER,  // paced vtuner writes, recorder, http streaming
+	THREAD_ROLE_SESSION, // RTSP sessions, server pool, coordination
+	THREAD_ROLE_LOGGER,
+	THREAD_ROLE_COUNT
+};
+
+/*
+ * Each thread tells its role when it starts and gets the policy of the role:
+ * scheduler class, priority or nice value and CPU affinity. The policies
+ * come from thread.<role>= lines of vtuner.conf, see configure(), and are
+ * applied again to the running threads when they change.
+ */
+class threadPolicies
+{
+public:
+	struct policy
+	{
+		int sched;     // SCHED_*, -1: as the process
+		int priority;  // SCHED_FIFO, SCHED_RR
+		bool has_nice; // SCHED_OTHER, SCHED_BATCH
+		int nice;
+		cpu_set_t cpus; // none: as the process
+	};
+
+	static const char* roleName(int role);
+	static int roleByName(const std::string& name);
+	// "sched:fifo,priority:20,affinity:0xc" onto 'p', false on errors
+	static bool parse(const std::string& options, policy& p);
+	// built in policy of 'role' on a box with 'ncpu' CPUs
+	static policy defaults(int role, int ncpu);
+
+private:
+	pthread_mutex_t m_lock;
+	policy m_policies[THREAD_ROLE_COUNT];
+	policy m_base; // of the process at startup
+	std::multimap<int, pid_t> m_threads; // by role
+
+	void apply(int role, pid_t tid);
+
+public:
+	threadPolicies();
+	virtual ~threadPolicies();
+
+	// thread.<role>= lines by role name, roles without one get their default
+	void configure(const std::map<std::string, std::string>& lines);
+
+	void enter(int role, const char* name); // the calling thread
+	void leave();
+
+	static threadPolicies* getInstance()
+	{
+		static threadPolicies instance;
+		return &instance;
+	}
+};
+
+// Policy of 'role' for the calling thread while in scope
+class threadRoleScope
+{
+public:
+	threadRoleScope(int role, const char* name) { threadPolicies::getInstance()->enter(role, name); }
+	~threadRoleScope() { threadPolicies::getInstance()->leave(); }
+};
+
+#endif
@@ -19,16 +19,24 @@
 
 #include "timer.h"
 #include "log.h"
+#include "trace.h"
 
-satipTimer::satipTimer()
+satipTimer::satipTimer(int size):
+	m_pool(std::make_unique<timer_elem[]>(size)),
+	m_pool_size(size)
 {
+	m_free.reserve(size);
+	m_timer_list.reserve(size);
+	for (int i = size - 1; i >= 0; --i)
+		m_free.push_back(&m_pool[i]);
 }
 
 satipTimer::~satipTimer()
 {
-	for(std::list<timer_elem*>::iterator it = m_timer_list.begin(); it != m_timer_list.end(); ++it)
+	for (timer_elem* timer : m_timer_list)
 	{
-		delete (*it);
+		if (!isPooled(timer))
+			delete timer;
 	}
 	m_timer_list.clear();
 }
@@ -38,8 +46,7 @@ void satipTimer::dump()
 	struct timespec cur_ts;
 	clock_gettime(CLOCK_REALTIME,&cur_ts);
 
-	std::list<timer_elem*>::iterator it = m_timer_list.begin();
-	for(;it != m_timer_list.end(); ++it)
+	for(std::vector<timer_elem*>::iterator it = m_timer_list.begin(); it != m_timer_list.end(); ++it)
 	{
 		int msec = ((*it)->getTimeSpecSec() - cur_ts.tv_sec) * 1000 + ((*it)->getTimeSpecNsec() - cur_ts.tv_nsec) / (1000 * 1000) + 1;
 		DEBUG(MSG_MAIN, "TIMER DUMP : %d (%s)\n", msec, (*it)->isActive() ? "active" : "inactive");
@@ -51,7 +58,18 @@ timer_elem* satipTimer::create(void (*handler)(void*), void* params, const char
 	DEBUG(MSG_MAIN, "timer create %s \n", description);
 	dump();	
 
-	timer_elem *timer = new timer_elem(handler, params, description);
+	timer_elem *timer;
+	if (!m_free.empty())
+	{
+		timer = m_free.back();
+		m_free.pop_back();
+	}
+	else
+	{
+		WARN(MSG_MAIN, "timer pool of %d used up, allocating %s\n", m_pool_size, description);
+		timer = new timer_elem;
+	}
+	timer->init(handler, params, description);
 	m_timer_list.push_back(timer);
 	dump();
 	return timer;
@@ -61,8 +79,19 @@ void satipTimer::remove(timer_elem* timer)
 {
 	DEBUG(MSG_MAIN, "timer remove %s\n", timer->getDescription());
 	dump();
-	m_timer_list.remove(timer);
-	delete timer;
+	for (std::vector<timer_elem*>::iterator it = m_timer_list.begin(); it != m_timer_list.end(); ++it)
+	{
+		if (*it == timer)
+		{
+			m_timer_list.erase(it);
+			break;
+		}
+	}
+	timer->stop();
+	if (isPooled(timer))
+		m_free.push_back(timer);
+	else
+		delete timer;
 	dump();
 }
 
@@ -71,13 +100,14 @@ void satipTimer::callNextTimer()
 	struct timespec cur_ts;
 	clock_gettime(CLOCK_REALTIME,&cur_ts);
 
-	for(std::list<timer_elem*>::iterator it = m_timer_list.begin() ;it != m_timer_list.end(); ++it)
+	for(std::vector<timer_elem*>::iterator it = m_timer_list.begin() ;it != m_timer_list.end(); ++it)
 	{
 		if ((*it)->isActive())
 		{
 			if ((cur_ts.tv_sec > (*it)->getTimeSpecSec()) || ((cur_ts.tv_sec == (*it)->getTimeSpecSec()) && cur_ts.tv_nsec > (*it)->getTimeSpecNsec()))
 			{
 				DEBUG(MSG_MAIN, "timer run %s\n", (*it)->getDescription());
+				TRACE_TIMER_FIRED((*it)->getDescription());
 				(*it)->call();
 			}
 		}
@@ -92,7 +122,7 @@ int satipTimer::getNextTimerBegin()
 	if (!m_timer_list.empty())
 	{
 		timer_elem* min_timer_elem = NULL;
-		std::list<timer_elem*>::iterator it = m_timer_list.begin();
+		std::vector<timer_elem*>::iterator it = m_timer_list.begin();
 
 		for(;it != m_timer_list.end(); ++it)
 		{
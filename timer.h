@@ -20,14 +20,14 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
-#include <list>
-#include <string>
+#include <memory>
+#include <vector>
 #include <time.h>
 
 class timer_elem
 {
 private:
-	std::string m_description;
+	const char* m_description; // static text
 	void (*m_handler) (void*);
 	void* m_params;
 	long m_interval;
@@ -35,10 +35,18 @@ private:
 	bool m_active;
 	bool m_single;
 public:
-	timer_elem(void (*handler)(void*), void *params, const char* description)
-		:m_description(description), m_handler(handler), m_params(params), m_active(false), m_single(false)
+	timer_elem()
+		:m_description(""), m_handler(NULL), m_params(NULL), m_interval(0), m_ts{0, 0}, m_active(false), m_single(false)
 	{
 	}
+	void init(void (*handler)(void*), void *params, const char* description)
+	{
+		m_description = description;
+		m_handler = handler;
+		m_params = params;
+		m_active = false;
+		m_single = false;
+	}
 	~timer_elem()
 	{
 		stop();
@@ -93,16 +101,28 @@ public:
 	}
 
 	bool isActive() { return m_active; }
-	const char* getDescription() { return m_description.c_str(); }
+	const char* getDescription() { return m_description; }
 	time_t getTimeSpecSec() { return m_ts.tv_sec; }
 	long getTimeSpecNsec() { return m_ts.tv_nsec; }
 };
 
+/*
+ * The timers come from a pool allocated with the session: create() and
+ * remove() only allocate once more than 'size' timers are in use.
+ */
 class satipTimer
 {
-	std::list<timer_elem*> m_timer_list;
+	std::unique_ptr<timer_elem[]> m_pool;
+	int m_pool_size;
+	std::vector<timer_elem*> m_free;
+	std::vector<timer_elem*> m_timer_list;
+
+	bool isPooled(const timer_elem* timer) const
+	{
+		return timer >= m_pool.get() && timer < m_pool.get() + m_pool_size;
+	}
 public:
-	satipTimer();
+	explicit satipTimer(int size);
 	~satipTimer();
 	void dump();
 	timer_elem* create(void (*handler)(void*), void* params, const char *description);
@@ -0,0 +1,559 @@
+/*
+ * satip: network impairment proxy for benchmarks and tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+
+#include "impair.h"
+
+#define TCP_READ_SIZE 16384
+#define POLL_MAX_MS 100
+
+static double monotonicNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// [0, 1)
+static double uniform(std::mt19937_64& random)
+{
+	return (random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool impairment::parse(const std::string& spec, impairment& res)
+{
+	size_t pos = 0;
+	while (pos < spec.size()) {
+		size_t end = spec.find(',', pos);
+		if (end == std::string::npos)
+			end = spec.size();
+		const std::string item = spec.substr(pos, end - pos);
+		pos = end + 1;
+
+		const size_t colon = item.find(':');
+		if (colon == std::string::npos)
+			return false;
+		const std::string key = item.substr(0, colon);
+		const char* value = item.c_str() + colon + 1;
+		char* rest;
+		const double v = strtod(value, &rest);
+		if (rest == value || v < 0)
+			return false;
+
+		if (key == "stall") {
+			if (*rest != '/')
+				return false;
+			const char* second = rest + 1;
+			res.stall_every_ms = v;
+			res.stall_ms = strtod(second, &rest);
+			if (rest == second || res.stall_ms < 0 || res.stall_ms >= res.stall_every_ms)
+				return false;
+			continue;
+		}
+		if (*rest)
+			return false;
+		if (key == "delay")
+			res.delay_ms = v;
+		else if (key == "jitter")
+			res.jitter_ms = v;
+		else if (key == "reorder")
+			res.reorder_pct = v;
+		else if (key == "reorder_ms")
+			res.reorder_ms = v;
+		else if (key == "loss" && v < 100)
+			res.loss_pct = v;
+		else if (key == "burst" && v >= 1)
+			res.burst = v;
+		else if (key == "rate")
+			res.rate_mbps = v;
+		else if (key == "queue_kb")
+			res.queue_kb = v;
+		else if (key == "seed")
+			res.seed = static_cast<uint64_t>(v);
+		else
+			return false;
+	}
+	return true;
+}
+
+satipImpairProxy::satipImpairProxy(const impairment& settings) :
+	m_impairment(settings),
+	m_address(),
+	m_upstream(),
+	m_listen_fd(-1),
+	m_port(0),
+	m_thread_hook(nullptr),
+	m_thread(0),
+	m_running(false),
+	m_start(0),
+	m_next_flow(0),
+	m_next_seq(0),
+	m_counters{0, 0, 0, 0, 0, 0, 0, 0}
+{
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+satipImpairProxy::~satipImpairProxy()
+{
+	stop();
+	pthread_mutex_destroy(&m_lock);
+}
+
+int satipImpairProxy::start(const char* address, int port, const char* server, int server_port)
+{
+	m_address.sin_family = AF_INET;
+	m_address.sin_port = htons(port);
+	m_upstream.sin_family = AF_INET;
+	m_upstream.sin_port = htons(server_port);
+	if (inet_pton(AF_INET, address, &m_address.sin_addr) != 1 || inet_pton(AF_INET, server, &m_upstream.sin_addr) != 1) {
+		fprintf(stderr, "impair: bad address %s or %s\n", address, server);
+		return -1;
+	}
+
+	m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0)
+		return -1;
+	const int on = 1;
+	setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr = m_address;
+	socklen_t len = sizeof(addr);
+	if (bind(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+		listen(m_listen_fd, 16) ||
+		getsockname(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &len)) {
+		fprintf(stderr, "impair: can't listen on %s:%d: %s\n", address, port, strerror(errno));
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return -1;
+	}
+	m_port = ntohs(addr.sin_port);
+
+	m_start = monotonicNow();
+	m_running = true;
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+	return 0;
+}
+
+void satipImpairProxy::stop()
+{
+	if (!m_running.exchange(false))
+		return;
+	pthread_join(m_thread, nullptr);
+
+	pthread_mutex_lock(&m_lock);
+	while (!m_connections.empty())
+		closeConnection(m_connections.begin()->first);
+	pthread_mutex_unlock(&m_lock);
+	close(m_listen_fd);
+	m_listen_fd = -1;
+}
+
+satipImpairProxy::counters satipImpairProxy::getCounters()
+{
+	pthread_mutex_lock(&m_lock);
+	const counters res = m_counters;
+	pthread_mutex_unlock(&m_lock);
+	return res;
+}
+
+void* satipImpairProxy::thread_wrapper(void* ptr)
+{
+	return static_cast<satipImpairProxy*>(ptr)->proxyLoop();
+}
+
+// the generators only depend on the seed and the order of the flows
+void satipImpairProxy::initLink(link& state)
+{
+	state.random.seed(m_impairment.seed * 1000003 + m_next_flow++);
+	state.bad = false;
+	state.link_free = 0;
+	state.last_due = 0;
+}
+
+// end of the stall 'now' is in, 0 if none
+double satipImpairProxy::stallEnd(double now)
+{
+	if (m_impairment.stall_every_ms <= 0)
+		return 0;
+	const double ms = (now - m_start) * 1000;
+	const double period = floor(ms / m_impairment.stall_every_ms);
+	if (period < 1 || ms - period * m_impairment.stall_every_ms >= m_impairment.stall_ms)
+		return 0;
+	return m_start + (period * m_impairment.stall_every_ms + m_impairment.stall_ms) / 1000;
+}
+
+// more than queue_kb waiting for the rate cap
+bool satipImpairProxy::queueFull(const link& state, double now, size_t size)
+{
+	if (m_impairment.rate_mbps <= 0)
+		return false;
+	const double backlog = std::max(0.0, state.link_free - now) * m_impairment.rate_mbps * 1e6 / 8;
+	return backlog + size > m_impairment.queue_kb * 1024;
+}
+
+// when 'size' bytes towards the client arrive: after a stall, the rate cap, delay and jitter
+double satipImpairProxy::schedule(link& state, double now, size_t size, double jitter, bool keep_order)
+{
+	double start = std::max(now, state.link_free);
+	const double stall = stallEnd(start);
+	if (stall > 0)
+		start = stall;
+	state.link_free = start;
+	if (m_impairment.rate_mbps > 0)
+		state.link_free += size * 8 / (m_impairment.rate_mbps * 1e6);
+
+	double due = state.link_free + (m_impairment.delay_ms + jitter * m_impairment.jitter_ms) / 1000;
+	if (keep_order) {
+		due = std::max(due, state.last_due);
+		state.last_due = due;
+	}
+	return due;
+}
+
+void satipImpairProxy::acceptConnection()
+{
+	auto conn = std::make_unique<connection>();
+	socklen_t len = sizeof(conn->peer);
+	conn->client_fd = accept4(m_listen_fd, reinterpret_cast<struct sockaddr*>(&conn->peer), &len, SOCK_CLOEXEC);
+	if (conn->client_fd < 0)
+		return;
+	conn->server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (conn->server_fd < 0 || connect(conn->server_fd, reinterpret_cast<const struct sockaddr*>(&m_upstream), sizeof(m_upstream))) {
+		fprintf(stderr, "impair: can't connect to the server: %s\n", strerror(errno));
+		if (conn->server_fd >= 0)
+			close(conn->server_fd);
+		close(conn->client_fd);
+		return;
+	}
+	// the delays are ours, not Nagle's
+	const int on = 1;
+	setsockopt(conn->client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(conn->server_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	for (tcpPipe* pipe : {&conn->to_client, &conn->to_server}) {
+		initLink(pipe->state);
+		pipe->sent = 0;
+		pipe->queued = 0;
+		pipe->blocked = false;
+	}
+	++m_counters.connections;
+	m_connections[conn->client_fd] = std::move(conn);
+}
+
+void satipImpairProxy::closeConnection(int fd)
+{
+	auto it = m_connections.find(fd);
+	if (it == m_connections.end())
+		return;
+	connection& conn = *it->second;
+	for (auto& flow : conn.flows)
+		close(flow->fd);
+	close(conn.server_fd);
+	close(conn.client_fd);
+	m_connections.erase(it);
+}
+
+// RTP and RTCP port of ours for the client's, 0 if none
+int satipImpairProxy::openFlows(connection& conn, int client_port)
+{
+	auto it = conn.ports.find(client_port);
+	if (it != conn.ports.end())
+		return it->second;
+
+	for (int attempt = 0; attempt < 32; ++attempt) {
+		int fds[2] = {socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0), socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)};
+		struct sockaddr_in addr = m_address;
+		addr.sin_port = 0;
+		socklen_t len = sizeof(addr);
+		int port = 0;
+		bool ok = fds[0] >= 0 && fds[1] >= 0 &&
+			!bind(fds[0], reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) &&
+			!getsockname(fds[0], reinterpret_cast<struct sockaddr*>(&addr), &len);
+		if (ok) {
+			// RTP on an even port, RTCP on the next
+			port = ntohs(addr.sin_port);
+			addr.sin_port = htons(port + 1);
+			ok = port % 2 == 0 && !bind(fds[1], reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+		}
+		if (!ok) {
+			for (int fd : fds)
+				if (fd >= 0)
+					close(fd);
+			continue;
+		}
+
+		for (int i = 0; i < 2; ++i) {
+			auto flow = std::make_unique<udpFlow>();
+			flow->fd = fds[i];
+			const int size = 4 * 1024 * 1024;
+			setsockopt(flow->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+			flow->to = conn.peer;
+			flow->to.sin_port = htons(client_port + i);
+			initLink(flow->state);
+			conn.flows.push_back(std::move(flow));
+		}
+		conn.ports[client_port] = port;
+		return port;
+	}
+	fprintf(stderr, "impair: no UDP port pair\n");
+	return 0;
+}
+
+// requests go to the server delayed, with our UDP ports
+bool satipImpairProxy::clientData(connection& conn)
+{
+	char buf[TCP_READ_SIZE];
+	const ssize_t res = recv(conn.client_fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR))
+		return false;
+	if (res < 0)
+		return true;
+	conn.request.append(buf, res);
+
+	const double now = monotonicNow();
+	for (;;) {
+		std::string out;
+		if (!conn.request.empty() && conn.request[0] == '$') {
+			if (conn.request.size() < 4)
+				break;
+			const size_t size = 4 + ((static_cast<unsigned char>(conn.request[2]) << 8) | static_cast<unsigned char>(conn.request[3]));
+			if (conn.request.size() < size)
+				break;
+			out = conn.request.substr(0, size);
+			conn.request.erase(0, size);
+		} else {
+			const size_t end = conn.request.find("\r\n\r\n");
+			if (end == std::string::npos)
+				break;
+			out = conn.request.substr(0, end + 4);
+			conn.request.erase(0, end + 4);
+
+			const size_t cp = out.find("client_port=");
+			if (cp != std::string::npos) {
+				const size_t from = cp + 12;
+				const size_t to = out.find_first_not_of("0123456789-", from);
+				const int port = openFlows(conn, atoi(out.c_str() + from));
+				if (port > 0)
+					out.replace(from, to - from, std::to_string(port) + "-" + std::to_string(port + 1));
+			}
+		}
+
+		tcpPipe& pipe = conn.to_server;
+		const double jitter = uniform(pipe.state.random);
+		const double due = std::max(now + (m_impairment.delay_ms + jitter * m_impairment.jitter_ms) / 1000, pipe.state.last_due);
+		pipe.state.last_due = due;
+		pipe.queue.push_back({due, m_next_seq++, std::vector<unsigned char>(out.begin(), out.end())});
+		pipe.queued += out.size();
+	}
+	return true;
+}
+
+// responses and interleaved data, as they were read
+bool satipImpairProxy::serverData(connection& conn)
+{
+	unsigned char buf[TCP_READ_SIZE];
+	const ssize_t res = recv(conn.server_fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR))
+		return false;
+	if (res < 0)
+		return true;
+
+	tcpPipe& pipe = conn.to_client;
+	const double due = schedule(pipe.state, monotonicNow(), res, uniform(pipe.state.random), true);
+	pipe.queue.push_back({due, m_next_seq++, std::vector<unsigned char>(buf, buf + res)});
+	pipe.queued += res;
+	return true;
+}
+
+void satipImpairProxy::udpData(udpFlow& flow)
+{
+	const double r = 1 / m_impairment.burst;
+	const double loss = m_impairment.loss_pct / 100;
+	// average loss 'loss' in bursts of 1 / r datagrams
+	const double enter = loss * r / (1 - loss);
+
+	unsigned char buf[65536];
+	for (int i = 0; i < 64; ++i) {
+		const ssize_t res = recv(flow.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (res < 0)
+			break;
+		++m_counters.datagrams;
+
+		// the same draws for every datagram
+		const double u_loss = uniform(flow.state.random);
+		const double u_reorder = uniform(flow.state.random);
+		const double u_jitter = uniform(flow.state.random);
+		flow.state.bad = flow.state.bad ? u_loss >= r : u_loss < enter;
+		if (flow.state.bad) {
+			++m_counters.lost;
+			continue;
+		}
+		const double now = monotonicNow();
+		if (queueFull(flow.state, now, res)) {
+			++m_counters.queue_dropped;
+			continue;
+		}
+		const bool reorder = u_reorder * 100 < m_impairment.reorder_pct;
+		double due = schedule(flow.state, now, res, u_jitter, !reorder);
+		if (reorder) {
+			due += m_impairment.reorder_ms / 1000;
+			++m_counters.reordered;
+		}
+		flow.queue.push({due, m_next_seq++, std::vector<unsigned char>(buf, buf + res)});
+	}
+}
+
+void satipImpairProxy::sendPipe(int fd, tcpPipe& pipe, double now, unsigned long& bytes)
+{
+	pipe.blocked = false;
+	while (!pipe.queue.empty() && pipe.queue.front().due <= now) {
+		packet& p = pipe.queue.front();
+		const ssize_t res = send(fd, p.data.data() + pipe.sent, p.data.size() - pipe.sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (res < 0) {
+			pipe.blocked = errno == EAGAIN;
+			return;
+		}
+		bytes += res;
+		pipe.sent += res;
+		if (pipe.sent < p.data.size())
+			continue;
+		pipe.queued -= p.data.size();
+		pipe.sent = 0;
+		pipe.queue.pop_front();
+	}
+}
+
+void satipImpairProxy::sendFlow(udpFlow& flow, double now)
+{
+	while (!flow.queue.empty() && flow.queue.top().due <= now) {
+		const packet& p = flow.queue.top();
+		sendto(flow.fd, p.data.data(), p.data.size(), MSG_DONTWAIT,
+			reinterpret_cast<const struct sockaddr*>(&flow.to), sizeof(flow.to));
+		flow.queue.pop();
+	}
+}
+
+void* satipImpairProxy::proxyLoop()
+{
+	pthread_setname_np(pthread_self(), "impair-proxy");
+	if (m_thread_hook)
+		m_thread_hook();
+
+	enum {LISTEN, CLIENT, SERVER, FLOW};
+	struct source
+	{
+		int kind;
+		connection* conn;
+		udpFlow* flow;
+	};
+	std::vector<struct pollfd> fds;
+	std::vector<source> sources;
+	std::vector<int> closing;
+	const size_t queue_limit = m_impairment.queue_kb * 1024;
+	double last_stall = 0;
+
+	while (m_running) {
+		// wait for data or the next datagram or TCP read that is due
+		const double now = monotonicNow();
+		double next = now + POLL_MAX_MS / 1000.0;
+		fds.clear();
+		sources.clear();
+		fds.push_back({m_listen_fd, POLLIN, 0});
+		sources.push_back({LISTEN, nullptr, nullptr});
+		for (auto& [fd, conn] : m_connections) {
+			// the server's sends block while too much waits for the client
+			const short server_events = (conn->to_client.queued < queue_limit ? POLLIN : 0) | (conn->to_server.blocked ? POLLOUT : 0);
+			fds.push_back({conn->client_fd, static_cast<short>(POLLIN | (conn->to_client.blocked ? POLLOUT : 0)), 0});
+			sources.push_back({CLIENT, conn.get(), nullptr});
+			fds.push_back({conn->server_fd, server_events, 0});
+			sources.push_back({SERVER, conn.get(), nullptr});
+			for (const tcpPipe* pipe : {&conn->to_client, &conn->to_server})
+				if (!pipe->queue.empty() && !pipe->blocked)
+					next = std::min(next, pipe->queue.front().due);
+			for (auto& flow : conn->flows) {
+				fds.push_back({flow->fd, POLLIN, 0});
+				sources.push_back({FLOW, conn.get(), flow.get()});
+				if (!flow->queue.empty())
+					next = std::min(next, flow->queue.top().due);
+			}
+		}
+		const double stall = stallEnd(now);
+		if (stall > 0)
+			next = std::max(next, std::min(stall, now + POLL_MAX_MS / 1000.0));
+		const int timeout = std::max(0.0, ceil((next - now) * 1000));
+		if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+			break;
+
+		pthread_mutex_lock(&m_lock);
+		closing.clear();
+		for (size_t i = 0; i < fds.size(); ++i) {
+			if (!fds[i].revents)
+				continue;
+			const source& src = sources[i];
+			switch (src.kind) {
+			case LISTEN:
+				acceptConnection();
+				break;
+			case CLIENT:
+				if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !clientData(*src.conn))
+					closing.push_back(src.conn->client_fd);
+				break;
+			case SERVER:
+				if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !serverData(*src.conn))
+					closing.push_back(src.conn->client_fd);
+				break;
+			case FLOW:
+				udpData(*src.flow);
+				break;
+			default:
+				break;
+			}
+		}
+		for (int fd : closing)
+			closeConnection(fd);
+
+		// what is due, nothing reaches the client during a stall
+		const double at = monotonicNow();
+		const double stall_end = stallEnd(at);
+		if (stall_end > 0 && stall_end != last_stall) {
+			++m_counters.stalls;
+			last_stall = stall_end;
+		}
+		for (auto& [fd, conn] : m_connections) {
+			sendPipe(conn->server_fd, conn->to_server, at, m_counters.tcp_to_server);
+			if (stall_end > 0)
+				continue;
+			sendPipe(conn->client_fd, conn->to_client, at, m_counters.tcp_to_client);
+			for (auto& flow : conn->flows)
+				sendFlow(*flow, at);
+		}
+		pthread_mutex_unlock(&m_lock);
+	}
+	return nullptr;
+}
@@ -0,0 +1,187 @@
+/*
+ * satip: network impairment proxy for benchmarks and tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_IMPAIR_H
+#define _SATIP_IMPAIR_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+/*
+ * What the network does to the traffic from the server, as
+ * "delay:20,jitter:5,loss:1,burst:4,..." (all optional):
+ *   delay:ms       one way, both directions of the RTSP connection and the UDP streams
+ *   jitter:ms      0 - ms more on each datagram or TCP read, the order is kept
+ *   reorder:%      datagrams held back by reorder_ms:ms (default 5), they arrive after later ones
+ *   loss:%         average datagram loss, in bursts of burst:N datagrams on average (default 1)
+ *   rate:Mbit/s    bandwidth towards the client, queue_kb:N (default 256) is queued before
+ *                  datagrams are dropped and the server's TCP sends block
+ *   stall:ms/ms    every first ms nothing reaches the client for the second ms, then the backlog
+ *   seed:N         of the random choices (default 1)
+ */
+struct impairment
+{
+	double delay_ms = 0;
+	double jitter_ms = 0;
+	double reorder_pct = 0;
+	double reorder_ms = 5;
+	double loss_pct = 0;
+	double burst = 1;
+	double rate_mbps = 0;
+	double queue_kb = 256;
+	double stall_every_ms = 0;
+	double stall_ms = 0;
+	uint64_t seed = 1;
+
+	// false on unknown keys or bad values
+	static bool parse(const std::string& spec, impairment& res);
+};
+
+/*
+ * A proxy between a SAT>IP client and a server (or the stand-in): RTSP
+ * connections are relayed to the server, the client_port of a SETUP is
+ * replaced by a port pair of the proxy and the datagrams the server sends
+ * there are relayed to the client. Everything towards the client goes
+ * through the impairment, requests are only delayed.
+ *
+ * The random choices come from one generator per flow (a UDP port or the
+ * data of an RTSP connection), seeded from the seed and the order the flows
+ * were set up in, with the same draws for every datagram. The same client
+ * and server behaviour meets the same losses, reordering and jitter.
+ * Stalls are timed from start().
+ */
+class satipImpairProxy
+{
+public:
+	struct counters
+	{
+		unsigned long connections;
+		unsigned long datagrams;     // from the server
+		unsigned long lost;
+		unsigned long reordered;
+		unsigned long queue_dropped; // over rate and queue_kb
+		unsigned long tcp_to_client; // bytes
+		unsigned long tcp_to_server;
+		unsigned long stalls;
+	};
+
+private:
+	struct packet
+	{
+		double due;
+		uint64_t seq;
+		std::vector<unsigned char> data;
+		bool operator>(const packet& other) const { return due != other.due ? due > other.due : seq > other.seq; }
+	};
+
+	// impairment state of one direction
+	struct link
+	{
+		std::mt19937_64 random;
+		bool bad;           // in a loss burst
+		double link_free;   // the rate cap sends the last queued byte by then
+		double last_due;    // keeps the order
+	};
+
+	struct udpFlow
+	{
+		int fd;
+		struct sockaddr_in to;
+		link state;
+		std::priority_queue<packet, std::vector<packet>, std::greater<packet>> queue;
+	};
+
+	struct tcpPipe
+	{
+		link state;
+		std::deque<packet> queue; // in order, data[0..sent) is gone
+		size_t sent;
+		size_t queued;
+		bool blocked;             // the last send would block
+	};
+
+	struct connection
+	{
+		int client_fd;
+		int server_fd;
+		struct sockaddr_in peer;
+		std::string request;      // from the client, until a request is complete
+		tcpPipe to_client;
+		tcpPipe to_server;
+		std::map<int, int> ports; // client RTP port to ours
+		std::vector<std::unique_ptr<udpFlow>> flows;
+	};
+
+	impairment m_impairment;
+	struct sockaddr_in m_address;  // ours, the UDP ports too
+	struct sockaddr_in m_upstream;
+	int m_listen_fd;
+	int m_port;
+	void (*m_thread_hook)();
+
+	pthread_t m_thread;
+	std::atomic<bool> m_running;
+	double m_start;
+	uint64_t m_next_flow;
+	uint64_t m_next_seq;
+
+	pthread_mutex_t m_lock;
+	std::map<int, std::unique_ptr<connection>> m_connections; // by client fd
+	counters m_counters;
+
+	static void* thread_wrapper(void* ptr);
+	void* proxyLoop();
+
+	void initLink(link& state);
+	double stallEnd(double now);
+	bool queueFull(const link& state, double now, size_t size);
+	double schedule(link& state, double now, size_t size, double jitter, bool keep_order);
+
+	void acceptConnection();
+	void closeConnection(int fd);
+	int openFlows(connection& conn, int client_port);
+	bool clientData(connection& conn); // false when closed
+	bool serverData(connection& conn);
+	void udpData(udpFlow& flow);
+	void sendPipe(int fd, tcpPipe& pipe, double now, unsigned long& bytes);
+	void sendFlow(udpFlow& flow, double now);
+
+public:
+	explicit satipImpairProxy(const impairment& settings);
+	virtual ~satipImpairProxy();
+
+	// listens on 'address':'port' (0: any free port), returns -1 on errors
+	int start(const char* address, int port, const char* server, int server_port);
+	void stop();
+	int getPort() { return m_port; }
+
+	void setThreadHook(void (*hook)()) { m_thread_hook = hook; }
+
+	counters getCounters();
+};
+
+#endif
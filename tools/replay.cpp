@@ -0,0 +1,233 @@
+/*
+ * satip: replay of a capture for the replay tool and tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <string_view>
+
+#include "replay.h"
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+		;
+}
+
+/* The RTP datagrams of one receive, as recvmmsg() returned them */
+struct rtpBatch
+{
+	struct mmsghdr msgs[satipRTP::RTP_BATCH];
+	struct iovec iov[satipRTP::RTP_BATCH];
+	int count = 0;
+	uint64_t time = 0;
+
+	void add(const captureReader::record& rec)
+	{
+		iov[count].iov_base = const_cast<unsigned char*>(rec.data);
+		iov[count].iov_len = rec.len;
+		memset(&msgs[count], 0, sizeof(msgs[count]));
+		msgs[count].msg_hdr.msg_iov = &iov[count];
+		msgs[count].msg_hdr.msg_iovlen = 1;
+		msgs[count].msg_len = rec.len;
+		time = rec.time;
+		++count;
+	}
+};
+
+captureReplay::captureReplay(const std::string& output, bool verbose) :
+	m_peer(-1),
+	m_verbose(verbose),
+	m_result()
+{
+	// interleaved data needs neither sockets nor the receiving thread, the replay is that thread
+	m_settings.m_vtuner_type = "satip_client";
+	m_settings.m_fe_type = FE_TYPE_SAT;
+	m_settings.m_ipaddr = "127.0.0.1";
+	m_settings.m_servers.push_back(m_settings.m_ipaddr);
+	m_settings.m_output = output;
+	m_settings.m_tcpdata = true;
+	m_config = std::make_unique<satipConfig>(FE_TYPE_SAT, &m_settings);
+	m_rtp = std::make_unique<satipRTP>(-1, &m_settings, m_config->getPidFilter());
+	if (m_rtp->isOpened())
+		m_rtsp = std::make_unique<satipRTSP>(m_config.get(), m_settings.m_ipaddr.c_str(), "554", m_rtp.get());
+}
+
+captureReplay::~captureReplay()
+{
+	// a TEARDOWN of the session goes to the pair, close it after
+	m_rtsp.reset();
+	if (m_peer != -1)
+		close(m_peer);
+}
+
+const char* captureReplay::typeName(captureType type)
+{
+	switch (type) {
+	case CAPTURE_RTP:
+		return "rtp";
+	case CAPTURE_RTCP:
+		return "rtcp";
+	case CAPTURE_INTERLEAVED:
+		return "interleaved";
+	case CAPTURE_RTSP_TX:
+		return "rtsp_tx";
+	case CAPTURE_RTSP_RX:
+		return "rtsp_rx";
+	case CAPTURE_TCP_RX:
+		return "tcp_rx";
+	default:
+		return "unknown";
+	}
+}
+
+// A new socket pair for the RTSP connection, the first or after a reset
+bool captureReplay::connect()
+{
+	if (m_peer != -1) {
+		close(m_peer);
+		m_peer = -1;
+	}
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+		fprintf(stderr, "satip_replay: socketpair: %s\n", strerror(errno));
+		return false;
+	}
+	m_peer = fds[1];
+	m_rtsp->replayConnect(fds[0]);
+	return true;
+}
+
+// Bytes of one read of the RTSP connection, read by satipRTSP as they come
+void captureReplay::receive(const unsigned char* data, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		const ssize_t res = send(m_peer, data + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (res > 0)
+			done += res;
+		else if (res == -1 && errno != EAGAIN && errno != EINTR)
+			break;
+
+		// until all is read, or no progress (full buffer)
+		const int fd = m_rtsp->getRtspSocketFd();
+		int pending = 0;
+		while (ioctl(fd, FIONREAD, &pending) == 0 && pending > 0) {
+			const bool waiting = m_rtsp->isWaitingResponse();
+			m_rtsp->replayReceive();
+			if (waiting && !m_rtsp->isWaitingResponse())
+				++m_result.responses;
+			if (m_rtsp->getRtspSocketFd() != fd) {
+				// reset by the client, what follows comes on a new connection
+				++m_result.resets;
+				connect();
+				return;
+			}
+			int left = 0;
+			if (ioctl(fd, FIONREAD, &left) != 0 || left >= pending)
+				break;
+			pending = left;
+		}
+		if (res <= 0 && pending > 0)
+			break; // neither sent nor read, the rest of this read is lost
+	}
+}
+
+bool captureReplay::run(const char* path, bool fast)
+{
+	captureReader reader(path);
+	if (!reader.isOpened() || !isOpened())
+		return false;
+	if (m_rtsp->getRtspSocketFd() == -1 && !connect())
+		return false;
+
+	rtpBatch batch;
+	const uint64_t start = nowNs();
+
+	auto flush = [&] {
+		if (batch.count > 0)
+			m_rtp->rtpUdpData(batch.msgs, batch.count);
+		batch.count = 0;
+	};
+
+	captureReader::record rec;
+	while (reader.next(rec)) {
+		if (rec.type < CAPTURE_RTP || rec.type > CAPTURE_TCP_RX)
+			continue;
+		++m_result.records[rec.type];
+		m_result.bytes += rec.len;
+		m_result.capture_ns = rec.time;
+
+		// datagrams of one receive share their time
+		if (rec.type == CAPTURE_RTP && batch.count > 0 && batch.count < satipRTP::RTP_BATCH && rec.time == batch.time) {
+			batch.add(rec);
+			continue;
+		}
+		flush();
+		if (!fast)
+			sleepUntil(start + rec.time);
+
+		switch (rec.type) {
+		case CAPTURE_RTP:
+			batch.add(rec);
+			break;
+		case CAPTURE_RTCP:
+			m_rtp->rtcpUdpData(rec.data, rec.len);
+			break;
+		case CAPTURE_INTERLEAVED:
+			m_rtp->rtpTcpData(rec.data, rec.len);
+			break;
+		case CAPTURE_RTSP_TX:
+			if (m_verbose)
+				printf("%.6f %s\n%.*s\n", rec.time / 1e9, typeName(rec.type), static_cast<int>(rec.len), rec.data);
+			m_rtsp->replayRequest(std::string_view(reinterpret_cast<const char*>(rec.data), rec.len));
+			break;
+		case CAPTURE_RTSP_RX:
+			if (m_verbose)
+				printf("%.6f %s\n%.*s\n", rec.time / 1e9, typeName(rec.type), static_cast<int>(rec.len), rec.data);
+			break;
+		case CAPTURE_TCP_RX:
+			receive(rec.data, rec.len);
+			break;
+		default:
+			break;
+		}
+	}
+	flush();
+	m_result.replay_sec = (nowNs() - start) / 1e9;
+
+	m_rtp->publishTelemetry();
+	m_result.telemetry = m_rtp->getTelemetry();
+	return true;
+}
@@ -0,0 +1,80 @@
+/*
+ * satip: replay of a capture for the replay tool and tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_REPLAY_H
+#define _SATIP_REPLAY_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "capture.h"
+#include "config.h"
+#include "option.h"
+#include "rtp.h"
+#include "rtsp.h"
+
+/*
+ * Feeds a capture through the client as it was received, at the original
+ * pacing or as fast as possible. Datagrams and interleaved frames of a
+ * shared connection go to satipRTP. The bytes read from the RTSP connection
+ * go through a satipRTSP on a socket pair, one write and read per record:
+ * each captured request puts it into waiting for its response, so response
+ * parsing and "$" deframing run as they did. A connection it resets is
+ * replaced by a new pair.
+ */
+class captureReplay
+{
+public:
+	struct result
+	{
+		unsigned long records[CAPTURE_TCP_RX + 1];
+		unsigned long long bytes;
+		uint64_t capture_ns;    // time of the last record
+		double replay_sec;
+		unsigned int responses; // RTSP responses parsed
+		unsigned int resets;    // RTSP connections reset by the client
+		frontendTelemetry telemetry;
+	};
+
+private:
+	vtunerOpt m_settings;
+	std::unique_ptr<satipConfig> m_config;
+	std::unique_ptr<satipRTP> m_rtp;
+	std::unique_ptr<satipRTSP> m_rtsp;
+	int m_peer; // our end of the socket pair, the "server"
+	bool m_verbose;
+	result m_result;
+
+	bool connect();
+	void receive(const unsigned char* data, size_t len);
+
+public:
+	// 'output' as output:<spec>, RTSP requests and responses are printed with 'verbose'
+	captureReplay(const std::string& output, bool verbose);
+	~captureReplay();
+
+	bool isOpened() const { return m_rtp && m_rtp->isOpened(); }
+
+	// false if 'path' is not a capture
+	bool run(const char* path, bool fast);
+	const result& getResult() const { return m_result; }
+
+	static const char* typeName(captureType type);
+};
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * satip: network impairment proxy
+ *
+ * Relays RTSP and the UDP streams between a SAT>IP client pointed at this
+ * host and a server (or satip_standin) with delay, jitter, reordering, loss
+ * bursts, a bandwidth cap and stalls, until SIGINT. Prints the counters
+ * every 5s. See tools/impair.h for the impairment.
+ *
+ * usage: satip_impair [-a address] [-p port] -s server[:port] [impairment]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "impair.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void onSignal(int)
+{
+	running = 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* address = "0.0.0.0";
+	int port = 5554;
+	std::string server;
+	int server_port = 554;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:s:")) != -1) {
+		switch (opt) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's': {
+			server = optarg;
+			const size_t colon = server.find(':');
+			if (colon != std::string::npos) {
+				server_port = atoi(server.c_str() + colon + 1);
+				server.resize(colon);
+			}
+			break;
+		}
+		default:
+			server.clear();
+			optind = argc;
+			break;
+		}
+	}
+	impairment settings;
+	if (server.empty() || optind < argc - 1 || (optind == argc - 1 && !impairment::parse(argv[optind], settings))) {
+		fprintf(stderr, "usage: %s [-a address] [-p port] -s server[:port] [delay:ms,jitter:ms,reorder:%%,reorder_ms:ms,"
+			"loss:%%,burst:N,rate:Mbit/s,queue_kb:N,stall:ms/ms,seed:N]\n", argv[0]);
+		return 1;
+	}
+
+	satipImpairProxy proxy(settings);
+	if (proxy.start(address, port, server.c_str(), server_port))
+		return 1;
+	printf("relaying %s:%d to %s:%d\n", address, proxy.getPort(), server.c_str(), server_port);
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	int ticks = 0;
+	while (running) {
+		usleep(100000);
+		if (++ticks % 50)
+			continue;
+		const satipImpairProxy::counters c = proxy.getCounters();
+		printf("connections %lu datagrams %lu lost %lu reordered %lu queue_dropped %lu tcp_to_client %lu stalls %lu\n",
+			c.connections, c.datagrams, c.lost, c.reordered, c.queue_dropped, c.tcp_to_client, c.stalls);
+		fflush(stdout);
+	}
+	proxy.stop();
+	return 0;
+}
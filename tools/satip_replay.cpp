@@ -0,0 +1,83 @@
+/*
+ * satip: replay of a capture
+ *
+ * Feeds a capture (capture:<path>) through the client as it was received,
+ * the datagrams through satipRTP and the bytes read from the RTSP
+ * connection through satipRTSP (see tools/replay.h), at the original pacing
+ * or with -f as fast as possible, into an output (default file:/dev/null).
+ * The RTSP exchanges are printed with -v. Ends with one JSON line: records,
+ * bytes, capture and replay time, throughput, the RTSP responses parsed and
+ * connections reset, and the telemetry of the stream.
+ *
+ * usage: satip_replay [-f] [-o output] [-v] capture
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "replay.h"
+
+int dbg_level = MSG_ERROR;
+unsigned int dbg_mask = MSG_ALL;
+int use_syslog = 0;
+
+int main(int argc, char** argv)
+{
+	bool fast = false;
+	bool verbose = false;
+	const char* output = "file:/dev/null";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "fo:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			fast = true;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-f] [-o output] [-v] capture\n", argv[0]);
+		return 1;
+	}
+
+	captureReplay replay(output, verbose);
+	if (!replay.isOpened()) {
+		fprintf(stderr, "satip_replay: no output %s\n", output);
+		return 1;
+	}
+	if (!replay.run(argv[optind], fast)) {
+		fprintf(stderr, "satip_replay: %s is not a capture\n", argv[optind]);
+		return 1;
+	}
+
+	const captureReplay::result& r = replay.getResult();
+	const frontendTelemetry& t = r.telemetry;
+	printf("{\"replay\":\"%s\",\"mode\":\"%s\"", argv[optind], fast ? "fast" : "paced");
+	for (int type = CAPTURE_RTP; type <= CAPTURE_TCP_RX; ++type)
+		printf(",\"%s\":%lu", captureReplay::typeName(static_cast<captureType>(type)), r.records[type]);
+	printf(",\"bytes\":%llu,\"capture_sec\":%.3f,\"replay_sec\":%.3f,\"mbps\":%.2f,"
+		"\"responses\":%u,\"resets\":%u,"
+		"\"rtp_lost\":%u,\"cc_errors\":%u,\"tei_packets\":%u,\"restarts\":%u}\n",
+		r.bytes, r.capture_ns / 1e9, r.replay_sec, r.replay_sec > 0 ? r.bytes * 8 / r.replay_sec / 1e6 : 0,
+		r.responses, r.resets, t.rtp_lost, t.cc_errors, t.tei_packets, t.restarts);
+	return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * satip: SAT>IP server stand-in
+ *
+ * Serves a synthetic TS of the requested PIDs to SAT>IP clients, e.g. a
+ * satipclient on a box pointed at this host, until SIGINT. Prints the
+ * counters every 5s.
+ *
+ * usage: satip_standin [-a address] [-p port] [-r Mbit/s per stream] [-f frontends]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "standin.h"
+
+static volatile sig_atomic_t running = 1;
+
+static void onSignal(int)
+{
+	running = 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* address = "0.0.0.0";
+	int port = 554;
+	double mbps = 20;
+	int frontends = 4;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:r:f:")) != -1) {
+		switch (opt) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			mbps = atof(optarg);
+			break;
+		case 'f':
+			frontends = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-a address] [-p port] [-r Mbit/s per stream] [-f frontends]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	satipStandIn server(mbps, frontends);
+	if (server.start(address, port))
+		return 1;
+	printf("serving on %s:%d, %d frontends at %.1f Mbit/s\n", address, server.getPort(), frontends, mbps);
+
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	int ticks = 0;
+	while (running) {
+		usleep(100000);
+		if (++ticks % 50)
+			continue;
+		const satipStandIn::counters c = server.getCounters();
+		printf("streams %d requests %lu datagrams %lu ts %lu dropped %lu\n",
+			c.streams, c.requests, c.datagrams, c.ts_packets, c.dropped);
+		fflush(stdout);
+	}
+	server.stop();
+	return 0;
+}
@@ -0,0 +1,546 @@
+/*
+ * satip: SAT>IP server stand-in for benchmarks and tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+
+#include "standin.h"
+
+#define NTP_UNIX_OFFSET 2208988800ULL
+
+static double monotonicNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put16(unsigned char* p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(unsigned char* p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// Value of "Name: value" in the request head, empty if missing
+static std::string header(const std::string& request, const char* name)
+{
+	const std::string key = std::string("\r\n") + name + ":";
+	size_t p = request.find(key);
+	if (p == std::string::npos)
+		return "";
+	p += key.size();
+	while (p < request.size() && request[p] == ' ')
+		++p;
+	return request.substr(p, request.find("\r\n", p) - p);
+}
+
+satipStandIn::satipStandIn(double mbps, int frontends) :
+	m_mbps(mbps),
+	m_frontends(frontends),
+	m_listen_fd(-1),
+	m_udp_fd(-1),
+	m_port(0),
+	m_thread_hook(nullptr),
+	m_rtsp_thread(0),
+	m_stream_thread(0),
+	m_running(false),
+	m_next_stream_id(1),
+	m_counters{0, 0, 0, 0, 0, 0}
+{
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+satipStandIn::~satipStandIn()
+{
+	stop();
+	pthread_mutex_destroy(&m_lock);
+}
+
+int satipStandIn::start(const char* address, int port)
+{
+	m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	m_udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0 || m_udp_fd < 0)
+		return -1;
+
+	const int on = 1;
+	setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	socklen_t len = sizeof(addr);
+	if (inet_pton(AF_INET, address, &addr.sin_addr) != 1 ||
+		bind(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+		listen(m_listen_fd, 16) ||
+		getsockname(m_listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &len)) {
+		fprintf(stderr, "standin: can't listen on %s:%d: %s\n", address, port, strerror(errno));
+		close(m_listen_fd);
+		close(m_udp_fd);
+		m_listen_fd = m_udp_fd = -1;
+		return -1;
+	}
+	m_port = ntohs(addr.sin_port);
+
+	m_running = true;
+	pthread_create(&m_rtsp_thread, NULL, rtsp_wrapper, this);
+	pthread_create(&m_stream_thread, NULL, stream_wrapper, this);
+	return 0;
+}
+
+void satipStandIn::stop()
+{
+	if (!m_running.exchange(false))
+		return;
+	pthread_join(m_rtsp_thread, nullptr);
+	pthread_join(m_stream_thread, nullptr);
+
+	pthread_mutex_lock(&m_lock);
+	while (!m_connections.empty())
+		closeConnection(m_connections.begin()->first);
+	pthread_mutex_unlock(&m_lock);
+	close(m_listen_fd);
+	close(m_udp_fd);
+	m_listen_fd = m_udp_fd = -1;
+}
+
+satipStandIn::counters satipStandIn::getCounters()
+{
+	pthread_mutex_lock(&m_lock);
+	counters res = m_counters;
+	res.streams = m_streams.size();
+	pthread_mutex_unlock(&m_lock);
+	return res;
+}
+
+void* satipStandIn::rtsp_wrapper(void* ptr)
+{
+	return static_cast<satipStandIn*>(ptr)->rtspLoop();
+}
+
+void* satipStandIn::stream_wrapper(void* ptr)
+{
+	return static_cast<satipStandIn*>(ptr)->streamLoop();
+}
+
+// with m_lock held, the streams of the connection end with it
+void satipStandIn::closeConnection(int fd)
+{
+	for (auto it = m_streams.begin(); it != m_streams.end();) {
+		if (it->second.fd == fd)
+			it = m_streams.erase(it);
+		else
+			++it;
+	}
+	m_connections.erase(fd);
+	close(fd);
+}
+
+void* satipStandIn::rtspLoop()
+{
+	pthread_setname_np(pthread_self(), "standin-rtsp");
+	if (m_thread_hook)
+		m_thread_hook();
+
+	std::vector<struct pollfd> fds;
+	char buf[16384];
+	while (m_running) {
+		fds.clear();
+		fds.push_back({m_listen_fd, POLLIN, 0});
+		pthread_mutex_lock(&m_lock);
+		for (const auto& [fd, conn] : m_connections)
+			fds.push_back({fd, POLLIN, 0});
+		pthread_mutex_unlock(&m_lock);
+
+		if (poll(fds.data(), fds.size(), 100) <= 0)
+			continue;
+
+		if (fds[0].revents & POLLIN) {
+			connection conn;
+			socklen_t len = sizeof(conn.peer);
+			conn.fd = accept4(m_listen_fd, reinterpret_cast<struct sockaddr*>(&conn.peer), &len, SOCK_CLOEXEC);
+			if (conn.fd >= 0) {
+				// interleaved frames go out as they are made, like from a server's data path
+				const int on = 1;
+				setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				pthread_mutex_lock(&m_lock);
+				m_connections[conn.fd] = conn;
+				pthread_mutex_unlock(&m_lock);
+			}
+		}
+
+		for (size_t i = 1; i < fds.size(); ++i) {
+			if (!fds[i].revents)
+				continue;
+			const ssize_t res = recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (res < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+
+			pthread_mutex_lock(&m_lock);
+			auto it = m_connections.find(fds[i].fd);
+			if (it != m_connections.end()) {
+				if (res <= 0) {
+					closeConnection(fds[i].fd);
+				} else {
+					connection& conn = it->second;
+					conn.rx.append(buf, res);
+					size_t end;
+					while ((end = conn.rx.find("\r\n\r\n")) != std::string::npos) {
+						const std::string request = conn.rx.substr(0, end + 2);
+						conn.rx.erase(0, end + 4);
+						handleRequest(conn, request);
+					}
+				}
+			}
+			pthread_mutex_unlock(&m_lock);
+		}
+	}
+	return nullptr;
+}
+
+// Tuning and PIDs from the query of a SETUP or PLAY url
+void satipStandIn::applyQuery(stream& s, const std::string& url)
+{
+	const size_t q = url.find('?');
+	if (q == std::string::npos)
+		return;
+
+	size_t pos = q + 1;
+	while (pos < url.size()) {
+		size_t end = url.find('&', pos);
+		if (end == std::string::npos)
+			end = url.size();
+		const std::string param = url.substr(pos, end - pos);
+		pos = end + 1;
+
+		const size_t eq = param.find('=');
+		if (eq == std::string::npos)
+			continue;
+		const std::string key = param.substr(0, eq);
+		const std::string value = param.substr(eq + 1);
+
+		if (key == "src")
+			s.src = value;
+		else if (key == "freq")
+			s.freq = value;
+		else if (key == "pol")
+			s.pol = value;
+		else if (key == "msys")
+			s.msys = value;
+		else if (key == "pids" || key == "addpids" || key == "delpids") {
+			if (key == "pids") {
+				s.pids.clear();
+				s.pids_all = value == "all";
+			}
+			size_t p = 0;
+			while (p < value.size()) {
+				const int pid = atoi(value.c_str() + p);
+				if (isdigit(static_cast<unsigned char>(value[p])) && pid >= 0 && pid < pidSet::PID_COUNT) {
+					if (key == "delpids")
+						s.pids.reset(pid);
+					else
+						s.pids.set(pid);
+				}
+				p = value.find(',', p);
+				if (p == std::string::npos)
+					break;
+				++p;
+			}
+		}
+	}
+
+	s.pid_list.clear();
+	if (s.pids_all) {
+		// a transponder's worth of PIDs: PSI and 16 of services
+		for (int pid : {0, 16, 17, 18, 20})
+			s.pid_list.push_back(pid);
+		for (int pid = 0x100; pid < 0x110; ++pid)
+			s.pid_list.push_back(pid);
+	} else {
+		s.pids.forEach([&](int pid) { s.pid_list.push_back(pid); });
+	}
+	s.pid_pos = 0;
+}
+
+std::string satipStandIn::describe()
+{
+	std::string sdp = "v=0\r\no=- 1 1 IN IP4 127.0.0.1\r\ns=SatIPServer:1 " + std::to_string(m_frontends) +
+		",0,0\r\nt=0 0\r\n";
+	for (const auto& [session, s] : m_streams) {
+		sdp += "m=video 0 RTP/AVP 33\r\nc=IN IP4 0.0.0.0\r\na=control:stream=" + std::to_string(s.id) + "\r\n";
+		sdp += "a=fmtp:33 ver=1.0;src=" + s.src + ";tuner=" + std::to_string(s.id) + ",224,1,15," + s.freq + "," +
+			s.pol + "," + s.msys + ",qpsk,off,0.35,27500,34;pids=" + (s.pids_all ? "all" : "") + "\r\n";
+		sdp += s.playing ? "a=sendonly\r\n" : "a=inactive\r\n";
+	}
+	return sdp;
+}
+
+// with m_lock held
+void satipStandIn::handleRequest(connection& conn, const std::string& request)
+{
+	++m_counters.requests;
+	const std::string method = request.substr(0, request.find(' '));
+	const size_t url_end = request.find(' ', method.size() + 1);
+	const std::string url = request.substr(method.size() + 1, url_end - method.size() - 1);
+	const std::string cseq = header(request, "CSeq");
+	std::string session = header(request, "Session");
+	session = session.substr(0, session.find(';'));
+	auto it = m_streams.find(session);
+
+	std::string status = "200 OK";
+	std::string extra;
+	std::string body;
+
+	if (method == "OPTIONS") {
+		extra = "Public: OPTIONS, SETUP, PLAY, TEARDOWN, DESCRIBE\r\n";
+	} else if (method == "SETUP") {
+		const std::string transport = header(request, "Transport");
+		if (it == m_streams.end()) {
+			if (static_cast<int>(m_streams.size()) >= m_frontends) {
+				status = "503 Service Unavailable";
+			} else {
+				char id[32];
+				snprintf(id, sizeof(id), "%08x%04x", static_cast<unsigned int>(random()), m_next_stream_id);
+				stream s;
+				memset(s.cc, 0, sizeof(s.cc));
+				s.id = m_next_stream_id++;
+				s.session = id;
+				s.fd = conn.fd;
+				s.playing = false;
+				s.src = "1";
+				s.pol = "h";
+				s.msys = "dvbs";
+				s.pids_all = false;
+				s.pid_pos = 0;
+				s.seq = 0;
+				s.ssrc = random();
+				s.credit = 0;
+				s.next_rtcp = 0;
+				s.packets = 0;
+				s.octets = 0;
+				it = m_streams.emplace(s.session, s).first;
+			}
+		}
+		if (it != m_streams.end()) {
+			stream& s = it->second;
+			const size_t il = transport.find("interleaved=");
+			const size_t cp = transport.find("client_port=");
+			s.tcp = il != std::string::npos;
+			if (s.tcp) {
+				s.channel = atoi(transport.c_str() + il + 12);
+			} else {
+				s.rtp = conn.peer;
+				s.rtp.sin_port = htons(cp != std::string::npos ? atoi(transport.c_str() + cp + 12) : 0);
+			}
+			applyQuery(s, url);
+			session = s.session;
+			extra = "Transport: " + transport + (s.tcp ? "" : ";server_port=" + std::to_string(m_port + 1) + "-" +
+				std::to_string(m_port + 2)) + "\r\ncom.ses.streamID: " + std::to_string(s.id) + "\r\n";
+		}
+	} else if (method == "PLAY") {
+		if (it == m_streams.end()) {
+			status = "454 Session Not Found";
+		} else {
+			applyQuery(it->second, url);
+			it->second.playing = true;
+			++m_counters.plays;
+		}
+	} else if (method == "TEARDOWN") {
+		if (it == m_streams.end())
+			status = "454 Session Not Found";
+		else
+			m_streams.erase(it);
+	} else if (method == "DESCRIBE") {
+		if (m_streams.empty()) {
+			status = "404 Not Found";
+		} else {
+			body = describe();
+			extra = "Content-Type: application/sdp\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+		}
+	} else {
+		status = "501 Not Implemented";
+	}
+
+	std::string response = "RTSP/1.0 " + status + "\r\nCSeq: " + cseq + "\r\n";
+	if (!session.empty() && status[0] == '2')
+		response += "Session: " + session + (method == "SETUP" ? ";timeout=60" : "") + "\r\n";
+	response += extra + "\r\n" + body;
+
+	size_t done = 0;
+	while (done < response.size()) {
+		const ssize_t res = send(conn.fd, response.data() + done, response.size() - done, MSG_NOSIGNAL);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+}
+
+// with m_lock held; an interleaved frame is sent whole or not at all
+void satipStandIn::sendData(stream& s, bool rtcp, const unsigned char* data, size_t size)
+{
+	if (!s.tcp) {
+		struct sockaddr_in dest = s.rtp;
+		dest.sin_port = htons(ntohs(dest.sin_port) + (rtcp ? 1 : 0));
+		sendto(m_udp_fd, data, size, 0, reinterpret_cast<struct sockaddr*>(&dest), sizeof(dest));
+		return;
+	}
+
+	unsigned char head[4] = {'$', static_cast<unsigned char>(s.channel + (rtcp ? 1 : 0)), 0, 0};
+	put16(head + 2, size);
+	struct iovec iov[2] = {{head, sizeof(head)}, {const_cast<unsigned char*>(data), size}};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	ssize_t res = sendmsg(s.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (res < 0) {
+		++m_counters.dropped;
+		return;
+	}
+
+	// finish the frame, the RTSP framing breaks otherwise
+	size_t done = res;
+	const size_t total = sizeof(head) + size;
+	while (done < total) {
+		struct pollfd pfd = {s.fd, POLLOUT, 0};
+		if (poll(&pfd, 1, 1000) <= 0)
+			break;
+		const unsigned char* from = done < sizeof(head) ? head + done : data + (done - sizeof(head));
+		const size_t left = done < sizeof(head) ? sizeof(head) - done : total - done;
+		res = send(s.fd, from, left, MSG_NOSIGNAL);
+		if (res <= 0)
+			break;
+		done += res;
+	}
+}
+
+void satipStandIn::sendRtp(stream& s)
+{
+	unsigned char rtp[12 + TS_PER_DATAGRAM * TS_PACKET_SIZE];
+	const uint32_t ts = static_cast<uint32_t>(monotonicNow() * 90000);
+	rtp[0] = 0x80;
+	rtp[1] = 33;
+	put16(rtp + 2, s.seq++);
+	put32(rtp + 4, ts);
+	put32(rtp + 8, s.ssrc);
+
+	for (int i = 0; i < TS_PER_DATAGRAM; ++i) {
+		unsigned char* p = rtp + 12 + i * TS_PACKET_SIZE;
+		const int pid = s.pid_list[s.pid_pos++ % s.pid_list.size()];
+		p[0] = 0x47;
+		p[1] = pid >> 8;
+		p[2] = pid;
+		p[3] = 0x10 | (s.cc[pid]++ & 0x0f);
+		memset(p + 4, 0xff, TS_PACKET_SIZE - 4);
+	}
+	sendData(s, false, rtp, sizeof(rtp));
+	++s.packets;
+	s.octets += TS_PER_DATAGRAM * TS_PACKET_SIZE;
+	++m_counters.datagrams;
+	m_counters.ts_packets += TS_PER_DATAGRAM;
+}
+
+// Sender report and the SAT>IP APP report, one compound packet
+void satipStandIn::sendRtcp(stream& s)
+{
+	unsigned char rtcp[512];
+	struct timespec real;
+	clock_gettime(CLOCK_REALTIME, &real);
+	const uint64_t ntp = ((real.tv_sec + NTP_UNIX_OFFSET) << 32) | ((static_cast<uint64_t>(real.tv_nsec) << 32) / 1000000000);
+
+	rtcp[0] = 0x80;
+	rtcp[1] = 200;
+	put16(rtcp + 2, 6);
+	put32(rtcp + 4, s.ssrc);
+	put32(rtcp + 8, ntp >> 32);
+	put32(rtcp + 12, ntp);
+	put32(rtcp + 16, static_cast<uint32_t>(monotonicNow() * 90000));
+	put32(rtcp + 20, s.packets);
+	put32(rtcp + 24, s.octets);
+
+	char app[256];
+	const int len = snprintf(app, sizeof(app), "ver=1.0;src=%s;tuner=%d,224,1,15,%s,%s,%s,qpsk,off,0.35,27500,34;pids=%s",
+		s.src.c_str(), s.id, s.freq.c_str(), s.pol.c_str(), s.msys.c_str(), s.pids_all ? "all" : "");
+	const int app_len = std::min<int>(len, sizeof(app) - 1);
+	const int app_size = (16 + app_len + 3) / 4 * 4;
+	unsigned char* p = rtcp + 28;
+	memset(p, 0, app_size);
+	p[0] = 0x80;
+	p[1] = 204;
+	put16(p + 2, app_size / 4 - 1);
+	put32(p + 4, s.ssrc);
+	memcpy(p + 8, "SES1", 4);
+	put16(p + 14, app_len);
+	memcpy(p + 16, app, app_len);
+
+	sendData(s, true, rtcp, 28 + app_size);
+}
+
+void* satipStandIn::streamLoop()
+{
+	pthread_setname_np(pthread_self(), "standin-data");
+	if (m_thread_hook)
+		m_thread_hook();
+
+	const double datagram = TS_PER_DATAGRAM * TS_PACKET_SIZE;
+	const double rate = m_mbps * 1e6 / 8;
+	double last = monotonicNow();
+	while (m_running) {
+		usleep(1000);
+		const double now = monotonicNow();
+		const double elapsed = now - last;
+		last = now;
+
+		pthread_mutex_lock(&m_lock);
+		for (auto& [session, s] : m_streams) {
+			if (!s.playing)
+				continue;
+			// at most 20ms of catching up after a stall
+			s.credit = std::min(s.credit + rate * elapsed, rate * 0.02 + datagram);
+			if (!s.pid_list.empty()) {
+				while (s.credit >= datagram) {
+					sendRtp(s);
+					s.credit -= datagram;
+				}
+			}
+			if (now >= s.next_rtcp) {
+				sendRtcp(s);
+				s.next_rtcp = now + RTCP_INTERVAL_MS / 1000.0;
+			}
+		}
+		pthread_mutex_unlock(&m_lock);
+	}
+	return nullptr;
+}
@@ -0,0 +1,137 @@
+/*
+ * satip: SAT>IP server stand-in for benchmarks and tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SATIP_STANDIN_H
+#define _SATIP_STANDIN_H
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "pidset.h"
+
+/*
+ * The part of a SAT>IP server satipRTSP talks to: OPTIONS, SETUP, PLAY,
+ * TEARDOWN and DESCRIBE on a loopback port, a synthetic TS of the requested
+ * PIDs at a fixed bitrate per stream, over UDP or interleaved on the RTSP
+ * connection, and RTCP sender reports with the SAT>IP APP report.
+ *
+ * Each TS packet carries its PID with a running continuity counter and a
+ * stuffed payload, so a receiver can count losses and see when a zap took
+ * effect. There are as many frontends as set, a SETUP beyond them gets 503.
+ */
+class satipStandIn
+{
+public:
+	static constexpr int TS_PACKET_SIZE = 188;
+	static constexpr int TS_PER_DATAGRAM = 7;
+	static constexpr int RTCP_INTERVAL_MS = 200;
+
+	struct counters
+	{
+		unsigned long requests;
+		unsigned long plays;       // PLAY answered with 200
+		unsigned long datagrams;   // RTP sent
+		unsigned long ts_packets;
+		unsigned long dropped;     // interleaved data the client did not take in time
+		int streams;
+	};
+
+private:
+	struct connection
+	{
+		int fd;
+		struct sockaddr_in peer;
+		std::string rx;
+	};
+
+	struct stream
+	{
+		int id;
+		std::string session;
+		int fd;                 // RTSP connection
+		bool tcp;
+		int channel;            // interleaved RTP channel, RTCP on channel + 1
+		struct sockaddr_in rtp; // UDP destination, RTCP on port + 1
+		bool playing;
+		std::string src, freq, pol, msys; // of the last tuning
+		bool pids_all;
+		pidSet pids;
+		std::vector<int> pid_list;
+		size_t pid_pos;
+		uint8_t cc[pidSet::PID_COUNT];
+		uint16_t seq;
+		uint32_t ssrc;
+		double credit;          // bytes we may send
+		double next_rtcp;
+		unsigned long packets;
+		unsigned long octets;
+	};
+
+	double m_mbps;
+	int m_frontends;
+	int m_listen_fd;
+	int m_udp_fd;
+	int m_port;
+	void (*m_thread_hook)();
+
+	pthread_t m_rtsp_thread;
+	pthread_t m_stream_thread;
+	std::atomic<bool> m_running;
+
+	pthread_mutex_t m_lock;
+	std::map<int, connection> m_connections; // by fd
+	std::map<std::string, stream> m_streams; // by session
+	int m_next_stream_id;
+	counters m_counters;
+
+	static void* rtsp_wrapper(void* ptr);
+	static void* stream_wrapper(void* ptr);
+	void* rtspLoop();
+	void* streamLoop();
+
+	void closeConnection(int fd);
+	void handleRequest(connection& conn, const std::string& request);
+	void applyQuery(stream& s, const std::string& url);
+	std::string describe();
+
+	void sendData(stream& s, bool rtcp, const unsigned char* data, size_t size);
+	void sendRtp(stream& s);
+	void sendRtcp(stream& s);
+
+public:
+	// 'mbps' of TS per stream
+	satipStandIn(double mbps, int frontends);
+	virtual ~satipStandIn();
+
+	// 'port' 0: any free port, returns -1 on errors
+	int start(const char* address = "127.0.0.1", int port = 0);
+	void stop();
+	int getPort() { return m_port; }
+
+	// called first on each thread of the server, e.g. to tell them apart
+	void setThreadHook(void (*hook)()) { m_thread_hook = hook; }
+
+	counters getCounters();
+};
+
+#endif
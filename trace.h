@@ -0,0 +1,56 @@
+/*
+ * satip: static tracepoints
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "_config.h"
+
+/*
+ * USDT probes of provider 'satipclient', built with --enable-tracepoints.
+ * Each probe is a single NOP until a tracer (perf, bpftrace, systemtap)
+ * attaches to it, e.g.:
+ *   bpftrace -e 'usdt:./satipclient:satipclient:packet_written { @ = hist(arg0); }'
+ */
+#if defined(ENABLE_TRACEPOINTS) && defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+
+// bytes received, 1 for TCP interleaved data
+#define TRACE_PACKET_RECEIVED(bytes, tcp) DTRACE_PROBE2(satipclient, packet_received, bytes, tcp)
+// bytes written to the output, result of the write
+#define TRACE_PACKET_WRITTEN(bytes, result) DTRACE_PROBE2(satipclient, packet_written, bytes, result)
+// RTSP_REQUEST_xxx, CSeq
+#define TRACE_RTSP_REQUEST_SENT(request, cseq) DTRACE_PROBE2(satipclient, rtsp_request_sent, request, cseq)
+// RTSP_REQUEST_xxx, RTSP status code
+#define TRACE_RTSP_RESPONSE_PARSED(request, code) DTRACE_PROBE2(satipclient, rtsp_response_parsed, request, code)
+// timer description
+#define TRACE_TIMER_FIRED(description) DTRACE_PROBE1(satipclient, timer_fired, description)
+// MSG_xxx vtuner message type
+#define TRACE_VTUNER_MESSAGE(type) DTRACE_PROBE1(satipclient, vtuner_message, type)
+
+#else
+
+#define TRACE_PACKET_RECEIVED(bytes, tcp) do {} while (0)
+#define TRACE_PACKET_WRITTEN(bytes, result) do {} while (0)
+#define TRACE_RTSP_REQUEST_SENT(request, cseq) do {} while (0)
+#define TRACE_RTSP_RESPONSE_PARSED(request, code) do {} while (0)
+#define TRACE_TIMER_FIRED(description) do {} while (0)
+#define TRACE_VTUNER_MESSAGE(type) do {} while (0)
+
+#endif
+
+#endif // __TRACE_H__
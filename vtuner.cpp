@@ -22,20 +22,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <poll.h>
+
+#include <algorithm>
 
 #include "config.h"
 #include "vtuner.h"
 #include "log.h"
+#include "trace.h"
 
 #include "rtp.h"
 
-const char* vtuner_path = "/dev/misc/vtuner";
+#define VTUNER_MAX_DRAIN 32 // messages handled per wakeup
 
 static inline timespec operator-( const timespec &t1, const timespec &t2 )
 {
@@ -74,7 +76,7 @@ static inline int64_t timeout_msec ( const timespec & orig )
 }
 
 satipVtuner::satipVtuner(satipConfig* satip_cfg)
-	:m_fd(-1), m_openok(false), m_tone(SEC_TONE_OFF)
+	:m_openok(false), tune_tries(0), timeout{0, 0}, m_snapshot{0, 0, 0, 0, 0}, m_tone(SEC_TONE_OFF)
 {
 	DEBUG(MSG_MAIN,"Create SATIP VTUNER.\n");
 	m_satip_cfg = satip_cfg;
@@ -86,53 +88,17 @@ satipVtuner::satipVtuner(satipConfig* satip_cfg)
 
 satipVtuner::~satipVtuner()
 {
-	if (m_fd >= 0)
-		close(m_fd);
-
 	DEBUG(MSG_MAIN,"Destruct SATIP VTUNER.\n");
 }
 
-int satipVtuner::AllocateVtuner()
-{
-	int vtuner_fd = -1;
-	int vtuner_index = 0;
-	char filename[128];
-
-	while( vtuner_fd < 0)
-	{
-		sprintf(filename, "%s%d", vtuner_path, vtuner_index);
-		if (access (filename, 0) != 0)	break;
-
-		vtuner_fd = open(filename, O_RDWR);
-		if (vtuner_fd < 0)	vtuner_index++;
-	}
-
-	if (vtuner_fd < 0)
-		return -1;
-
-	DEBUG(MSG_MAIN, "Allocate vtuner %s%d\n", vtuner_path, vtuner_index);
-
-	return vtuner_fd;
-}
-
 int satipVtuner::openVtuner()
 {
-	int fd;
 	struct dvb_frontend_info fe_info;
+	u32 delsys[3] = {0, 0, 0};
 
 	int fe_type = -1;
 	char fe_type_str[8];
 
-	fd = AllocateVtuner();
-
-	if (fd == -1)
-	{
-		DEBUG(MSG_MAIN, "Allocate vtuner failed!\n");
-		goto error;
-	}
-
-	m_fd = fd;
-
 	fe_type = m_satip_cfg->getFeType();
 
 	switch (fe_type)
@@ -154,6 +120,8 @@ int satipVtuner::openVtuner()
 						FE_CAN_FEC_5_6 | FE_CAN_FEC_7_8 | FE_CAN_FEC_8_9 |
 						FE_CAN_QPSK | FE_CAN_RECOVER | FE_CAN_2G_MODULATION |
 						FE_CAN_MULTISTREAM);
+			delsys[0] = SYS_DVBS;
+			delsys[1] = SYS_DVBS2;
 			break;
 
 		case FE_TYPE_CABLE:
@@ -171,6 +139,7 @@ int satipVtuner::openVtuner()
 			fe_info.caps=static_cast<fe_caps_t>(FE_CAN_INVERSION_AUTO |
 						FE_CAN_QAM_16 | FE_CAN_QAM_32 | FE_CAN_QAM_64 | FE_CAN_QAM_128 |
 						FE_CAN_QAM_256 | FE_CAN_RECOVER | FE_CAN_FEC_AUTO);
+			delsys[0] = SYS_DVBC_ANNEX_A;
 			break;
 
 		case FE_TYPE_TERRESTRIAL:
@@ -188,6 +157,8 @@ int satipVtuner::openVtuner()
 						FE_CAN_QAM_16 | FE_CAN_QAM_64 | FE_CAN_QPSK |
 						FE_CAN_TRANSMISSION_MODE_AUTO | FE_CAN_GUARD_INTERVAL_AUTO |
 						FE_CAN_HIERARCHY_AUTO | FE_CAN_RECOVER | FE_CAN_2G_MODULATION);
+			delsys[0] = SYS_DVBT;
+			delsys[1] = SYS_DVBT2;
 			break;
 
 		default:
@@ -196,61 +167,16 @@ int satipVtuner::openVtuner()
 			break;
 	}
 
-	ioctl(fd, VTUNER_SET_NAME, fe_info.name);
-	ioctl(fd, VTUNER_SET_TYPE, fe_type_str);
-	ioctl(fd, VTUNER_SET_FE_INFO, &fe_info);
-
-#if DVB_VER_ATLEAST(5, 5)
-	/* set delsys */
-	{
-		u32 ncaps = 0;
-		struct dtv_property p[1];
-		p[0].cmd = DTV_ENUM_DELSYS;
-		memset(p[0].u.buffer.data, 0, sizeof(p[0].u.buffer.data));
-
-		switch(fe_type)
-		{
-			case FE_TYPE_SAT:
-				p[0].u.buffer.data[ncaps++] = SYS_DVBS;
-				if (fe_info.caps & FE_CAN_2G_MODULATION)
-					p[0].u.buffer.data[ncaps++] = SYS_DVBS2;
-				break;
-
-			case FE_TYPE_CABLE:
-				p[0].u.buffer.data[ncaps++] = SYS_DVBC_ANNEX_A;
-				break;
-
-			case FE_TYPE_TERRESTRIAL:
-				p[0].u.buffer.data[ncaps++] = SYS_DVBT;
-				if (fe_info.caps & FE_CAN_2G_MODULATION)
-					p[0].u.buffer.data[ncaps++] = SYS_DVBT2;
-				break;
-
-			default:
-				ERROR(MSG_MAIN, "Unknown frontend type: %d\n", fe_type);
-				goto error;
-				break;
-		}
-	//		p[0].u.buffer.len = ncaps;
-		ioctl(fd, VTUNER_SET_DELSYS, p[0].u.buffer.data);
-	}
-#endif
-
-	/* has_outputs */
-	if (ioctl(fd, VTUNER_SET_HAS_OUTPUTS, "no"))
-	{
-		ERROR(MSG_MAIN,"VTUNER_SET_HAS_OUTPUTS error\n");
-	}
+	m_control = vtunerControl::create(m_satip_cfg->getControl(), fe_type);
+	if (!m_control)
+		goto error;
+	m_control->setFrontend(fe_info, fe_type_str, delsys);
 
 	DEBUG(MSG_MAIN, "Vtuner initialize OK!\n");
 	return 0;
 
 error:
-	if (m_fd >= 0)
-	{
-		close(m_fd);
-		m_fd = -1;
-	}
+	m_control.reset();
 	return -1;
 }
 
@@ -501,15 +427,101 @@ void satipVtuner::setDiseqc(struct vtuner_message* msg)
 void satipVtuner::setPidList(struct vtuner_message* msg)
 {
 	u16* pid_list = msg->body.pidlist;
-	m_satip_cfg->updatePidList(pid_list);
+	m_satip_cfg->updatePidList(pid_list, VTUNER_PIDLIST_LEN);
+}
+
+void satipVtuner::updateStatusSnapshot()
+{
+	const frontendTelemetry t = m_satip_rtp ? m_satip_rtp->getTelemetry() : frontendTelemetry();
+
+	m_snapshot.status = 0;
+	if (t.has_lock)
+		m_snapshot.status = FE_HAS_LOCK;
+	else {
+		if (timeout_msec(timeout) < 0)
+			m_snapshot.status |= FE_TIMEDOUT;
+		if (tune_tries & 4)
+			m_snapshot.status |= FE_HAS_SIGNAL;
+	}
+
+	// BER: errored TS packets per million in the last window,
+	// UCBLOCKS: TS packets lost, out of sequence or flagged since tuning
+	m_snapshot.ber = t.window_ts_packets ?
+		static_cast<u32>(std::min<uint64_t>(static_cast<uint64_t>(t.window_errors) * 1000000 / t.window_ts_packets, 1000000)) : 0;
+	m_snapshot.ucb = t.rtp_lost * satipRTP::TS_PER_RTP + t.cc_errors + t.tei_packets;
+	m_snapshot.ss = static_cast<u16>(t.signal_strength);
+	m_snapshot.snr = static_cast<u16>(static_cast<uint64_t>(t.signal_strength) * t.signal_quality / 65535);
 }
 
+/* Fast path for the status polling of the frontend (every 50ms while tuning) */
+bool satipVtuner::handleStatusQuery(struct vtuner_message* msg)
+{
+	switch(msg->type)
+	{
+		case MSG_READ_STATUS:
+			msg->body.status = m_snapshot.status;
+			break;
+
+		case MSG_READ_BER:
+			msg->body.ber = m_snapshot.ber;
+			break;
+
+		case MSG_READ_SIGNAL_STRENGTH:
+			if (m_satip_rtp)
+				msg->body.ss = m_snapshot.ss;
+			break;
+
+		case MSG_READ_SNR:
+			if (m_satip_rtp)
+				msg->body.snr = m_snapshot.snr;
+			break;
+
+		case MSG_READ_UCBLOCKS:
+			msg->body.ucb = m_snapshot.ucb;
+			break;
+
+		default:
+			return false;
+	}
+
+	msg->type = 0;
+	m_control->setResponse(msg);
+	return true;
+}
+
+/* Handle all queued messages, status queries are answered from the snapshot */
 void satipVtuner::vtunerEvent()
 {
-	struct vtuner_message  msg;
+	updateStatusSnapshot();
 
-	if (ioctl(m_fd, VTUNER_GET_MESSAGE, &msg))
-		return;
+	for (int i = 0; i < VTUNER_MAX_DRAIN; ++i)
+	{
+		struct vtuner_message msg;
+
+		if (!m_control->getMessage(&msg))
+			return;
+
+		TRACE_VTUNER_MESSAGE(msg.type);
+
+		if (!handleStatusQuery(&msg))
+		{
+			if (handleMessage(&msg))
+			{
+				msg.type = 0;
+				m_control->setResponse(&msg);
+			}
+			updateStatusSnapshot();
+		}
+
+		if (!m_control->isMessagePending())
+			break;
+	}
+}
+
+/* Returns true if a response has to be sent */
+bool satipVtuner::handleMessage(struct vtuner_message* msg_ptr)
+{
+	struct vtuner_message& msg = *msg_ptr;
 
 	switch(msg.type)
 	{
@@ -540,42 +552,7 @@ void satipVtuner::vtunerEvent()
 		case MSG_PIDLIST:
 			setPidList(&msg);
 			DEBUG(MSG_MAIN,"MSG_SET_PIDLIST: \n");
-			return;
-			break;
-
-		case MSG_READ_STATUS:
-			msg.body.status = 0;
-			//INFO(MSG_MAIN,"MSG_READ_STATUS\n");
-			if (m_satip_rtp && m_satip_rtp->getHasLock())
-				msg.body.status = FE_HAS_LOCK;
-			else {
-				if (timeout_msec(timeout) < 0)
-					msg.body.status |= FE_TIMEDOUT;
-				if (tune_tries & 4)
-					msg.body.status |= FE_HAS_SIGNAL;
-			}
-			break;
-		case MSG_READ_BER:
-			//INFO(MSG_MAIN,"MSG_READ_BER\n");
-			msg.body.ber = 0;
-			break;
-
-		case MSG_READ_SIGNAL_STRENGTH:
-			//INFO(MSG_MAIN,"MSG_READ_SIGNAL_STRENGTH %d -> %d\n", msg.body.ss, rtcp_data.signalStrength);
-			if (m_satip_rtp)
-				msg.body.ss = static_cast<u16>(m_satip_rtp->getSignalStrength());
-			break;
-
-		case MSG_READ_SNR:
-			//INFO(MSG_MAIN,"MSG_READ_SNR %d -> %d\n", msg.body.snr, m_satip_cfg->satip_get_signal_quality());
-			if (m_satip_rtp)
-				msg.body.snr = static_cast<u16>(m_satip_rtp->getSignalStrength()) * static_cast<u16>(m_satip_rtp->getSignalQuality()) / 65535;
-			break;
-
-		case MSG_READ_UCBLOCKS:
-			DEBUG(MSG_MAIN,"MSG_READ_UCBLOCKS\n");
-			msg.body.ucb = 0;
-			break;
+			return false;
 
 		case MSG_SEND_DISEQC_BURST:
 			DEBUG(MSG_MAIN,"MSG_SEND_DISEQC_BURST\n");
@@ -626,9 +603,6 @@ void satipVtuner::vtunerEvent()
 			break;
 	}
 
-	msg.type=0;
-
-	if (ioctl(m_fd, VTUNER_SET_RESPONSE, &msg))
-		return;
+	return true;
 }
 
@@ -0,0 +1,113 @@
+/*
+ * satip: control channel of a vtuner
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "vtunercontrol.h"
+#include "vtuneremulator.h"
+#include "log.h"
+
+const char* vtuner_path = "/dev/misc/vtuner";
+
+std::unique_ptr<vtunerControl> vtunerControl::create(const std::string& spec, int fe_type)
+{
+	if (spec.empty() || spec == "vtuner") {
+		auto device = std::make_unique<vtunerDevice>();
+		if (!device->isOpened())
+			return nullptr;
+		return device;
+	}
+	if (spec.compare(0, 9, "emulator:") == 0) {
+		auto emulator = std::make_unique<vtunerEmulator>(spec.substr(9), fe_type);
+		if (!emulator->isOpened())
+			return nullptr;
+		return emulator;
+	}
+	ERROR(MSG_MAIN, "unknown vtuner control %s\n", spec.c_str());
+	return nullptr;
+}
+
+vtunerDevice::vtunerDevice() : m_fd(-1)
+{
+	int vtuner_index = 0;
+	char filename[128];
+
+	while (m_fd < 0)
+	{
+		sprintf(filename, "%s%d", vtuner_path, vtuner_index);
+		if (access(filename, 0) != 0)
+			break;
+
+		m_fd = open(filename, O_RDWR);
+		if (m_fd < 0)
+			vtuner_index++;
+	}
+
+	if (m_fd < 0)
+		DEBUG(MSG_MAIN, "Allocate vtuner failed!\n");
+	else
+		DEBUG(MSG_MAIN, "Allocate vtuner %s%d\n", vtuner_path, vtuner_index);
+}
+
+vtunerDevice::~vtunerDevice()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+void vtunerDevice::setFrontend(const struct dvb_frontend_info& info, const char* type, const u32* delsys)
+{
+	ioctl(m_fd, VTUNER_SET_NAME, info.name);
+	ioctl(m_fd, VTUNER_SET_TYPE, type);
+	ioctl(m_fd, VTUNER_SET_FE_INFO, &info);
+
+#if DVB_VER_ATLEAST(5, 5)
+	struct dtv_property p;
+	memset(p.u.buffer.data, 0, sizeof(p.u.buffer.data));
+	for (size_t i = 0; i < sizeof(p.u.buffer.data) && delsys[i]; ++i)
+		p.u.buffer.data[i] = delsys[i];
+	ioctl(m_fd, VTUNER_SET_DELSYS, p.u.buffer.data);
+#else
+	(void)delsys;
+#endif
+
+	if (ioctl(m_fd, VTUNER_SET_HAS_OUTPUTS, "no"))
+		ERROR(MSG_MAIN,"VTUNER_SET_HAS_OUTPUTS error\n");
+}
+
+bool vtunerDevice::getMessage(struct vtuner_message* msg)
+{
+	return ioctl(m_fd, VTUNER_GET_MESSAGE, msg) == 0;
+}
+
+void vtunerDevice::setResponse(struct vtuner_message* msg)
+{
+	ioctl(m_fd, VTUNER_SET_RESPONSE, msg);
+}
+
+bool vtunerDevice::isMessagePending()
+{
+	struct pollfd pfd;
+	pfd.fd = m_fd;
+	pfd.events = POLLPRI;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLPRI);
+}
@@ -0,0 +1,224 @@
+/*
+ * satip: control channel of a vtuner
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __VTUNERCONTROL_H__
+#define __VTUNERCONTROL_H__
+
+#include <memory>
+#include <string>
+
+#include <poll.h>
+
+#include "_config.h"
+
+#define VTUNER_PIDLIST_LEN 30 // from usbtunerhelper
+
+#include <linux/dvb/version.h>
+#include <linux/dvb/frontend.h>
+#include <linux/dvb/dmx.h>
+
+#define DVB_VER_INT(maj,min) (((maj) << 16) + (min))
+
+#define DVB_VER_ATLEAST(maj, min) \
+ (DVB_VER_INT(DVB_API_VERSION,  DVB_API_VERSION_MINOR) >= DVB_VER_INT(maj, min))
+
+#define MSG_SET_FRONTEND         1
+#define MSG_GET_FRONTEND         2
+#define MSG_READ_STATUS          3
+#define MSG_READ_BER             4
+#define MSG_READ_SIGNAL_STRENGTH 5
+#define MSG_READ_SNR             6
+#define MSG_READ_UCBLOCKS        7
+#define MSG_SET_TONE             8
+#define MSG_SET_VOLTAGE          9
+#define MSG_ENABLE_HIGH_VOLTAGE 10
+#define MSG_SEND_DISEQC_MSG     11
+#define MSG_SEND_DISEQC_BURST   13
+#define MSG_PIDLIST             14
+#define MSG_TYPE_CHANGED        15
+#define MSG_SET_PROPERTY        16
+#define MSG_GET_PROPERTY        17
+#define MSG_GET_TUNE_SETTINGS   18
+
+#define MSG_NULL          1024
+#define MSG_DISCOVER      1025
+#define MSG_UPDATE        1026
+
+typedef unsigned int   u32;
+typedef unsigned short u16;
+typedef unsigned char  u8;
+
+struct dvb_frontend_tune_settings
+{
+	int min_delay_ms;
+	int step_size;
+	int max_drift;
+};
+
+#if VMSG_TYPE1
+struct vtuner_message {
+	__u32 type;
+	union 
+	{
+		struct dvb_frontend_parameters fe_params;
+		struct dvb_frontend_tune_settings tune_settings;
+
+#if DVB_API_VERSION >= 5
+		struct dtv_property prop;
+#endif
+		u32 status;
+		__u32 ber;
+		__u16 ss;
+		__u16 snr;
+		__u32 ucb;
+		fe_sec_tone_mode_t tone;
+		fe_sec_voltage_t voltage;
+		struct dvb_diseqc_master_cmd diseqc_master_cmd;
+		fe_sec_mini_cmd_t burst;
+		__u16 pidlist[VTUNER_PIDLIST_LEN];
+		unsigned char  pad[72];
+		__u32 type_changed;
+	} body;
+};
+#else
+struct vtuner_message
+{
+    __s32 type;
+    union
+    {
+        struct
+        {
+            __u32	frequency;
+            __u8	inversion;
+            union
+            {
+                struct
+                {
+                    __u32	symbol_rate;
+                    __u32	fec_inner;
+                } qpsk;
+                struct
+                {
+                    __u32   symbol_rate;
+                    __u32   fec_inner;
+                    __u32	modulation;
+                } qam;
+                struct
+                {
+                    __u32	bandwidth;
+                    __u32	code_rate_HP;
+                    __u32	code_rate_LP;
+                    __u32	constellation;
+                    __u32	transmission_mode;
+                    __u32	guard_interval;
+                    __u32	hierarchy_information;
+                } ofdm;
+                struct
+                {
+                    __u32	modulation;
+                } vsb;
+            } u;
+        } fe_params;
+		struct dvb_frontend_tune_settings tune_settings;
+        struct dtv_property prop;
+        u32 status;
+        __u32 ber;
+        __u16 ss;
+        __u16 snr;
+        __u32 ucb;
+        __u8 tone;
+        __u8 voltage;
+        struct dvb_diseqc_master_cmd diseqc_master_cmd;
+        __u8 burst;
+        __u16 pidlist[30];
+        __u8  pad[72];
+        __u32 type_changed;
+    } body;
+};
+#endif
+
+
+#if VMSG_TYPE2
+#define VTUNER_GET_MESSAGE  11
+#define VTUNER_SET_RESPONSE 12
+#define VTUNER_SET_NAME     13
+#define VTUNER_SET_TYPE     14
+#define VTUNER_SET_HAS_OUTPUTS 15
+#define VTUNER_SET_FE_INFO  16
+#define VTUNER_SET_DELSYS   17
+#else
+#define VTUNER_GET_MESSAGE  1
+#define VTUNER_SET_RESPONSE 2
+#define VTUNER_SET_NAME     3
+#define VTUNER_SET_TYPE     4
+#define VTUNER_SET_HAS_OUTPUTS 5
+#define VTUNER_SET_FE_INFO  6
+#define VTUNER_SET_DELSYS   7
+#endif
+
+
+/*
+ * Where the frontend messages of a vtuner come from and the responses go:
+ * the vtuner device, or the emulator for machines without the kernel
+ * module ("control:emulator:<scenario>", see vtuneremulator.h).
+ *
+ * Messages are read by the session thread when the poll fd signals the
+ * poll events. Every message but MSG_PIDLIST gets a response.
+ */
+class vtunerControl
+{
+public:
+	virtual ~vtunerControl() {}
+
+	// "" for the device, nullptr if there is none or 'spec' is unknown
+	static std::unique_ptr<vtunerControl> create(const std::string& spec, int fe_type);
+
+	// announce the frontend, 'delsys' the delivery systems ending with 0
+	virtual void setFrontend(const struct dvb_frontend_info& info, const char* type, const u32* delsys) = 0;
+
+	virtual int getPollFd() = 0;
+	virtual short getPollEvents() = 0;
+	virtual int getDataFd() = 0; // the TS for the vtuner output
+
+	virtual bool getMessage(struct vtuner_message* msg) = 0;
+	virtual void setResponse(struct vtuner_message* msg) = 0;
+	virtual bool isMessagePending() = 0;
+};
+
+/* /dev/misc/vtunerN, the first one free */
+class vtunerDevice : public vtunerControl
+{
+	int m_fd;
+
+public:
+	vtunerDevice();
+	virtual ~vtunerDevice();
+
+	bool isOpened() { return m_fd >= 0; }
+
+	void setFrontend(const struct dvb_frontend_info& info, const char* type, const u32* delsys) override;
+
+	int getPollFd() override { return m_fd; }
+	short getPollEvents() override { return POLLPRI; }
+	int getDataFd() override { return m_fd; }
+
+	bool getMessage(struct vtuner_message* msg) override;
+	void setResponse(struct vtuner_message* msg) override;
+	bool isMessagePending() override;
+};
+
+#endif // __VTUNERCONTROL_H__
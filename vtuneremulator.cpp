@@ -0,0 +1,496 @@
+/*
+ * satip: user-space vtuner emulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+#include "vtuneremulator.h"
+#include "config.h"
+#include "log.h"
+
+#define PIDLIST_STAGE_MS 20 // between the PID lists of a zap, as the demux filters start
+
+/* The counters of all emulators, latencies in quarter octave buckets */
+static struct
+{
+	std::atomic<unsigned long> messages;
+	std::atomic<unsigned long> responses;
+	std::atomic<unsigned long> timeouts;
+	std::atomic<unsigned long> zaps;
+	std::atomic<unsigned long> locks;
+	std::atomic<unsigned long> pid_lists;
+	std::atomic<unsigned long> response_ns[vtunerEmulator::LATENCY_BUCKETS];
+	std::atomic<unsigned long> lock_ns[vtunerEmulator::LATENCY_BUCKETS];
+	std::atomic<uint64_t> response_max;
+	std::atomic<uint64_t> lock_max;
+} totals;
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(std::atomic<unsigned long>* buckets, std::atomic<uint64_t>& max, uint64_t ns)
+{
+	const int bucket = ns > 1 ? std::min<int>(4 * log2(ns), vtunerEmulator::LATENCY_BUCKETS - 1) : 0;
+	++buckets[bucket];
+	uint64_t seen = max.load(std::memory_order_relaxed);
+	while (ns > seen && !max.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+		;
+}
+
+// 'p' of the samples in ns, interpolated by rank inside its bucket: a
+// bucket spans 19%, its upper end would put most percentiles on the max
+static double percentile(const std::atomic<unsigned long>* buckets, double p)
+{
+	unsigned long count = 0;
+	for (int i = 0; i < vtunerEmulator::LATENCY_BUCKETS; ++i)
+		count += buckets[i];
+	if (count == 0)
+		return 0;
+	const unsigned long target = std::max(1UL, static_cast<unsigned long>(ceil(p * count)));
+	unsigned long seen = 0;
+	for (int i = 0; i < vtunerEmulator::LATENCY_BUCKETS; ++i) {
+		const unsigned long n = buckets[i];
+		if (seen + n >= target) {
+			const double frac = static_cast<double>(target - seen) / n;
+			const double hi = exp2((i + 1) / 4.0);
+			if (i == 0)
+				return hi * frac;
+			const double lo = exp2(i / 4.0);
+			return lo * pow(hi / lo, frac);
+		}
+		seen += n;
+	}
+	return 0;
+}
+
+vtunerEmulator::counters vtunerEmulator::getTotals()
+{
+	counters res;
+	res.messages = totals.messages;
+	res.responses = totals.responses;
+	res.timeouts = totals.timeouts;
+	res.zaps = totals.zaps;
+	res.locks = totals.locks;
+	res.pid_lists = totals.pid_lists;
+	// the interpolation can lie above the largest sample
+	const double response_max = totals.response_max;
+	const double lock_max = totals.lock_max;
+	res.response_us_p50 = std::min(percentile(totals.response_ns, 0.5), response_max) / 1e3;
+	res.response_us_p99 = std::min(percentile(totals.response_ns, 0.99), response_max) / 1e3;
+	res.response_us_max = response_max / 1e3;
+	res.lock_ms_p50 = std::min(percentile(totals.lock_ns, 0.5), lock_max) / 1e6;
+	res.lock_ms_p99 = std::min(percentile(totals.lock_ns, 0.99), lock_max) / 1e6;
+	res.lock_ms_max = lock_max / 1e6;
+	return res;
+}
+
+void vtunerEmulator::resetTotals()
+{
+	totals.messages = 0;
+	totals.responses = 0;
+	totals.timeouts = 0;
+	totals.zaps = 0;
+	totals.locks = 0;
+	totals.pid_lists = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+		totals.response_ns[i] = 0;
+		totals.lock_ns[i] = 0;
+	}
+	totals.response_max = 0;
+	totals.lock_max = 0;
+}
+
+vtunerEmulator::vtunerEmulator(const std::string& spec, int fe_type) :
+	m_scenario(SCENARIO_IDLE),
+	m_interval_ms(0),
+	m_fe_type(fe_type),
+	m_event_fd(-1),
+	m_data_fd(-1),
+	m_thread(0),
+	m_running(false),
+	m_attached(false),
+	m_waiting(false),
+	m_taken(false),
+	m_answered(false),
+	m_stale(0),
+	m_zap(0),
+	m_churn(0),
+	m_tuned_at(0)
+{
+	memset(&m_response, 0, sizeof(m_response));
+	pthread_mutex_init(&m_lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&m_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	const size_t colon = spec.find(':');
+	const std::string name = spec.substr(0, colon);
+	if (name == "idle") {
+		m_scenario = SCENARIO_IDLE;
+	} else if (name == "zap") {
+		m_scenario = SCENARIO_ZAP;
+		m_interval_ms = 2000;
+	} else if (name == "storm") {
+		m_scenario = SCENARIO_STORM;
+		m_interval_ms = 100;
+	} else if (name == "pidchurn") {
+		m_scenario = SCENARIO_PIDCHURN;
+		m_interval_ms = 20;
+	} else {
+		ERROR(MSG_MAIN, "unknown vtuner emulator scenario %s\n", spec.c_str());
+		return;
+	}
+	if (colon != std::string::npos)
+		m_interval_ms = std::max(1, atoi(spec.c_str() + colon + 1));
+
+	m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_data_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	INFO(MSG_MAIN, "vtuner emulator, scenario %s\n", spec.c_str());
+}
+
+vtunerEmulator::~vtunerEmulator()
+{
+	if (m_thread) {
+		m_running = false;
+		pthread_mutex_lock(&m_lock);
+		pthread_cond_broadcast(&m_cond);
+		pthread_mutex_unlock(&m_lock);
+		pthread_join(m_thread, nullptr);
+	}
+	if (m_event_fd >= 0)
+		close(m_event_fd);
+	if (m_data_fd >= 0)
+		close(m_data_fd);
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_lock);
+}
+
+// the frontend shows up, the session gets a first wakeup and the script starts when it comes
+void vtunerEmulator::setFrontend(const struct dvb_frontend_info& info, const char* type, const u32* delsys)
+{
+	(void)delsys;
+	DEBUG(MSG_MAIN, "vtuner emulator: %s (%s)\n", info.name, type);
+	if (m_thread || m_event_fd < 0)
+		return;
+	const uint64_t one = 1;
+	if (write(m_event_fd, &one, sizeof(one)) != sizeof(one))
+		return;
+	m_running = true;
+	pthread_create(&m_thread, NULL, thread_wrapper, this);
+}
+
+bool vtunerEmulator::getMessage(struct vtuner_message* msg)
+{
+	pthread_mutex_lock(&m_lock);
+	if (!m_attached) {
+		m_attached = true;
+		pthread_cond_broadcast(&m_cond);
+	}
+	const bool found = !m_queue.empty();
+	if (found) {
+		*msg = m_queue.front().msg;
+		if (m_queue.front().awaited)
+			m_taken = true;
+		m_queue.pop_front();
+	}
+	if (m_queue.empty()) {
+		uint64_t count;
+		if (read(m_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			ERROR(MSG_MAIN, "vtuner emulator: eventfd read failed\n");
+	}
+	pthread_mutex_unlock(&m_lock);
+	return found;
+}
+
+void vtunerEmulator::setResponse(struct vtuner_message* msg)
+{
+	pthread_mutex_lock(&m_lock);
+	if (m_stale > 0) {
+		--m_stale;
+	} else if (m_waiting && m_taken) {
+		m_response = *msg;
+		m_answered = true;
+		pthread_cond_broadcast(&m_cond);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+bool vtunerEmulator::isMessagePending()
+{
+	pthread_mutex_lock(&m_lock);
+	const bool pending = !m_queue.empty();
+	pthread_mutex_unlock(&m_lock);
+	return pending;
+}
+
+void* vtunerEmulator::thread_wrapper(void* ptr)
+{
+	return static_cast<vtunerEmulator*>(ptr)->scriptLoop();
+}
+
+// like the frontend ioctl: queue, wake the session, wait for the response
+bool vtunerEmulator::send(struct vtuner_message& msg, bool wait)
+{
+	pthread_mutex_lock(&m_lock);
+	m_queue.push_back({msg, wait});
+	++totals.messages;
+	const uint64_t one = 1;
+	if (write(m_event_fd, &one, sizeof(one)) != sizeof(one))
+		ERROR(MSG_MAIN, "vtuner emulator: eventfd write failed\n");
+	if (!wait) {
+		pthread_mutex_unlock(&m_lock);
+		return true;
+	}
+
+	m_waiting = true;
+	m_taken = false;
+	m_answered = false;
+	const uint64_t start = nowNs();
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += RESPONSE_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += (RESPONSE_TIMEOUT_MS % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (!m_answered && m_running)
+		if (pthread_cond_timedwait(&m_cond, &m_lock, &deadline) == ETIMEDOUT)
+			break;
+
+	const bool answered = m_answered;
+	if (answered) {
+		msg = m_response;
+		++totals.responses;
+		record(totals.response_ns, totals.response_max, nowNs() - start);
+	} else {
+		// still queued: take it back, else its response comes late
+		auto it = std::find_if(m_queue.begin(), m_queue.end(), [](const queued& q) { return q.awaited; });
+		if (it != m_queue.end())
+			m_queue.erase(it);
+		else
+			++m_stale;
+		if (m_running)
+			++totals.timeouts;
+	}
+	m_waiting = false;
+	pthread_mutex_unlock(&m_lock);
+	return answered;
+}
+
+void vtunerEmulator::setProperty(int cmd, uint32_t data)
+{
+	struct vtuner_message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_SET_PROPERTY;
+	msg.body.prop.cmd = cmd;
+	msg.body.prop.u.data = data;
+	send(msg, true);
+}
+
+// what Enigma2 does to tune, through the dvb frontend
+void vtunerEmulator::zap()
+{
+	++m_zap;
+	++totals.zaps;
+	const bool first = m_zap % 2;
+	struct vtuner_message msg;
+
+	if (m_fe_type == FE_TYPE_SAT) {
+		// 11836 H low band or 12012 V high band, LNB 9750 / 10600, in 100kHz
+		const unsigned int freq = first ? 118360 : 120120;
+		const bool high = freq >= 117000;
+		const bool horizontal = first;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.type = MSG_SET_VOLTAGE;
+		msg.body.voltage = horizontal ? SEC_VOLTAGE_18 : SEC_VOLTAGE_13;
+		send(msg, true);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.type = MSG_SET_TONE;
+		msg.body.tone = SEC_TONE_OFF;
+		send(msg, true);
+
+		// committed switch, position 1
+		memset(&msg, 0, sizeof(msg));
+		msg.type = MSG_SEND_DISEQC_MSG;
+		msg.body.diseqc_master_cmd.msg[0] = 0xe0;
+		msg.body.diseqc_master_cmd.msg[1] = 0x10;
+		msg.body.diseqc_master_cmd.msg[2] = 0x38;
+		msg.body.diseqc_master_cmd.msg[3] = 0xf0 | (horizontal ? 0x02 : 0) | (high ? 0x01 : 0);
+		msg.body.diseqc_master_cmd.msg_len = 4;
+		send(msg, true);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.type = MSG_SET_TONE;
+		msg.body.tone = high ? SEC_TONE_ON : SEC_TONE_OFF;
+		send(msg, true);
+
+		setProperty(DTV_CLEAR, 0);
+		setProperty(DTV_DELIVERY_SYSTEM, SYS_DVBS2);
+		setProperty(DTV_FREQUENCY, (freq - (high ? 106000 : 97500)) * 100);
+		setProperty(DTV_MODULATION, PSK_8);
+		setProperty(DTV_SYMBOL_RATE, 27500000);
+		setProperty(DTV_INNER_FEC, FEC_3_4);
+		setProperty(DTV_ROLLOFF, ROLLOFF_35);
+		setProperty(DTV_PILOT, PILOT_AUTO);
+	} else {
+		setProperty(DTV_CLEAR, 0);
+		setProperty(DTV_DELIVERY_SYSTEM, m_fe_type == FE_TYPE_CABLE ? SYS_DVBC_ANNEX_A : SYS_DVBT2);
+		setProperty(DTV_FREQUENCY, first ? 474000000 : 482000000);
+		if (m_fe_type == FE_TYPE_CABLE) {
+			setProperty(DTV_SYMBOL_RATE, 6900000);
+			setProperty(DTV_MODULATION, QAM_256);
+			setProperty(DTV_INNER_FEC, FEC_AUTO);
+		} else {
+			setProperty(DTV_BANDWIDTH_HZ, 8000000);
+		}
+	}
+	m_tuned_at = nowNs();
+	setProperty(DTV_TUNE, 0);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_GET_TUNE_SETTINGS;
+	send(msg, true);
+}
+
+/*
+ * 1: PAT, SDT, EIT and TDT, 2: and the PMT, 3: and video, audio and
+ * teletext, 4: another audio and subtitle track of the same channel
+ */
+void vtunerEmulator::pidList(int stage)
+{
+	const int base = 0x100 + (m_zap % 64) * 16;
+	int pids[] = {0, 0x11, 0x12, 0x14, base, base + 1, base + 2, base + 3};
+	int count = 4;
+	if (stage >= 2)
+		count = 5;
+	if (stage >= 3)
+		count = 8;
+	if (stage == 4) {
+		++m_churn;
+		pids[6] = base + 4 + m_churn % 6;
+		pids[7] = base + 10 + (m_churn / 6) % 6;
+	}
+
+	struct vtuner_message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_PIDLIST;
+	for (int i = 0; i < VTUNER_PIDLIST_LEN; ++i)
+		msg.body.pidlist[i] = i < count ? pids[i] : 0xffff;
+	++totals.pid_lists;
+	send(msg, false);
+}
+
+void vtunerEmulator::pollStatus()
+{
+	struct vtuner_message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = MSG_READ_STATUS;
+	// the lock is seen at the next poll: DTV_TUNE to lock in steps of STATUS_INTERVAL_MS
+	if (send(msg, true) && (msg.body.status & FE_HAS_LOCK) && m_tuned_at) {
+		++totals.locks;
+		record(totals.lock_ns, totals.lock_max, nowNs() - m_tuned_at);
+		m_tuned_at = 0;
+	}
+}
+
+// the signal meter of the infobar
+void vtunerEmulator::pollStats()
+{
+	static const int types[] = {MSG_READ_SIGNAL_STRENGTH, MSG_READ_SNR, MSG_READ_BER, MSG_READ_UCBLOCKS};
+	for (int type : types) {
+		struct vtuner_message msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.type = type;
+		send(msg, true);
+	}
+}
+
+void* vtunerEmulator::scriptLoop()
+{
+	pthread_setname_np(pthread_self(), "vtuner-emu");
+
+	pthread_mutex_lock(&m_lock);
+	while (!m_attached && m_running)
+		pthread_cond_wait(&m_cond, &m_lock);
+	pthread_mutex_unlock(&m_lock);
+
+	const uint64_t ms = 1000000;
+	uint64_t now = nowNs();
+	uint64_t next_status = now + STATUS_INTERVAL_MS * ms;
+	uint64_t next_stats = now + STATS_INTERVAL_MS * ms;
+	uint64_t next_action = now;
+	uint64_t next_pids = 0;
+	int stage = 0;
+
+	while (m_running) {
+		now = nowNs();
+		if (now >= next_status) {
+			pollStatus();
+			next_status = std::max(next_status + STATUS_INTERVAL_MS * ms, now);
+		}
+		if (now >= next_stats) {
+			pollStats();
+			next_stats = std::max(next_stats + STATS_INTERVAL_MS * ms, now);
+		}
+		if (stage > 0 && now >= next_pids) {
+			pidList(stage);
+			stage = stage < 3 ? stage + 1 : 0;
+			next_pids = now + PIDLIST_STAGE_MS * ms;
+		}
+		if (m_scenario != SCENARIO_IDLE && now >= next_action) {
+			if (m_scenario == SCENARIO_PIDCHURN && m_zap > 0) {
+				if (stage == 0)
+					pidList(4);
+			} else {
+				zap();
+				stage = 1;
+				next_pids = nowNs() + PIDLIST_STAGE_MS * ms;
+			}
+			next_action = now + m_interval_ms * ms;
+		}
+
+		uint64_t next = std::min(next_status, next_stats);
+		if (stage > 0)
+			next = std::min(next, next_pids);
+		if (m_scenario != SCENARIO_IDLE)
+			next = std::min(next, next_action);
+		now = nowNs();
+		if (next > now) {
+			const uint64_t wait = next - now;
+			struct timespec ts = {static_cast<time_t>(wait / 1000000000ULL), static_cast<long>(wait % 1000000000ULL)};
+			nanosleep(&ts, nullptr);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * satip: user-space vtuner emulator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __VTUNEREMULATOR_H__
+#define __VTUNEREMULATOR_H__
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include <pthread.h>
+
+#include "vtunercontrol.h"
+
+/*
+ * Plays the kernel module and Enigma2 on its frontend: a thread sends the
+ * messages a box sends and waits for the responses like the frontend ioctl
+ * does, MSG_PIDLIST goes out without waiting like from the demux. The TS
+ * of the vtuner output goes to /dev/null.
+ *
+ * Always: MSG_READ_STATUS every 50ms, signal strength, SNR, BER and
+ * UCBLOCKS every second. "control:emulator:<scenario>[:<ms>]" adds:
+ *   idle      nothing, the tuning comes from elsewhere (satipSession::tune)
+ *   zap       a zap every <ms> (default 2000): DiSEqC committed switch,
+ *             tone, SET_PROPERTY ... DTV_TUNE, GET_TUNE_SETTINGS, then the
+ *             PIDs as the demux filters start: PAT, PMT, audio and video
+ *   storm     zaps every <ms> (default 100), whether locked or not
+ *   pidchurn  one zap, then every <ms> (default 20) another PID list of the
+ *             same transponder
+ * Transponders alternate between 11836 H (low band) and 12012 V (high band)
+ * on position 1, or 474 / 482 MHz on cable and terrestrial.
+ *
+ * The counters add up over all emulators of the process.
+ */
+class vtunerEmulator : public vtunerControl
+{
+public:
+	static constexpr int STATUS_INTERVAL_MS = 50;
+	static constexpr int STATS_INTERVAL_MS = 1000;
+	static constexpr int RESPONSE_TIMEOUT_MS = 1000;
+	static constexpr int LATENCY_BUCKETS = 160; // quarter octaves of ns
+
+	struct counters
+	{
+		unsigned long messages;
+		unsigned long responses;
+		unsigned long timeouts;    // no response within RESPONSE_TIMEOUT_MS
+		unsigned long zaps;
+		unsigned long locks;       // first FE_HAS_LOCK after a zap
+		unsigned long pid_lists;
+		// response time of the session thread in us and DTV_TUNE to lock in ms,
+		// the lock as seen by the status poll, to STATUS_INTERVAL_MS
+		double response_us_p50, response_us_p99, response_us_max;
+		double lock_ms_p50, lock_ms_p99, lock_ms_max;
+	};
+
+private:
+	enum scenario {SCENARIO_IDLE, SCENARIO_ZAP, SCENARIO_STORM, SCENARIO_PIDCHURN};
+
+	scenario m_scenario;
+	int m_interval_ms;
+	int m_fe_type;
+	int m_event_fd;
+	int m_data_fd;
+
+	pthread_t m_thread;
+	std::atomic<bool> m_running;
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_cond;
+	struct queued
+	{
+		struct vtuner_message msg;
+		bool awaited;
+	};
+	std::deque<queued> m_queue;
+	bool m_attached;      // the session read the first time, the script starts
+	bool m_waiting;       // for the response to the last message
+	bool m_taken;         // and the session has it
+	bool m_answered;
+	int m_stale;          // responses to messages we gave up on
+	struct vtuner_message m_response;
+
+	int m_zap;            // zaps so far, picks the transponder and PIDs
+	int m_churn;
+	uint64_t m_tuned_at;  // ns of the last DTV_TUNE, 0 once locked
+
+	static void* thread_wrapper(void* ptr);
+	void* scriptLoop();
+
+	bool send(struct vtuner_message& msg, bool wait);
+	void setProperty(int cmd, uint32_t data);
+	void zap();
+	void pidList(int stage);
+	void pollStatus();
+	void pollStats();
+
+public:
+	vtunerEmulator(const std::string& spec, int fe_type);
+	virtual ~vtunerEmulator();
+
+	bool isOpened() { return m_event_fd >= 0 && m_data_fd >= 0; }
+
+	void setFrontend(const struct dvb_frontend_info& info, const char* type, const u32* delsys) override;
+
+	int getPollFd() override { return m_event_fd; }
+	short getPollEvents() override { return POLLIN; }
+	int getDataFd() override { return m_data_fd; }
+
+	bool getMessage(struct vtuner_message* msg) override;
+	void setResponse(struct vtuner_message* msg) override;
+	bool isMessagePending() override;
+
+	static counters getTotals();
+	static void resetTotals();
+};
+
+#endif // __VTUNEREMULATOR_H__